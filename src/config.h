@@ -13,7 +13,34 @@
 #ifndef __CONFIG_H__
 #define __CONFIG_H__
 
-/// Tiempo HTTP API requires an Affiliate ID for accounting and throttling.
+/// Tiempo HTTP API requires an Affiliate ID for accounting and throttling (used unless a pool of keys is configured at runtime).
 #define TIEMPO_AFFILATE_ID "0123456789abcd"
 
+/// Seconds a throttled API key cools down the first time (it doubles every time the key is throttled again).
+#define WTR_KEYS_COOLDOWN 60
+
+/// Maximum cool-down, in seconds, of a throttled API key.
+#define WTR_KEYS_MAX_COOLDOWN 3600
+
+/// Seconds after which the popularity score of a location halves.
+#define WTR_POPULARITY_HALF_LIFE (3 * 24 * 3600)
+
+/// Age, in seconds, after which the cached forecasts of a popular location are refreshed by wtr_tiempo_forecast_refresh_popular().
+#define WTR_POPULAR_REFRESH_AGE (3 * 3600)
+
+/// Percentage of the memory budget (see libmem.h) above which the library starts saving memory.
+#define WTR_MEMORY_PRESSURE 75
+
+/// Expected size, in bytes, of a forecasts document; with a memory budget, it limits how many documents are buffered at once.
+#define WTR_MEMORY_DOCUMENT_SIZE (64 * 1024)
+
+/// Maximum number of locations whose parsed forecasts are memoized by a process.
+#define WTR_MEMO_MAX_LOCATIONS 256
+
+/// Lifetime, in seconds, of the host addresses saved in the persistent resolve cache.
+#define WTR_RESOLVE_TTL 3600
+
+/// Directory of the documents of the fixture driver, unless the @c WTR_FIXTURE_DIR environment variable is set.
+#define WTR_FIXTURE_DIR "fixtures"
+
 #endif  // __CONFIG_H__
@@ -0,0 +1,453 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libevents.c
+ * @brief Always-on in-memory event log (implementation).
+ *
+ * Each ring buffer has a single writer, its thread. A record is marked as
+ * being written (sequence number 0) before its fields are filled in and gets
+ * its sequence number only afterwards, so a dump running at the same time
+ * can tell apart and skip the records that are being overwritten.
+ *
+ * The rings are accounted in the memory budget (see libmem.h): a thread
+ * whose ring doesn't fit logs nothing into the rings, its events are only
+ * printed and streamed.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+// sigwait() and pthread_sigmask() are POSIX, not C99
+#define _POSIX_C_SOURCE 200809L
+
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "libevents.h"
+#include "libmem.h"
+
+/// Records of the ring buffer of each thread.
+#define EVENTS_RING_SIZE 1024
+/// Maximum number of arguments of an event.
+#define EVENTS_MAX_ARGS 6
+/// Room for the string arguments of an event, terminators included.
+#define EVENTS_STRINGS_SIZE 96
+
+/**
+ * @brief A logged event.
+ */
+typedef struct {
+	/// Sequence number of the event in its ring (wrapping around) plus 1, 0 while the record is being written.
+	volatile gint seq;
+	/// When the event was logged, in microseconds since the Unix epoch.
+	gint64 time;
+	/// The format (a string literal).
+	const gchar *format;
+	/// Severity.
+	events_level level;
+	/// Integer arguments, or offsets in @c strings of the string arguments.
+	gint64 args[EVENTS_MAX_ARGS];
+	/// The string arguments, one after the other.
+	gchar strings[EVENTS_STRINGS_SIZE];
+} events_record;
+
+/**
+ * @brief The ring buffer of a thread.
+ */
+typedef struct {
+	/// Number of the thread, in order of first event.
+	guint thread;
+	/// Number of events logged so far.
+	gsize next;
+	/// The records.
+	events_record records[EVENTS_RING_SIZE];
+} events_ring;
+
+void events_ring_free(gpointer data);
+
+/// Ring buffer of the current thread, freed when the thread ends.
+static GPrivate events_thread_ring = G_PRIVATE_INIT(events_ring_free);
+/// The ring buffers of the running threads (events_ring).
+static GPtrArray *events_rings = NULL;
+/// Number of the next thread that logs an event.
+static guint events_next_thread = 0;
+/// Protects the list of ring buffers and the sink.
+static GMutex events_lock;
+/// Events up to this level are printed on the standard error too.
+static volatile gint events_stderr_level = EVENTS_ERROR;
+/// The sink, if any.
+static events_sink_func events_sink = NULL;
+/// User data of the sink.
+static gpointer events_sink_data = NULL;
+/// TRUE if there is a sink, checked without taking the lock.
+static volatile gint events_streaming = FALSE;
+
+/// Names of the levels, indexed by events_level.
+static const gchar *events_level_names[] = {"ERROR", "WARNING", "INFO", "DEBUG"};
+
+/**
+ * @brief A conversion of a format.
+ */
+typedef struct {
+	/// Where the conversion starts (at its '%').
+	const gchar *start;
+	/// Length of the conversion specification.
+	gsize length;
+	/// The conversion character (d, i, u, x, X or s), '%' for a literal '%', '?' if unsupported, '\0' at the end of the format.
+	gchar conversion;
+	/// Number of 'l' modifiers, -1 for 'h', 3 for 'z'.
+	gint modifier;
+} events_conversion;
+
+/**
+ * @brief Finds the next conversion of a format.
+ *
+ * @param[in] format Where to start looking.
+ * @param[out] conversion The conversion found; those with flags, width, precision or other modifiers or conversion characters are unsupported.
+ * @return Where the text before the conversion ends.
+ */
+const gchar *events_next_conversion(const gchar *format, events_conversion *conversion) {
+	const gchar *p = strchr(format, '%');
+	if (p == NULL) {
+		conversion->start = format + strlen(format);
+		conversion->length = 0;
+		conversion->conversion = '\0';
+		return conversion->start;
+	}
+	const gchar *q = p + 1;
+	gboolean supported = TRUE;
+	// Flags, width and precision
+	while (*q != '\0' && strchr("-+ #'0123456789.*", *q) != NULL) {
+		supported = FALSE;
+		++q;
+	}
+	gint modifier = 0;
+	if (*q == 'h') {
+		modifier = -1;
+		++q;
+		if (*q == 'h') {
+			supported = FALSE;
+			++q;
+		}
+	} else if (*q == 'z') {
+		modifier = 3;
+		++q;
+	} else if (*q != '\0' && strchr("jtLq", *q) != NULL) {
+		supported = FALSE;
+		++q;
+	} else {
+		while (*q == 'l' && modifier < 2) {
+			++modifier;
+			++q;
+		}
+	}
+	conversion->start = p;
+	conversion->modifier = modifier;
+	if (*q == '\0') {
+		conversion->length = q - p;
+		conversion->conversion = '?';
+	} else {
+		conversion->length = q - p + 1;
+		conversion->conversion = supported && strchr("diuxXs%", *q) != NULL ? *q : '?';
+	}
+	return p;
+}
+
+/**
+ * @brief Returns the ring buffer of the current thread, creating it the first time.
+ *
+ * @return The ring, NULL if it doesn't fit into the memory budget.
+ */
+events_ring *events_get_ring(void) {
+	events_ring *ring = (events_ring *)g_private_get(&events_thread_ring);
+	if (ring == NULL) {
+		if (!mem_charge(sizeof(events_ring))) {
+			return NULL;
+		}
+		ring = (events_ring *)g_malloc0(sizeof(events_ring));
+		g_mutex_lock(&events_lock);
+		if (events_rings == NULL) {
+			events_rings = g_ptr_array_new();
+		}
+		ring->thread = events_next_thread++;
+		g_ptr_array_add(events_rings, ring);
+		g_mutex_unlock(&events_lock);
+		g_private_set(&events_thread_ring, ring);
+	}
+	return ring;
+}
+
+/**
+ * @brief Frees the ring buffer of a thread that ended, with its events (GDestroyNotify).
+ */
+void events_ring_free(gpointer data) {
+	g_mutex_lock(&events_lock);
+	g_ptr_array_remove(events_rings, data);
+	g_mutex_unlock(&events_lock);
+	g_free(data);
+	mem_release(sizeof(events_ring));
+}
+
+/**
+ * @brief Formats a logged event.
+ *
+ * @warning The returned string must be freed with @c g_free.
+ */
+gchar *events_format(const events_record *record) {
+	GString *message = g_string_new(NULL);
+	const gchar *format = record->format;
+	guint arg = 0;
+	events_conversion conversion;
+	for (;;) {
+		const gchar *end = events_next_conversion(format, &conversion);
+		g_string_append_len(message, format, end - format);
+		if (conversion.conversion == '\0') {
+			break;
+		} else if (conversion.conversion == '%') {
+			g_string_append_c(message, '%');
+		} else if (conversion.conversion == '?' || arg == EVENTS_MAX_ARGS) {
+			g_string_append(message, "?");
+		} else if (conversion.conversion == 's') {
+			g_string_append(message, record->args[arg] >= 0 ? record->strings + record->args[arg] : "(null)");
+			++arg;
+		} else if (conversion.conversion == 'd' || conversion.conversion == 'i') {
+			g_string_append_printf(message, "%" G_GINT64_FORMAT, record->args[arg++]);
+		} else if (conversion.conversion == 'u') {
+			g_string_append_printf(message, "%" G_GUINT64_FORMAT, (guint64)record->args[arg++]);
+		} else {
+			g_string_append_printf(message, conversion.conversion == 'x' ? "%" G_GINT64_MODIFIER "x" : "%" G_GINT64_MODIFIER "X",
+			                       (guint64)record->args[arg++]);
+		}
+		format = conversion.start + conversion.length;
+	}
+	return g_string_free(message, FALSE);
+}
+
+/**
+ * @brief Stores the arguments of an event into its record, following its format.
+ *
+ * @return TRUE on success, FALSE if the format has unsupported conversions (the arguments can't be read past them).
+ */
+gboolean events_store_args(events_record *record, va_list args) {
+	const gchar *format = record->format;
+	guint arg = 0;
+	gsize strings_len = 0;
+	events_conversion conversion;
+	for (events_next_conversion(format, &conversion); conversion.conversion != '\0' && arg < EVENTS_MAX_ARGS;
+	     events_next_conversion(conversion.start + conversion.length, &conversion)) {
+		gboolean is_signed = conversion.conversion == 'd' || conversion.conversion == 'i';
+		if (conversion.conversion == '%') {
+			continue;
+		} else if (conversion.conversion == '?') {
+			return FALSE;
+		} else if (conversion.conversion == 's') {
+			const gchar *s = va_arg(args, const gchar *);
+			if (s == NULL || strings_len == EVENTS_STRINGS_SIZE) {
+				record->args[arg] = s == NULL ? -1 : (gint64)strings_len - 1;
+			} else {
+				// Truncated strings still fit, with their terminator
+				gsize len = MIN(strlen(s), EVENTS_STRINGS_SIZE - strings_len - 1);
+				memcpy(record->strings + strings_len, s, len);
+				record->strings[strings_len + len] = '\0';
+				record->args[arg] = (gint64)strings_len;
+				strings_len += len + 1;
+			}
+		} else if (conversion.modifier == 3) {
+			record->args[arg] = (gint64)va_arg(args, size_t);
+		} else if (conversion.modifier == 2) {
+			record->args[arg] = is_signed ? (gint64)va_arg(args, long long) : (gint64)va_arg(args, unsigned long long);
+		} else if (conversion.modifier == 1) {
+			record->args[arg] = is_signed ? (gint64)va_arg(args, long) : (gint64)va_arg(args, unsigned long);
+		} else {
+			// short arguments are promoted to int
+			record->args[arg] = is_signed ? (gint64)va_arg(args, int) : (gint64)va_arg(args, unsigned int);
+		}
+		++arg;
+	}
+	return TRUE;
+}
+
+/**
+ * @brief Prints and streams an event, as configured.
+ */
+void events_publish(events_level level, gint64 time, const gchar *message) {
+	if ((gint)level <= g_atomic_int_get(&events_stderr_level)) {
+		g_printerr("%s\n", message);
+	}
+	// Only streaming takes the lock
+	if (g_atomic_int_get(&events_streaming)) {
+		g_mutex_lock(&events_lock);
+		if (events_sink != NULL) {
+			events_sink(level, time, message, events_sink_data);
+		}
+		g_mutex_unlock(&events_lock);
+	}
+}
+
+void events_log(events_level level, const gchar *format, ...) {
+	gboolean publish = (gint)level <= g_atomic_int_get(&events_stderr_level) || g_atomic_int_get(&events_streaming);
+	events_ring *ring = events_get_ring();
+	va_list args;
+	va_start(args, format);
+	if (ring == NULL) {
+		// Without a ring the event is formatted right away, only to be printed and streamed
+		if (publish) {
+			gchar *message = g_strdup_vprintf(format, args);
+			events_publish(level, g_get_real_time(), message);
+			g_free(message);
+		}
+		va_end(args);
+		return;
+	}
+	events_record *record = &ring->records[ring->next % EVENTS_RING_SIZE];
+	g_atomic_int_set(&record->seq, 0);
+	record->time = g_get_real_time();
+	record->format = format;
+	record->level = level;
+	va_list copy;
+	va_copy(copy, args);
+	if (!events_store_args(record, args)) {
+		// The arguments can't be stored, so the event is formatted right away (and may be truncated)
+		g_vsnprintf(record->strings, EVENTS_STRINGS_SIZE, format, copy);
+		record->format = "%s";
+		record->args[0] = 0;
+	}
+	va_end(copy);
+	va_end(args);
+	g_atomic_int_set(&record->seq, (gint)(ring->next++ % G_MAXINT) + 1);
+	if (publish) {
+		gchar *message = events_format(record);
+		events_publish(level, record->time, message);
+		g_free(message);
+	}
+}
+
+void events_set_stderr_level(gint level) {
+	g_atomic_int_set(&events_stderr_level, level);
+}
+
+void events_set_sink(events_sink_func func, gpointer user_data) {
+	g_mutex_lock(&events_lock);
+	events_sink = func;
+	events_sink_data = user_data;
+	g_atomic_int_set(&events_streaming, func != NULL);
+	g_mutex_unlock(&events_lock);
+}
+
+/**
+ * @brief An event copied out of a ring buffer, to be dumped.
+ */
+typedef struct {
+	/// Number of the thread that logged the event.
+	guint thread;
+	/// The event.
+	events_record record;
+} events_copy;
+
+/**
+ * @brief Sorts the events by time (GCompareFunc).
+ */
+gint events_compare(gconstpointer a, gconstpointer b) {
+	gint64 time_a = ((const events_copy *)a)->record.time;
+	gint64 time_b = ((const events_copy *)b)->record.time;
+	return time_a < time_b ? -1 : time_a > time_b ? 1 : 0;
+}
+
+/**
+ * @brief Writes a whole buffer into a file descriptor.
+ */
+void events_write(int fd, const gchar *buffer, gsize length) {
+	while (length > 0) {
+		ssize_t written = write(fd, buffer, length);
+		if (written <= 0) {
+			break;
+		}
+		buffer += written;
+		length -= written;
+	}
+}
+
+guint events_dump(int fd) {
+	GArray *events = g_array_new(FALSE, FALSE, sizeof(events_copy));
+	g_mutex_lock(&events_lock);
+	for (guint r = 0; events_rings != NULL && r < events_rings->len; ++r) {
+		events_ring *ring = (events_ring *)g_ptr_array_index(events_rings, r);
+		for (guint i = 0; i < EVENTS_RING_SIZE; ++i) {
+			events_copy copy;
+			copy.thread = ring->thread;
+			gint seq = g_atomic_int_get(&ring->records[i].seq);
+			memcpy(&copy.record, &ring->records[i], sizeof(events_record));
+			// Skip records that are empty or were overwritten while being copied
+			if (seq != 0 && seq == g_atomic_int_get(&ring->records[i].seq)) {
+				g_array_append_val(events, copy);
+			}
+		}
+	}
+	g_mutex_unlock(&events_lock);
+	g_array_sort(events, events_compare);
+	GString *out = g_string_new(NULL);
+	for (guint i = 0; i < events->len; ++i) {
+		events_copy *copy = &g_array_index(events, events_copy, i);
+		GDateTime *time = g_date_time_new_from_unix_local(copy->record.time / G_USEC_PER_SEC);
+		gchar *time_str = g_date_time_format(time, "%Y-%m-%d %H:%M:%S");
+		gchar *message = events_format(&copy->record);
+		g_string_append_printf(out, "%s.%06d T%u %-7s %s\n", time_str, (gint)(copy->record.time % G_USEC_PER_SEC), copy->thread,
+		                       events_level_names[copy->record.level], message);
+		g_free(message);
+		g_free(time_str);
+		g_date_time_unref(time);
+	}
+	events_write(fd, out->str, out->len);
+	g_string_free(out, TRUE);
+	guint count = events->len;
+	g_array_free(events, TRUE);
+	return count;
+}
+
+/**
+ * @brief Where to dump the events when a signal is received.
+ */
+typedef struct {
+	/// The signal.
+	int signum;
+	/// File descriptor to write the events into.
+	int fd;
+} events_signal_watch;
+
+/**
+ * @brief Waits for the signal and dumps the events every time it's received (GThreadFunc).
+ *
+ * @param[in] data The signal and where to dump the events (events_signal_watch).
+ */
+gpointer events_signal_thread(gpointer data) {
+	events_signal_watch *watch = (events_signal_watch *)data;
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, watch->signum);
+	int signum;
+	while (sigwait(&set, &signum) == 0) {
+		events_dump(watch->fd);
+	}
+	g_free(watch);
+	return NULL;
+}
+
+gboolean events_dump_on_signal(int signum, int fd) {
+	sigset_t set;
+	sigemptyset(&set);
+	// The threads started afterwards inherit the mask, so the signal is only received by sigwait()
+	if (sigaddset(&set, signum) != 0 || pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+		events_log(EVENTS_ERROR, "events_dump_on_signal can't block signal %d", signum);
+		return FALSE;
+	}
+	events_signal_watch *watch = g_new(events_signal_watch, 1);
+	watch->signum = signum;
+	watch->fd = fd;
+	g_thread_unref(g_thread_new("events-dump", events_signal_thread, watch));
+	return TRUE;
+}
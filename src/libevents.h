@@ -0,0 +1,102 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBEVENTS_H__
+#define __LIBEVENTS_H__
+
+/**
+ * @file libevents.h
+ * @brief Always-on in-memory event log.
+ *
+ * Every thread logs its events into its own ring buffer of fixed-size
+ * binary records, without locks: only the format string (by pointer) and
+ * the values of its arguments are stored, the text is only built when the
+ * log is dumped or when the event is streamed to a sink. When a ring is
+ * full the oldest events are overwritten. The ring of a thread is freed,
+ * with its events, when the thread ends, and it's accounted in the memory
+ * budget (see libmem.h).
+ *
+ * Since events are formatted later, the format must be a string literal.
+ * Only integer (d, i, u, x, X, with the h, l, ll and z modifiers) and
+ * string (s) conversions, without flags, width or precision, are stored
+ * as values; events with other conversions are formatted right away into
+ * the record. Strings are copied into the record and may be truncated.
+ *
+ * Events of a level up to the standard error level (by default
+ * EVENTS_ERROR) are also printed on the standard error right away.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+#include <glib.h>
+
+/**
+ * @brief Severity of an event.
+ */
+typedef enum {
+	/** Something failed. */
+	EVENTS_ERROR,
+	/** Something unexpected that was handled. */
+	EVENTS_WARNING,
+	/** Something worth knowing. */
+	EVENTS_INFO,
+	/** Details useful for troubleshooting. */
+	EVENTS_DEBUG
+} events_level;
+
+/**
+ * @brief Receives every event as soon as it's logged.
+ *
+ * @param[in] level Severity of the event.
+ * @param[in] time When the event was logged, in microseconds since the Unix epoch.
+ * @param[in] message The formatted event.
+ * @param[in] user_data The user data passed to events_set_sink().
+ */
+typedef void (*events_sink_func)(events_level level, gint64 time, const gchar *message, gpointer user_data);
+
+/**
+ * @brief Log an event.
+ *
+ * @param[in] level Severity of the event.
+ * @param[in] format printf-like format, which must be a string literal (see the restrictions above).
+ * @param[in] ... Arguments of the format.
+ */
+void events_log(events_level level, const gchar *format, ...) G_GNUC_PRINTF(2, 3);
+
+/**
+ * @brief Set up to which level events are also printed on the standard error.
+ *
+ * @param[in] level The level; -1 prints nothing.
+ */
+void events_set_stderr_level(gint level);
+
+/**
+ * @brief Stream every event to a sink, besides logging it into the ring buffers.
+ *
+ * @param[in] func The sink, NULL to stop streaming.
+ * @param[in] user_data Passed to the sink.
+ */
+void events_set_sink(events_sink_func func, gpointer user_data);
+
+/**
+ * @brief Write the events still in the ring buffers of all the threads, oldest first.
+ *
+ * @param[in] fd File descriptor to write the events into.
+ * @return Number of events written.
+ */
+guint events_dump(int fd);
+
+/**
+ * @brief Dump the events every time a signal is received.
+ *
+ * The signal is blocked and a background thread waits for it with
+ * @c sigwait, so nothing runs in a signal handler and nothing polls.
+ *
+ * @param[in] signum The signal (e.g. @c SIGUSR1).
+ * @param[in] fd File descriptor to write the events into.
+ * @return TRUE on success, FALSE if the signal can't be blocked.
+ * @warning It must be called before any other thread is started, so that the signal is blocked in all of them.
+ */
+gboolean events_dump_on_signal(int signum, int fd);
+
+#endif  // __LIBEVENTS_H__
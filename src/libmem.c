@@ -0,0 +1,199 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libmem.c
+ * @brief Memory budget, for devices with little memory (implementation).
+ *
+ * The accounting allocator keeps the size of each block in a header in front
+ * of it, so that freeing a block releases exactly what was charged for it.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <curl/curl.h>
+#include <glib.h>
+#include <libxml/xmlmemory.h>
+
+#include "config.h"
+#include "libmem.h"
+
+/// Size of the header of the blocks of the accounting allocator (it keeps the blocks aligned).
+#define MEM_HEADER 16
+
+/// The budget, 0 if there is no limit.
+static gsize mem_limit = 0;
+/// Memory accounted right now.
+static volatile gssize mem_current = 0;
+/// Largest amount of memory accounted so far.
+static volatile gssize mem_max = 0;
+/// Serializes the updates of mem_max.
+static GMutex mem_max_lock;
+
+void mem_budget_set(gsize budget) {
+	mem_limit = budget;
+}
+
+gsize mem_budget(void) {
+	return mem_limit;
+}
+
+/**
+ * @brief Optimistically accounts the memory, then takes it back if it doesn't fit.
+ */
+gboolean mem_charge(gsize size) {
+	gssize used = g_atomic_pointer_add(&mem_current, (gssize)size) + (gssize)size;
+	if (mem_limit > 0 && (gsize)used > mem_limit) {
+		g_atomic_pointer_add(&mem_current, -(gssize)size);
+		return FALSE;
+	}
+	if (used > (gssize)g_atomic_pointer_get(&mem_max)) {
+		g_mutex_lock(&mem_max_lock);
+		if (used > mem_max) {
+			mem_max = used;
+		}
+		g_mutex_unlock(&mem_max_lock);
+	}
+	return TRUE;
+}
+
+void mem_release(gsize size) {
+	g_atomic_pointer_add(&mem_current, -(gssize)size);
+}
+
+gsize mem_used(void) {
+	return (gsize)MAX((gssize)g_atomic_pointer_get(&mem_current), 0);
+}
+
+gsize mem_peak(void) {
+	return (gsize)g_atomic_pointer_get(&mem_max);
+}
+
+gsize mem_headroom(void) {
+	gsize budget = mem_budget();
+	if (budget == 0) {
+		return G_MAXSIZE;
+	}
+	gsize threshold = budget / 100 * WTR_MEMORY_PRESSURE;
+	gsize used = mem_used();
+	return used < threshold ? threshold - used : 0;
+}
+
+gboolean mem_pressure(void) {
+	return mem_headroom() == 0;
+}
+
+/**
+ * @brief Allocates an accounted block.
+ *
+ * @return The block, or NULL if it doesn't fit into the budget or the allocation fails.
+ */
+void *mem_malloc(size_t size) {
+	if (!mem_charge(size)) {
+		return NULL;
+	}
+	char *block = (char *)malloc(size + MEM_HEADER);
+	if (block == NULL) {
+		mem_release(size);
+		return NULL;
+	}
+	*(size_t *)block = size;
+	return block + MEM_HEADER;
+}
+
+/**
+ * @brief Frees an accounted block.
+ */
+void mem_free(void *ptr) {
+	if (ptr != NULL) {
+		char *block = (char *)ptr - MEM_HEADER;
+		mem_release(*(size_t *)block);
+		free(block);
+	}
+}
+
+/**
+ * @brief Resizes an accounted block.
+ *
+ * @return The resized block, or NULL if it doesn't fit into the budget or the allocation fails (the block is left untouched).
+ */
+void *mem_realloc(void *ptr, size_t size) {
+	if (ptr == NULL) {
+		return mem_malloc(size);
+	}
+	char *block = (char *)ptr - MEM_HEADER;
+	size_t old_size = *(size_t *)block;
+	if (size > old_size && !mem_charge(size - old_size)) {
+		return NULL;
+	}
+	char *resized = (char *)realloc(block, size + MEM_HEADER);
+	if (resized == NULL) {
+		if (size > old_size) {
+			mem_release(size - old_size);
+		}
+		return NULL;
+	}
+	if (size < old_size) {
+		mem_release(old_size - size);
+	}
+	*(size_t *)resized = size;
+	return resized + MEM_HEADER;
+}
+
+/**
+ * @brief Duplicates a string into an accounted block.
+ */
+char *mem_strdup(const char *str) {
+	size_t size = strlen(str) + 1;
+	char *copy = (char *)mem_malloc(size);
+	if (copy != NULL) {
+		memcpy(copy, str, size);
+	}
+	return copy;
+}
+
+/**
+ * @brief Allocates an accounted zero-filled array.
+ */
+void *mem_calloc(size_t count, size_t size) {
+	if (size > 0 && count > G_MAXSIZE / size) {
+		return NULL;
+	}
+	void *ptr = mem_malloc(count * size);
+	if (ptr != NULL) {
+		memset(ptr, 0, count * size);
+	}
+	return ptr;
+}
+
+/**
+ * @brief Duplicates a string into an accounted block (libxml2's xmlStrdupFunc).
+ */
+char *mem_xml_strdup(const char *str) {
+	return mem_strdup(str);
+}
+
+gboolean mem_xml_setup(void) {
+	return xmlMemSetup(mem_free, mem_malloc, mem_realloc, mem_xml_strdup) == 0;
+}
+
+CURLcode mem_curl_global_init(long flags) {
+	return curl_global_init_mem(flags, mem_malloc, mem_free, mem_realloc, mem_strdup, mem_calloc);
+}
+
+gsize mem_peak_rss(void) {
+	gchar *status = NULL;
+	gsize peak_kb = 0;
+	if (g_file_get_contents("/proc/self/status", &status, NULL, NULL)) {
+		const gchar *line = strstr(status, "VmHWM:");
+		if (line != NULL) {
+			sscanf(line + strlen("VmHWM:"), "%" G_GSIZE_FORMAT, &peak_kb);
+		}
+		g_free(status);
+	}
+	return peak_kb * 1024;
+}
@@ -0,0 +1,111 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBMEM_H__
+#define __LIBMEM_H__
+
+/**
+ * @file libmem.h
+ * @brief Memory budget, for devices with little memory.
+ *
+ * Libmem accounts the memory whose size depends on the input: the HTTP
+ * responses being buffered, the allocations of libxml2 (document trees) and
+ * libcurl (when their allocators are set up with mem_xml_setup() and
+ * mem_curl_global_init()) and the in-memory caches of the library. The rest
+ * is not accounted, so it's not capped: the code and the libraries, and the
+ * allocations made through GLib (the forecasts built by the parser, among
+ * them), which can't be routed to another allocator. A budget therefore
+ * bounds the accounted memory, not the resident set size, which is larger
+ * by a baseline that doesn't depend much on the input (see the
+ * @c memory-check target of the Makefile).
+ *
+ * When a budget is set, allocations that would exceed it fail, and the
+ * library degrades gracefully well before that, as soon as the accounted
+ * memory is under pressure (see WTR_MEMORY_PRESSURE): fewer responses are
+ * buffered at once, the hourly forecasts are dropped while parsing and the
+ * in-memory caches are emptied.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+#include <curl/curl.h>
+#include <glib.h>
+
+/**
+ * @brief Set the memory budget.
+ *
+ * @param[in] budget Maximum memory to account, in bytes; 0 means no limit (the default).
+ * @warning It must be called before any other thread is started.
+ */
+void mem_budget_set(gsize budget);
+
+/**
+ * @brief Get the memory budget.
+ *
+ * @return The budget in bytes, 0 if there is no limit.
+ */
+gsize mem_budget(void);
+
+/**
+ * @brief Account some memory that is about to be allocated.
+ *
+ * @param[in] size Bytes.
+ * @return TRUE if the memory fits into the budget and was accounted, FALSE otherwise (nothing is accounted).
+ */
+gboolean mem_charge(gsize size);
+
+/**
+ * @brief Account some memory that was freed.
+ *
+ * @param[in] size Bytes, as passed to mem_charge().
+ */
+void mem_release(gsize size);
+
+/**
+ * @brief Get the memory accounted right now, in bytes.
+ */
+gsize mem_used(void);
+
+/**
+ * @brief Get the largest amount of memory accounted so far, in bytes.
+ */
+gsize mem_peak(void);
+
+/**
+ * @brief Get how much memory is left before the pressure threshold.
+ *
+ * @return Bytes left, 0 if the memory is already under pressure, G_MAXSIZE if there is no budget.
+ */
+gsize mem_headroom(void);
+
+/**
+ * @brief Tell whether the memory is under pressure, that is whether the library should save memory.
+ *
+ * @return TRUE if a budget is set and the accounted memory is above WTR_MEMORY_PRESSURE percent of it.
+ */
+gboolean mem_pressure(void);
+
+/**
+ * @brief Make libxml2 allocate through the accounting allocator.
+ *
+ * @return TRUE on success.
+ * @warning It must be called before any other libxml2 function (@c xmlInitParser included).
+ */
+gboolean mem_xml_setup(void);
+
+/**
+ * @brief Initialize libcurl, making it allocate through the accounting allocator.
+ *
+ * @param[in] flags As for @c curl_global_init.
+ * @return As @c curl_global_init.
+ */
+CURLcode mem_curl_global_init(long flags);
+
+/**
+ * @brief Get the peak resident set size of the process.
+ *
+ * @return The peak RSS in bytes, 0 if it's not available.
+ */
+gsize mem_peak_rss(void);
+
+#endif  // __LIBMEM_H__
@@ -0,0 +1,221 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libmetrics.c
+ * @brief Process-wide counters and latency histograms (implementation).
+ *
+ * A histogram bucket is identified by the position of the most significant
+ * bit of the value and by the 3 bits that follow it; values below 8 have a
+ * bucket each. Bucket boundaries are powers of two every 8 buckets, so the
+ * cumulative counts the Prometheus format wants are exact at those bounds.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "libevents.h"
+#include "libmetrics.h"
+
+/// Sub-buckets of each power of two, as a number of bits.
+#define METRICS_SUB_BITS 3
+/// Sub-buckets of each power of two.
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+/// Buckets of a histogram, enough for any 64 bit value.
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+/// Smallest power of two (in µs) used as a Prometheus bucket bound.
+#define METRICS_PROMETHEUS_MIN_EXP 4
+/// Largest power of two (in µs) used as a Prometheus bucket bound, about a minute.
+#define METRICS_PROMETHEUS_MAX_EXP 26
+
+/**
+ * @brief A latency histogram.
+ */
+typedef struct {
+	/// Number of values recorded into each bucket.
+	volatile gsize buckets[METRICS_BUCKETS];
+	/// Number of values recorded.
+	volatile gsize count;
+	/// Sum of the values recorded.
+	volatile gsize sum;
+	/// Largest value recorded (up to G_MAXINT).
+	volatile gint max;
+} metrics_hist;
+
+/**
+ * @brief Name and description of a metric.
+ */
+typedef struct {
+	/// Name, without the "wtr_" prefix of the Prometheus format.
+	const gchar *name;
+	/// Description.
+	const gchar *help;
+} metrics_info;
+
+/// Names of the counters, indexed by metrics_counter.
+static const metrics_info metrics_counters_info[] = {
+    {"cache_hits_total", "Cached documents found, or their forecasts already parsed."},
+    {"cache_misses_total", "Cached documents not found."},
+    {"cache_read_bytes_total", "Bytes read from the cache."},
+    {"cache_writes_total", "Documents written into the cache."},
+    {"cache_unchanged_total", "Documents identical to the cached ones, not written again."},
+    {"cache_written_bytes_total", "Bytes written into the cache."},
+    {"http_downloaded_bytes_total", "Bytes downloaded by HTTP requests."},
+    {"parse_documents_total", "Documents parsed into forecasts."},
+    {"parse_errors_total", "Documents that couldn't be parsed."}};
+
+/// Names of the histograms, indexed by metrics_histogram.
+static const metrics_info metrics_histograms_info[] = {{"http_request_duration_seconds", "Duration of the HTTP requests."},
+                                                       {"parse_duration_seconds", "Time spent parsing a document in memory."}};
+
+/// The counters.
+static volatile gsize metrics_counters[METRICS_COUNTERS];
+/// HTTP requests by status code.
+static volatile gsize metrics_http_statuses[METRICS_HTTP_STATUSES];
+/// The histograms.
+static metrics_hist metrics_histograms[METRICS_HISTOGRAMS];
+
+/**
+ * @brief Returns the bucket of a value.
+ */
+guint metrics_bucket(guint64 value) {
+	if (value < METRICS_SUB_BUCKETS) {
+		return (guint)value;
+	}
+	guint msb = 63 - __builtin_clzll(value);
+	return (msb - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS + ((value >> (msb - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief Returns the smallest value of a bucket (the values of a bucket are below the smallest one of the next).
+ */
+guint64 metrics_bucket_min(guint bucket) {
+	if (bucket < METRICS_SUB_BUCKETS) {
+		return bucket;
+	}
+	guint msb = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+	return (guint64)(METRICS_SUB_BUCKETS + bucket % METRICS_SUB_BUCKETS) << (msb - METRICS_SUB_BITS);
+}
+
+void metrics_add(metrics_counter counter, gsize value) {
+	g_atomic_pointer_add(&metrics_counters[counter], value);
+}
+
+void metrics_record(metrics_histogram histogram, gint64 value) {
+	metrics_hist *hist = &metrics_histograms[histogram];
+	gsize v = (gsize)MAX(value, 0);
+	g_atomic_pointer_add(&hist->buckets[metrics_bucket(v)], 1);
+	g_atomic_pointer_add(&hist->count, 1);
+	g_atomic_pointer_add(&hist->sum, v);
+	gint clamped = (gint)MIN(v, G_MAXINT);
+	gint max = g_atomic_int_get(&hist->max);
+	while (clamped > max && !g_atomic_int_compare_and_exchange(&hist->max, max, clamped)) {
+		max = g_atomic_int_get(&hist->max);
+	}
+}
+
+void metrics_http_request(gulong http_code, gsize bytes, gint64 duration) {
+	g_atomic_pointer_add(&metrics_http_statuses[http_code < METRICS_HTTP_STATUSES ? http_code : 0], 1);
+	metrics_add(METRICS_HTTP_BYTES, bytes);
+	metrics_record(METRICS_HTTP_DURATION, duration);
+}
+
+gsize metrics_get(metrics_counter counter) {
+	return (gsize)g_atomic_pointer_get(&metrics_counters[counter]);
+}
+
+gint64 metrics_percentile(metrics_histogram histogram, gdouble percentile) {
+	metrics_hist *hist = &metrics_histograms[histogram];
+	gsize count = (gsize)g_atomic_pointer_get(&hist->count);
+	gsize rank = (gsize)(count * CLAMP(percentile, 0, 100) / 100);
+	gsize seen = 0;
+	for (guint b = 0; b < METRICS_BUCKETS - 1 && count > 0; ++b) {
+		seen += (gsize)g_atomic_pointer_get(&hist->buckets[b]);
+		if (seen > 0 && seen >= rank) {
+			// The largest value recorded is a tighter bound than the end of its bucket
+			return (gint64)MIN(metrics_bucket_min(b + 1), (gsize)g_atomic_int_get(&hist->max));
+		}
+	}
+	return g_atomic_int_get(&hist->max);
+}
+
+void metrics_print(void) {
+	for (guint c = 0; c < METRICS_COUNTERS; ++c) {
+		gsize value = metrics_get(c);
+		if (value > 0) {
+			g_print("%-36s %" G_GSIZE_FORMAT "\n", metrics_counters_info[c].name, value);
+		}
+	}
+	for (guint s = 0; s < METRICS_HTTP_STATUSES; ++s) {
+		gsize value = (gsize)g_atomic_pointer_get(&metrics_http_statuses[s]);
+		if (value > 0) {
+			gchar *name = g_strdup_printf("http_requests_total{status=\"%u\"}", s);
+			g_print("%-36s %" G_GSIZE_FORMAT "\n", name, value);
+			g_free(name);
+		}
+	}
+	for (guint h = 0; h < METRICS_HISTOGRAMS; ++h) {
+		metrics_hist *hist = &metrics_histograms[h];
+		gsize count = (gsize)g_atomic_pointer_get(&hist->count);
+		if (count > 0) {
+			g_print("%-36s count %" G_GSIZE_FORMAT ", mean %.3f ms, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+			        metrics_histograms_info[h].name, count, (gsize)g_atomic_pointer_get(&hist->sum) / 1000.0 / count,
+			        metrics_percentile(h, 50) / 1000.0, metrics_percentile(h, 90) / 1000.0, metrics_percentile(h, 99) / 1000.0,
+			        (gsize)g_atomic_int_get(&hist->max) / 1000.0);
+		}
+	}
+}
+
+/**
+ * @brief Appends a histogram in the Prometheus text format, with bounds in seconds.
+ */
+void metrics_prometheus_histogram(GString *out, metrics_histogram histogram) {
+	metrics_hist *hist = &metrics_histograms[histogram];
+	const gchar *name = metrics_histograms_info[histogram].name;
+	g_string_append_printf(out, "# HELP wtr_%s %s\n# TYPE wtr_%s histogram\n", name, metrics_histograms_info[histogram].help, name);
+	gsize cumulative = 0;
+	guint b = 0;
+	for (guint e = METRICS_PROMETHEUS_MIN_EXP; e <= METRICS_PROMETHEUS_MAX_EXP; ++e) {
+		// The buckets below 2^e µs
+		for (; b < METRICS_BUCKETS && metrics_bucket_min(b + 1) <= ((guint64)1 << e); ++b) {
+			cumulative += (gsize)g_atomic_pointer_get(&hist->buckets[b]);
+		}
+		g_string_append_printf(out, "wtr_%s_bucket{le=\"%.9g\"} %" G_GSIZE_FORMAT "\n", name, (gdouble)((guint64)1 << e) / G_USEC_PER_SEC,
+		                       cumulative);
+	}
+	gsize count = (gsize)g_atomic_pointer_get(&hist->count);
+	g_string_append_printf(out, "wtr_%s_bucket{le=\"+Inf\"} %" G_GSIZE_FORMAT "\n", name, count);
+	g_string_append_printf(out, "wtr_%s_sum %g\n", name, (gdouble)(gsize)g_atomic_pointer_get(&hist->sum) / G_USEC_PER_SEC);
+	g_string_append_printf(out, "wtr_%s_count %" G_GSIZE_FORMAT "\n", name, count);
+}
+
+gboolean metrics_write_prometheus(const gchar *path) {
+	GString *out = g_string_new(NULL);
+	for (guint c = 0; c < METRICS_COUNTERS; ++c) {
+		const metrics_info *info = &metrics_counters_info[c];
+		g_string_append_printf(out, "# HELP wtr_%s %s\n# TYPE wtr_%s counter\nwtr_%s %" G_GSIZE_FORMAT "\n", info->name, info->help,
+		                       info->name, info->name, metrics_get(c));
+	}
+	g_string_append(out, "# HELP wtr_http_requests_total HTTP requests by status code (0 means no response).\n"
+	                     "# TYPE wtr_http_requests_total counter\n");
+	for (guint s = 0; s < METRICS_HTTP_STATUSES; ++s) {
+		gsize value = (gsize)g_atomic_pointer_get(&metrics_http_statuses[s]);
+		if (value > 0) {
+			g_string_append_printf(out, "wtr_http_requests_total{status=\"%u\"} %" G_GSIZE_FORMAT "\n", s, value);
+		}
+	}
+	for (guint h = 0; h < METRICS_HISTOGRAMS; ++h) {
+		metrics_prometheus_histogram(out, h);
+	}
+	GError *error = NULL;
+	gboolean ok = g_file_set_contents(path, out->str, out->len, &error);
+	if (!ok) {
+		events_log(EVENTS_ERROR, "metrics_write_prometheus can't write %s: %s", path, error->message);
+		g_error_free(error);
+	}
+	g_string_free(out, TRUE);
+	return ok;
+}
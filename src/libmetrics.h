@@ -0,0 +1,121 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBMETRICS_H__
+#define __LIBMETRICS_H__
+
+/**
+ * @file libmetrics.h
+ * @brief Process-wide counters and latency histograms.
+ *
+ * Libmetrics keeps a fixed set of counters, updated with atomic operations
+ * so that they can be incremented from any thread without locks, and of
+ * log-linear latency histograms in the style of HdrHistogram: each power of
+ * two is split into 8 buckets, so any recorded value is known within 12.5%.
+ *
+ * The metrics can be shown as a human readable summary or written into a
+ * Prometheus textfile (e.g. for node_exporter's textfile collector).
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+#include <glib.h>
+
+/**
+ * @brief The counters.
+ */
+typedef enum {
+	/** Cached documents found, or their forecasts already parsed (in the memo or in the shared memory cache). */
+	METRICS_CACHE_HITS,
+	/** Cached documents not found. */
+	METRICS_CACHE_MISSES,
+	/** Bytes read from the cache. */
+	METRICS_CACHE_READ_BYTES,
+	/** Documents written into the cache. */
+	METRICS_CACHE_WRITES,
+	/** Documents not written into the cache because they were identical to the cached ones. */
+	METRICS_CACHE_UNCHANGED,
+	/** Bytes written into the cache. */
+	METRICS_CACHE_WRITTEN_BYTES,
+	/** Bytes downloaded by HTTP requests. */
+	METRICS_HTTP_BYTES,
+	/** Documents parsed into forecasts. */
+	METRICS_PARSE_DOCUMENTS,
+	/** Documents that couldn't be parsed. */
+	METRICS_PARSE_ERRORS,
+	/** Number of counters (not a counter). */
+	METRICS_COUNTERS
+} metrics_counter;
+
+/**
+ * @brief The latency histograms (values are in microseconds).
+ */
+typedef enum {
+	/** Duration of the HTTP requests. */
+	METRICS_HTTP_DURATION,
+	/** Time spent parsing a document already in memory. */
+	METRICS_PARSE_DURATION,
+	/** Number of histograms (not a histogram). */
+	METRICS_HISTOGRAMS
+} metrics_histogram;
+
+/// HTTP status codes are counted one by one up to this value (excluded); 0 stands for requests without a response.
+#define METRICS_HTTP_STATUSES 600
+
+/**
+ * @brief Increment a counter.
+ *
+ * @param[in] counter The counter.
+ * @param[in] value How much to add.
+ */
+void metrics_add(metrics_counter counter, gsize value);
+
+/**
+ * @brief Record a value into a histogram.
+ *
+ * @param[in] histogram The histogram.
+ * @param[in] value The value, in microseconds (negative values count as 0).
+ */
+void metrics_record(metrics_histogram histogram, gint64 value);
+
+/**
+ * @brief Count a completed HTTP request.
+ *
+ * @param[in] http_code HTTP status code of the response, 0 if there is no response.
+ * @param[in] bytes Bytes downloaded.
+ * @param[in] duration Duration of the request, in microseconds.
+ */
+void metrics_http_request(gulong http_code, gsize bytes, gint64 duration);
+
+/**
+ * @brief Get the current value of a counter.
+ */
+gsize metrics_get(metrics_counter counter);
+
+/**
+ * @brief Get a percentile of a histogram.
+ *
+ * @param[in] histogram The histogram.
+ * @param[in] percentile The percentile, between 0 and 100.
+ * @return The upper bound of the bucket the percentile falls into, in microseconds (0 for an empty histogram).
+ */
+gint64 metrics_percentile(metrics_histogram histogram, gdouble percentile);
+
+/**
+ * @brief Show a summary of the metrics on the standard output.
+ *
+ * Counters that are still 0 and empty histograms are omitted.
+ */
+void metrics_print(void);
+
+/**
+ * @brief Write the metrics in the Prometheus text format.
+ *
+ * The file is replaced atomically, so that a collector never reads it half written.
+ *
+ * @param[in] path Path of the file.
+ * @return TRUE on success, FALSE otherwise (errors are reported on the standard error).
+ */
+gboolean metrics_write_prometheus(const gchar *path);
+
+#endif  // __LIBMETRICS_H__
@@ -9,14 +9,147 @@
  * contains the data and the HTTP results and a function to free the
  * heap used by the data.
  *
+ * Every HTTP GET can also be recorded to a corpus file (capture mode) and
+ * later served back from it (replay mode), so that a real refresh cycle can
+ * be reproduced offline on identical input.
+ *
+ * The addresses of the contacted hosts can be kept in a small on-disk resolve
+ * cache, so that short-lived processes can skip DNS resolution entirely.
+ *
  * @author Paolo Bernardi
  * @date 6 Mar 2018
  */
 
+// getaddrinfo() and inet_ntop() are POSIX, not C99
+#define _POSIX_C_SOURCE 200112L
+
+#include <arpa/inet.h>
+#include <netdb.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 
+#include "libevents.h"
+#include "libmem.h"
+#include "libmetrics.h"
 #include "libnet.h"
+#include "probes.h"
+
+#ifdef WTR_HAVE_SDT
+WTR_PROBE_SEMAPHORE_DEFINE(libnet, http__start);
+WTR_PROBE_SEMAPHORE_DEFINE(libnet, http__done);
+#endif
+
+/// Magic string at the beginning of a traffic corpus file (the last two digits are the format version).
+#define NET_CORPUS_MAGIC "WTRCAP01"
+
+/// Query parameters left out of the URLs of a traffic corpus: credentials (e.g. the keys of a pool) change between runs.
+static const gchar *const NET_CORPUS_MASKED_PARAMS[] = {"affiliate_id", NULL};
+
+/**
+ * @brief Where net_http_get() gets its responses from.
+ */
+typedef enum {
+	/** Responses come from the network (default). */
+	NET_TRAFFIC_LIVE,
+	/** Responses come from the network and are recorded into the corpus file. */
+	NET_TRAFFIC_CAPTURE,
+	/** Responses come from a previously recorded corpus file. */
+	NET_TRAFFIC_REPLAY,
+} net_traffic_mode;
+
+/**
+ * @brief Header of a single HTTP GET recorded in a traffic corpus file.
+ *
+ * In the corpus file each header is immediately followed by @c url_len bytes
+ * of URL and @c body_len bytes of response body (neither is NULL-terminated).
+ * All integers are stored in host byte order, since a corpus is meant to be
+ * replayed on the same kind of machine that recorded it.
+ */
+typedef struct {
+	/// Start of the request, in microseconds since the beginning of the capture.
+	gint64 offset_us;
+	/// Duration of the request, in microseconds.
+	gint64 duration_us;
+	/// cURL error code of the request.
+	guint32 curl_code;
+	/// HTTP status code of the response.
+	guint32 http_code;
+	/// Length of the URL that follows the header.
+	guint32 url_len;
+	/// Length of the response body that follows the URL.
+	guint32 body_len;
+} net_corpus_record;
+
+/**
+ * @brief A recorded HTTP GET loaded in memory for replay.
+ */
+typedef struct {
+	/// Recorded header.
+	net_corpus_record record;
+	/// Response body (it points inside the loaded corpus, it's not NULL-terminated).
+	const gchar *body;
+} net_corpus_entry;
+
+/**
+ * @brief Recorded responses for a single URL, in capture order.
+ */
+typedef struct {
+	/// All the net_corpus_entry recorded for the URL.
+	GList *all;
+	/// Next net_corpus_entry to be served (the last one is served again once reached).
+	GList *next;
+} net_replay_slot;
+
+/// Capture and replay state, shared by all the net_http_get() calls.
+static struct {
+	/// Current traffic mode.
+	net_traffic_mode mode;
+	/// Corpus file being recorded (capture mode).
+	FILE *capture;
+	/// Monotonic time of the beginning of the capture.
+	gint64 capture_start;
+	/// Raw content of the corpus file being replayed (replay mode).
+	gchar *corpus;
+	/// Replayed URLs and their net_replay_slot (replay mode).
+	GHashTable *replay;
+	/// If TRUE the recorded timing is reproduced (replay mode).
+	gboolean realtime;
+	/// Monotonic time of the first replayed request, 0 until then (replay mode).
+	gint64 replay_start;
+	/// Serializes the access to the capture file and to the replay slots.
+	GMutex lock;
+} net_traffic;
+
+/**
+ * @brief A connect target of the resolve cache.
+ */
+typedef struct {
+	/// Address to connect to (IPv6 addresses are enclosed in brackets, as @c CURLOPT_RESOLVE wants).
+	gchar *address;
+	/// Expiration time, in seconds since the Unix epoch.
+	gint64 expires;
+} net_resolve_entry;
+
+/// Resolve cache state, shared by all the HTTP calls.
+static struct {
+	/// Path of the resolve cache file, NULL if the resolve cache is not used.
+	gchar *path;
+	/// Lifetime of the newly resolved targets, in seconds.
+	guint ttl;
+	/// Connect targets as "host:port" -> net_resolve_entry.
+	GHashTable *entries;
+	/// Addresses that couldn't be connected to, as "host:port" -> address; they are never stored again.
+	GHashTable *failed;
+	/// Targets loaded from the resolve cache file, in @c CURLOPT_RESOLVE format.
+	struct curl_slist *targets;
+	/// Background resolutions of the expired targets (GThread).
+	GList *refreshers;
+	/// TRUE if the entries changed since the resolve cache file was loaded.
+	gboolean dirty;
+	/// Serializes the access to the entries.
+	GMutex lock;
+} net_resolve;
 
 /**
  * @brief Initialize a net_http_rawdata.
@@ -30,9 +163,10 @@ void net_http_rawdata_init(net_http_rawdata *data) {
 	data->curl_code = 0;
 	data->http_code = 0;
 	data->len = 0;
+	data->charged = 0;
 	data->buffer = g_malloc(data->len + 1);
 	if (data->buffer == NULL) {
-		fprintf(stderr, "g_malloc() failed\n");
+		events_log(EVENTS_ERROR, "g_malloc() failed");
 	} else {
 		data->buffer[0] = '\0';
 	}
@@ -48,6 +182,8 @@ void net_http_rawdata_init(net_http_rawdata *data) {
  * @param[in] data The net_http_rawdata to free the buffer of.
  */
 void net_http_rawdata_free(net_http_rawdata *data) {
+	mem_release(data->charged);
+	data->charged = 0;
 	g_free(data->buffer);
 }
 
@@ -67,7 +203,7 @@ size_t net_http_rawdata_write(void *ptr, size_t size, size_t nmemb, net_http_raw
 	size_t new_len = data->len + size * nmemb;
 	data->buffer = g_realloc(data->buffer, new_len + 1);
 	if (data->buffer == NULL) {
-		fprintf(stderr, "g_realloc() failed\n");
+		events_log(EVENTS_ERROR, "g_realloc() failed");
 		exit(EXIT_FAILURE);
 	}
 	memcpy(data->buffer + data->len, ptr, size * nmemb);
@@ -77,22 +213,664 @@ size_t net_http_rawdata_write(void *ptr, size_t size, size_t nmemb, net_http_raw
 }
 
 /**
- * @brief Uses the @c curl_easy functions to perform an HTTP GET.
+ * @brief Frees a net_replay_slot and its list of entries.
  *
- * This function assumes that libcurl has been correctly initialized.
+ * The entries themselves are owned by the list and are freed too.
+ *
+ * @param[in] slot The net_replay_slot to free.
  */
-net_http_rawdata net_http_get(const gchar *url) {
-	net_http_rawdata data;
-	net_http_rawdata_init(&data);
+void net_replay_slot_free(gpointer slot) {
+	g_list_free_full(((net_replay_slot *)slot)->all, g_free);
+	g_free(slot);
+}
+
+/**
+ * @brief Returns the URL of a request as recorded in a traffic corpus, without the NET_CORPUS_MASKED_PARAMS.
+ *
+ * @param[in] url URL of the request.
+ * @return The URL to record and to look up.
+ * @warning The returned string must be freed with @c g_free.
+ */
+gchar *net_corpus_key(const gchar *url) {
+	const gchar *query = strchr(url, '?');
+	if (query == NULL) {
+		return g_strdup(url);
+	}
+	GString *key = g_string_new_len(url, query - url);
+	gchar **params = g_strsplit(query + 1, "&", -1);
+	gchar separator = '?';
+	for (gchar **param = params; *param != NULL; ++param) {
+		gsize name_len = strcspn(*param, "=");
+		gboolean masked = FALSE;
+		for (guint i = 0; NET_CORPUS_MASKED_PARAMS[i] != NULL && !masked; ++i) {
+			masked = strlen(NET_CORPUS_MASKED_PARAMS[i]) == name_len && strncmp(*param, NET_CORPUS_MASKED_PARAMS[i], name_len) == 0;
+		}
+		if (!masked) {
+			g_string_append_c(key, separator);
+			g_string_append(key, *param);
+			separator = '&';
+		}
+	}
+	g_strfreev(params);
+	return g_string_free(key, FALSE);
+}
+
+/**
+ * @brief Appends a completed HTTP GET to the corpus file being recorded.
+ *
+ * @param[in] url URL of the request.
+ * @param[in] start Monotonic time of the beginning of the request.
+ * @param[in] end Monotonic time of the end of the request.
+ * @param[in] data Result of the request.
+ */
+void net_capture_record(const gchar *url, gint64 start, gint64 end, const net_http_rawdata *data) {
+	gchar *key = net_corpus_key(url);
+	net_corpus_record record;
+	record.duration_us = end - start;
+	record.curl_code = data->curl_code;
+	record.http_code = data->http_code;
+	record.url_len = strlen(key);
+	record.body_len = data->len;
+	g_mutex_lock(&net_traffic.lock);
+	if (net_traffic.capture != NULL) {
+		record.offset_us = start - net_traffic.capture_start;
+		if (fwrite(&record, sizeof(record), 1, net_traffic.capture) != 1 ||
+		    fwrite(key, 1, record.url_len, net_traffic.capture) != record.url_len ||
+		    fwrite(data->buffer, 1, record.body_len, net_traffic.capture) != record.body_len) {
+			events_log(EVENTS_ERROR, "net_capture_record: cannot write the corpus file");
+		}
+		fflush(net_traffic.capture);
+	}
+	g_mutex_unlock(&net_traffic.lock);
+	g_free(key);
+}
+
+/**
+ * @brief Serves an HTTP GET from the corpus being replayed.
+ *
+ * In realtime mode this function sleeps until the time the recorded response
+ * was received, relative to the first replayed request.
+ *
+ * @param[in] url URL of the request.
+ * @param[in,out] data The recorded response will be written here.
+ */
+void net_replay_serve(const gchar *url, net_http_rawdata *data) {
+	gchar *key = net_corpus_key(url);
+	g_mutex_lock(&net_traffic.lock);
+	net_replay_slot *slot = g_hash_table_lookup(net_traffic.replay, key);
+	g_free(key);
+	if (slot == NULL) {
+		g_mutex_unlock(&net_traffic.lock);
+		events_log(EVENTS_ERROR, "net_replay_serve: no recorded response for %s", url);
+		data->curl_code = CURLE_COULDNT_CONNECT;
+		return;
+	}
+	net_corpus_entry *entry = (net_corpus_entry *)slot->next->data;
+	if (slot->next->next != NULL) {
+		slot->next = slot->next->next;
+	}
+	gint64 now = g_get_monotonic_time();
+	if (net_traffic.replay_start == 0) {
+		net_traffic.replay_start = now - entry->record.offset_us;
+	}
+	gint64 deadline = net_traffic.replay_start + entry->record.offset_us + entry->record.duration_us;
+	g_mutex_unlock(&net_traffic.lock);
+	if (net_traffic.realtime && deadline > now) {
+		g_usleep(deadline - now);
+	}
+	if (!mem_charge(entry->record.body_len)) {
+		events_log(EVENTS_ERROR, "net_replay_serve: no memory left for %s", url);
+		data->curl_code = CURLE_OUT_OF_MEMORY;
+		return;
+	}
+	data->charged += entry->record.body_len;
+	data->curl_code = entry->record.curl_code;
+	data->http_code = entry->record.http_code;
+	data->len = entry->record.body_len;
+	data->buffer = g_realloc(data->buffer, data->len + 1);
+	memcpy(data->buffer, entry->body, data->len);
+	data->buffer[data->len] = '\0';
+}
+
+/**
+ * @brief Serves a request from the corpus being replayed.
+ *
+ * Streamed requests get the recorded body in chunks of @c NET_REPLAY_CHUNK_SIZE
+ * bytes, just like a live transfer.
+ *
+ * @param[in,out] request The request to serve; its @c data must have been initialized.
+ */
+void net_replay_serve_request(net_http_request *request) {
+	net_replay_serve(request->url, &request->data);
+	if (request->write_func == NULL) {
+		return;
+	}
+	for (size_t pos = 0; pos < request->data.len; pos += NET_REPLAY_CHUNK_SIZE) {
+		size_t len = MIN(NET_REPLAY_CHUNK_SIZE, request->data.len - pos);
+		if (!request->write_func(request->data.buffer + pos, len, request->user_data)) {
+			request->data.len = pos + len;
+			request->data.curl_code = CURLE_WRITE_ERROR;
+			break;
+		}
+	}
+	request->data.buffer[0] = '\0';
+	request->data.len = 0;
+}
+
+/**
+ * @brief Creates the corpus file and switches to capture mode.
+ *
+ * Any capture or replay in progress is terminated first.
+ */
+gboolean net_capture_open(const gchar *path) {
+	net_traffic_close();
+	FILE *capture = fopen(path, "wb");
+	if (capture == NULL) {
+		events_log(EVENTS_ERROR, "net_capture_open: cannot create %s", path);
+		return FALSE;
+	}
+	fwrite(NET_CORPUS_MAGIC, 1, strlen(NET_CORPUS_MAGIC), capture);
+	net_traffic.capture = capture;
+	net_traffic.capture_start = g_get_monotonic_time();
+	net_traffic.mode = NET_TRAFFIC_CAPTURE;
+	return TRUE;
+}
+
+/**
+ * @brief Loads the corpus file and switches to replay mode.
+ *
+ * The whole corpus is loaded in memory and indexed by URL; the response bodies
+ * are not copied until they are served. A truncated corpus is loaded up to its
+ * last complete record.
+ */
+gboolean net_replay_open(const gchar *path, gboolean realtime) {
+	net_traffic_close();
+	gchar *corpus = NULL;
+	gsize length = 0;
+	size_t magic_len = strlen(NET_CORPUS_MAGIC);
+	if (!g_file_get_contents(path, &corpus, &length, NULL) || length < magic_len ||
+	    memcmp(corpus, NET_CORPUS_MAGIC, magic_len) != 0) {
+		events_log(EVENTS_ERROR, "net_replay_open: %s is not a valid traffic corpus", path);
+		g_free(corpus);
+		return FALSE;
+	}
+	net_traffic.replay = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, net_replay_slot_free);
+	for (gsize pos = magic_len; pos < length;) {
+		net_corpus_entry *entry = g_malloc(sizeof(net_corpus_entry));
+		if (length - pos < sizeof(entry->record)) {
+			g_free(entry);
+			events_log(EVENTS_ERROR, "net_replay_open: %s is truncated", path);
+			break;
+		}
+		memcpy(&entry->record, corpus + pos, sizeof(entry->record));
+		pos += sizeof(entry->record);
+		if (length - pos < (gsize)entry->record.url_len + entry->record.body_len) {
+			g_free(entry);
+			events_log(EVENTS_ERROR, "net_replay_open: %s is truncated", path);
+			break;
+		}
+		// Corpora recorded before the credentials were masked
+		gchar *recorded_url = g_strndup(corpus + pos, entry->record.url_len);
+		gchar *url = net_corpus_key(recorded_url);
+		g_free(recorded_url);
+		entry->body = corpus + pos + entry->record.url_len;
+		pos += entry->record.url_len + entry->record.body_len;
+		net_replay_slot *slot = g_hash_table_lookup(net_traffic.replay, url);
+		if (slot == NULL) {
+			slot = g_malloc(sizeof(net_replay_slot));
+			slot->all = NULL;
+			g_hash_table_insert(net_traffic.replay, url, slot);
+		} else {
+			g_free(url);
+		}
+		slot->all = g_list_append(slot->all, entry);
+		slot->next = slot->all;
+	}
+	net_traffic.corpus = corpus;
+	net_traffic.realtime = realtime;
+	net_traffic.replay_start = 0;
+	net_traffic.mode = NET_TRAFFIC_REPLAY;
+	return TRUE;
+}
+
+/**
+ * @brief Closes the corpus file or frees the replayed corpus.
+ */
+void net_traffic_close(void) {
+	if (net_traffic.capture != NULL) {
+		fclose(net_traffic.capture);
+		net_traffic.capture = NULL;
+	}
+	if (net_traffic.replay != NULL) {
+		g_hash_table_destroy(net_traffic.replay);
+		net_traffic.replay = NULL;
+	}
+	g_free(net_traffic.corpus);
+	net_traffic.corpus = NULL;
+	net_traffic.mode = NET_TRAFFIC_LIVE;
+}
+
+/**
+ * @brief Frees a net_resolve_entry.
+ *
+ * @param[in] entry The net_resolve_entry to free.
+ */
+void net_resolve_entry_free(gpointer entry) {
+	g_free(((net_resolve_entry *)entry)->address);
+	g_free(entry);
+}
+
+/**
+ * @brief Returns the "host:port" resolve cache key of an URL.
+ *
+ * @param[in] url An absolute URL.
+ * @return The resolve cache key, or NULL if the URL can't be parsed or its host is an IP address.
+ * @warning The returned string must be freed with @c g_free.
+ */
+gchar *net_resolve_key(const gchar *url) {
+	gchar *key = NULL;
+	char *host = NULL;
+	char *port = NULL;
+	CURLU *parsed = curl_url();
+	if (curl_url_set(parsed, CURLUPART_URL, url, 0) == CURLUE_OK && curl_url_get(parsed, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+	    curl_url_get(parsed, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) == CURLUE_OK && host[0] != '[' &&
+	    !g_ascii_isdigit(host[strlen(host) - 1])) {
+		key = g_strdup_printf("%s:%s", host, port);
+	}
+	curl_free(host);
+	curl_free(port);
+	curl_url_cleanup(parsed);
+	return key;
+}
+
+/**
+ * @brief Stores the address of a connect target in the resolve cache.
+ *
+ * @param[in] key The "host:port" of the target (it's copied).
+ * @param[in] ip The IP address of the target, as returned by @c inet_ntop or @c CURLINFO_PRIMARY_IP.
+ */
+void net_resolve_store(const gchar *key, const gchar *ip) {
+	net_resolve_entry *entry = g_malloc(sizeof(net_resolve_entry));
+	entry->address = strchr(ip, ':') != NULL ? g_strdup_printf("[%s]", ip) : g_strdup(ip);
+	entry->expires = g_get_real_time() / G_USEC_PER_SEC + net_resolve.ttl;
+	g_mutex_lock(&net_resolve.lock);
+	const gchar *failed = (const gchar *)g_hash_table_lookup(net_resolve.failed, key);
+	if (failed != NULL && strcmp(failed, entry->address) == 0) {
+		net_resolve_entry_free(entry);
+	} else {
+		g_hash_table_replace(net_resolve.entries, g_strdup(key), entry);
+		net_resolve.dirty = TRUE;
+	}
+	g_mutex_unlock(&net_resolve.lock);
+}
+
+/**
+ * @brief Resolves an expired connect target again (background thread body).
+ *
+ * If the resolution fails the expired target is kept, so that it can still be
+ * tried by the following processes.
+ *
+ * @param[in] key The "host:port" to resolve; it's freed by this function.
+ * @return Always NULL.
+ */
+gpointer net_resolve_refresh(gpointer key) {
+	gchar *host = g_strdup(key);
+	gchar *port = strrchr(host, ':');
+	*port++ = '\0';
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *result = NULL;
+	if (getaddrinfo(host, port, &hints, &result) == 0) {
+		char ip[INET6_ADDRSTRLEN];
+		const void *addr = result->ai_family == AF_INET6 ? (const void *)&((struct sockaddr_in6 *)result->ai_addr)->sin6_addr
+		                                                 : (const void *)&((struct sockaddr_in *)result->ai_addr)->sin_addr;
+		if (inet_ntop(result->ai_family, addr, ip, sizeof(ip)) != NULL) {
+			net_resolve_store(key, ip);
+		}
+		freeaddrinfo(result);
+	}
+	g_free(host);
+	g_free(key);
+	return NULL;
+}
+
+/**
+ * @brief Updates the resolve cache with the outcome of a completed transfer.
+ *
+ * Hosts resolved by cURL are added to the resolve cache, while targets that
+ * couldn't be connected to are dropped from it and from the targets passed to
+ * cURL (with a @c -host:port entry, which also applies to the transfers of
+ * the batch that didn't start yet). Their address is remembered so that it's
+ * not stored again.
+ *
+ * @param[in] curl The cURL easy handle of the transfer.
+ * @param[in] code The cURL result of the transfer.
+ */
+void net_resolve_learn(CURL *curl, CURLcode code) {
+	if (net_resolve.entries == NULL || (code != CURLE_OK && code != CURLE_COULDNT_CONNECT)) {
+		return;
+	}
+	char *url = NULL;
+	curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+	gchar *key = url != NULL ? net_resolve_key(url) : NULL;
+	if (key == NULL) {
+		return;
+	}
+	char *ip = NULL;
+	if (curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip) != CURLE_OK || ip == NULL || ip[0] == '\0') {
+		ip = NULL;
+	}
+	g_mutex_lock(&net_resolve.lock);
+	gboolean known = g_hash_table_contains(net_resolve.entries, key);
+	if (code == CURLE_COULDNT_CONNECT) {
+		if (known) {
+			g_hash_table_remove(net_resolve.entries, key);
+			net_resolve.dirty = TRUE;
+		}
+		if (ip != NULL) {
+			g_hash_table_replace(net_resolve.failed, g_strdup(key),
+			                     strchr(ip, ':') != NULL ? g_strdup_printf("[%s]", ip) : g_strdup(ip));
+		}
+		gchar *removal = g_strdup_printf("-%s", key);
+		net_resolve.targets = curl_slist_append(net_resolve.targets, removal);
+		g_free(removal);
+	}
+	g_mutex_unlock(&net_resolve.lock);
+	if (!known && code == CURLE_OK && ip != NULL) {
+		net_resolve_store(key, ip);
+	}
+	g_free(key);
+}
+
+/**
+ * @brief Loads the resolve cache file and starts the resolution of its expired targets.
+ *
+ * Malformed lines are silently skipped; a missing file is just an empty cache.
+ */
+void net_resolve_cache_open(const gchar *path, guint ttl) {
+	net_resolve_cache_close();
+	net_resolve.path = g_strdup(path);
+	net_resolve.ttl = ttl;
+	net_resolve.entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, net_resolve_entry_free);
+	net_resolve.failed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	net_resolve.dirty = FALSE;
+	gchar *content = NULL;
+	if (!g_file_get_contents(path, &content, NULL, NULL)) {
+		return;
+	}
+	gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+	gchar **lines = g_strsplit(content, "\n", -1);
+	for (gchar **line = lines; *line != NULL; ++line) {
+		// e.g. api.ilmeteo.net:80:203.0.113.7 1520553600
+		gchar **fields = g_strsplit(*line, " ", 2);
+		gchar *port = fields[0] != NULL ? strchr(fields[0], ':') : NULL;
+		gchar *address = port != NULL ? strchr(port + 1, ':') : NULL;
+		if (address != NULL && fields[1] != NULL) {
+			net_resolve_entry *entry = g_malloc(sizeof(net_resolve_entry));
+			entry->address = g_strdup(address + 1);
+			entry->expires = g_ascii_strtoll(fields[1], NULL, 10);
+			gchar *key = g_strndup(fields[0], address - fields[0]);
+			net_resolve.targets = curl_slist_append(net_resolve.targets, fields[0]);
+			if (entry->expires <= now) {
+				net_resolve.refreshers = g_list_prepend(net_resolve.refreshers, g_thread_new("resolve", net_resolve_refresh, g_strdup(key)));
+			}
+			g_hash_table_replace(net_resolve.entries, key, entry);
+		}
+		g_strfreev(fields);
+	}
+	g_strfreev(lines);
+	g_free(content);
+}
+
+/**
+ * @brief Joins the background resolutions and saves the resolve cache file if needed.
+ */
+void net_resolve_cache_close(void) {
+	for (GList *refresher = net_resolve.refreshers; refresher != NULL; refresher = refresher->next) {
+		g_thread_join((GThread *)refresher->data);
+	}
+	g_list_free(net_resolve.refreshers);
+	net_resolve.refreshers = NULL;
+	if (net_resolve.entries != NULL && net_resolve.dirty) {
+		GString *content = g_string_new(NULL);
+		GHashTableIter iter;
+		gpointer key, value;
+		g_hash_table_iter_init(&iter, net_resolve.entries);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			net_resolve_entry *entry = (net_resolve_entry *)value;
+			g_string_append_printf(content, "%s:%s %" G_GINT64_FORMAT "\n", (gchar *)key, entry->address, entry->expires);
+		}
+		g_file_set_contents(net_resolve.path, content->str, content->len, NULL);
+		g_string_free(content, TRUE);
+	}
+	if (net_resolve.entries != NULL) {
+		g_hash_table_destroy(net_resolve.entries);
+		net_resolve.entries = NULL;
+		g_hash_table_destroy(net_resolve.failed);
+		net_resolve.failed = NULL;
+	}
+	curl_slist_free_all(net_resolve.targets);
+	net_resolve.targets = NULL;
+	g_free(net_resolve.path);
+	net_resolve.path = NULL;
+}
+
+/**
+ * @brief Callback for cURL to write data into a net_http_request.
+ *
+ * The data is stored in the request @c data, or streamed to its @c write_func
+ * if it has one (in capture mode streamed data is stored as well, so that it
+ * can be recorded).
+ *
+ * @param[in] ptr Chunk of new data received from the server.
+ * @param[in] size Number of elements (chars) in the data buffer.
+ * @param[in] nmemb Size of a single element (char) in the data buffer.
+ * @param[in,out] request The request the data belongs to.
+ * @return Number of bytes consumed (0 aborts the transfer).
+ */
+size_t net_http_request_write(void *ptr, size_t size, size_t nmemb, net_http_request *request) {
+	size_t len = size * nmemb;
+	if (request->write_func == NULL || net_traffic.mode == NET_TRAFFIC_CAPTURE) {
+		// Out of budget: abort the transfer rather than the process
+		if (!mem_charge(len)) {
+			events_log(EVENTS_ERROR, "net_http_get %s: no memory left for the response", request->url);
+			return 0;
+		}
+		request->data.charged += len;
+		net_http_rawdata_write(ptr, size, nmemb, &request->data);
+	} else {
+		request->data.len += len;
+	}
+	if (request->write_func != NULL && !request->write_func(ptr, len, request->user_data)) {
+		return 0;
+	}
+	return len;
+}
+
+/**
+ * @brief Completes a request after its transfer is over.
+ *
+ * The request is recorded in capture mode, then the body of streamed
+ * requests is dropped.
+ *
+ * @param[in,out] request The completed request.
+ * @param[in] start Monotonic time of the beginning of the transfer.
+ */
+void net_http_request_done(net_http_request *request, gint64 start) {
+	gint64 duration = g_get_monotonic_time() - start;
+	metrics_http_request(request->data.http_code, request->data.len, duration);
+	events_log(EVENTS_DEBUG, "net_http_get %s: HTTP status code %lu, curl code %d, %zu bytes in %" G_GINT64_FORMAT " us",
+	           request->url, request->data.http_code, request->data.curl_code, request->data.len, duration);
+	WTR_PROBE5(libnet, http__done, request->url, request->data.len, request->data.http_code, request->data.curl_code,
+	           duration);
+	if (net_traffic.mode == NET_TRAFFIC_CAPTURE) {
+		net_capture_record(request->url, start, g_get_monotonic_time(), &request->data);
+	}
+	if (request->write_func != NULL) {
+		request->data.buffer[0] = '\0';
+		request->data.len = 0;
+	}
+}
+
+/**
+ * @brief Creates a cURL easy handle for an HTTP GET.
+ *
+ * The handle writes the response into the request. The targets of the
+ * resolve cache, if any, are passed to cURL so that it doesn't need to
+ * resolve them.
+ *
+ * @param[in,out] request The request; the response will be written into it.
+ * @return The cURL easy handle, which must be freed with @c curl_easy_cleanup.
+ */
+CURL *net_http_easy_new(net_http_request *request) {
 	CURL *curl = curl_easy_init();
-	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_URL, request->url);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, net_http_rawdata_write);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &data);
-	data.curl_code = curl_easy_perform(curl);
-	if (data.curl_code == 0) {
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &data.http_code);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, net_http_request_write);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, request);
+	if (net_resolve.targets != NULL) {
+		curl_easy_setopt(curl, CURLOPT_RESOLVE, net_resolve.targets);
+	}
+	return curl;
+}
+
+/**
+ * @brief Uses the @c curl_easy functions to perform a single request.
+ *
+ * This function assumes that libcurl has been correctly initialized.
+ * In replay mode the network is not used at all; in capture mode the
+ * result is recorded after the request is completed.
+ *
+ * @param[in,out] request The request to perform; its @c data will be initialized.
+ */
+void net_http_perform(net_http_request *request) {
+	net_http_rawdata_init(&request->data);
+	if (net_traffic.mode == NET_TRAFFIC_REPLAY) {
+		net_replay_serve_request(request);
+		return;
 	}
+	gint64 start = g_get_monotonic_time();
+	WTR_PROBE1(libnet, http__start, request->url);
+	CURL *curl = net_http_easy_new(request);
+	request->data.curl_code = curl_easy_perform(curl);
+	// The status code is available even if the transfer was aborted while receiving the body
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &request->data.http_code);
+	net_resolve_learn(curl, request->data.curl_code);
 	curl_easy_cleanup(curl);
-	return data;
+	net_http_request_done(request, start);
+}
+
+/**
+ * @brief Performs a buffered request.
+ */
+net_http_rawdata net_http_get(const gchar *url) {
+	net_http_request request = {url, NULL, NULL};
+	net_http_perform(&request);
+	return request.data;
+}
+
+/**
+ * @brief Performs a streamed request.
+ */
+net_http_rawdata net_http_get_stream(const gchar *url, net_http_write_func write_func, gpointer user_data) {
+	net_http_request request = {url, write_func, user_data};
+	net_http_perform(&request);
+	return request.data;
+}
+
+/**
+ * @brief Performs many HTTP GETs concurrently, waiting for all of them.
+ */
+void net_http_get_many(net_http_request *requests, guint count) {
+	net_http_get_until(requests, count, 0, NULL, NULL);
+}
+
+/**
+ * @brief Uses the @c curl_multi functions to perform many HTTP GETs concurrently.
+ *
+ * All the requests are added to a single multi handle, which works as a
+ * bounded pool of HTTP/1.1 keep-alive connections:
+ * @c CURLMOPT_MAX_HOST_CONNECTIONS queues the transfers past the limit until
+ * a connection to their host is free, and then they reuse it. The waits for
+ * network activity never go past the deadline.
+ *
+ * In replay mode the requests are served one by one from the corpus.
+ */
+void net_http_get_until(net_http_request *requests, guint count, guint timeout, net_http_done_func done_func,
+                        gpointer user_data) {
+	if (net_traffic.mode == NET_TRAFFIC_REPLAY) {
+		gboolean stop = FALSE;
+		for (guint i = 0; i < count; ++i) {
+			net_http_rawdata_init(&requests[i].data);
+			if (stop) {
+				requests[i].data.curl_code = CURLE_ABORTED_BY_CALLBACK;
+				continue;
+			}
+			net_replay_serve_request(&requests[i]);
+			stop = done_func != NULL && done_func(&requests[i], user_data);
+		}
+		return;
+	}
+	gint64 start = g_get_monotonic_time();
+	gint64 deadline = timeout > 0 ? start + (gint64)timeout * 1000 : G_MAXINT64;
+	CURLM *multi = curl_multi_init();
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)NET_MAX_HOST_CONNECTIONS);
+	// Handles still in progress, indexed like the requests (NULL once completed)
+	CURL **handles = g_malloc(sizeof(CURL *) * MAX(count, 1));
+	for (guint i = 0; i < count; ++i) {
+		net_http_rawdata_init(&requests[i].data);
+		handles[i] = net_http_easy_new(&requests[i]);
+		curl_easy_setopt(handles[i], CURLOPT_PRIVATE, &requests[i]);
+		curl_multi_add_handle(multi, handles[i]);
+		WTR_PROBE1(libnet, http__start, requests[i].url);
+	}
+	int running = 0;
+	gboolean stop = FALSE;
+	CURLcode abort_code = CURLE_ABORTED_BY_CALLBACK;
+	do {
+		CURLMcode code = curl_multi_perform(multi, &running);
+		if (code == CURLM_OK && running > 0) {
+			gint64 remaining = (deadline - g_get_monotonic_time()) / 1000;
+			code = curl_multi_wait(multi, NULL, 0, (int)CLAMP(remaining, 0, 1000), NULL);
+		}
+		if (code != CURLM_OK) {
+			events_log(EVENTS_ERROR, "net_http_get_until: curl_multi error %d: %s", code, curl_multi_strerror(code));
+			break;
+		}
+		CURLMsg *msg;
+		int queued;
+		while (!stop && (msg = curl_multi_info_read(multi, &queued)) != NULL) {
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			net_http_request *request = NULL;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&request);
+			request->data.curl_code = msg->data.result;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &request->data.http_code);
+			net_resolve_learn(msg->easy_handle, request->data.curl_code);
+			// The transfers may have waited for a connection: each one is timed from its own beginning
+			curl_off_t total_us = 0;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME_T, &total_us);
+			net_http_request_done(request, g_get_monotonic_time() - (gint64)total_us);
+			handles[request - requests] = NULL;
+			curl_multi_remove_handle(multi, msg->easy_handle);
+			curl_easy_cleanup(msg->easy_handle);
+			stop = done_func != NULL && done_func(request, user_data);
+		}
+		if (!stop && running > 0 && g_get_monotonic_time() >= deadline) {
+			abort_code = CURLE_OPERATION_TIMEDOUT;
+			stop = TRUE;
+		}
+	} while (running > 0 && !stop);
+	// If the loop was interrupted by an error, a deadline or done_func some transfers may still be there
+	for (guint i = 0; i < count; ++i) {
+		if (handles[i] != NULL) {
+			requests[i].data.curl_code = abort_code;
+			curl_multi_remove_handle(multi, handles[i]);
+			curl_easy_cleanup(handles[i]);
+		}
+	}
+	g_free(handles);
+	curl_multi_cleanup(multi);
 }
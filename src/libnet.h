@@ -12,6 +12,13 @@
  * contains the data and the HTTP results and a function to free the
  * heap used by the data.
  *
+ * Every HTTP GET can also be recorded to a corpus file (capture mode) and
+ * later served back from it (replay mode), so that a real refresh cycle can
+ * be reproduced offline on identical input.
+ *
+ * The addresses of the contacted hosts can be kept in a small on-disk resolve
+ * cache, so that short-lived processes can skip DNS resolution entirely.
+ *
  * @author Paolo Bernardi
  * @date 6 Mar 2018
  */
@@ -34,8 +41,52 @@ typedef struct {
 	CURLcode curl_code;
 	/// HTTP status code.
 	unsigned long http_code;
+	/// Bytes of the buffer accounted in the memory budget (see libmem.h).
+	size_t charged;
 } net_http_rawdata;
 
+/**
+ * @brief Consumer of a streamed HTTP response body.
+ *
+ * This function is called with every chunk of the response body as soon as
+ * it's received from the server.
+ *
+ * @param[in] chunk Chunk of the response body (it's not NULL-terminated).
+ * @param[in] len Length of the chunk.
+ * @param[in] user_data User data passed along with the function.
+ * @return TRUE to go on with the transfer, FALSE to abort it (the cURL code will be @c CURLE_WRITE_ERROR).
+ */
+typedef gboolean (*net_http_write_func)(const gchar *chunk, size_t len, gpointer user_data);
+
+/**
+ * @brief An HTTP GET to be performed by net_http_get_many().
+ */
+typedef struct {
+	/// URL that will be passed to the HTTP GET call.
+	const gchar *url;
+	/// If not NULL, the response body is streamed to this function instead of being stored in @c data.
+	net_http_write_func write_func;
+	/// User data for @c write_func.
+	gpointer user_data;
+	/// Result of the HTTP request, filled by net_http_get_many().
+	net_http_rawdata data;
+} net_http_request;
+
+/**
+ * @brief Function called by net_http_get_until() as soon as a request is completed.
+ *
+ * @param[in,out] request The completed request.
+ * @param[in] user_data User data passed to net_http_get_until().
+ * @return TRUE to abort the requests still in progress, FALSE to go on.
+ */
+typedef gboolean (*net_http_done_func)(net_http_request *request, gpointer user_data);
+
+/// Size of the chunks of a replayed response body passed to a net_http_write_func.
+#define NET_REPLAY_CHUNK_SIZE 16384
+
+/// Size of the pool of connections that net_http_get_many() keeps to the same host.
+#define NET_MAX_HOST_CONNECTIONS 4
+
 /**
  * @brief Simple HTTP GET client.
  *
@@ -49,6 +100,57 @@ typedef struct {
  */
 net_http_rawdata net_http_get(const gchar *url);
 
+/**
+ * @brief Streaming HTTP GET client.
+ *
+ * This function sends an HTTP GET request to a web server and passes the
+ * response body to @p write_func chunk by chunk, as soon as it's received,
+ * without storing it. The consumer can abort the transfer as soon as it has
+ * received enough data.
+ *
+ * @param[in] url URL that will be passed to the HTTP GET call.
+ * @param[in] write_func Consumer of the response body.
+ * @param[in] user_data User data for @p write_func.
+ * @return cURL and HTTP response codes; the @c buffer is empty (@c len is 0).
+ * @warning The caller has the responsibility to free the heap of the results by calling net_http_rawdata()
+ */
+net_http_rawdata net_http_get_stream(const gchar *url, net_http_write_func write_func, gpointer user_data);
+
+/**
+ * @brief Bulk HTTP GET client.
+ *
+ * This function performs many HTTP GET requests concurrently and stores the
+ * result of each one in its @c data member. Requests to the same host share
+ * a pool of at most @c NET_MAX_HOST_CONNECTIONS HTTP/1.1 keep-alive
+ * connections: the requests past the limit wait for a free connection
+ * instead of opening new ones. Requests with a @c write_func are streamed as
+ * in net_http_get_stream().
+ *
+ * @param[in,out] requests The requests to perform; their @c data member will be overwritten.
+ * @param[in] count Number of requests.
+ * @warning The caller has the responsibility to free the @c data of each request by calling net_http_rawdata_free()
+ */
+void net_http_get_many(net_http_request *requests, guint count);
+
+/**
+ * @brief Bulk HTTP GET client with a deadline.
+ *
+ * This function works like net_http_get_many(), but it gives up on the
+ * requests still in progress when the deadline expires (their cURL code
+ * will be @c CURLE_OPERATION_TIMEDOUT) or when @p done_func asks to stop
+ * (@c CURLE_ABORTED_BY_CALLBACK), so that a slow server doesn't delay
+ * the results of the others.
+ *
+ * @param[in,out] requests The requests to perform; their @c data member will be overwritten.
+ * @param[in] count Number of requests.
+ * @param[in] timeout Milliseconds available to complete the requests, 0 to wait for all of them.
+ * @param[in] done_func If not NULL, function called as soon as each request is completed.
+ * @param[in] user_data User data for @p done_func.
+ * @warning The caller has the responsibility to free the @c data of each request by calling net_http_rawdata_free()
+ */
+void net_http_get_until(net_http_request *requests, guint count, guint timeout, net_http_done_func done_func,
+                        gpointer user_data);
+
 /**
  * @brief Free the heap used by a net_http_rawdata variable.
  *
@@ -59,4 +161,69 @@ net_http_rawdata net_http_get(const gchar *url);
  */
 void net_http_rawdata_free(net_http_rawdata *data);
 
+/**
+ * @brief Start recording every HTTP GET into a corpus file.
+ *
+ * From now on each call to net_http_get() is performed as usual and its URL,
+ * timing, cURL and HTTP codes and body are appended to the corpus file. The
+ * corpus can be fed back to net_replay_open(). Credentials in the query of
+ * the URLs (e.g. Tiempo's @c affiliate_id) are not recorded, so the corpus
+ * can be shared and replayed whatever keys are used.
+ *
+ * @param[in] path Path of the corpus file (it will be overwritten).
+ * @return TRUE if the corpus file could be created, FALSE otherwise.
+ * @warning The capture must be terminated with net_traffic_close() to flush the corpus file.
+ */
+gboolean net_capture_open(const gchar *path);
+
+/**
+ * @brief Serve every HTTP GET from a recorded corpus file.
+ *
+ * From now on net_http_get() doesn't touch the network: responses are looked
+ * up by URL (without credentials) in the corpus recorded by net_capture_open(). Repeated requests
+ * for the same URL get the recorded responses in order (the last one is
+ * served again once they are exhausted); unknown URLs fail with
+ * @c CURLE_COULDNT_CONNECT.
+ *
+ * @param[in] path Path of the corpus file.
+ * @param[in] realtime If TRUE, responses are delayed to reproduce the recorded inter-arrival timing and latency, otherwise they
+ * are served as fast as possible.
+ * @return TRUE if the corpus file could be loaded, FALSE otherwise.
+ * @warning The replay must be terminated with net_traffic_close() to free the corpus.
+ */
+gboolean net_replay_open(const gchar *path, gboolean realtime);
+
+/**
+ * @brief Terminate the current capture or replay and go back to live traffic.
+ *
+ * It's safe to call this function even if neither net_capture_open() nor
+ * net_replay_open() were called.
+ */
+void net_traffic_close(void);
+
+/**
+ * @brief Use a persistent resolve cache for the following HTTP calls.
+ *
+ * The resolve cache is a text file with a @c host:port:address target and an
+ * expiration time (seconds since the Unix epoch) per line. Its targets are
+ * passed to cURL via @c CURLOPT_RESOLVE, so cached hosts are contacted without
+ * any DNS query. Expired targets are still used but they are resolved again
+ * in the background; hosts that are not in the cache are added once cURL has
+ * resolved them and targets that can't be connected to are dropped.
+ *
+ * @param[in] path Path of the resolve cache file (it will be created if needed).
+ * @param[in] ttl Lifetime of the newly resolved targets, in seconds.
+ * @warning The resolve cache must be closed with net_resolve_cache_close() to be saved.
+ */
+void net_resolve_cache_open(const gchar *path, guint ttl);
+
+/**
+ * @brief Save and close the resolve cache.
+ *
+ * This function waits for the background resolutions to complete and saves the
+ * resolve cache if it changed. It's safe to call this function even if
+ * net_resolve_cache_open() was not called.
+ */
+void net_resolve_cache_close(void);
+
 #endif  // __LIBNET_H__
@@ -6,7 +6,8 @@
  *
  * Libutils contains several unrelated utility functions. For example
  * there are type conversion functions, date parsing and xml attribute
- * reader functions.
+ * reader functions. There is also a fast non-cryptographic hash function
+ * (XXH64) to detect identical payloads.
  *
  * @author Paolo Bernardi
  * @date 6 Mar 2018
@@ -23,6 +24,13 @@
 
 #include "libutils.h"
 
+/// XXH64 prime constants.
+#define XXH_PRIME64_1 G_GUINT64_CONSTANT(11400714785074694791)
+#define XXH_PRIME64_2 G_GUINT64_CONSTANT(14029467366897019727)
+#define XXH_PRIME64_3 G_GUINT64_CONSTANT(1609587929392839161)
+#define XXH_PRIME64_4 G_GUINT64_CONSTANT(9650029242287828579)
+#define XXH_PRIME64_5 G_GUINT64_CONSTANT(2870177450012600261)
+
 /**
  * @brief strptime extern declaration (sometimes it's not imported from time.h).
  *
@@ -103,7 +111,7 @@ int xmlGetPropInt(xmlNode *node, char *property) {
 	if (str2int(&i, str, 10) != STR2INT_SUCCESS) {
 		i = INT_MIN;
 	}
-	g_free(str);
+	xmlFree(str);
 	return i;
 }
 
@@ -123,7 +131,7 @@ double xmlGetPropDouble(xmlNode *node, char *property) {
 	if (str2double(&d, str) != STR2DOUBLE_SUCCESS) {
 		d = DBL_MIN;
 	}
-	g_free(str);
+	xmlFree(str);
 	return d;
 }
 
@@ -162,3 +170,181 @@ gboolean is_number(char *str) {
 	}
 	return TRUE;
 }
+
+/**
+ * @brief Rotates a 64 bit integer to the left.
+ */
+static inline guint64 xxh64_rotl(guint64 x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * @brief Reads a little-endian 64 bit integer (XXH64 is defined on little-endian input).
+ */
+static inline guint64 xxh64_read64(const guchar *p) {
+	return (guint64)p[0] | (guint64)p[1] << 8 | (guint64)p[2] << 16 | (guint64)p[3] << 24 | (guint64)p[4] << 32 | (guint64)p[5] << 40 |
+	       (guint64)p[6] << 48 | (guint64)p[7] << 56;
+}
+
+/**
+ * @brief Reads a little-endian 32 bit integer.
+ */
+static inline guint64 xxh64_read32(const guchar *p) {
+	return (guint64)p[0] | (guint64)p[1] << 8 | (guint64)p[2] << 16 | (guint64)p[3] << 24;
+}
+
+/**
+ * @brief Mixes 8 bytes of input into an accumulator.
+ */
+static inline guint64 xxh64_round(guint64 acc, guint64 input) {
+	acc += input * XXH_PRIME64_2;
+	acc = xxh64_rotl(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+/**
+ * @brief Merges an accumulator into the final hash.
+ */
+static inline guint64 xxh64_merge_round(guint64 hash, guint64 acc) {
+	hash ^= xxh64_round(0, acc);
+	return hash * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/**
+ * @brief Initializes the accumulators as per the XXH64 specification.
+ */
+void xxh64_init(xxh64_state *state, guint64 seed) {
+	state->seed = seed;
+	state->acc[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+	state->acc[1] = seed + XXH_PRIME64_2;
+	state->acc[2] = seed;
+	state->acc[3] = seed - XXH_PRIME64_1;
+	state->total_len = 0;
+	state->buffered = 0;
+}
+
+/**
+ * @brief Consumes the data in 32 byte stripes, buffering the remainder.
+ */
+void xxh64_update(xxh64_state *state, const void *data, size_t len) {
+	const guchar *p = (const guchar *)data;
+	const guchar *end = p + len;
+	state->total_len += len;
+	if (state->buffered + len < 32) {
+		memcpy(state->buffer + state->buffered, p, len);
+		state->buffered += len;
+		return;
+	}
+	if (state->buffered > 0) {
+		size_t fill = 32 - state->buffered;
+		memcpy(state->buffer + state->buffered, p, fill);
+		for (int i = 0; i < 4; ++i) {
+			state->acc[i] = xxh64_round(state->acc[i], xxh64_read64(state->buffer + i * 8));
+		}
+		p += fill;
+		state->buffered = 0;
+	}
+	// Four independent accumulators keep the CPU pipelines busy
+	guint64 v1 = state->acc[0], v2 = state->acc[1], v3 = state->acc[2], v4 = state->acc[3];
+	for (; p + 32 <= end; p += 32) {
+		v1 = xxh64_round(v1, xxh64_read64(p));
+		v2 = xxh64_round(v2, xxh64_read64(p + 8));
+		v3 = xxh64_round(v3, xxh64_read64(p + 16));
+		v4 = xxh64_round(v4, xxh64_read64(p + 24));
+	}
+	state->acc[0] = v1, state->acc[1] = v2, state->acc[2] = v3, state->acc[3] = v4;
+	state->buffered = end - p;
+	memcpy(state->buffer, p, state->buffered);
+}
+
+/**
+ * @brief Merges the accumulators, the buffered tail and the length, then avalanches.
+ */
+guint64 xxh64_digest(const xxh64_state *state) {
+	guint64 hash;
+	if (state->total_len >= 32) {
+		hash = xxh64_rotl(state->acc[0], 1) + xxh64_rotl(state->acc[1], 7) + xxh64_rotl(state->acc[2], 12) + xxh64_rotl(state->acc[3], 18);
+		for (int i = 0; i < 4; ++i) {
+			hash = xxh64_merge_round(hash, state->acc[i]);
+		}
+	} else {
+		hash = state->seed + XXH_PRIME64_5;
+	}
+	hash += state->total_len;
+	const guchar *p = state->buffer;
+	const guchar *end = p + state->buffered;
+	for (; p + 8 <= end; p += 8) {
+		hash ^= xxh64_round(0, xxh64_read64(p));
+		hash = xxh64_rotl(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		hash ^= xxh64_read32(p) * XXH_PRIME64_1;
+		hash = xxh64_rotl(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; ++p) {
+		hash ^= *p * XXH_PRIME64_5;
+		hash = xxh64_rotl(hash, 11) * XXH_PRIME64_1;
+	}
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME64_3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+/**
+ * @brief One-shot XXH64 (it's just init, update and digest).
+ */
+guint64 xxh64(const void *data, size_t len, guint64 seed) {
+	xxh64_state state;
+	xxh64_init(&state, seed);
+	xxh64_update(&state, data, len);
+	return xxh64_digest(&state);
+}
+
+/**
+ * @brief Varint encoding, as used by Protocol Buffers.
+ */
+guint varint_encode(guint64 value, guint8 *out) {
+	guint length = 0;
+	while (value >= 0x80) {
+		out[length++] = (guint8)(value | 0x80);
+		value >>= 7;
+	}
+	out[length++] = (guint8)value;
+	return length;
+}
+
+/**
+ * @brief Varint decoding; a varint can't be longer than 64 bits.
+ */
+gboolean varint_decode(const guint8 **data, const guint8 *end, guint64 *value) {
+	guint64 result = 0;
+	const guint8 *p = *data;
+	for (guint shift = 0; shift < 64 && p < end; shift += 7) {
+		guint8 byte = *p++;
+		result |= (guint64)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			*value = result;
+			*data = p;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * @brief Zigzag encoding, as used by Protocol Buffers.
+ */
+guint64 zigzag_encode(gint64 value) {
+	return ((guint64)value << 1) ^ (guint64)(value >> 63);
+}
+
+/**
+ * @brief Zigzag decoding.
+ */
+gint64 zigzag_decode(guint64 value) {
+	return (gint64)(value >> 1) ^ -(gint64)(value & 1);
+}
@@ -9,7 +9,8 @@
  *
  * Libutils contains several unrelated utility functions. For example
  * there are type conversion functions, date parsing and xml attribute
- * reader functions.
+ * reader functions. There is also a fast non-cryptographic hash function
+ * (XXH64) to detect identical payloads.
  *
  * @author Paolo Bernardi
  * @date 6 Mar 2018
@@ -137,4 +138,92 @@ GDateTime *parseDateTime(char *str, char *format);
  */
 gboolean is_number(char *str);
 
+/**
+ * @brief State of an incremental XXH64 hash computation.
+ *
+ * XXH64 is a fast non-cryptographic 64 bit hash function, suitable to detect
+ * identical payloads (see https://github.com/Cyan4973/xxHash).
+ */
+typedef struct {
+	/// The four accumulators.
+	guint64 acc[4];
+	/// Hash seed.
+	guint64 seed;
+	/// Number of bytes hashed so far.
+	guint64 total_len;
+	/// Bytes not yet consumed by the accumulators (less than a 32 byte stripe).
+	guchar buffer[32];
+	/// Number of bytes in @c buffer.
+	guint buffered;
+} xxh64_state;
+
+/**
+ * @brief Starts an incremental XXH64 hash computation.
+ *
+ * @param[out] state The hash state to initialize.
+ * @param[in] seed Hash seed (0 is fine for most uses).
+ */
+void xxh64_init(xxh64_state *state, guint64 seed);
+
+/**
+ * @brief Adds data to an incremental XXH64 hash computation.
+ *
+ * @param[in,out] state The hash state, as initialized by xxh64_init().
+ * @param[in] data Data to hash.
+ * @param[in] len Length of the data, in bytes.
+ */
+void xxh64_update(xxh64_state *state, const void *data, size_t len);
+
+/**
+ * @brief Returns the XXH64 hash of all the data added so far.
+ *
+ * The state is not modified, so more data can be added afterwards.
+ *
+ * @param[in] state The hash state.
+ * @return The 64 bit hash.
+ */
+guint64 xxh64_digest(const xxh64_state *state);
+
+/**
+ * @brief Computes the XXH64 hash of a buffer.
+ *
+ * @param[in] data Data to hash.
+ * @param[in] len Length of the data, in bytes.
+ * @param[in] seed Hash seed (0 is fine for most uses).
+ * @return The 64 bit hash.
+ */
+guint64 xxh64(const void *data, size_t len, guint64 seed);
+
+/// Maximum length of a varint-encoded 64 bit integer, in bytes.
+#define VARINT_MAX_LENGTH 10
+
+/**
+ * @brief Encodes an unsigned integer as a varint (7 bits per byte, least significant first).
+ *
+ * @param[in] value The integer to encode.
+ * @param[out] out Buffer of at least @c VARINT_MAX_LENGTH bytes.
+ * @return Number of bytes written.
+ */
+guint varint_encode(guint64 value, guint8 *out);
+
+/**
+ * @brief Decodes a varint.
+ *
+ * @param[in,out] data Pointer to the varint; it's moved past it.
+ * @param[in] end End of the buffer that contains the varint.
+ * @param[out] value The decoded integer.
+ * @return TRUE on success, FALSE if the varint is truncated or too long.
+ */
+gboolean varint_decode(const guint8 **data, const guint8 *end, guint64 *value);
+
+/**
+ * @brief Maps a signed integer to an unsigned one, so that small negative numbers stay small (0, -1, 1, -2... become 0, 1, 2, 3...).
+ */
+guint64 zigzag_encode(gint64 value);
+
+/**
+ * @brief Reverses zigzag_encode().
+ */
+gint64 zigzag_decode(guint64 value);
+
 #endif  // __LIBUTILS_H__
@@ -23,6 +23,15 @@
 #include "libnet.h"
 #include "libutils.h"
 #include "libweather.h"
+#include "probes.h"
+
+#ifdef WTR_HAVE_SDT
+WTR_PROBE_SEMAPHORE_DEFINE(libweather, cache__hit);
+WTR_PROBE_SEMAPHORE_DEFINE(libweather, cache__miss);
+WTR_PROBE_SEMAPHORE_DEFINE(libweather, cache__set);
+WTR_PROBE_SEMAPHORE_DEFINE(libweather, forecast__parse);
+WTR_PROBE_SEMAPHORE_DEFINE(libweather, location__search);
+#endif
 
 /**
  * @brief Pretty-prints a location.
@@ -42,6 +51,7 @@ void wtr_location_print(wtr_location location) {
  * This kind of search is quite fast even if the locations are more than 8000.
  */
 GList *wtr_location_search(gchar *query, wtr_location_search_type search_type) {
+	gint64 start = WTR_PROBE_TIME();
 	int count = sizeof(WTR_LOCATIONS) / sizeof(wtr_location);
 	GList *list = NULL;
 	gchar *nameUpper = g_utf8_strup(query, -1);
@@ -53,6 +63,9 @@ GList *wtr_location_search(gchar *query, wtr_location_search_type search_type) {
 		}
 	}
 	g_free(nameUpper);
+	if (WTR_PROBE_ENABLED(libweather, location__search)) {
+		WTR_PROBE4(libweather, location__search, query, search_type, g_list_length(list), WTR_PROBE_TIME() - start);
+	}
 	return list;
 }
 
@@ -66,9 +79,44 @@ GList *wtr_location_search(gchar *query, wtr_location_search_type search_type) {
 wtr_forecast *wtr_forecast_init() {
 	wtr_forecast *forecast = (wtr_forecast *)g_malloc(sizeof(wtr_forecast));
 	forecast->days = NULL;
+	forecast->hash = 0;
+	forecast->hours_dropped = FALSE;
 	return forecast;
 }
 
+/**
+ * @brief Deep-copies a wtr_forecast.
+ *
+ * Dates are shared (GDateTime is immutable and reference counted), everything
+ * else is copied. The hash is kept only if all the days are copied, since a
+ * partial copy doesn't represent the whole document anymore.
+ */
+wtr_forecast *wtr_forecast_copy(wtr_forecast *forecast, guint days) {
+	wtr_forecast *copy = wtr_forecast_init();
+	guint count = 0;
+	for (GList *day_ptr = forecast->days; day_ptr != NULL && (days == 0 || count < days); day_ptr = day_ptr->next, ++count) {
+		wtr_forecast_day *day = (wtr_forecast_day *)g_malloc(sizeof(wtr_forecast_day));
+		*day = *(wtr_forecast_day *)day_ptr->data;
+		g_date_time_ref(day->date);
+		day->hours = NULL;
+		for (GList *hour_ptr = ((wtr_forecast_day *)day_ptr->data)->hours; hour_ptr != NULL; hour_ptr = hour_ptr->next) {
+			wtr_forecast_hour *hour = (wtr_forecast_hour *)g_malloc(sizeof(wtr_forecast_hour));
+			*hour = *(wtr_forecast_hour *)hour_ptr->data;
+			g_date_time_ref(hour->tstamp);
+			hour->wind_dir = g_strdup(hour->wind_dir);
+			day->hours = g_list_prepend(day->hours, hour);
+		}
+		day->hours = g_list_reverse(day->hours);
+		copy->days = g_list_prepend(copy->days, day);
+	}
+	copy->days = g_list_reverse(copy->days);
+	if (days == 0 || g_list_length(forecast->days) <= days) {
+		copy->hash = forecast->hash;
+	}
+	copy->hours_dropped = forecast->hours_dropped;
+	return copy;
+}
+
 /**
  * @brief frees a wtr_forecast pointer, as created by wtr_forecast_init().
  *
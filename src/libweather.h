@@ -166,8 +166,19 @@ typedef struct {
  *
  * The weather forecasts for a location contain a list of daily forecasts,
  * which in turn contain a list of hourly forecasts for each day.
+ *
+ * Forecasts parsed from a complete provider document also carry the hash of
+ * such document: two forecasts with the same non-zero @c hash come from
+ * identical documents, so consumers can cheaply skip re-rendering them.
  */
-typedef struct { GList *days; } wtr_forecast;
+typedef struct {
+	/// Daily forecasts.
+	GList *days;
+	/// XXH64 hash of the document the forecasts were parsed from, 0 if unknown.
+	guint64 hash;
+	/// TRUE if some hourly forecasts of the document were dropped to save memory (see libmem.h).
+	gboolean hours_dropped;
+} wtr_forecast;
 
 /**
  * The location database has been placed in a separate header due to its size.
@@ -206,6 +217,19 @@ GList *wtr_location_search(gchar *name, wtr_location_search_type search_type);
  */
 wtr_forecast *wtr_forecast_init();
 
+/**
+ * @brief Copies a wtr_forecast.
+ *
+ * This function returns a deep copy of the forecasts, optionally limited to
+ * the first days.
+ *
+ * @param[in] forecast Weather forecasts to copy.
+ * @param[in] days Number of days to copy, 0 to copy all of them.
+ * @return A new wtr_forecast structure.
+ * @warn The caller must free the wtr_forecast struct with wtr_forecast_free().
+ */
+wtr_forecast *wtr_forecast_copy(wtr_forecast *forecast, guint days);
+
 /**
  * Stampa le previsioni meteo a schermo.
  */
@@ -0,0 +1,346 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_alerts.c
+ * @brief Standing alert rules, evaluated incrementally as forecasts are refreshed (implementation).
+ *
+ * The state file is a key file too. The group @c "location CODE" holds the
+ * hash of the last forecasts of a location and a fingerprint (a hash of the
+ * values of every hourly forecast) for each field; the group @c "alert RULE"
+ * holds, for each location of the rule, whether the alert is firing and the
+ * hour (since the Unix epoch) of its last evaluation.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "libevents.h"
+#include "libutils.h"
+#include "libweather.h"
+#include "libweather_alerts.h"
+#include "libweather_query.h"
+
+/// Number of fingerprinted fields, in the same order as the @c WTR_QUERY_USES_* flags.
+#define WTR_ALERTS_FIELDS 7
+
+/**
+ * @brief A rule, as read from the rules file.
+ */
+typedef struct {
+	/// Name of the rule.
+	gchar *name;
+	/// Condition of the rule.
+	wtr_query *query;
+	/// Fields read by the condition (@c WTR_QUERY_USES_* flags).
+	guint uses;
+	/// Number of hours evaluated from the current one, 0 to evaluate all of them.
+	guint window;
+} wtr_alerts_rule;
+
+/// Keys of the fingerprints in the state file, in the same order as the @c WTR_QUERY_USES_* flags.
+static const gchar *wtr_alerts_fields[WTR_ALERTS_FIELDS] = {"weather", "temp", "wind_speed", "rain", "humidity", "pressure", "time"};
+
+/// The rules (wtr_alerts_rule), NULL if the alerts are disabled.
+static GPtrArray *wtr_alerts_rules = NULL;
+/// Rules of each location code (GPtrArray of wtr_alerts_rule, not owned).
+static GHashTable *wtr_alerts_index = NULL;
+/// Rules of every location (wtr_alerts_rule, not owned).
+static GPtrArray *wtr_alerts_everywhere = NULL;
+/// State of the alerts.
+static GKeyFile *wtr_alerts_state = NULL;
+/// Where the state of the alerts is saved.
+static gchar *wtr_alerts_state_file = NULL;
+/// TRUE if the state changed since it was loaded.
+static gboolean wtr_alerts_state_dirty = FALSE;
+/// Function called on every transition.
+static wtr_alerts_func wtr_alerts_callback = NULL;
+/// Data passed to wtr_alerts_callback.
+static gpointer wtr_alerts_user_data = NULL;
+/// Serializes the updates from many threads.
+static GMutex wtr_alerts_lock;
+
+/**
+ * @brief Frees a rule.
+ */
+void wtr_alerts_rule_free(wtr_alerts_rule *rule) {
+	g_free(rule->name);
+	wtr_query_free(rule->query);
+	g_free(rule);
+}
+
+/**
+ * @brief Reads a rule from a group of the rules file.
+ *
+ * @return The rule, or NULL if it's not valid (the error is reported on the standard error).
+ */
+wtr_alerts_rule *wtr_alerts_rule_read(GKeyFile *rules, const gchar *name) {
+	gchar *where = g_key_file_get_string(rules, name, "where", NULL);
+	gint window = g_key_file_has_key(rules, name, "window", NULL) ? g_key_file_get_integer(rules, name, "window", NULL) : 0;
+	if (where == NULL || !g_key_file_has_key(rules, name, "locations", NULL) || window < 0) {
+		events_log(EVENTS_ERROR, "wtr_alerts_open rule '%s' needs a query (where), some locations and a non-negative window", name);
+		g_free(where);
+		return NULL;
+	}
+	GError *error = NULL;
+	wtr_query *query = wtr_query_compile(where, &error);
+	g_free(where);
+	if (query == NULL) {
+		events_log(EVENTS_ERROR, "wtr_alerts_open rule '%s': %s", name, error->message);
+		g_error_free(error);
+		return NULL;
+	}
+	wtr_alerts_rule *rule = (wtr_alerts_rule *)g_malloc(sizeof(wtr_alerts_rule));
+	rule->name = g_strdup(name);
+	rule->query = query;
+	rule->uses = wtr_query_uses(query);
+	rule->window = window;
+	return rule;
+}
+
+/**
+ * @brief Adds a rule to the index of its locations.
+ */
+void wtr_alerts_index_rule(GKeyFile *rules, wtr_alerts_rule *rule) {
+	gchar **locations = g_key_file_get_string_list(rules, rule->name, "locations", NULL, NULL);
+	for (guint i = 0; locations != NULL && locations[i] != NULL; ++i) {
+		gchar *code = g_strstrip(locations[i]);
+		if (strcmp(code, "*") == 0) {
+			g_ptr_array_add(wtr_alerts_everywhere, rule);
+		} else if (*code != '\0') {
+			GPtrArray *location_rules = (GPtrArray *)g_hash_table_lookup(wtr_alerts_index, code);
+			if (location_rules == NULL) {
+				location_rules = g_ptr_array_new();
+				g_hash_table_insert(wtr_alerts_index, g_strdup(code), location_rules);
+			}
+			g_ptr_array_add(location_rules, rule);
+		}
+	}
+	g_strfreev(locations);
+}
+
+/**
+ * @brief Removes from the state the alerts of the rules that don't exist anymore.
+ */
+void wtr_alerts_state_prune(void) {
+	gchar **groups = g_key_file_get_groups(wtr_alerts_state, NULL);
+	for (guint i = 0; groups[i] != NULL; ++i) {
+		if (!g_str_has_prefix(groups[i], "alert ")) {
+			continue;
+		}
+		gboolean found = FALSE;
+		for (guint r = 0; r < wtr_alerts_rules->len && !found; ++r) {
+			found = strcmp(groups[i] + strlen("alert "), ((wtr_alerts_rule *)g_ptr_array_index(wtr_alerts_rules, r))->name) == 0;
+		}
+		if (!found) {
+			g_key_file_remove_group(wtr_alerts_state, groups[i], NULL);
+			wtr_alerts_state_dirty = TRUE;
+		}
+	}
+	g_strfreev(groups);
+}
+
+/**
+ * @brief Frees the rules and the state, without saving it.
+ */
+void wtr_alerts_free(void) {
+	if (wtr_alerts_rules != NULL) {
+		g_ptr_array_free(wtr_alerts_rules, TRUE);
+		g_hash_table_destroy(wtr_alerts_index);
+		g_ptr_array_free(wtr_alerts_everywhere, TRUE);
+		g_key_file_free(wtr_alerts_state);
+		g_free(wtr_alerts_state_file);
+	}
+	wtr_alerts_rules = NULL;
+	wtr_alerts_index = NULL;
+	wtr_alerts_everywhere = NULL;
+	wtr_alerts_state = NULL;
+	wtr_alerts_state_file = NULL;
+	wtr_alerts_state_dirty = FALSE;
+}
+
+gboolean wtr_alerts_open(const gchar *rules_file, const gchar *state_file, wtr_alerts_func func, gpointer user_data) {
+	GKeyFile *rules = g_key_file_new();
+	GError *error = NULL;
+	if (!g_key_file_load_from_file(rules, rules_file, G_KEY_FILE_NONE, &error)) {
+		events_log(EVENTS_ERROR, "wtr_alerts_open can't read %s: %s", rules_file, error->message);
+		g_error_free(error);
+		g_key_file_free(rules);
+		return FALSE;
+	}
+	g_mutex_lock(&wtr_alerts_lock);
+	wtr_alerts_free();
+	wtr_alerts_rules = g_ptr_array_new_with_free_func((GDestroyNotify)wtr_alerts_rule_free);
+	wtr_alerts_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+	wtr_alerts_everywhere = g_ptr_array_new();
+	gboolean ok = TRUE;
+	gchar **groups = g_key_file_get_groups(rules, NULL);
+	for (guint i = 0; groups[i] != NULL; ++i) {
+		wtr_alerts_rule *rule = wtr_alerts_rule_read(rules, groups[i]);
+		if (rule == NULL) {
+			ok = FALSE;
+			continue;
+		}
+		g_ptr_array_add(wtr_alerts_rules, rule);
+		wtr_alerts_index_rule(rules, rule);
+	}
+	g_strfreev(groups);
+	g_key_file_free(rules);
+	// A missing or unreadable state just means that no alert is firing yet
+	wtr_alerts_state = g_key_file_new();
+	g_key_file_load_from_file(wtr_alerts_state, state_file, G_KEY_FILE_NONE, NULL);
+	wtr_alerts_state_file = g_strdup(state_file);
+	wtr_alerts_callback = func;
+	wtr_alerts_user_data = user_data;
+	if (ok) {
+		wtr_alerts_state_prune();
+	} else {
+		wtr_alerts_free();
+	}
+	g_mutex_unlock(&wtr_alerts_lock);
+	return ok;
+}
+
+void wtr_alerts_close(void) {
+	g_mutex_lock(&wtr_alerts_lock);
+	if (wtr_alerts_state_dirty) {
+		gsize length;
+		gchar *data = g_key_file_to_data(wtr_alerts_state, &length, NULL);
+		GError *error = NULL;
+		if (!g_file_set_contents(wtr_alerts_state_file, data, length, &error)) {
+			events_log(EVENTS_ERROR, "wtr_alerts_close can't save %s: %s", wtr_alerts_state_file, error->message);
+			g_error_free(error);
+		}
+		g_free(data);
+	}
+	wtr_alerts_free();
+	g_mutex_unlock(&wtr_alerts_lock);
+}
+
+/**
+ * @brief Computes the fingerprint of each field of the hourly forecasts.
+ *
+ * @param[in] forecast The forecasts.
+ * @param[out] fingerprints A fingerprint for each field, in the same order as the @c WTR_QUERY_USES_* flags.
+ */
+void wtr_alerts_fingerprint(wtr_forecast *forecast, guint64 *fingerprints) {
+	xxh64_state states[WTR_ALERTS_FIELDS];
+	for (guint f = 0; f < WTR_ALERTS_FIELDS; ++f) {
+		xxh64_init(&states[f], 0);
+	}
+	gdouble day_index = 0;
+	for (GList *day_ptr = forecast->days; day_ptr != NULL; day_ptr = day_ptr->next, ++day_index) {
+		wtr_forecast_day *day = (wtr_forecast_day *)day_ptr->data;
+		for (GList *hour_ptr = day->hours; hour_ptr != NULL; hour_ptr = hour_ptr->next) {
+			wtr_forecast_hour *hour = (wtr_forecast_hour *)hour_ptr->data;
+			gdouble values[] = {hour->weather, hour->temp, hour->wind_speed, hour->rain, hour->humidity, hour->pressure};
+			for (guint f = 0; f < G_N_ELEMENTS(values); ++f) {
+				xxh64_update(&states[f], &values[f], sizeof(gdouble));
+			}
+			// Hourly forecasts moving to another time or day change the outcome of any rule
+			gint64 tstamp = g_date_time_to_unix(hour->tstamp);
+			xxh64_update(&states[WTR_ALERTS_FIELDS - 1], &tstamp, sizeof(tstamp));
+			xxh64_update(&states[WTR_ALERTS_FIELDS - 1], &day_index, sizeof(day_index));
+		}
+	}
+	for (guint f = 0; f < WTR_ALERTS_FIELDS; ++f) {
+		fingerprints[f] = xxh64_digest(&states[f]);
+	}
+}
+
+/**
+ * @brief Finds out which fields changed since the last forecasts of a location, and records the new ones.
+ *
+ * @return The changed fields, as @c WTR_QUERY_USES_* flags.
+ */
+guint wtr_alerts_changes(const gchar *location_code, wtr_forecast *forecast) {
+	gchar *group = g_strconcat("location ", location_code, NULL);
+	GError *error = NULL;
+	guint64 hash = g_key_file_get_uint64(wtr_alerts_state, group, "hash", &error);
+	guint changed = 0;
+	// Same document, same fields: not even the fingerprints are needed
+	if (error != NULL || forecast->hash == 0 || hash != forecast->hash) {
+		guint64 fingerprints[WTR_ALERTS_FIELDS];
+		wtr_alerts_fingerprint(forecast, fingerprints);
+		for (guint f = 0; f < WTR_ALERTS_FIELDS; ++f) {
+			GError *field_error = NULL;
+			guint64 fingerprint = g_key_file_get_uint64(wtr_alerts_state, group, wtr_alerts_fields[f], &field_error);
+			if (field_error != NULL || fingerprint != fingerprints[f]) {
+				changed |= 1 << f;
+				g_key_file_set_uint64(wtr_alerts_state, group, wtr_alerts_fields[f], fingerprints[f]);
+			}
+			g_clear_error(&field_error);
+		}
+		g_key_file_set_uint64(wtr_alerts_state, group, "hash", forecast->hash);
+		wtr_alerts_state_dirty = TRUE;
+	}
+	g_clear_error(&error);
+	g_free(group);
+	return changed;
+}
+
+/**
+ * @brief Evaluates the rules of a location affected by the changed fields, reporting the transitions.
+ *
+ * @param[in] rules The rules (wtr_alerts_rule).
+ * @param[in] location_code Location code.
+ * @param[in] forecast The forecasts of the location.
+ * @param[in] changed The changed fields, as @c WTR_QUERY_USES_* flags.
+ * @param[in] now Current time, in seconds since the Unix epoch.
+ */
+void wtr_alerts_check(GPtrArray *rules, const gchar *location_code, wtr_forecast *forecast, guint changed, gint64 now) {
+	gint hour = (gint)(now / 3600);
+	for (guint r = 0; r < rules->len; ++r) {
+		wtr_alerts_rule *rule = (wtr_alerts_rule *)g_ptr_array_index(rules, r);
+		gchar *group = g_strconcat("alert ", rule->name, NULL);
+		gsize length = 0;
+		gint *state = g_key_file_get_integer_list(wtr_alerts_state, group, location_code, &length, NULL);
+		gboolean known = state != NULL && length == 2;
+		gboolean firing = known && state[0];
+		gint evaluated = known ? state[1] : -1;
+		g_free(state);
+		// Inputs unchanged: the outcome can't change either
+		if (known && (rule->uses & changed) == 0 && (rule->window == 0 || evaluated == hour)) {
+			g_free(group);
+			continue;
+		}
+		gint64 from = (gint64)hour * 3600;
+		gint64 match = rule->window > 0 ? wtr_query_match_range(rule->query, forecast, from, from + (gint64)rule->window * 3600)
+		                                : wtr_query_match(rule->query, forecast);
+		if ((match >= 0) != firing && wtr_alerts_callback != NULL) {
+			wtr_alerts_callback(rule->name, location_code, match >= 0, match >= 0 ? match : now, wtr_alerts_user_data);
+		}
+		gint new_state[] = {match >= 0, hour};
+		g_key_file_set_integer_list(wtr_alerts_state, group, location_code, new_state, G_N_ELEMENTS(new_state));
+		wtr_alerts_state_dirty = TRUE;
+		g_free(group);
+	}
+}
+
+gboolean wtr_alerts_watching(const gchar *location_code) {
+	g_mutex_lock(&wtr_alerts_lock);
+	gboolean watching = wtr_alerts_rules != NULL &&
+	                    (wtr_alerts_everywhere->len > 0 || g_hash_table_contains(wtr_alerts_index, location_code));
+	g_mutex_unlock(&wtr_alerts_lock);
+	return watching;
+}
+
+void wtr_alerts_update(const gchar *location_code, wtr_forecast *forecast) {
+	g_mutex_lock(&wtr_alerts_lock);
+	if (wtr_alerts_rules != NULL) {
+		GPtrArray *rules = (GPtrArray *)g_hash_table_lookup(wtr_alerts_index, location_code);
+		// Locations without rules cost a lookup
+		if (rules != NULL || wtr_alerts_everywhere->len > 0) {
+			gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+			guint changed = wtr_alerts_changes(location_code, forecast);
+			if (rules != NULL) {
+				wtr_alerts_check(rules, location_code, forecast, changed, now);
+			}
+			wtr_alerts_check(wtr_alerts_everywhere, location_code, forecast, changed, now);
+		}
+	}
+	g_mutex_unlock(&wtr_alerts_lock);
+}
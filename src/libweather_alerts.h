@@ -0,0 +1,91 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_ALERTS_H__
+#define __LIBWEATHER_ALERTS_H__
+
+#include <glib.h>
+
+#include "libweather.h"
+
+/**
+ * @file libweather_alerts.h
+ * @brief Standing alert rules, evaluated incrementally as forecasts are refreshed.
+ *
+ * Rules are read from a key file, one group per rule:
+ *
+ *     [strong-wind]
+ *     locations=3782;3785;8412
+ *     where=wind > 60
+ *     window=24
+ *
+ * @c where is a query (see libweather_query.h), @c locations is a list of
+ * location codes (@c * means every location) and @c window, if present,
+ * limits the evaluation to the hourly forecasts starting in the next N
+ * hours. An alert (a rule on a location) fires when the query starts
+ * matching and clears when it stops matching.
+ *
+ * Rules are indexed by location and they know which fields they read: when
+ * the forecasts of a location are refreshed only the rules of that location
+ * whose fields changed (or whose window moved) are evaluated again. The
+ * state of the alerts, along with a fingerprint of each field of the last
+ * forecasts of every location, is kept in a state file between runs.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/**
+ * @brief Function called when an alert fires or clears.
+ *
+ * It's called with the alerts engine locked, so it must not call the
+ * functions of this module.
+ *
+ * @param[in] rule Name of the rule.
+ * @param[in] location_code Location code.
+ * @param[in] firing TRUE if the alert fired, FALSE if it cleared.
+ * @param[in] when Time of the first matching hourly forecast if the alert fired, current time otherwise (seconds since the Unix epoch).
+ * @param[in] user_data Data passed to wtr_alerts_open().
+ */
+typedef void (*wtr_alerts_func)(const gchar *rule, const gchar *location_code, gboolean firing, gint64 when,
+                                gpointer user_data);
+
+/**
+ * @brief Enable the alerts: from now on every refreshed forecast is checked against the rules.
+ *
+ * @param[in] rules_file Key file with the rules.
+ * @param[in] state_file File with the state of the alerts; it's created if it doesn't exist yet.
+ * @param[in] func Function called on every transition.
+ * @param[in] user_data Data to pass to @p func.
+ * @return TRUE if the rules are valid, FALSE otherwise (errors are reported on the standard error).
+ * @warning The alerts must be closed with wtr_alerts_close().
+ */
+gboolean wtr_alerts_open(const gchar *rules_file, const gchar *state_file, wtr_alerts_func func, gpointer user_data);
+
+/**
+ * @brief Disable the alerts, saving their state.
+ *
+ * It's safe to call this function even if wtr_alerts_open() was not called.
+ */
+void wtr_alerts_close(void);
+
+/**
+ * @brief Tell whether some rules apply to a location.
+ *
+ * Callers can use it to avoid preparing forecasts just for wtr_alerts_update().
+ *
+ * @param[in] location_code Location code.
+ * @return TRUE if the alerts are enabled and some rules apply to the location.
+ */
+gboolean wtr_alerts_watching(const gchar *location_code);
+
+/**
+ * @brief Evaluate the rules affected by the refreshed forecasts of a location, if the alerts are enabled.
+ *
+ * It can be called by many threads at the same time.
+ *
+ * @param[in] location_code Location code.
+ * @param[in] forecast Complete forecasts of the location.
+ */
+void wtr_alerts_update(const gchar *location_code, wtr_forecast *forecast);
+
+#endif  // __LIBWEATHER_ALERTS_H__
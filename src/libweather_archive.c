@@ -0,0 +1,431 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_archive.c
+ * @brief Columnar archive of the fetched forecasts (implementation).
+ *
+ * Each partition directory contains, for each table, an index file
+ * (e.g. @c hours.idx) and a file per column (e.g. @c hours.temp). The index
+ * is an array of fixed-size entries, one per appended forecast; each entry
+ * records where the block of the forecast ends in every column (it starts
+ * where the block of the previous entry ends) and a checksum of the block.
+ *
+ * Appends are serialized with an exclusive lock on the index. The blocks
+ * are written before their index entry and neither is synced: after a crash
+ * a block may be lost, but its checksum won't match and it's skipped by the
+ * readers. Data after the last index entry (i.e. a block whose entry was
+ * never written) is truncated by the next append.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+// flock() is BSD, mmap(), pread() and pwrite() are POSIX, none of them is C99
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "libevents.h"
+#include "libutils.h"
+#include "libweather.h"
+#include "libweather_archive.h"
+
+/// Maximum number of columns of a table.
+#define WTR_ARCHIVE_MAX_COLUMNS 8
+/// Size of the (NULL-terminated) location code in the index.
+#define WTR_ARCHIVE_CODE_LENGTH 16
+/// Length of a partition name (YYYYMMDD).
+#define WTR_ARCHIVE_PARTITION_LENGTH 8
+
+/**
+ * @brief Entry of a partition index: a forecast appended to the archive.
+ *
+ * Integers are stored little endian.
+ */
+typedef struct {
+	/// Location code.
+	gchar code[WTR_ARCHIVE_CODE_LENGTH];
+	/// When the forecast was fetched, in seconds since the Unix epoch.
+	gint64 fetched;
+	/// Number of rows of the block.
+	guint32 rows;
+	/// Unused, always 0.
+	guint32 reserved;
+	/// End offset of the block in each column file.
+	guint64 ends[WTR_ARCHIVE_MAX_COLUMNS];
+	/// Lower 32 bits of the XXH64 of the block in each column file.
+	guint32 checksums[WTR_ARCHIVE_MAX_COLUMNS];
+} wtr_archive_entry;
+
+/// Names of the tables, in the same order as wtr_archive_table.
+static const gchar *wtr_archive_tables[] = {"days", "hours"};
+
+/// Names of the columns of each table, NULL-terminated.
+static const gchar *wtr_archive_columns[][WTR_ARCHIVE_MAX_COLUMNS + 1] = {
+    {"date", "weather", "temp_min", "temp_max", "wind_speed", "rain", "humidity", "pressure", NULL},
+    {"tstamp", "weather", "temp", "wind_speed", "rain", "humidity", "pressure", NULL}};
+
+/// Root directory of the archive, NULL if the archive is disabled.
+static gchar *wtr_archive_dir = NULL;
+
+gboolean wtr_archive_open(const gchar *dir) {
+	if (g_mkdir_with_parents(dir, 0755) != 0) {
+		events_log(EVENTS_ERROR, "wtr_archive_open can't create %s", dir);
+		return FALSE;
+	}
+	g_free(wtr_archive_dir);
+	wtr_archive_dir = g_strdup(dir);
+	return TRUE;
+}
+
+void wtr_archive_close(void) {
+	g_free(wtr_archive_dir);
+	wtr_archive_dir = NULL;
+}
+
+/**
+ * @brief Returns the number of columns of a table.
+ */
+guint wtr_archive_columns_count(wtr_archive_table table) {
+	guint count = 0;
+	while (wtr_archive_columns[table][count] != NULL) {
+		++count;
+	}
+	return count;
+}
+
+/**
+ * @brief Returns the rain in tenths of mm, so that it can be stored as an integer.
+ */
+gint64 wtr_archive_rain(gdouble rain) {
+	return (gint64)round(rain * 10);
+}
+
+/**
+ * @brief Converts a forecast into the rows of a table, column by column.
+ *
+ * @param[in] forecast The forecast.
+ * @param[in] table The table.
+ * @param[out] rows Number of rows.
+ * @return An array of values for each column (to be freed with @c g_array_free).
+ */
+GArray **wtr_archive_rows(wtr_forecast *forecast, wtr_archive_table table, guint *rows) {
+	guint columns_count = wtr_archive_columns_count(table);
+	GArray **columns = (GArray **)g_malloc(sizeof(GArray *) * columns_count);
+	for (guint c = 0; c < columns_count; ++c) {
+		columns[c] = g_array_new(FALSE, FALSE, sizeof(gint64));
+	}
+	for (GList *day_ptr = forecast->days; day_ptr != NULL; day_ptr = day_ptr->next) {
+		wtr_forecast_day *day = (wtr_forecast_day *)day_ptr->data;
+		if (table == WTR_ARCHIVE_DAYS) {
+			gint64 values[] = {g_date_time_to_unix(day->date),
+			                   day->weather,
+			                   day->temp_min,
+			                   day->temp_max,
+			                   day->wind_speed,
+			                   wtr_archive_rain(day->rain),
+			                   day->humidity,
+			                   day->pressure};
+			for (guint c = 0; c < columns_count; ++c) {
+				g_array_append_val(columns[c], values[c]);
+			}
+			continue;
+		}
+		for (GList *hour_ptr = day->hours; hour_ptr != NULL; hour_ptr = hour_ptr->next) {
+			wtr_forecast_hour *hour = (wtr_forecast_hour *)hour_ptr->data;
+			gint64 values[] = {g_date_time_to_unix(hour->tstamp), hour->weather,  hour->temp,    hour->wind_speed,
+			                   wtr_archive_rain(hour->rain),      hour->humidity, hour->pressure};
+			for (guint c = 0; c < columns_count; ++c) {
+				g_array_append_val(columns[c], values[c]);
+			}
+		}
+	}
+	*rows = columns[0]->len;
+	return columns;
+}
+
+/**
+ * @brief Encodes a block of values: the difference from the previous value (0 for the first one), as a zigzag varint.
+ *
+ * @param[in] values The values.
+ * @return The encoded block (to be freed with @c g_byte_array_free).
+ */
+GByteArray *wtr_archive_encode(GArray *values) {
+	GByteArray *block = g_byte_array_sized_new(values->len * 2);
+	gint64 previous = 0;
+	guint8 varint[VARINT_MAX_LENGTH];
+	for (guint i = 0; i < values->len; ++i) {
+		gint64 value = g_array_index(values, gint64, i);
+		// The subtraction is done unsigned, so that it wraps around instead of overflowing
+		guint length = varint_encode(zigzag_encode((gint64)((guint64)value - (guint64)previous)), varint);
+		g_byte_array_append(block, varint, length);
+		previous = value;
+	}
+	return block;
+}
+
+/**
+ * @brief Decodes a block of values encoded by wtr_archive_encode().
+ *
+ * @param[in] block The encoded block.
+ * @param[in] length Length of the encoded block.
+ * @param[out] values The decoded values.
+ * @param[in] count Number of values.
+ * @return TRUE on success, FALSE if the block is malformed.
+ */
+gboolean wtr_archive_decode(const guint8 *block, gsize length, gint64 *values, guint count) {
+	const guint8 *end = block + length;
+	gint64 previous = 0;
+	for (guint i = 0; i < count; ++i) {
+		guint64 delta;
+		if (!varint_decode(&block, end, &delta)) {
+			return FALSE;
+		}
+		previous = (gint64)((guint64)previous + (guint64)zigzag_decode(delta));
+		values[i] = previous;
+	}
+	return block == end;
+}
+
+/**
+ * @brief Returns the path of a file of a partition (e.g. @c archive/20180308/hours.temp).
+ *
+ * @warning The returned string must be freed with @c g_free.
+ */
+gchar *wtr_archive_file(const gchar *dir, const gchar *partition, wtr_archive_table table, const gchar *suffix) {
+	gchar *name = g_strdup_printf("%s.%s", wtr_archive_tables[table], suffix);
+	gchar *file = g_build_filename(dir, partition, name, NULL);
+	g_free(name);
+	return file;
+}
+
+/**
+ * @brief Appends a forecast to a table of today's partition.
+ *
+ * @param[in] partition Name of today's partition.
+ * @param[in] table The table.
+ * @param[in] location_code Location code.
+ * @param[in] fetched When the forecast was fetched.
+ * @param[in] forecast The forecast.
+ * @return TRUE on success, FALSE on I/O errors.
+ */
+gboolean wtr_archive_append_table(const gchar *partition, wtr_archive_table table, const gchar *location_code, gint64 fetched,
+                                  wtr_forecast *forecast) {
+	gchar *index_file = wtr_archive_file(wtr_archive_dir, partition, table, "idx");
+	int index_fd = open(index_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	g_free(index_file);
+	if (index_fd < 0) {
+		return FALSE;
+	}
+	if (flock(index_fd, LOCK_EX) != 0) {
+		close(index_fd);
+		return FALSE;
+	}
+	// Blocks start where the ones of the last complete index entry end; anything else is garbage from a failed append
+	struct stat st;
+	wtr_archive_entry entry;
+	memset(&entry, 0, sizeof(entry));
+	gboolean ok = fstat(index_fd, &st) == 0;
+	off_t entries_size = ok ? st.st_size - st.st_size % sizeof(wtr_archive_entry) : 0;
+	if (ok && entries_size > 0) {
+		ok = pread(index_fd, &entry, sizeof(entry), entries_size - sizeof(entry)) == sizeof(entry);
+	}
+	guint rows;
+	GArray **columns = wtr_archive_rows(forecast, table, &rows);
+	guint columns_count = wtr_archive_columns_count(table);
+	for (guint c = 0; c < columns_count; ++c) {
+		GByteArray *block = wtr_archive_encode(columns[c]);
+		guint64 start = GUINT64_FROM_LE(entry.ends[c]);
+		gchar *column_file = wtr_archive_file(wtr_archive_dir, partition, table, wtr_archive_columns[table][c]);
+		int fd = ok ? open(column_file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644) : -1;
+		ok = fd >= 0 && ftruncate(fd, start) == 0 && pwrite(fd, block->data, block->len, start) == (ssize_t)block->len;
+		if (fd >= 0) {
+			ok = close(fd) == 0 && ok;
+		}
+		entry.ends[c] = GUINT64_TO_LE(start + block->len);
+		entry.checksums[c] = GUINT32_TO_LE((guint32)xxh64(block->data, block->len, 0));
+		g_free(column_file);
+		g_byte_array_free(block, TRUE);
+		g_array_free(columns[c], TRUE);
+	}
+	g_free(columns);
+	if (ok) {
+		g_snprintf(entry.code, WTR_ARCHIVE_CODE_LENGTH, "%s", location_code);
+		entry.fetched = GINT64_TO_LE(fetched);
+		entry.rows = GUINT32_TO_LE(rows);
+		ok = pwrite(index_fd, &entry, sizeof(entry), entries_size) == sizeof(entry);
+	}
+	flock(index_fd, LOCK_UN);
+	close(index_fd);
+	return ok;
+}
+
+gboolean wtr_archive_append(const gchar *location_code, wtr_forecast *forecast) {
+	return wtr_archive_append_at(location_code, forecast, g_get_real_time() / G_USEC_PER_SEC);
+}
+
+/**
+ * @brief Appends the forecast to both tables of the partition of its fetch date.
+ */
+gboolean wtr_archive_append_at(const gchar *location_code, wtr_forecast *forecast, gint64 fetched) {
+	if (wtr_archive_dir == NULL || forecast == NULL || strlen(location_code) >= WTR_ARCHIVE_CODE_LENGTH) {
+		return FALSE;
+	}
+	if (forecast->hours_dropped) {
+		// The hours table would silently miss the hourly forecasts
+		events_log(EVENTS_WARNING, "wtr_archive_append skips the forecasts of %s, whose hours were dropped", location_code);
+		return FALSE;
+	}
+	GDateTime *fetched_time = g_date_time_new_from_unix_local(fetched);
+	gchar *partition = g_date_time_format(fetched_time, "%Y%m%d");
+	gchar *partition_dir = g_build_filename(wtr_archive_dir, partition, NULL);
+	gboolean ok = g_mkdir_with_parents(partition_dir, 0755) == 0 &&
+	              wtr_archive_append_table(partition, WTR_ARCHIVE_DAYS, location_code, fetched, forecast) &&
+	              wtr_archive_append_table(partition, WTR_ARCHIVE_HOURS, location_code, fetched, forecast);
+	if (!ok) {
+		events_log(EVENTS_ERROR, "wtr_archive_append can't archive the forecasts of %s", location_code);
+	}
+	g_free(partition_dir);
+	g_free(partition);
+	g_date_time_unref(fetched_time);
+	return ok;
+}
+
+/**
+ * @brief Maps a whole file in memory, read-only.
+ *
+ * @param[in] file Path of the file.
+ * @param[out] length Length of the file.
+ * @return The mapped file, or NULL if it doesn't exist or it's empty.
+ * @warning The file must be unmapped with @c munmap.
+ */
+const guint8 *wtr_archive_map(const gchar *file, gsize *length) {
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		*length = st.st_size;
+		data = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	return data != MAP_FAILED ? (const guint8 *)data : NULL;
+}
+
+/**
+ * @brief Scans a column of a partition.
+ *
+ * @return FALSE if the scan was stopped by the callback, TRUE otherwise.
+ */
+gboolean wtr_archive_scan_partition(const gchar *dir, const gchar *partition, wtr_archive_table table, guint column,
+                                    const gchar *location_code, wtr_archive_func func, gpointer user_data) {
+	gchar *index_file = wtr_archive_file(dir, partition, table, "idx");
+	gchar *column_file = wtr_archive_file(dir, partition, table, wtr_archive_columns[table][column]);
+	gsize index_length = 0;
+	gsize column_length = 0;
+	const guint8 *index = wtr_archive_map(index_file, &index_length);
+	const guint8 *data = index != NULL ? wtr_archive_map(column_file, &column_length) : NULL;
+	g_free(column_file);
+	g_free(index_file);
+	gboolean go_on = TRUE;
+	GArray *values = g_array_new(FALSE, FALSE, sizeof(gint64));
+	guint64 start = 0;
+	for (gsize offset = 0; data != NULL && go_on && offset + sizeof(wtr_archive_entry) <= index_length;
+	     offset += sizeof(wtr_archive_entry)) {
+		wtr_archive_entry entry;
+		memcpy(&entry, index + offset, sizeof(entry));
+		guint64 end = GUINT64_FROM_LE(entry.ends[column]);
+		guint64 block_start = start;
+		start = end;
+		entry.code[WTR_ARCHIVE_CODE_LENGTH - 1] = '\0';
+		if ((location_code != NULL && g_strcmp0(entry.code, location_code) != 0) || end < block_start || end > column_length) {
+			continue;
+		}
+		// Blocks lost in a crash are skipped
+		if ((guint32)xxh64(data + block_start, end - block_start, 0) != GUINT32_FROM_LE(entry.checksums[column])) {
+			continue;
+		}
+		guint rows = GUINT32_FROM_LE(entry.rows);
+		g_array_set_size(values, rows);
+		if (wtr_archive_decode(data + block_start, end - block_start, (gint64 *)values->data, rows)) {
+			go_on = func(entry.code, GINT64_FROM_LE(entry.fetched), (const gint64 *)values->data, rows, user_data);
+		}
+	}
+	g_array_free(values, TRUE);
+	if (data != NULL) {
+		munmap((void *)data, column_length);
+	}
+	if (index != NULL) {
+		munmap((void *)index, index_length);
+	}
+	return go_on;
+}
+
+/**
+ * @brief Tells whether a directory name is a partition name (YYYYMMDD).
+ */
+gboolean wtr_archive_is_partition(const gchar *name) {
+	if (strlen(name) != WTR_ARCHIVE_PARTITION_LENGTH) {
+		return FALSE;
+	}
+	for (guint i = 0; i < WTR_ARCHIVE_PARTITION_LENGTH; ++i) {
+		if (!g_ascii_isdigit(name[i])) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * @brief Compares two partition names through pointers to them (for @c qsort).
+ */
+int wtr_archive_partition_compare(const void *a, const void *b) {
+	return strcmp(*(const gchar *const *)a, *(const gchar *const *)b);
+}
+
+/**
+ * @brief Scans the partitions in the date range in chronological order; YYYYMMDD names sort like dates.
+ */
+gboolean wtr_archive_scan(const gchar *dir, wtr_archive_table table, const gchar *column, const gchar *from, const gchar *to,
+                          const gchar *location_code, wtr_archive_func func, gpointer user_data) {
+	guint column_index = 0;
+	while (wtr_archive_columns[table][column_index] != NULL && g_strcmp0(wtr_archive_columns[table][column_index], column) != 0) {
+		++column_index;
+	}
+	if (wtr_archive_columns[table][column_index] == NULL) {
+		return FALSE;
+	}
+	GDir *root = g_dir_open(dir, 0, NULL);
+	if (root == NULL) {
+		return FALSE;
+	}
+	GPtrArray *partitions = g_ptr_array_new_with_free_func(g_free);
+	const gchar *name;
+	while ((name = g_dir_read_name(root)) != NULL) {
+		if (wtr_archive_is_partition(name) && (from == NULL || strcmp(name, from) >= 0) && (to == NULL || strcmp(name, to) <= 0)) {
+			g_ptr_array_add(partitions, g_strdup(name));
+		}
+	}
+	g_dir_close(root);
+	qsort(partitions->pdata, partitions->len, sizeof(gpointer), wtr_archive_partition_compare);
+	for (guint i = 0; i < partitions->len; ++i) {
+		if (!wtr_archive_scan_partition(dir, g_ptr_array_index(partitions, i), table, column_index, location_code, func,
+		                                user_data)) {
+			break;
+		}
+	}
+	g_ptr_array_free(partitions, TRUE);
+	return TRUE;
+}
@@ -0,0 +1,114 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_ARCHIVE_H__
+#define __LIBWEATHER_ARCHIVE_H__
+
+#include <glib.h>
+
+#include "libweather.h"
+
+/**
+ * @file libweather_archive.h
+ * @brief Columnar archive of the fetched forecasts.
+ *
+ * Unlike the cache, which only keeps today's forecasts, the archive keeps
+ * every fetched forecast, for example to compare old forecasts with the
+ * actual weather. The archive is append-only and columnar: each field of the
+ * daily and hourly forecasts is stored in its own file, so that a scan of a
+ * field doesn't read the others.
+ *
+ * The archive is partitioned by fetch date (one directory per day, e.g.
+ * @c 20180308). Each appended forecast is a block of rows in every column,
+ * described by an entry of the partition index along with its location, so
+ * that the blocks of the other locations can be skipped without being read.
+ * Inside a block the values are delta-encoded and stored as zigzag varints.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/**
+ * @brief Tables of the archive.
+ */
+typedef enum {
+	/// Daily forecasts; columns: date, weather, temp_min, temp_max, wind_speed, rain, humidity, pressure.
+	WTR_ARCHIVE_DAYS,
+	/// Hourly forecasts; columns: tstamp, weather, temp, wind_speed, rain, humidity, pressure.
+	WTR_ARCHIVE_HOURS
+} wtr_archive_table;
+
+/**
+ * @brief Function called for each block of values by wtr_archive_scan().
+ *
+ * Dates and times are in seconds since the Unix epoch, rain is in tenths
+ * of mm, everything else has the same unit of the forecasts.
+ *
+ * @param[in] location_code Location code of the forecast the block comes from.
+ * @param[in] fetched When the forecast was fetched.
+ * @param[in] values Values of the scanned column.
+ * @param[in] count Number of values.
+ * @param[in] user_data Data passed to wtr_archive_scan().
+ * @return TRUE to continue the scan, FALSE to stop it.
+ */
+typedef gboolean (*wtr_archive_func)(const gchar *location_code, gint64 fetched, const gint64 *values, guint count,
+                                     gpointer user_data);
+
+/**
+ * @brief Enable the archive: from now on every forecast fetched from the network is archived.
+ *
+ * @param[in] dir Root directory of the archive; it's created if it doesn't exist yet.
+ * @return TRUE if the archive can be used, FALSE otherwise.
+ * @warning The archive must be closed with wtr_archive_close().
+ */
+gboolean wtr_archive_open(const gchar *dir);
+
+/**
+ * @brief Disable the archive.
+ *
+ * It's safe to call this function even if wtr_archive_open() was not called.
+ */
+void wtr_archive_close(void);
+
+/**
+ * @brief Archive a forecast just fetched, if the archive is enabled.
+ *
+ * Many processes can append to the same archive at the same time.
+ *
+ * @param[in] location_code Location code.
+ * @param[in] forecast The forecast.
+ * @return TRUE if the forecast was archived, FALSE if the archive is disabled, if the hourly forecasts were dropped to save memory or on I/O errors.
+ */
+gboolean wtr_archive_append(const gchar *location_code, wtr_forecast *forecast);
+
+/**
+ * @brief Archive a forecast fetched at some time in the past, if the archive is enabled.
+ *
+ * Like wtr_archive_append(), but the forecast goes into the partition of
+ * @p fetched, e.g. when old documents are ingested (see libweather_ingest.h).
+ *
+ * @param[in] location_code Location code.
+ * @param[in] forecast The forecast.
+ * @param[in] fetched When the forecast was fetched, in seconds since the Unix epoch.
+ * @return TRUE if the forecast was archived, FALSE if the archive is disabled, if the hourly forecasts were dropped to save memory or on I/O errors.
+ */
+gboolean wtr_archive_append_at(const gchar *location_code, wtr_forecast *forecast, gint64 fetched);
+
+/**
+ * @brief Scan a column of the archive over a range of fetch dates.
+ *
+ * Only the partition indexes and the scanned column are read (via @c mmap).
+ *
+ * @param[in] dir Root directory of the archive.
+ * @param[in] table The table.
+ * @param[in] column Name of the column (see wtr_archive_table).
+ * @param[in] from First fetch date to scan, as YYYYMMDD (NULL to scan from the first one).
+ * @param[in] to Last fetch date to scan, as YYYYMMDD (NULL to scan up to the last one).
+ * @param[in] location_code Location to scan, or NULL to scan all of them.
+ * @param[in] func Function called for each block of values.
+ * @param[in] user_data Data to pass to @p func.
+ * @return TRUE on success, FALSE if the column doesn't exist or the archive can't be read.
+ */
+gboolean wtr_archive_scan(const gchar *dir, wtr_archive_table table, const gchar *column, const gchar *from, const gchar *to,
+                          const gchar *location_code, wtr_archive_func func, gpointer user_data);
+
+#endif  // __LIBWEATHER_ARCHIVE_H__
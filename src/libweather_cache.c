@@ -8,17 +8,90 @@
  * temporary filesystem area and to retrieve forecasts for the same
  * location and the same day without having to issue a network call twice.
  *
+ * Each cached document can be stored along with its hash, so that writing
+ * again a document identical to the cached one can be skipped. Documents
+ * can also be written incrementally, while they are being downloaded, and
+ * published atomically once complete.
+ *
  * @author Paolo Bernardi
  * @date 6 Mar 2018
  */
 
+// fsync() is POSIX, syncfs() is Linux-specific, neither is C99
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
 #include <glib.h>
 #include <glib/gprintf.h>
+#include <glib/gstdio.h>
+#ifdef WTR_HAVE_LIBURING
+#include <liburing.h>
+#endif
 
+#include "libevents.h"
+#include "libmetrics.h"
 #include "libweather_cache.h"
+#include "probes.h"
 
 /// Maximum length for a driver cache directory name.
 #define MAX_WTR_CACHE_TEMP_DIR_LENGTH 1024
+/// Suffix of the file that contains the hash of a cached document.
+#define WTR_CACHE_HASH_SUFFIX ".xxh64"
+/// Suffix of the template of the temporary files used by wtr_cache_writer (see g_mkstemp()).
+#define WTR_CACHE_TEMP_SUFFIX ".XXXXXX"
+/// Minimum number of documents that wtr_cache_get_many() reads in parallel instead of one by one.
+#define WTR_CACHE_PARALLEL_MIN 8
+/// Number of threads reading documents when io_uring is not available.
+#define WTR_CACHE_READ_THREADS 8
+/// Number of documents read by each round of io_uring submissions.
+#define WTR_CACHE_URING_BATCH 64
+
+/**
+ * @brief A cached document being written incrementally.
+ */
+struct _wtr_cache_writer {
+	/// Path of the cache entry.
+	gchar *file;
+	/// Path of the temporary file.
+	gchar *temp_file;
+	/// File descriptor of the temporary file.
+	int fd;
+	/// FALSE after an I/O error.
+	gboolean ok;
+	/// Bytes written so far.
+	gsize length;
+};
+
+/**
+ * @brief A document written during a batch, waiting to be published.
+ */
+typedef struct {
+	/// Path of the cache entry.
+	gchar *file;
+	/// Path of the temporary file that contains the document.
+	gchar *temp_file;
+	/// Path of the hash file.
+	gchar *hash_file;
+	/// Path of the temporary file that contains the hash.
+	gchar *hash_temp_file;
+} wtr_cache_staged;
+
+/**
+ * @brief Batch write state of a thread (see wtr_cache_batch_begin()).
+ */
+typedef struct {
+	/// Documents waiting to be published (wtr_cache_staged, most recent first).
+	GList *staged;
+} wtr_cache_batch;
+
+/// The batch of the calling thread, set between wtr_cache_batch_begin() and wtr_cache_batch_commit().
+static GPrivate wtr_cache_thread_batch;
 
 gchar *wtr_cache_dir() {
 	// e.g. /tmp
@@ -64,14 +137,617 @@ gchar *wtr_cache_temp_file(gchar *driver, gchar *location_code) {
 gchar *wtr_cache_get(gchar *driver, gchar *location_code) {
 	gchar *file = wtr_cache_temp_file(driver, location_code);
 	gchar *data = NULL;
-	g_file_get_contents(file, &data, NULL, NULL);
+	gsize length = 0;
+	if (g_file_get_contents(file, &data, &length, NULL)) {
+		metrics_add(METRICS_CACHE_HITS, 1);
+		metrics_add(METRICS_CACHE_READ_BYTES, length);
+		WTR_PROBE2(libweather, cache__hit, file, length);
+	} else {
+		metrics_add(METRICS_CACHE_MISSES, 1);
+		WTR_PROBE1(libweather, cache__miss, file);
+		events_log(EVENTS_DEBUG, "wtr_cache_get %s: miss", file);
+	}
 	g_free(file);
 	return data;
 }
 
+/**
+ * @brief A cached document read by wtr_cache_get_many().
+ */
+typedef struct {
+	/// Path of the cache entry.
+	gchar *file;
+	/// The document, NULL if it's not cached.
+	gchar *data;
+	/// Length of the document.
+	gsize length;
+	/// TRUE while the document still has to be read.
+	gboolean pending;
+#ifdef WTR_HAVE_LIBURING
+	/// File descriptor of the cache entry, or a negative errno.
+	int fd;
+	/// Size of the cache entry.
+	struct statx stx;
+	/// Result of statx, 0 on success or a negative errno.
+	int stx_res;
+#endif
+} wtr_cache_read;
+
+/**
+ * @brief Reads a cached document with a plain g_file_get_contents().
+ *
+ * @param[in,out] read The document to read.
+ */
+void wtr_cache_read_file(wtr_cache_read *read) {
+	g_file_get_contents(read->file, &read->data, &read->length, NULL);
+	read->pending = FALSE;
+}
+
+/**
+ * @brief Reads a cached document on a thread of the pool (GFunc).
+ */
+void wtr_cache_read_task(gpointer read, gpointer user_data) {
+	wtr_cache_read_file((wtr_cache_read *)read);
+}
+
+/**
+ * @brief Reads the pending documents with a pool of threads.
+ *
+ * @param[in,out] reads The documents to read.
+ * @param[in] count Number of documents.
+ */
+void wtr_cache_read_threads(wtr_cache_read *reads, guint count) {
+	guint pending = 0;
+	for (guint i = 0; i < count; ++i) {
+		pending += reads[i].pending ? 1 : 0;
+	}
+	if (pending == 0) {
+		return;
+	}
+	GThreadPool *pool = g_thread_pool_new(wtr_cache_read_task, NULL, WTR_CACHE_READ_THREADS, FALSE, NULL);
+	for (guint i = 0; i < count; ++i) {
+		if (!reads[i].pending) {
+			continue;
+		}
+		if (pool == NULL || !g_thread_pool_push(pool, &reads[i], NULL)) {
+			wtr_cache_read_file(&reads[i]);
+		}
+	}
+	if (pool != NULL) {
+		// Waits for all the reads to complete
+		g_thread_pool_free(pool, FALSE, TRUE);
+	}
+}
+
+#ifdef WTR_HAVE_LIBURING
+/// Operations submitted to io_uring, stored in the low bits of the user data along with the document index.
+enum { WTR_CACHE_URING_OPEN, WTR_CACHE_URING_STATX, WTR_CACHE_URING_READ, WTR_CACHE_URING_CLOSE, WTR_CACHE_URING_OPS };
+
+/**
+ * @brief Gets a submission queue entry for an operation on a document.
+ *
+ * @warning The caller must check that the ring is not full (see @c io_uring_sq_space_left).
+ */
+struct io_uring_sqe *wtr_cache_uring_sqe(struct io_uring *ring, guint index, guint op) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(index * WTR_CACHE_URING_OPS + op));
+	return sqe;
+}
+
+/**
+ * @brief Submits the queued operations and collects their completions.
+ *
+ * @param[in] ring The ring.
+ * @param[in,out] reads The documents being read.
+ * @param[in] queued Number of queued operations.
+ * @return TRUE if all the operations were submitted and completed, FALSE otherwise (the ring must not be used anymore).
+ */
+gboolean wtr_cache_uring_complete(struct io_uring *ring, wtr_cache_read *reads, guint queued) {
+	int submitted = io_uring_submit(ring);
+	if (submitted < 0) {
+		return FALSE;
+	}
+	for (int done = 0; done < submitted; ++done) {
+		struct io_uring_cqe *cqe;
+		int ret;
+		while ((ret = io_uring_wait_cqe(ring, &cqe)) == -EINTR) {
+		}
+		if (ret != 0) {
+			return FALSE;
+		}
+		guint tag = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+		wtr_cache_read *read = &reads[tag / WTR_CACHE_URING_OPS];
+		switch (tag % WTR_CACHE_URING_OPS) {
+		case WTR_CACHE_URING_OPEN:
+			read->fd = cqe->res;
+			break;
+		case WTR_CACHE_URING_STATX:
+			read->stx_res = cqe->res;
+			break;
+		case WTR_CACHE_URING_READ:
+			// One byte more than the size was requested: a longer read means the entry was replaced meanwhile
+			if (cqe->res >= 0 && (guint64)cqe->res <= read->stx.stx_size) {
+				read->length = cqe->res;
+				read->data[read->length] = '\0';
+				read->pending = FALSE;
+			} else {
+				g_free(read->data);
+				read->data = NULL;
+			}
+			break;
+		case WTR_CACHE_URING_CLOSE:
+			read->fd = -EBADF;
+			break;
+		}
+		io_uring_cqe_seen(ring, cqe);
+	}
+	return (guint)submitted == queued;
+}
+
+/**
+ * @brief Reads a batch of documents through io_uring.
+ *
+ * The entries are opened and stat'ed in a first round, then read and closed
+ * in a second one. The close is hard-linked to the read, so that it's
+ * executed even if the read fails or is short. Documents that can't be read
+ * this way are left pending.
+ *
+ * @param[in] ring The ring, with room for at least 2 operations per document.
+ * @param[in,out] reads The documents to read.
+ * @param[in] count Number of documents.
+ * @return TRUE on success, FALSE if the ring failed (the ring must not be used anymore).
+ */
+gboolean wtr_cache_uring_batch(struct io_uring *ring, wtr_cache_read *reads, guint count) {
+	guint queued = 0;
+	for (guint i = 0; i < count; ++i) {
+		reads[i].fd = -EAGAIN;
+		reads[i].stx_res = -EAGAIN;
+	}
+	for (guint i = 0; i < count && io_uring_sq_space_left(ring) >= 2; ++i) {
+		struct io_uring_sqe *open_sqe = wtr_cache_uring_sqe(ring, i, WTR_CACHE_URING_OPEN);
+		io_uring_prep_openat(open_sqe, AT_FDCWD, reads[i].file, O_RDONLY | O_CLOEXEC, 0);
+		struct io_uring_sqe *statx_sqe = wtr_cache_uring_sqe(ring, i, WTR_CACHE_URING_STATX);
+		io_uring_prep_statx(statx_sqe, AT_FDCWD, reads[i].file, 0, STATX_SIZE, &reads[i].stx);
+		queued += 2;
+	}
+	gboolean ok = wtr_cache_uring_complete(ring, reads, queued);
+	queued = 0;
+	for (guint i = 0; ok && i < count; ++i) {
+		wtr_cache_read *read = &reads[i];
+		if (read->fd == -ENOENT) {
+			// Not cached
+			read->pending = FALSE;
+			continue;
+		}
+		if (read->fd < 0) {
+			continue;
+		}
+		if (io_uring_sq_space_left(ring) < 2) {
+			break;
+		}
+		if (read->stx_res == 0) {
+			struct io_uring_sqe *read_sqe = wtr_cache_uring_sqe(ring, i, WTR_CACHE_URING_READ);
+			read->data = (gchar *)g_malloc(read->stx.stx_size + 2);
+			io_uring_prep_read(read_sqe, read->fd, read->data, read->stx.stx_size + 1, 0);
+			io_uring_sqe_set_flags(read_sqe, IOSQE_IO_HARDLINK);
+			++queued;
+		}
+		struct io_uring_sqe *close_sqe = wtr_cache_uring_sqe(ring, i, WTR_CACHE_URING_CLOSE);
+		io_uring_prep_close(close_sqe, read->fd);
+		++queued;
+	}
+	ok = ok && wtr_cache_uring_complete(ring, reads, queued);
+	// Whatever was not completed is left to the fallback
+	for (guint i = 0; i < count; ++i) {
+		if (reads[i].pending && reads[i].data != NULL) {
+			g_free(reads[i].data);
+			reads[i].data = NULL;
+		}
+		if (reads[i].fd >= 0) {
+			close(reads[i].fd);
+		}
+	}
+	return ok;
+}
+
+/**
+ * @brief Reads the documents through io_uring, in batches.
+ *
+ * @param[in,out] reads The documents to read.
+ * @param[in] count Number of documents.
+ * @return FALSE if io_uring is not available (no document was read), TRUE otherwise (some documents can still be pending).
+ */
+gboolean wtr_cache_read_uring(wtr_cache_read *reads, guint count) {
+	struct io_uring ring;
+	if (io_uring_queue_init(WTR_CACHE_URING_BATCH * 2, &ring, 0) != 0) {
+		return FALSE;
+	}
+	for (guint first = 0; first < count; first += WTR_CACHE_URING_BATCH) {
+		if (!wtr_cache_uring_batch(&ring, reads + first, MIN(WTR_CACHE_URING_BATCH, count - first))) {
+			break;
+		}
+	}
+	io_uring_queue_exit(&ring);
+	return TRUE;
+}
+#endif
+
+/**
+ * @brief Builds the paths of all the documents, then reads them in the fastest available way.
+ *
+ * Whatever io_uring couldn't read (e.g. documents replaced while being read)
+ * is read again with g_file_get_contents().
+ */
+guint wtr_cache_get_many(gchar *driver, gchar **location_codes, guint count, gchar **data, gsize *lengths) {
+	wtr_cache_read *reads = (wtr_cache_read *)g_malloc0(sizeof(wtr_cache_read) * count);
+	for (guint i = 0; i < count; ++i) {
+		reads[i].file = wtr_cache_temp_file(driver, location_codes[i]);
+		reads[i].pending = TRUE;
+	}
+	if (count >= WTR_CACHE_PARALLEL_MIN) {
+#ifdef WTR_HAVE_LIBURING
+		wtr_cache_read_uring(reads, count);
+#endif
+		// Does nothing if io_uring already read everything
+		wtr_cache_read_threads(reads, count);
+	}
+	guint found = 0;
+	for (guint i = 0; i < count; ++i) {
+		if (reads[i].pending) {
+			wtr_cache_read_file(&reads[i]);
+		}
+		data[i] = reads[i].data;
+		if (lengths != NULL) {
+			lengths[i] = reads[i].length;
+		}
+		if (data[i] != NULL) {
+			metrics_add(METRICS_CACHE_READ_BYTES, reads[i].length);
+			++found;
+		}
+		g_free(reads[i].file);
+	}
+	g_free(reads);
+	metrics_add(METRICS_CACHE_HITS, found);
+	metrics_add(METRICS_CACHE_MISSES, count - found);
+	return found;
+}
+
 gchar *wtr_cache_set(gchar *driver, gchar *location_code, gchar *data) {
 	gchar *file = wtr_cache_temp_file(driver, location_code);
-	g_file_set_contents(file, data, -1, NULL);
+	gchar *hash_file = g_strconcat(file, WTR_CACHE_HASH_SUFFIX, NULL);
+	// The old hash would not match the new document anymore
+	g_unlink(hash_file);
+	gsize length = strlen(data);
+	if (g_file_set_contents(file, data, length, NULL)) {
+		metrics_add(METRICS_CACHE_WRITES, 1);
+		metrics_add(METRICS_CACHE_WRITTEN_BYTES, length);
+	}
+	WTR_PROBE3(libweather, cache__set, file, length, 0);
+	g_free(hash_file);
 	g_free(file);
 	return NULL;
 }
+
+/**
+ * @brief Writes the hash of a cached document.
+ *
+ * @param[in] hash_file Path of the hash file.
+ * @param[in] hash Hash of the document.
+ * @return TRUE on success, FALSE on I/O errors.
+ */
+gboolean wtr_cache_write_hash(gchar *hash_file, guint64 hash) {
+	gchar hash_str[17];
+	g_snprintf(hash_str, sizeof(hash_str), "%016" G_GINT64_MODIFIER "x", hash);
+	return g_file_set_contents(hash_file, hash_str, -1, NULL);
+}
+
+/**
+ * @brief Reads the hash of a cached document.
+ *
+ * @param[in] file Path of the cache entry.
+ * @param[in] hash_file Path of its hash file.
+ * @param[out] hash The hash of the cached document.
+ * @return TRUE if both the document and its hash exist, FALSE otherwise.
+ */
+gboolean wtr_cache_read_hash(gchar *file, gchar *hash_file, guint64 *hash) {
+	gchar *content = NULL;
+	gboolean found = g_file_get_contents(hash_file, &content, NULL, NULL) && g_file_test(file, G_FILE_TEST_IS_REGULAR);
+	if (found) {
+		*hash = g_ascii_strtoull(content, NULL, 16);
+	}
+	g_free(content);
+	return found;
+}
+
+gboolean wtr_cache_get_hash(gchar *driver, gchar *location_code, guint64 *hash) {
+	gchar *file = wtr_cache_temp_file(driver, location_code);
+	gchar *hash_file = g_strconcat(file, WTR_CACHE_HASH_SUFFIX, NULL);
+	gboolean found = wtr_cache_read_hash(file, hash_file, hash);
+	g_free(hash_file);
+	g_free(file);
+	return found;
+}
+
+/**
+ * @brief Records that a cached document was just confirmed unchanged, by updating the time of its hash file.
+ *
+ * @param[in] hash_file Path of the hash file.
+ */
+void wtr_cache_touch_hash(gchar *hash_file) {
+	utime(hash_file, NULL);
+}
+
+void wtr_cache_touch(gchar *driver, gchar *location_code) {
+	gchar *file = wtr_cache_temp_file(driver, location_code);
+	gchar *hash_file = g_strconcat(file, WTR_CACHE_HASH_SUFFIX, NULL);
+	wtr_cache_touch_hash(hash_file);
+	g_free(hash_file);
+	g_free(file);
+}
+
+/**
+ * @brief The hash file is written (or touched) every time the document is fetched, the document itself only when it changes.
+ */
+gboolean wtr_cache_get_age(gchar *driver, gchar *location_code, gint64 *age) {
+	gchar *file = wtr_cache_temp_file(driver, location_code);
+	gchar *hash_file = g_strconcat(file, WTR_CACHE_HASH_SUFFIX, NULL);
+	struct stat st;
+	struct stat hash_st;
+	gboolean found = stat(file, &st) == 0;
+	if (found) {
+		gint64 fetched = stat(hash_file, &hash_st) == 0 ? MAX(st.st_mtime, hash_st.st_mtime) : st.st_mtime;
+		*age = MAX(g_get_real_time() / G_USEC_PER_SEC - fetched, 0);
+	}
+	g_free(hash_file);
+	g_free(file);
+	return found;
+}
+
+wtr_cache_outcome wtr_cache_set_hashed(gchar *driver, gchar *location_code, gchar *data, gsize length, guint64 hash) {
+	guint64 cached_hash;
+	if (wtr_cache_get_hash(driver, location_code, &cached_hash) && cached_hash == hash) {
+		wtr_cache_touch(driver, location_code);
+		return WTR_CACHE_UNCHANGED;
+	}
+	wtr_cache_writer *writer = wtr_cache_writer_new(driver, location_code);
+	if (writer == NULL) {
+		events_log(EVENTS_ERROR, "wtr_cache_set_hashed can't cache %s-%s", driver, location_code);
+		return WTR_CACHE_FAILED;
+	}
+	wtr_cache_writer_write(writer, data, length);
+	return wtr_cache_writer_commit(writer, hash);
+}
+
+/**
+ * @brief Lists today's cache directory, whose entries are named "driver-code".
+ *
+ * Hash files and temporary files have a dot in their name, cache entries don't.
+ */
+void wtr_cache_foreach(wtr_cache_func func, gpointer user_data) {
+	gchar *cache_dir_today = wtr_cache_dir_today();
+	GDir *dir = g_dir_open(cache_dir_today, 0, NULL);
+	if (dir != NULL) {
+		const gchar *name;
+		while ((name = g_dir_read_name(dir)) != NULL) {
+			const gchar *separator = strchr(name, '-');
+			if (separator == NULL || separator == name || separator[1] == '\0' || strchr(name, '.') != NULL) {
+				continue;
+			}
+			gchar *driver = g_strndup(name, separator - name);
+			gchar *location_code = g_strdup(separator + 1);
+			func(driver, location_code, user_data);
+			g_free(location_code);
+			g_free(driver);
+		}
+		g_dir_close(dir);
+	}
+	g_free(cache_dir_today);
+}
+
+wtr_cache_writer *wtr_cache_writer_new(gchar *driver, gchar *location_code) {
+	wtr_cache_writer *writer = (wtr_cache_writer *)g_malloc(sizeof(wtr_cache_writer));
+	writer->file = wtr_cache_temp_file(driver, location_code);
+	// e.g. /tmp/libweather/20180308/tiempo-1234546.a1B2c3
+	writer->temp_file = g_strconcat(writer->file, WTR_CACHE_TEMP_SUFFIX, NULL);
+	writer->fd = g_mkstemp(writer->temp_file);
+	writer->ok = TRUE;
+	writer->length = 0;
+	if (writer->fd < 0) {
+		g_free(writer->temp_file);
+		g_free(writer->file);
+		g_free(writer);
+		return NULL;
+	}
+	// g_mkstemp() creates private files, cache entries are readable by everyone
+	fchmod(writer->fd, 0644);
+	return writer;
+}
+
+gboolean wtr_cache_writer_write(wtr_cache_writer *writer, const gchar *chunk, gsize len) {
+	while (writer->ok && len > 0) {
+		ssize_t written = write(writer->fd, chunk, len);
+		if (written < 0 && errno != EINTR) {
+			writer->ok = FALSE;
+		} else if (written > 0) {
+			writer->length += written;
+			chunk += written;
+			len -= written;
+		}
+	}
+	return writer->ok;
+}
+
+/**
+ * @brief Frees a wtr_cache_writer, removing its temporary file if it's still there.
+ *
+ * @param[in] writer The writer to free.
+ */
+void wtr_cache_writer_free(wtr_cache_writer *writer) {
+	if (writer->fd >= 0) {
+		close(writer->fd);
+		g_unlink(writer->temp_file);
+	}
+	g_free(writer->temp_file);
+	g_free(writer->file);
+	g_free(writer);
+}
+
+/**
+ * @brief Frees a wtr_cache_staged entry, removing its temporary files.
+ *
+ * @param[in] staged The staged entry to free.
+ */
+void wtr_cache_staged_free(gpointer staged) {
+	wtr_cache_staged *entry = (wtr_cache_staged *)staged;
+	g_unlink(entry->temp_file);
+	g_unlink(entry->hash_temp_file);
+	g_free(entry->file);
+	g_free(entry->temp_file);
+	g_free(entry->hash_file);
+	g_free(entry->hash_temp_file);
+	g_free(entry);
+}
+
+/**
+ * @brief Stages a completely written document for a batch.
+ *
+ * The data file is closed without being synced and the hash is written into a
+ * temporary file too; both are published by wtr_cache_batch_commit().
+ *
+ * @param[in,out] batch The batch of the calling thread.
+ * @param[in,out] writer The writer; its file descriptor is closed.
+ * @param[in] hash_file Path of the hash file.
+ * @param[in] hash Hash of the document.
+ * @return TRUE if the document was staged, FALSE on I/O errors (nothing is staged).
+ */
+gboolean wtr_cache_batch_stage(wtr_cache_batch *batch, wtr_cache_writer *writer, gchar *hash_file, guint64 hash) {
+	wtr_cache_staged *entry = (wtr_cache_staged *)g_malloc(sizeof(wtr_cache_staged));
+	entry->hash_temp_file = g_strconcat(hash_file, WTR_CACHE_TEMP_SUFFIX, NULL);
+	int hash_fd = g_mkstemp(entry->hash_temp_file);
+	gchar hash_str[17];
+	g_snprintf(hash_str, sizeof(hash_str), "%016" G_GINT64_MODIFIER "x", hash);
+	gboolean ok = hash_fd >= 0 && fchmod(hash_fd, 0644) == 0 && write(hash_fd, hash_str, 16) == 16;
+	if (hash_fd >= 0) {
+		ok = close(hash_fd) == 0 && ok;
+	}
+	ok = close(writer->fd) == 0 && ok;
+	writer->fd = -1;
+	entry->file = g_strdup(writer->file);
+	entry->temp_file = g_strdup(writer->temp_file);
+	entry->hash_file = g_strdup(hash_file);
+	if (!ok) {
+		wtr_cache_staged_free(entry);
+		return FALSE;
+	}
+	batch->staged = g_list_prepend(batch->staged, entry);
+	return TRUE;
+}
+
+wtr_cache_outcome wtr_cache_writer_commit(wtr_cache_writer *writer, guint64 hash) {
+	gchar *hash_file = g_strconcat(writer->file, WTR_CACHE_HASH_SUFFIX, NULL);
+	guint64 cached_hash;
+	gboolean unchanged = wtr_cache_read_hash(writer->file, hash_file, &cached_hash) && cached_hash == hash;
+	wtr_cache_outcome outcome = unchanged ? WTR_CACHE_UNCHANGED : writer->ok ? WTR_CACHE_WRITTEN : WTR_CACHE_FAILED;
+	wtr_cache_batch *batch = (wtr_cache_batch *)g_private_get(&wtr_cache_thread_batch);
+	if (unchanged) {
+		wtr_cache_touch_hash(hash_file);
+	} else if (outcome == WTR_CACHE_WRITTEN && batch != NULL) {
+		if (!wtr_cache_batch_stage(batch, writer, hash_file, hash)) {
+			outcome = WTR_CACHE_FAILED;
+		}
+	} else if (outcome == WTR_CACHE_WRITTEN) {
+		// Like g_file_set_contents(), make the data durable before it replaces an existing file
+		gboolean replacing = g_file_test(writer->file, G_FILE_TEST_EXISTS);
+		g_unlink(hash_file);
+		if ((!replacing || fsync(writer->fd) == 0) && close(writer->fd) == 0) {
+			writer->fd = -1;
+			if (g_rename(writer->temp_file, writer->file) != 0) {
+				g_unlink(writer->temp_file);
+				outcome = WTR_CACHE_FAILED;
+			} else if (!wtr_cache_write_hash(hash_file, hash)) {
+				outcome = WTR_CACHE_FAILED;
+			}
+		} else {
+			outcome = WTR_CACHE_FAILED;
+		}
+	}
+	if (outcome == WTR_CACHE_UNCHANGED) {
+		metrics_add(METRICS_CACHE_UNCHANGED, 1);
+	} else if (outcome == WTR_CACHE_WRITTEN) {
+		metrics_add(METRICS_CACHE_WRITES, 1);
+		metrics_add(METRICS_CACHE_WRITTEN_BYTES, writer->length);
+	} else {
+		events_log(EVENTS_ERROR, "wtr_cache_writer_commit can't write %s", writer->file);
+	}
+	WTR_PROBE3(libweather, cache__set, writer->file, writer->length, unchanged);
+	events_log(EVENTS_DEBUG, "wtr_cache_writer_commit %s: %zu bytes%s", writer->file, writer->length, unchanged ? " (unchanged)" : "");
+	g_free(hash_file);
+	wtr_cache_writer_free(writer);
+	return outcome;
+}
+
+void wtr_cache_writer_abort(wtr_cache_writer *writer) {
+	wtr_cache_writer_free(writer);
+}
+
+void wtr_cache_batch_begin(void) {
+	if (g_private_get(&wtr_cache_thread_batch) == NULL) {
+		g_private_set(&wtr_cache_thread_batch, g_malloc0(sizeof(wtr_cache_batch)));
+	}
+}
+
+/**
+ * @brief Syncs all the staged documents at once, then publishes them one by one.
+ *
+ * On Linux a single @c syncfs flushes the whole cache filesystem; elsewhere
+ * @c sync does the same for all the filesystems. After the renames every
+ * touched directory is synced once, so that the renames are durable too.
+ */
+void wtr_cache_batch_commit(void) {
+	wtr_cache_batch *batch = (wtr_cache_batch *)g_private_get(&wtr_cache_thread_batch);
+	if (batch == NULL) {
+		return;
+	}
+	GList *staged = g_list_reverse(batch->staged);
+	g_private_set(&wtr_cache_thread_batch, NULL);
+	g_free(batch);
+	if (staged == NULL) {
+		return;
+	}
+	gchar *cache_dir = wtr_cache_dir();
+#ifdef __linux__
+	int cache_fd = open(cache_dir, O_RDONLY | O_DIRECTORY);
+	if (cache_fd < 0 || syncfs(cache_fd) != 0) {
+		sync();
+	}
+	if (cache_fd >= 0) {
+		close(cache_fd);
+	}
+#else
+	sync();
+#endif
+	g_free(cache_dir);
+	GHashTable *dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	for (GList *ptr = staged; ptr != NULL; ptr = ptr->next) {
+		wtr_cache_staged *entry = (wtr_cache_staged *)ptr->data;
+		// The hash is removed first and published last, so that it never describes another document
+		g_unlink(entry->hash_file);
+		if (g_rename(entry->temp_file, entry->file) == 0) {
+			g_rename(entry->hash_temp_file, entry->hash_file);
+			g_hash_table_add(dirs, g_path_get_dirname(entry->file));
+		}
+	}
+	GHashTableIter iter;
+	gpointer dir;
+	g_hash_table_iter_init(&iter, dirs);
+	while (g_hash_table_iter_next(&iter, &dir, NULL)) {
+		int dir_fd = open((gchar *)dir, O_RDONLY | O_DIRECTORY);
+		if (dir_fd >= 0) {
+			fsync(dir_fd);
+			close(dir_fd);
+		}
+	}
+	g_hash_table_destroy(dirs);
+	// Renamed files are not there anymore, so this just frees the entries or cleans up the failed ones
+	g_list_free_full(staged, wtr_cache_staged_free);
+}
@@ -13,12 +13,191 @@
  * temporary filesystem area and to retrieve forecasts for the same
  * location and the same day without having to issue a network call twice.
  *
+ * Each cached document can be stored along with its hash, so that writing
+ * again a document identical to the cached one can be skipped. Documents
+ * can also be written incrementally, while they are being downloaded, and
+ * published atomically once complete. Bulk writes can be grouped in a batch
+ * that is made durable with a single sync.
+ *
  * @author Paolo Bernardi
  * @date 6 Mar 2018
  */
 
+/**
+ * @brief Returns the root directory of the cache.
+ *
+ * The directory (e.g. @c /tmp/libweather) is created if it doesn't exist yet.
+ *
+ * @return Path of the cache root directory.
+ * @warning The returned string must be freed with @c g_free.
+ */
+gchar *wtr_cache_dir();
+
 gchar *wtr_cache_get(gchar *driver, gchar *location_code);
 
 gchar *wtr_cache_set(gchar *driver, gchar *location_code, gchar *data);
 
+/**
+ * @brief Outcome of writing a document into the cache.
+ */
+typedef enum {
+	/** The document was written (or staged in the batch of the calling thread). */
+	WTR_CACHE_WRITTEN,
+	/** The cached document has the same hash, so nothing was written. */
+	WTR_CACHE_UNCHANGED,
+	/** The document couldn't be written; the cached one, if any, is left untouched. */
+	WTR_CACHE_FAILED
+} wtr_cache_outcome;
+
+/**
+ * @brief Gets many cached documents of the same "driver" at once.
+ *
+ * The reads are submitted together through io_uring, when libweather was
+ * built with liburing and the kernel supports it, otherwise they are spread
+ * over a pool of threads; few documents are just read one by one.
+ *
+ * @param[in] driver Name of the libweather "driver".
+ * @param[in] location_codes Location codes.
+ * @param[in] count Number of location codes.
+ * @param[out] data For each location code, its cached document or NULL if it's not cached.
+ * @param[out] lengths For each location code, the length of its cached document (it can be NULL).
+ * @return Number of cached documents found.
+ * @warning Each returned document must be freed with @c g_free.
+ */
+guint wtr_cache_get_many(gchar *driver, gchar **location_codes, guint count, gchar **data, gsize *lengths);
+
+/**
+ * @brief Returns the hash of a cached document.
+ *
+ * @param[in] driver Name of the libweather "driver".
+ * @param[in] location_code Location code.
+ * @param[out] hash The hash stored by wtr_cache_set_hashed().
+ * @return TRUE if the document is cached along with its hash, FALSE otherwise.
+ */
+gboolean wtr_cache_get_hash(gchar *driver, gchar *location_code, guint64 *hash);
+
+/**
+ * @brief Caches a document along with its hash, unless it's already cached.
+ *
+ * If the cached document has the same hash, nothing is written at all.
+ *
+ * @param[in] driver Name of the libweather "driver".
+ * @param[in] location_code Location code.
+ * @param[in] data Document to cache.
+ * @param[in] length Length of the document.
+ * @param[in] hash Hash of the document (see xxh64()).
+ * @return Whether the document was written, skipped because unchanged, or couldn't be written (an event is logged).
+ */
+wtr_cache_outcome wtr_cache_set_hashed(gchar *driver, gchar *location_code, gchar *data, gsize length, guint64 hash);
+
+/**
+ * @brief Records that a cached document was just fetched again and found unchanged.
+ *
+ * The age of the document (see wtr_cache_get_age()) starts again from 0.
+ *
+ * @param[in] driver Name of the libweather "driver".
+ * @param[in] location_code Location code.
+ */
+void wtr_cache_touch(gchar *driver, gchar *location_code);
+
+/**
+ * @brief Returns how long ago a cached document was fetched (or confirmed unchanged).
+ *
+ * @param[in] driver Name of the libweather "driver".
+ * @param[in] location_code Location code.
+ * @param[out] age Age of the document, in seconds.
+ * @return TRUE if the document is in today's cache, FALSE otherwise.
+ */
+gboolean wtr_cache_get_age(gchar *driver, gchar *location_code, gint64 *age);
+
+/**
+ * @brief Function called for each cached document by wtr_cache_foreach().
+ *
+ * @param[in] driver Name of the libweather "driver".
+ * @param[in] location_code Location code.
+ * @param[in] user_data Data passed to wtr_cache_foreach().
+ */
+typedef void (*wtr_cache_func)(gchar *driver, gchar *location_code, gpointer user_data);
+
+/**
+ * @brief Calls a function for each document in today's cache.
+ *
+ * Documents being written (temporary files) are skipped.
+ *
+ * @param[in] func Function to call.
+ * @param[in] user_data Data to pass to the function.
+ */
+void wtr_cache_foreach(wtr_cache_func func, gpointer user_data);
+
+/**
+ * @brief A cached document being written incrementally.
+ *
+ * The document is written into a temporary file next to the cache entry,
+ * which is atomically renamed into place by wtr_cache_writer_commit().
+ */
+typedef struct _wtr_cache_writer wtr_cache_writer;
+
+/**
+ * @brief Starts writing a cached document incrementally.
+ *
+ * @param[in] driver Name of the libweather "driver".
+ * @param[in] location_code Location code.
+ * @return A new writer, or NULL if the temporary file can't be created.
+ * @warning The writer must be freed with either wtr_cache_writer_commit() or wtr_cache_writer_abort().
+ */
+wtr_cache_writer *wtr_cache_writer_new(gchar *driver, gchar *location_code);
+
+/**
+ * @brief Appends a chunk to a cached document being written.
+ *
+ * @param[in,out] writer The writer.
+ * @param[in] chunk Chunk of the document.
+ * @param[in] len Length of the chunk.
+ * @return TRUE if the chunk was written, FALSE on I/O errors (the writer can only be aborted, then).
+ */
+gboolean wtr_cache_writer_write(wtr_cache_writer *writer, const gchar *chunk, gsize len);
+
+/**
+ * @brief Publishes a completely written document in the cache and frees the writer.
+ *
+ * The document replaces the cached one atomically, unless they have the same
+ * hash: in that case the new document is just discarded.
+ *
+ * @param[in] writer The writer; it's freed by this function.
+ * @param[in] hash Hash of the document (see xxh64()).
+ * @return Whether the document was published, discarded because unchanged, or couldn't be published (an event is logged).
+ */
+wtr_cache_outcome wtr_cache_writer_commit(wtr_cache_writer *writer, guint64 hash);
+
+/**
+ * @brief Discards a cached document being written and frees the writer.
+ *
+ * The cached document, if any, is left untouched.
+ *
+ * @param[in] writer The writer; it's freed by this function.
+ */
+void wtr_cache_writer_abort(wtr_cache_writer *writer);
+
+/**
+ * @brief Starts a batch of cache writes.
+ *
+ * Until wtr_cache_batch_commit() is called, the documents written by
+ * wtr_cache_set_hashed() and wtr_cache_writer_commit() are staged in temporary
+ * files without being synced, instead of being published one by one with a
+ * sync each. Documents written in the meanwhile are not visible in the cache.
+ *
+ * The batch belongs to the calling thread: the documents written by other
+ * threads are published as usual, and the batch must be committed by the
+ * same thread.
+ */
+void wtr_cache_batch_begin(void);
+
+/**
+ * @brief Makes all the documents written during the batch durable and publishes them.
+ *
+ * The staged documents are synced together, then each of them atomically
+ * replaces its cache entry.
+ */
+void wtr_cache_batch_commit(void);
+
 #endif  // __LIBWEATHER_CACHE_H__
@@ -0,0 +1,455 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_diff.c
+ * @brief Differences between successive forecasts of a location (implementation).
+ *
+ * Days and hours are sorted by time in both forecasts, so they are aligned
+ * with a merge join: the diff and its application are linear in the number
+ * of days and hours.
+ *
+ * Encoding (integers are little endian):
+ *
+ *     base hash (8 bytes), hash (8 bytes), number of changes (varint)
+ *     for each change:
+ *         kind (1 byte: op, plus 4 if hourly)
+ *         time (zigzag varint, difference from the time of the previous change)
+ *         unless removed: fields (varint), then the value of each field, in order
+ *         (zigzag varint; the wind direction is its length plus one, 0 if unknown, and its bytes)
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "libutils.h"
+#include "libweather.h"
+#include "libweather_diff.h"
+
+/// Flag of the kind of an encoded change: the change is about an hourly forecast.
+#define WTR_DIFF_HOURLY_FLAG 4
+/// Size of the encoded hashes.
+#define WTR_DIFF_HEADER_LENGTH 16
+/// Fields of a daily forecast.
+#define WTR_DIFF_DAY_FIELDS                                                                                        \
+	((1 << WTR_DIFF_WEATHER) | (1 << WTR_DIFF_TEMP_MIN) | (1 << WTR_DIFF_TEMP_MAX) | (1 << WTR_DIFF_WIND_SPEED) | \
+	 (1 << WTR_DIFF_RAIN) | (1 << WTR_DIFF_HUMIDITY) | (1 << WTR_DIFF_PRESSURE))
+/// Fields of an hourly forecast.
+#define WTR_DIFF_HOUR_FIELDS                                                                                   \
+	((1 << WTR_DIFF_WEATHER) | (1 << WTR_DIFF_TEMP) | (1 << WTR_DIFF_WIND_SPEED) | (1 << WTR_DIFF_RAIN) | \
+	 (1 << WTR_DIFF_HUMIDITY) | (1 << WTR_DIFF_PRESSURE) | (1 << WTR_DIFF_WIND_DIR))
+
+/**
+ * @brief Returns the rain in tenths of mm, the precision kept by the deltas.
+ */
+gint wtr_diff_rain(gdouble rain) {
+	return (gint)round(rain * 10);
+}
+
+/**
+ * @brief Loads the fields of a daily forecast, indexed by wtr_diff_field.
+ */
+void wtr_diff_day_values(wtr_forecast_day *day, gint *values) {
+	memset(values, 0, sizeof(gint) * WTR_DIFF_FIELDS);
+	values[WTR_DIFF_WEATHER] = day->weather;
+	values[WTR_DIFF_TEMP_MIN] = day->temp_min;
+	values[WTR_DIFF_TEMP_MAX] = day->temp_max;
+	values[WTR_DIFF_WIND_SPEED] = day->wind_speed;
+	values[WTR_DIFF_RAIN] = wtr_diff_rain(day->rain);
+	values[WTR_DIFF_HUMIDITY] = day->humidity;
+	values[WTR_DIFF_PRESSURE] = day->pressure;
+}
+
+/**
+ * @brief Loads the fields of an hourly forecast, indexed by wtr_diff_field (except the wind direction).
+ */
+void wtr_diff_hour_values(wtr_forecast_hour *hour, gint *values) {
+	memset(values, 0, sizeof(gint) * WTR_DIFF_FIELDS);
+	values[WTR_DIFF_WEATHER] = hour->weather;
+	values[WTR_DIFF_TEMP] = hour->temp;
+	values[WTR_DIFF_WIND_SPEED] = hour->wind_speed;
+	values[WTR_DIFF_RAIN] = wtr_diff_rain(hour->rain);
+	values[WTR_DIFF_HUMIDITY] = hour->humidity;
+	values[WTR_DIFF_PRESSURE] = hour->pressure;
+}
+
+/**
+ * @brief Appends a change to a delta, keeping only the values of the changed fields.
+ */
+void wtr_diff_push(wtr_forecast_delta *delta, wtr_diff_op op, gboolean hourly, gint64 time, guint fields, const gint *values,
+                   const gchar *wind_dir) {
+	wtr_forecast_change change;
+	memset(&change, 0, sizeof(change));
+	change.op = op;
+	change.hourly = hourly;
+	change.time = time;
+	change.fields = fields;
+	for (guint f = 0; f < WTR_DIFF_FIELDS; ++f) {
+		if (fields & (1 << f)) {
+			change.values[f] = values[f];
+		}
+	}
+	change.wind_dir = (fields & (1 << WTR_DIFF_WIND_DIR)) ? g_strdup(wind_dir) : NULL;
+	g_array_append_val(delta->changes, change);
+}
+
+/**
+ * @brief Returns the fields whose values differ.
+ */
+guint wtr_diff_compare(const gint *old_values, const gint *new_values, guint fields) {
+	guint changed = 0;
+	for (guint f = 0; f < WTR_DIFF_FIELDS; ++f) {
+		if ((fields & (1 << f)) && old_values[f] != new_values[f]) {
+			changed |= 1 << f;
+		}
+	}
+	return changed;
+}
+
+/**
+ * @brief Appends the changes between the hourly forecasts of a day.
+ */
+void wtr_diff_hours(wtr_forecast_delta *delta, GList *old_hours, GList *new_hours) {
+	gint old_values[WTR_DIFF_FIELDS];
+	gint new_values[WTR_DIFF_FIELDS];
+	while (old_hours != NULL || new_hours != NULL) {
+		wtr_forecast_hour *old_hour = old_hours != NULL ? (wtr_forecast_hour *)old_hours->data : NULL;
+		wtr_forecast_hour *new_hour = new_hours != NULL ? (wtr_forecast_hour *)new_hours->data : NULL;
+		gint64 old_time = old_hour != NULL ? g_date_time_to_unix(old_hour->tstamp) : G_MAXINT64;
+		gint64 new_time = new_hour != NULL ? g_date_time_to_unix(new_hour->tstamp) : G_MAXINT64;
+		if (old_time < new_time) {
+			wtr_diff_push(delta, WTR_DIFF_REMOVED, TRUE, old_time, 0, NULL, NULL);
+			old_hours = old_hours->next;
+			continue;
+		}
+		wtr_diff_hour_values(new_hour, new_values);
+		if (new_time < old_time) {
+			wtr_diff_push(delta, WTR_DIFF_ADDED, TRUE, new_time, WTR_DIFF_HOUR_FIELDS, new_values, new_hour->wind_dir);
+		} else {
+			wtr_diff_hour_values(old_hour, old_values);
+			guint changed = wtr_diff_compare(old_values, new_values, WTR_DIFF_HOUR_FIELDS);
+			if (g_strcmp0(old_hour->wind_dir, new_hour->wind_dir) != 0) {
+				changed |= 1 << WTR_DIFF_WIND_DIR;
+			}
+			if (changed != 0) {
+				wtr_diff_push(delta, WTR_DIFF_CHANGED, TRUE, new_time, changed, new_values, new_hour->wind_dir);
+			}
+			old_hours = old_hours->next;
+		}
+		new_hours = new_hours->next;
+	}
+}
+
+wtr_forecast_delta *wtr_forecast_diff(wtr_forecast *old_forecast, wtr_forecast *new_forecast) {
+	wtr_forecast_delta *delta = (wtr_forecast_delta *)g_malloc(sizeof(wtr_forecast_delta));
+	delta->base_hash = old_forecast->hash;
+	delta->hash = new_forecast->hash;
+	delta->changes = g_array_new(FALSE, FALSE, sizeof(wtr_forecast_change));
+	gint old_values[WTR_DIFF_FIELDS];
+	gint new_values[WTR_DIFF_FIELDS];
+	GList *old_days = old_forecast->days;
+	GList *new_days = new_forecast->days;
+	while (old_days != NULL || new_days != NULL) {
+		wtr_forecast_day *old_day = old_days != NULL ? (wtr_forecast_day *)old_days->data : NULL;
+		wtr_forecast_day *new_day = new_days != NULL ? (wtr_forecast_day *)new_days->data : NULL;
+		gint64 old_time = old_day != NULL ? g_date_time_to_unix(old_day->date) : G_MAXINT64;
+		gint64 new_time = new_day != NULL ? g_date_time_to_unix(new_day->date) : G_MAXINT64;
+		if (old_time < new_time) {
+			wtr_diff_push(delta, WTR_DIFF_REMOVED, FALSE, old_time, 0, NULL, NULL);
+			old_days = old_days->next;
+			continue;
+		}
+		wtr_diff_day_values(new_day, new_values);
+		if (new_time < old_time) {
+			wtr_diff_push(delta, WTR_DIFF_ADDED, FALSE, new_time, WTR_DIFF_DAY_FIELDS, new_values, NULL);
+			wtr_diff_hours(delta, NULL, new_day->hours);
+		} else {
+			wtr_diff_day_values(old_day, old_values);
+			guint day_index = delta->changes->len;
+			wtr_diff_push(delta, WTR_DIFF_CHANGED, FALSE, new_time, wtr_diff_compare(old_values, new_values, WTR_DIFF_DAY_FIELDS),
+			              new_values, NULL);
+			wtr_diff_hours(delta, old_day->hours, new_day->hours);
+			// Neither the summary nor the hours changed
+			if (delta->changes->len == day_index + 1 && g_array_index(delta->changes, wtr_forecast_change, day_index).fields == 0) {
+				g_array_set_size(delta->changes, day_index);
+			}
+			old_days = old_days->next;
+		}
+		new_days = new_days->next;
+	}
+	return delta;
+}
+
+/**
+ * @brief Sets the changed fields of a daily forecast.
+ */
+void wtr_diff_set_day(wtr_forecast_day *day, wtr_forecast_change *change) {
+	gint *values = change->values;
+	guint fields = change->fields;
+	day->weather = (fields & (1 << WTR_DIFF_WEATHER)) ? values[WTR_DIFF_WEATHER] : day->weather;
+	day->temp_min = (fields & (1 << WTR_DIFF_TEMP_MIN)) ? values[WTR_DIFF_TEMP_MIN] : day->temp_min;
+	day->temp_max = (fields & (1 << WTR_DIFF_TEMP_MAX)) ? values[WTR_DIFF_TEMP_MAX] : day->temp_max;
+	day->wind_speed = (fields & (1 << WTR_DIFF_WIND_SPEED)) ? values[WTR_DIFF_WIND_SPEED] : day->wind_speed;
+	day->rain = (fields & (1 << WTR_DIFF_RAIN)) ? values[WTR_DIFF_RAIN] / 10.0 : day->rain;
+	day->humidity = (fields & (1 << WTR_DIFF_HUMIDITY)) ? values[WTR_DIFF_HUMIDITY] : day->humidity;
+	day->pressure = (fields & (1 << WTR_DIFF_PRESSURE)) ? values[WTR_DIFF_PRESSURE] : day->pressure;
+}
+
+/**
+ * @brief Sets the changed fields of an hourly forecast.
+ */
+void wtr_diff_set_hour(wtr_forecast_hour *hour, wtr_forecast_change *change) {
+	gint *values = change->values;
+	guint fields = change->fields;
+	hour->weather = (fields & (1 << WTR_DIFF_WEATHER)) ? values[WTR_DIFF_WEATHER] : hour->weather;
+	hour->temp = (fields & (1 << WTR_DIFF_TEMP)) ? values[WTR_DIFF_TEMP] : hour->temp;
+	hour->wind_speed = (fields & (1 << WTR_DIFF_WIND_SPEED)) ? values[WTR_DIFF_WIND_SPEED] : hour->wind_speed;
+	hour->rain = (fields & (1 << WTR_DIFF_RAIN)) ? values[WTR_DIFF_RAIN] / 10.0 : hour->rain;
+	hour->humidity = (fields & (1 << WTR_DIFF_HUMIDITY)) ? values[WTR_DIFF_HUMIDITY] : hour->humidity;
+	hour->pressure = (fields & (1 << WTR_DIFF_PRESSURE)) ? values[WTR_DIFF_PRESSURE] : hour->pressure;
+	if (fields & (1 << WTR_DIFF_WIND_DIR)) {
+		g_free(hour->wind_dir);
+		hour->wind_dir = g_strdup(change->wind_dir);
+	}
+}
+
+/**
+ * @brief Frees an hourly forecast.
+ */
+void wtr_diff_hour_free(wtr_forecast_hour *hour) {
+	g_date_time_unref(hour->tstamp);
+	g_free(hour->wind_dir);
+	g_free(hour);
+}
+
+/**
+ * @brief Frees a daily forecast and its hourly forecasts.
+ */
+void wtr_diff_day_free(wtr_forecast_day *day) {
+	g_list_free_full(day->hours, (GDestroyNotify)wtr_diff_hour_free);
+	g_date_time_unref(day->date);
+	g_free(day);
+}
+
+/**
+ * @brief Applies the change of an hourly forecast to a day.
+ *
+ * @param[in,out] day The day.
+ * @param[in,out] hour_ptr Position of the first hourly forecast not yet passed by the changes.
+ * @param[in] change The change.
+ * @return TRUE on success, FALSE if the change doesn't apply to the day.
+ */
+gboolean wtr_diff_apply_hour(wtr_forecast_day *day, GList **hour_ptr, wtr_forecast_change *change) {
+	while (*hour_ptr != NULL && g_date_time_to_unix(((wtr_forecast_hour *)(*hour_ptr)->data)->tstamp) < change->time) {
+		*hour_ptr = (*hour_ptr)->next;
+	}
+	gboolean found = *hour_ptr != NULL && g_date_time_to_unix(((wtr_forecast_hour *)(*hour_ptr)->data)->tstamp) == change->time;
+	if (change->op == WTR_DIFF_ADDED) {
+		if (found) {
+			return FALSE;
+		}
+		wtr_forecast_hour *hour = (wtr_forecast_hour *)g_malloc0(sizeof(wtr_forecast_hour));
+		hour->tstamp = g_date_time_new_from_unix_local(change->time);
+		wtr_diff_set_hour(hour, change);
+		day->hours = g_list_insert_before(day->hours, *hour_ptr, hour);
+	} else if (!found) {
+		return FALSE;
+	} else if (change->op == WTR_DIFF_REMOVED) {
+		GList *next = (*hour_ptr)->next;
+		wtr_diff_hour_free((wtr_forecast_hour *)(*hour_ptr)->data);
+		day->hours = g_list_delete_link(day->hours, *hour_ptr);
+		*hour_ptr = next;
+	} else {
+		wtr_diff_set_hour((wtr_forecast_hour *)(*hour_ptr)->data, change);
+		*hour_ptr = (*hour_ptr)->next;
+	}
+	return TRUE;
+}
+
+/**
+ * @brief Walks the days and hours of a copy of the old forecasts along with the changes, in a single pass.
+ */
+wtr_forecast *wtr_forecast_delta_apply(wtr_forecast *old_forecast, wtr_forecast_delta *delta) {
+	if (delta->base_hash != 0 && old_forecast->hash != 0 && delta->base_hash != old_forecast->hash) {
+		return NULL;
+	}
+	wtr_forecast *forecast = wtr_forecast_copy(old_forecast, 0);
+	GList *day_ptr = forecast->days;
+	wtr_forecast_day *day = NULL;
+	GList *hour_ptr = NULL;
+	gboolean ok = TRUE;
+	for (guint i = 0; i < delta->changes->len && ok; ++i) {
+		wtr_forecast_change *change = &g_array_index(delta->changes, wtr_forecast_change, i);
+		if (change->hourly) {
+			ok = day != NULL && wtr_diff_apply_hour(day, &hour_ptr, change);
+			continue;
+		}
+		while (day_ptr != NULL && g_date_time_to_unix(((wtr_forecast_day *)day_ptr->data)->date) < change->time) {
+			day_ptr = day_ptr->next;
+		}
+		gboolean found = day_ptr != NULL && g_date_time_to_unix(((wtr_forecast_day *)day_ptr->data)->date) == change->time;
+		day = NULL;
+		if (change->op == WTR_DIFF_ADDED) {
+			if (found) {
+				ok = FALSE;
+				continue;
+			}
+			day = (wtr_forecast_day *)g_malloc0(sizeof(wtr_forecast_day));
+			day->date = g_date_time_new_from_unix_local(change->time);
+			wtr_diff_set_day(day, change);
+			forecast->days = g_list_insert_before(forecast->days, day_ptr, day);
+			hour_ptr = NULL;
+		} else if (!found) {
+			ok = FALSE;
+		} else if (change->op == WTR_DIFF_REMOVED) {
+			GList *next = day_ptr->next;
+			wtr_diff_day_free((wtr_forecast_day *)day_ptr->data);
+			forecast->days = g_list_delete_link(forecast->days, day_ptr);
+			day_ptr = next;
+		} else {
+			day = (wtr_forecast_day *)day_ptr->data;
+			wtr_diff_set_day(day, change);
+			hour_ptr = day->hours;
+			day_ptr = day_ptr->next;
+		}
+	}
+	if (!ok) {
+		wtr_forecast_free(forecast);
+		return NULL;
+	}
+	// Rain is kept in tenths of mm, so the rebuilt forecasts may differ from the ones parsed from the document
+	forecast->hash = 0;
+	return forecast;
+}
+
+/**
+ * @brief Appends a varint to a buffer.
+ */
+void wtr_diff_put_varint(GByteArray *buffer, guint64 value) {
+	guint8 varint[VARINT_MAX_LENGTH];
+	g_byte_array_append(buffer, varint, varint_encode(value, varint));
+}
+
+GByteArray *wtr_forecast_delta_encode(wtr_forecast_delta *delta) {
+	GByteArray *buffer = g_byte_array_sized_new(WTR_DIFF_HEADER_LENGTH + delta->changes->len * 4);
+	guint64 hashes[] = {GUINT64_TO_LE(delta->base_hash), GUINT64_TO_LE(delta->hash)};
+	g_byte_array_append(buffer, (guint8 *)hashes, sizeof(hashes));
+	wtr_diff_put_varint(buffer, delta->changes->len);
+	gint64 time = 0;
+	for (guint i = 0; i < delta->changes->len; ++i) {
+		wtr_forecast_change *change = &g_array_index(delta->changes, wtr_forecast_change, i);
+		guint8 kind = change->op | (change->hourly ? WTR_DIFF_HOURLY_FLAG : 0);
+		g_byte_array_append(buffer, &kind, 1);
+		wtr_diff_put_varint(buffer, zigzag_encode(change->time - time));
+		time = change->time;
+		if (change->op == WTR_DIFF_REMOVED) {
+			continue;
+		}
+		wtr_diff_put_varint(buffer, change->fields);
+		for (guint f = 0; f < WTR_DIFF_FIELDS; ++f) {
+			if (!(change->fields & (1 << f))) {
+				continue;
+			} else if (f != WTR_DIFF_WIND_DIR) {
+				wtr_diff_put_varint(buffer, zigzag_encode(change->values[f]));
+			} else if (change->wind_dir == NULL) {
+				wtr_diff_put_varint(buffer, 0);
+			} else {
+				gsize length = strlen(change->wind_dir);
+				wtr_diff_put_varint(buffer, length + 1);
+				g_byte_array_append(buffer, (const guint8 *)change->wind_dir, length);
+			}
+		}
+	}
+	return buffer;
+}
+
+/**
+ * @brief Decodes the fields of a change.
+ *
+ * @return TRUE on success, FALSE if the data is not valid.
+ */
+gboolean wtr_diff_decode_fields(const guint8 **data, const guint8 *end, wtr_forecast_change *change) {
+	guint64 fields;
+	if (!varint_decode(data, end, &fields) || fields >= (1 << WTR_DIFF_FIELDS)) {
+		return FALSE;
+	}
+	change->fields = (guint)fields;
+	for (guint f = 0; f < WTR_DIFF_FIELDS; ++f) {
+		guint64 value;
+		if (!(change->fields & (1 << f))) {
+			continue;
+		} else if (!varint_decode(data, end, &value)) {
+			return FALSE;
+		} else if (f != WTR_DIFF_WIND_DIR) {
+			gint64 decoded = zigzag_decode(value);
+			if (decoded < G_MININT || decoded > G_MAXINT) {
+				return FALSE;
+			}
+			change->values[f] = (gint)decoded;
+		} else if (value > 0) {
+			if (value - 1 > (guint64)(end - *data)) {
+				return FALSE;
+			}
+			change->wind_dir = g_strndup((const gchar *)*data, value - 1);
+			*data += value - 1;
+		}
+	}
+	return TRUE;
+}
+
+wtr_forecast_delta *wtr_forecast_delta_decode(const guint8 *data, gsize length) {
+	if (length < WTR_DIFF_HEADER_LENGTH) {
+		return NULL;
+	}
+	const guint8 *end = data + length;
+	guint64 hashes[2];
+	memcpy(hashes, data, sizeof(hashes));
+	data += WTR_DIFF_HEADER_LENGTH;
+	guint64 count;
+	// Each change takes at least 2 bytes: don't trust larger counts
+	if (!varint_decode(&data, end, &count) || count > (guint64)(end - data) / 2) {
+		return NULL;
+	}
+	wtr_forecast_delta *delta = (wtr_forecast_delta *)g_malloc(sizeof(wtr_forecast_delta));
+	delta->base_hash = GUINT64_FROM_LE(hashes[0]);
+	delta->hash = GUINT64_FROM_LE(hashes[1]);
+	delta->changes = g_array_sized_new(FALSE, FALSE, sizeof(wtr_forecast_change), (guint)count);
+	gboolean ok = TRUE;
+	gint64 time = 0;
+	for (guint64 i = 0; i < count && ok; ++i) {
+		wtr_forecast_change change;
+		memset(&change, 0, sizeof(change));
+		guint64 time_delta;
+		if (data >= end || (*data & ~(WTR_DIFF_HOURLY_FLAG | 3)) != 0 || (*data & 3) > WTR_DIFF_REMOVED) {
+			ok = FALSE;
+			break;
+		}
+		change.op = (wtr_diff_op)(*data & 3);
+		change.hourly = (*data & WTR_DIFF_HOURLY_FLAG) != 0;
+		++data;
+		ok = varint_decode(&data, end, &time_delta);
+		time += zigzag_decode(time_delta);
+		change.time = time;
+		if (ok && change.op != WTR_DIFF_REMOVED) {
+			ok = wtr_diff_decode_fields(&data, end, &change);
+		}
+		g_array_append_val(delta->changes, change);
+	}
+	if (!ok || data != end) {
+		wtr_forecast_delta_free(delta);
+		return NULL;
+	}
+	return delta;
+}
+
+void wtr_forecast_delta_free(wtr_forecast_delta *delta) {
+	for (guint i = 0; i < delta->changes->len; ++i) {
+		g_free(g_array_index(delta->changes, wtr_forecast_change, i).wind_dir);
+	}
+	g_array_free(delta->changes, TRUE);
+	g_free(delta);
+}
@@ -0,0 +1,146 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_DIFF_H__
+#define __LIBWEATHER_DIFF_H__
+
+#include <glib.h>
+
+#include "libweather.h"
+
+/**
+ * @file libweather_diff.h
+ * @brief Differences between successive forecasts of a location.
+ *
+ * A delta lists the daily and hourly forecasts that were added, removed or
+ * changed, and for the changed ones only the fields that changed, so that
+ * the consumers of the forecasts can send or render only what changed.
+ * Deltas have a compact binary encoding and can be applied to the old
+ * forecasts to rebuild the new ones.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/**
+ * @brief Fields of the daily and hourly forecasts.
+ */
+typedef enum {
+	/// Weather code (daily and hourly).
+	WTR_DIFF_WEATHER,
+	/// Temperature (hourly).
+	WTR_DIFF_TEMP,
+	/// Minimum temperature (daily).
+	WTR_DIFF_TEMP_MIN,
+	/// Maximum temperature (daily).
+	WTR_DIFF_TEMP_MAX,
+	/// Wind speed (daily and hourly).
+	WTR_DIFF_WIND_SPEED,
+	/// Rain level, in tenths of mm (daily and hourly).
+	WTR_DIFF_RAIN,
+	/// Humidity (daily and hourly).
+	WTR_DIFF_HUMIDITY,
+	/// Pressure (daily and hourly).
+	WTR_DIFF_PRESSURE,
+	/// Wind direction (hourly).
+	WTR_DIFF_WIND_DIR,
+	/// Number of fields.
+	WTR_DIFF_FIELDS
+} wtr_diff_field;
+
+/**
+ * @brief Kinds of change.
+ */
+typedef enum {
+	/// Some fields changed.
+	WTR_DIFF_CHANGED,
+	/// The forecast is new.
+	WTR_DIFF_ADDED,
+	/// The forecast is gone (for a day, along with its hourly forecasts).
+	WTR_DIFF_REMOVED
+} wtr_diff_op;
+
+/**
+ * @brief A change of a daily or hourly forecast.
+ */
+typedef struct {
+	/// Kind of change.
+	wtr_diff_op op;
+	/// TRUE for an hourly forecast, FALSE for a daily one.
+	gboolean hourly;
+	/// Date of the day or beginning of the hour, in seconds since the Unix epoch.
+	gint64 time;
+	/// Changed fields (a bit for each wtr_diff_field); all of them for added forecasts, none for removed ones.
+	guint fields;
+	/// New values of the changed fields, indexed by wtr_diff_field (except the wind direction).
+	gint values[WTR_DIFF_FIELDS];
+	/// New wind direction, if changed.
+	gchar *wind_dir;
+} wtr_forecast_change;
+
+/**
+ * @brief Differences between two forecasts of a location.
+ *
+ * Changes are sorted by time. The change of a day precedes the changes of
+ * its hours; a day whose hours changed has a change even if its summary
+ * didn't (with no fields).
+ */
+typedef struct {
+	/// Hash of the old forecasts, 0 if unknown.
+	guint64 base_hash;
+	/// Hash of the new forecasts, 0 if unknown.
+	guint64 hash;
+	/// The changes (wtr_forecast_change).
+	GArray *changes;
+} wtr_forecast_delta;
+
+/**
+ * @brief Compares two forecasts of the same location.
+ *
+ * The days and hours of both forecasts are aligned by time in a single pass.
+ *
+ * @param[in] old_forecast The old forecasts.
+ * @param[in] new_forecast The new forecasts.
+ * @return The differences (with no changes if the forecasts are equal).
+ * @warning The delta must be freed with wtr_forecast_delta_free().
+ */
+wtr_forecast_delta *wtr_forecast_diff(wtr_forecast *old_forecast, wtr_forecast *new_forecast);
+
+/**
+ * @brief Rebuilds the new forecasts from the old ones and their differences.
+ *
+ * The rain is rebuilt with the precision kept by the delta (tenths of mm), so
+ * the rebuilt forecasts don't claim to be the ones of the new document: their
+ * hash is 0 (@c delta->hash still tells which document they come from).
+ *
+ * @param[in] old_forecast The old forecasts.
+ * @param[in] delta Differences between the old forecasts and the new ones.
+ * @return The new forecasts, or NULL if the delta doesn't apply to the old forecasts.
+ * @warning The caller has the responsibility to free the returned forecasts by calling wtr_forecast_free()
+ */
+wtr_forecast *wtr_forecast_delta_apply(wtr_forecast *old_forecast, wtr_forecast_delta *delta);
+
+/**
+ * @brief Encodes a delta in a compact binary format (times and values are varints).
+ *
+ * @param[in] delta The delta.
+ * @return The encoded delta.
+ * @warning The caller must free the returned buffer with @c g_byte_array_unref.
+ */
+GByteArray *wtr_forecast_delta_encode(wtr_forecast_delta *delta);
+
+/**
+ * @brief Decodes a delta encoded by wtr_forecast_delta_encode().
+ *
+ * @param[in] data The encoded delta.
+ * @param[in] length Length of the encoded delta.
+ * @return The delta, or NULL if the data is not a valid delta.
+ * @warning The delta must be freed with wtr_forecast_delta_free().
+ */
+wtr_forecast_delta *wtr_forecast_delta_decode(const guint8 *data, gsize length);
+
+/**
+ * @brief Frees a delta.
+ */
+void wtr_forecast_delta_free(wtr_forecast_delta *delta);
+
+#endif  // __LIBWEATHER_DIFF_H__
@@ -0,0 +1,213 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_driver.c
+ * @brief Interface of the libweather "drivers" and dispatcher over many of them (implementation).
+ *
+ * The requests to the providers are performed by a single net_http_get_until()
+ * call, which parses every answer as soon as it's received: in
+ * @c WTR_DISPATCH_FIRST mode the first good one stops the others.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+#include <string.h>
+
+#include <curl/curl.h>
+#include <glib.h>
+
+#include "libevents.h"
+#include "libnet.h"
+#include "libutils.h"
+#include "libweather.h"
+#include "libweather_cache.h"
+#include "libweather_driver.h"
+#include "libweather_fixture.h"
+#include "libweather_popularity.h"
+#include "libweather_tiempo.h"
+
+/// The known drivers.
+static const wtr_driver *(*wtr_drivers[])(void) = {wtr_tiempo_driver, wtr_fixture_driver};
+
+const wtr_driver *wtr_driver_find(const gchar *name) {
+	for (guint i = 0; i < G_N_ELEMENTS(wtr_drivers); ++i) {
+		const wtr_driver *driver = wtr_drivers[i]();
+		if (g_strcmp0(driver->name, name) == 0) {
+			return driver;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Forecasts requested to many providers at once.
+ */
+typedef struct {
+	/// The drivers.
+	const wtr_driver **drivers;
+	/// Location code.
+	gchar *location_code;
+	/// How to combine the answers.
+	wtr_dispatch_mode mode;
+	/// Requests to the providers.
+	net_http_request *requests;
+	/// Index of the driver of each request.
+	guint *request_driver;
+	/// Answer of each driver, NULL until a good one is received.
+	wtr_forecast **answers;
+} wtr_dispatch;
+
+/**
+ * @brief Parses and caches an answer as soon as it's received (net_http_done_func).
+ *
+ * @return TRUE if the answer is good and the first one is enough.
+ */
+gboolean wtr_dispatch_done(net_http_request *request, gpointer user_data) {
+	wtr_dispatch *dispatch = (wtr_dispatch *)user_data;
+	guint d = dispatch->request_driver[request - dispatch->requests];
+	const wtr_driver *driver = dispatch->drivers[d];
+	net_http_rawdata *data = &request->data;
+	if (data->http_code != 0 && data->http_code != 200) {
+		events_log(EVENTS_ERROR, "wtr_driver_forecast_get %s HTTP status code %lu", driver->name, data->http_code);
+		return FALSE;
+	} else if (data->curl_code) {
+		events_log(EVENTS_ERROR, "wtr_driver_forecast_get %s curl error %u: %s", driver->name, data->curl_code,
+		           curl_easy_strerror(data->curl_code));
+		return FALSE;
+	}
+	wtr_forecast *forecast = driver->forecast_parse(data->buffer, data->len, 0);
+	if (forecast == NULL) {
+		events_log(EVENTS_ERROR, "wtr_driver_forecast_get %s returned invalid forecasts", driver->name);
+		return FALSE;
+	}
+	forecast->hash = xxh64(data->buffer, data->len, 0);
+	wtr_cache_set_hashed(driver->name, dispatch->location_code, data->buffer, data->len, forecast->hash);
+	dispatch->answers[d] = forecast;
+	return dispatch->mode == WTR_DISPATCH_FIRST;
+}
+
+/**
+ * @brief Returns the time of a daily forecast, to align days.
+ */
+gint64 wtr_driver_day_time(gpointer day) {
+	return g_date_time_to_unix(((wtr_forecast_day *)day)->date);
+}
+
+/**
+ * @brief Returns the time of an hourly forecast, to align hours.
+ */
+gint64 wtr_driver_hour_time(gpointer hour) {
+	return g_date_time_to_unix(((wtr_forecast_hour *)hour)->tstamp);
+}
+
+/**
+ * @brief Moves the items missing from a list sorted by time from another one.
+ *
+ * @param[in] into The list to complete.
+ * @param[in,out] from The list to take the missing items from; they are removed from it.
+ * @param[in] time Returns the time of an item.
+ * @param[in] merge If not NULL, called on the items of both lists with the same time.
+ * @return The new head of @p into.
+ */
+GList *wtr_driver_merge_list(GList *into, GList **from, gint64 (*time)(gpointer), void (*merge)(gpointer, gpointer)) {
+	GList *into_ptr = into;
+	GList *from_ptr = *from;
+	while (from_ptr != NULL) {
+		GList *next = from_ptr->next;
+		gint64 from_time = time(from_ptr->data);
+		while (into_ptr != NULL && time(into_ptr->data) < from_time) {
+			into_ptr = into_ptr->next;
+		}
+		if (into_ptr != NULL && time(into_ptr->data) == from_time) {
+			if (merge != NULL) {
+				merge(into_ptr->data, from_ptr->data);
+			}
+		} else {
+			*from = g_list_remove_link(*from, from_ptr);
+			into = g_list_insert_before(into, into_ptr, from_ptr->data);
+			g_list_free_1(from_ptr);
+		}
+		from_ptr = next;
+	}
+	return into;
+}
+
+/**
+ * @brief Moves the hourly forecasts missing from a day from the same day of another answer.
+ */
+void wtr_driver_merge_day(gpointer into, gpointer from) {
+	wtr_forecast_day *into_day = (wtr_forecast_day *)into;
+	wtr_forecast_day *from_day = (wtr_forecast_day *)from;
+	into_day->hours = wtr_driver_merge_list(into_day->hours, &from_day->hours, wtr_driver_hour_time, NULL);
+}
+
+/**
+ * @brief Uses the cached documents first, then downloads the others concurrently.
+ */
+wtr_forecast *wtr_driver_forecast_get(const wtr_driver **drivers, guint count, gchar *location_code, guint days,
+                                      guint deadline, wtr_dispatch_mode mode) {
+	wtr_dispatch dispatch = {drivers, location_code, mode, NULL, NULL, NULL};
+	dispatch.requests = (net_http_request *)g_malloc(sizeof(net_http_request) * MAX(count, 1));
+	dispatch.request_driver = (guint *)g_malloc(sizeof(guint) * MAX(count, 1));
+	dispatch.answers = (wtr_forecast **)g_malloc0(sizeof(wtr_forecast *) * MAX(count, 1));
+	guint requests_count = 0;
+	gboolean answered = FALSE;
+	for (guint d = 0; d < count; ++d) {
+		wtr_popularity_hit(drivers[d]->name, location_code);
+		gchar *cached = wtr_cache_get(drivers[d]->name, location_code);
+		if (cached != NULL) {
+			dispatch.answers[d] = drivers[d]->forecast_parse(cached, strlen(cached), 0);
+			g_free(cached);
+		}
+		answered = answered || dispatch.answers[d] != NULL;
+	}
+	// A cached answer is as fast as it gets
+	for (guint d = 0; d < count && !(answered && mode == WTR_DISPATCH_FIRST); ++d) {
+		if (dispatch.answers[d] == NULL) {
+			dispatch.requests[requests_count].url = drivers[d]->forecast_url(location_code);
+			dispatch.requests[requests_count].write_func = NULL;
+			dispatch.requests[requests_count].user_data = NULL;
+			dispatch.request_driver[requests_count++] = d;
+		}
+	}
+	net_http_get_until(dispatch.requests, requests_count, deadline, wtr_dispatch_done, &dispatch);
+	for (guint r = 0; r < requests_count; ++r) {
+		const wtr_driver *driver = drivers[dispatch.request_driver[r]];
+		if (driver->report != NULL) {
+			driver->report(dispatch.requests[r].url, &dispatch.requests[r].data);
+		}
+		net_http_rawdata_free(&dispatch.requests[r].data);
+		g_free((gchar *)dispatch.requests[r].url);
+	}
+	// The answers are combined in order of preference
+	wtr_forecast *forecast = NULL;
+	guint answers_count = 0;
+	for (guint d = 0; d < count; ++d) {
+		if (dispatch.answers[d] == NULL) {
+			continue;
+		} else if (forecast == NULL) {
+			forecast = dispatch.answers[d];
+		} else if (mode == WTR_DISPATCH_MERGE) {
+			forecast->days = wtr_driver_merge_list(forecast->days, &dispatch.answers[d]->days, wtr_driver_day_time,
+			                                       wtr_driver_merge_day);
+			wtr_forecast_free(dispatch.answers[d]);
+		} else {
+			wtr_forecast_free(dispatch.answers[d]);
+		}
+		++answers_count;
+	}
+	if (forecast != NULL && mode == WTR_DISPATCH_MERGE && answers_count > 1) {
+		// The merged forecasts don't come from a single document
+		forecast->hash = 0;
+	}
+	if (forecast != NULL && days > 0 && g_list_length(forecast->days) > days) {
+		wtr_forecast *truncated = wtr_forecast_copy(forecast, days);
+		wtr_forecast_free(forecast);
+		forecast = truncated;
+	}
+	g_free(dispatch.answers);
+	g_free(dispatch.request_driver);
+	g_free(dispatch.requests);
+	return forecast;
+}
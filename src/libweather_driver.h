@@ -0,0 +1,76 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_DRIVER_H__
+#define __LIBWEATHER_DRIVER_H__
+
+#include <glib.h>
+
+#include "libnet.h"
+#include "libweather.h"
+
+/**
+ * @file libweather_driver.h
+ * @brief Interface of the libweather "drivers" and dispatcher over many of them.
+ *
+ * A driver knows where a provider publishes the forecasts of a location and
+ * how to parse them; its name is also its namespace in the cache. The
+ * dispatcher asks many providers for the same location concurrently and
+ * either returns the first good answer or merges all the answers received
+ * within a deadline, so that a single slow provider doesn't set the latency.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/**
+ * @brief A libweather "driver".
+ */
+typedef struct {
+	/// Name of the driver, also used as its namespace in the cache.
+	gchar *name;
+	/// Returns the URL of the forecasts of a location (to be freed with @c g_free).
+	gchar *(*forecast_url)(gchar *location_code);
+	/// Parses a document downloaded from the URL, returns NULL if it's not valid (@c days is 0 to parse all of them).
+	wtr_forecast *(*forecast_parse)(char *content, size_t length, guint days);
+	/// Reports the outcome of every request made to one of its URLs, sent or not (e.g. for its API keys), NULL if not needed.
+	gboolean (*report)(const gchar *url, net_http_rawdata *data);
+} wtr_driver;
+
+/**
+ * @brief How the dispatcher combines the answers of the providers.
+ */
+typedef enum {
+	/// The first good answer wins, the other requests are aborted.
+	WTR_DISPATCH_FIRST,
+	/// Every good answer received within the deadline is merged into the one of the first driver.
+	WTR_DISPATCH_MERGE
+} wtr_dispatch_mode;
+
+/**
+ * @brief Find a driver by name.
+ *
+ * @param[in] name Name of the driver (e.g. @c WTR_DRIVER_TIEMPO).
+ * @return The driver, or NULL if there's no such driver.
+ */
+const wtr_driver *wtr_driver_find(const gchar *name);
+
+/**
+ * @brief Get the forecasts of a location from many providers concurrently.
+ *
+ * Cached documents are used first; the others are downloaded concurrently
+ * and cached. When merging, the days and hours missing from the answer of
+ * a driver are taken from the answers of the following ones.
+ *
+ * @param[in] drivers The drivers, in order of preference.
+ * @param[in] count Number of drivers.
+ * @param[in] location_code Location code (the same for every driver).
+ * @param[in] days Number of days to get (starting from the current one), 0 to get all of them.
+ * @param[in] deadline Milliseconds available to the providers, 0 to wait for all of them.
+ * @param[in] mode How to combine the answers.
+ * @return The forecasts, or NULL if no provider gave a good answer within the deadline.
+ * @warning The caller has the responsibility to free the returned forecasts by calling wtr_forecast_free()
+ */
+wtr_forecast *wtr_driver_forecast_get(const wtr_driver **drivers, guint count, gchar *location_code, guint days,
+                                      guint deadline, wtr_dispatch_mode mode);
+
+#endif  // __LIBWEATHER_DRIVER_H__
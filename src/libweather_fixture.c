@@ -0,0 +1,175 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_fixture.c
+ * @brief Fixture "driver" for libweather, which reads forecasts from local files (implementation).
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "config.h"
+#include "libevents.h"
+#include "libutils.h"
+#include "libweather.h"
+#include "libweather_fixture.h"
+
+/// Number of fields of a daily forecast line.
+#define WTR_FIXTURE_DAY_FIELDS 9
+/// Number of fields of an hourly forecast line.
+#define WTR_FIXTURE_HOUR_FIELDS 9
+
+gchar *wtr_fixture_forecast_url(gchar *code) {
+	const gchar *dir = g_getenv("WTR_FIXTURE_DIR");
+	gchar *file_name = g_strconcat(code, ".csv", NULL);
+	gchar *path = g_build_filename(dir != NULL ? dir : WTR_FIXTURE_DIR, file_name, NULL);
+	// file:// URLs must be absolute
+	if (!g_path_is_absolute(path)) {
+		gchar *current_dir = g_get_current_dir();
+		gchar *absolute_path = g_build_filename(current_dir, path, NULL);
+		g_free(current_dir);
+		g_free(path);
+		path = absolute_path;
+	}
+	gchar *url = g_filename_to_uri(path, NULL, NULL);
+	g_free(path);
+	g_free(file_name);
+	return url;
+}
+
+/**
+ * @brief Parses the integer fields of a line.
+ *
+ * @param[in] fields The fields of the line.
+ * @param[in] indexes Indexes of the integer fields, terminated by -1.
+ * @param[out] values The values of the fields, in the same order as @p indexes.
+ * @return TRUE if every field is an integer.
+ */
+gboolean wtr_fixture_ints(gchar **fields, const gint *indexes, gint *values) {
+	for (guint i = 0; indexes[i] >= 0; ++i) {
+		if (str2int(&values[i], fields[indexes[i]], 10) != STR2INT_SUCCESS) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * @brief Parses a daily forecast line.
+ *
+ * @return The daily forecast, or NULL if the line is malformed.
+ */
+wtr_forecast_day *wtr_fixture_parse_day(gchar **fields) {
+	static const gint indexes[] = {2, 3, 4, 5, 7, 8, -1};
+	gint values[G_N_ELEMENTS(indexes) - 1];
+	gint year, month, day_of_month;
+	gdouble rain;
+	if (g_strv_length(fields) != WTR_FIXTURE_DAY_FIELDS || sscanf(fields[1], "%d-%d-%d", &year, &month, &day_of_month) != 3 ||
+	    !wtr_fixture_ints(fields, indexes, values) || str2double(&rain, fields[6]) != STR2DOUBLE_SUCCESS) {
+		return NULL;
+	}
+	GDateTime *date = g_date_time_new_local(year, month, day_of_month, 0, 0, 0);
+	if (date == NULL) {
+		return NULL;
+	}
+	wtr_forecast_day *day = (wtr_forecast_day *)g_malloc0(sizeof(wtr_forecast_day));
+	day->date = date;
+	day->weather = values[0];
+	day->temp_min = values[1];
+	day->temp_max = values[2];
+	day->wind_speed = values[3];
+	day->rain = rain;
+	day->humidity = values[4];
+	day->pressure = values[5];
+	return day;
+}
+
+/**
+ * @brief Parses an hourly forecast line.
+ *
+ * @return The hourly forecast, or NULL if the line is malformed.
+ */
+wtr_forecast_hour *wtr_fixture_parse_hour(gchar **fields) {
+	static const gint indexes[] = {2, 3, 4, 7, 8, -1};
+	gint values[G_N_ELEMENTS(indexes) - 1];
+	gint year, month, day_of_month, hour_of_day, minute;
+	gdouble rain;
+	if (g_strv_length(fields) != WTR_FIXTURE_HOUR_FIELDS ||
+	    sscanf(fields[1], "%d-%d-%d %d:%d", &year, &month, &day_of_month, &hour_of_day, &minute) != 5 ||
+	    !wtr_fixture_ints(fields, indexes, values) || str2double(&rain, fields[6]) != STR2DOUBLE_SUCCESS) {
+		return NULL;
+	}
+	GDateTime *tstamp = g_date_time_new_local(year, month, day_of_month, hour_of_day, minute, 0);
+	if (tstamp == NULL) {
+		return NULL;
+	}
+	wtr_forecast_hour *hour = (wtr_forecast_hour *)g_malloc0(sizeof(wtr_forecast_hour));
+	hour->tstamp = tstamp;
+	hour->weather = values[0];
+	hour->temp = values[1];
+	hour->wind_speed = values[2];
+	hour->wind_dir = g_strdup(fields[5]);
+	hour->rain = rain;
+	hour->humidity = values[3];
+	hour->pressure = values[4];
+	return hour;
+}
+
+/**
+ * @brief Parses the fixture line by line; hourly forecasts are appended to the last parsed day.
+ */
+wtr_forecast *wtr_fixture_forecast_parse(char *content, size_t length, guint days) {
+	gchar *text = g_strndup(content, length);
+	gchar **lines = g_strsplit(text, "\n", -1);
+	g_free(text);
+	wtr_forecast *forecast = wtr_forecast_init();
+	wtr_forecast_day *day = NULL;
+	guint days_count = 0;
+	gboolean ok = TRUE;
+	for (guint i = 0; lines[i] != NULL && ok; ++i) {
+		gchar *line = g_strstrip(lines[i]);
+		if (*line == '\0' || *line == '#') {
+			continue;
+		}
+		gchar **fields = g_strsplit(line, ",", -1);
+		if (strcmp(fields[0], "day") == 0) {
+			if (days > 0 && days_count == days) {
+				g_strfreev(fields);
+				break;
+			}
+			day = wtr_fixture_parse_day(fields);
+			ok = day != NULL;
+			if (ok) {
+				forecast->days = g_list_prepend(forecast->days, day);
+				++days_count;
+			}
+		} else if (strcmp(fields[0], "hour") == 0 && day != NULL) {
+			wtr_forecast_hour *hour = wtr_fixture_parse_hour(fields);
+			ok = hour != NULL;
+			if (ok) {
+				day->hours = g_list_append(day->hours, hour);
+			}
+		} else {
+			ok = FALSE;
+		}
+		g_strfreev(fields);
+	}
+	g_strfreev(lines);
+	forecast->days = g_list_reverse(forecast->days);
+	if (!ok || forecast->days == NULL) {
+		events_log(EVENTS_ERROR, "wtr_fixture_forecast_parse malformed fixture");
+		wtr_forecast_free(forecast);
+		return NULL;
+	}
+	return forecast;
+}
+
+const wtr_driver *wtr_fixture_driver(void) {
+	static const wtr_driver driver = {WTR_DRIVER_FIXTURE, wtr_fixture_forecast_url, wtr_fixture_forecast_parse, NULL};
+	return &driver;
+}
@@ -0,0 +1,59 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_FIXTURE_H__
+#define __LIBWEATHER_FIXTURE_H__
+
+#include <glib.h>
+
+#include "libweather.h"
+#include "libweather_driver.h"
+
+/**
+ * @file libweather_fixture.h
+ * @brief Fixture "driver" for libweather, which reads forecasts from local files.
+ *
+ * The forecasts of a location are read from @c CODE.csv in the fixture
+ * directory (see @c WTR_FIXTURE_DIR), via a @c file:// URL. Each line is
+ * either a daily forecast or an hourly forecast of the previous day:
+ *
+ *     day,2018-03-12,1,8,15,10,0.0,60,1015
+ *     hour,2018-03-12 13:00,1,14,10,NE,0.0,55,1014
+ *
+ * The fields are the ones of wtr_forecast_day (weather, temp_min, temp_max,
+ * wind_speed, rain, humidity, pressure) and wtr_forecast_hour (weather, temp,
+ * wind_speed, wind_dir, rain, humidity, pressure). Empty lines and lines
+ * starting with @c # are ignored; days must be in chronological order, and so
+ * must be the hours of each day.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/// Name of the libweather "driver" for the local fixtures.
+#define WTR_DRIVER_FIXTURE "fixture"
+
+/**
+ * @brief Returns the URL of the fixture of a location.
+ *
+ * @param[in] code Location code.
+ * @return The @c file:// URL of the fixture (to be freed with @c g_free).
+ */
+gchar *wtr_fixture_forecast_url(gchar *code);
+
+/**
+ * @brief Parses a fixture.
+ *
+ * @param[in] content The fixture.
+ * @param[in] length Length of the fixture.
+ * @param[in] days Number of days to parse, 0 to parse all of them.
+ * @return The forecasts, or NULL if the fixture is malformed.
+ * @warning The caller of this function must free the wtr_forecast with wtr_forecast_free().
+ */
+wtr_forecast *wtr_fixture_forecast_parse(char *content, size_t length, guint days);
+
+/**
+ * @brief Returns the fixture driver, for the dispatcher (see libweather_driver.h).
+ */
+const wtr_driver *wtr_fixture_driver(void);
+
+#endif  // __LIBWEATHER_FIXTURE_H__
@@ -0,0 +1,195 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_ingest.c
+ * @brief Offline ingest of saved Tiempo's XML documents (implementation).
+ *
+ * The files are listed first, then the threads take them one by one from
+ * the list, so that a few big files don't keep a single thread busy while
+ * the others are idle. Each thread counts its own documents and adds them to
+ * the totals when it's done.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+// mmap() and posix_madvise() are POSIX, not C99
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "libevents.h"
+#include "libutils.h"
+#include "libweather.h"
+#include "libweather_ingest.h"
+#include "libweather_tiempo.h"
+
+/**
+ * @brief An ingest in progress, shared by the parsing threads.
+ */
+typedef struct {
+	/// Paths of the files to ingest.
+	GPtrArray *files;
+	/// Index of the next file to ingest.
+	gint next;
+	/// Function called with the forecasts of each document.
+	wtr_ingest_func func;
+	/// Data to pass to @c func.
+	gpointer user_data;
+	/// Serializes the calls to @c func and the updates of @c stats.
+	GMutex lock;
+	/// Outcome of the ingest so far.
+	wtr_ingest_stats stats;
+} wtr_ingest_job;
+
+/**
+ * @brief Adds the regular files of a directory tree to a list, skipping the hidden ones and the symbolic links.
+ *
+ * Symbolic links are not followed, so a link to a parent directory can't make the walk loop.
+ * @return TRUE on success, FALSE if a directory can't be read.
+ */
+gboolean wtr_ingest_list(const gchar *dir, GPtrArray *files) {
+	GError *error = NULL;
+	GDir *handle = g_dir_open(dir, 0, &error);
+	if (handle == NULL) {
+		events_log(EVENTS_ERROR, "wtr_ingest_dir can't read %s: %s", dir, error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+	gboolean ok = TRUE;
+	const gchar *name;
+	while (ok && (name = g_dir_read_name(handle)) != NULL) {
+		if (name[0] == '.') {
+			continue;
+		}
+		gchar *path = g_build_filename(dir, name, NULL);
+		if (g_file_test(path, G_FILE_TEST_IS_SYMLINK)) {
+			g_free(path);
+		} else if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+			ok = wtr_ingest_list(path, files);
+			g_free(path);
+		} else if (g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+			g_ptr_array_add(files, path);
+		} else {
+			g_free(path);
+		}
+	}
+	g_dir_close(handle);
+	return ok;
+}
+
+/**
+ * @brief Returns the location code of a document: its file name up to the first dot.
+ *
+ * @warning The returned string must be freed with @c g_free.
+ */
+gchar *wtr_ingest_code(const gchar *path) {
+	gchar *code = g_path_get_basename(path);
+	gchar *dot = strchr(code, '.');
+	if (dot != NULL) {
+		*dot = '\0';
+	}
+	return code;
+}
+
+/**
+ * @brief Maps a document and parses it with the parser of the calling thread.
+ *
+ * @param[in] parser The parser of the calling thread.
+ * @param[in] path Path of the document.
+ * @param[out] fetched Modification time of the document.
+ * @param[out] length Length of the document.
+ * @return The forecasts, or NULL if the document can't be read or it's malformed.
+ */
+wtr_forecast *wtr_ingest_parse(wtr_tiempo_parser *parser, const gchar *path, gint64 *fetched, gsize *length) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		*fetched = st.st_mtime;
+		*length = st.st_size;
+		data = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
+	// The document is read once, from start to end
+	posix_madvise(data, *length, POSIX_MADV_SEQUENTIAL);
+	wtr_forecast *forecast = wtr_tiempo_parser_parse(parser, (const char *)data, *length);
+	if (forecast != NULL) {
+		forecast->hash = xxh64(data, *length, 0);
+	}
+	munmap(data, *length);
+	return forecast;
+}
+
+/**
+ * @brief Ingests documents until there are no more left (GThreadFunc).
+ */
+gpointer wtr_ingest_thread(gpointer data) {
+	wtr_ingest_job *job = (wtr_ingest_job *)data;
+	wtr_tiempo_parser *parser = wtr_tiempo_parser_new(0);
+	wtr_ingest_stats stats = {0, 0, 0, 0};
+	gint next;
+	while ((next = g_atomic_int_add(&job->next, 1)) < (gint)job->files->len) {
+		const gchar *path = (const gchar *)g_ptr_array_index(job->files, next);
+		gchar *code = wtr_ingest_code(path);
+		gint64 fetched = 0;
+		gsize length = 0;
+		wtr_forecast *forecast = *code != '\0' ? wtr_ingest_parse(parser, path, &fetched, &length) : NULL;
+		if (forecast == NULL) {
+			events_log(EVENTS_ERROR, "wtr_ingest_dir can't ingest %s", path);
+			++stats.errors;
+		} else {
+			++stats.documents;
+			stats.bytes += length;
+			g_mutex_lock(&job->lock);
+			job->func(code, fetched, forecast, job->user_data);
+			g_mutex_unlock(&job->lock);
+			wtr_forecast_free(forecast);
+		}
+		g_free(code);
+	}
+	wtr_tiempo_parser_free(parser);
+	g_mutex_lock(&job->lock);
+	job->stats.documents += stats.documents;
+	job->stats.errors += stats.errors;
+	job->stats.bytes += stats.bytes;
+	g_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+gboolean wtr_ingest_dir(const gchar *dir, guint threads, wtr_ingest_func func, gpointer user_data, wtr_ingest_stats *stats) {
+	gint64 start = g_get_monotonic_time();
+	wtr_ingest_job job = {g_ptr_array_new_with_free_func(g_free), 0, func, user_data, {0}, {0, 0, 0, 0}};
+	g_mutex_init(&job.lock);
+	gboolean ok = wtr_ingest_list(dir, job.files);
+	if (ok) {
+		threads = CLAMP(threads > 0 ? threads : g_get_num_processors(), 1, MAX(job.files->len, 1));
+		GThread **workers = (GThread **)g_malloc(sizeof(GThread *) * threads);
+		for (guint t = 0; t < threads; ++t) {
+			workers[t] = g_thread_new("wtr_ingest", wtr_ingest_thread, &job);
+		}
+		for (guint t = 0; t < threads; ++t) {
+			g_thread_join(workers[t]);
+		}
+		g_free(workers);
+	}
+	job.stats.duration = g_get_monotonic_time() - start;
+	if (stats != NULL) {
+		*stats = job.stats;
+	}
+	g_mutex_clear(&job.lock);
+	g_ptr_array_free(job.files, TRUE);
+	return ok;
+}
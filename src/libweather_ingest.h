@@ -0,0 +1,65 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_INGEST_H__
+#define __LIBWEATHER_INGEST_H__
+
+#include <glib.h>
+
+#include "libweather.h"
+
+/**
+ * @file libweather_ingest.h
+ * @brief Offline ingest of saved Tiempo's XML documents.
+ *
+ * Raw Tiempo responses saved over time (e.g. a year of them) are reprocessed
+ * in a single pass: every file of a directory tree is mapped in memory and
+ * parsed by a pool of threads, each one reusing its own parser. The file name
+ * up to the first dot is the location code (e.g. @c 8031 or
+ * @c 8031.20180308.xml) and the modification time of the file is when the
+ * forecast was fetched.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/**
+ * @brief Function called with the forecasts of each ingested document.
+ *
+ * It's called by the parsing threads, one at a time, in no particular order.
+ *
+ * @param[in] location_code Location code, from the file name.
+ * @param[in] fetched When the forecast was fetched, in seconds since the Unix epoch.
+ * @param[in] forecast The forecast (with the hash of its document); it's freed after the call.
+ * @param[in] user_data Data passed to wtr_ingest_dir().
+ */
+typedef void (*wtr_ingest_func)(const gchar *location_code, gint64 fetched, wtr_forecast *forecast, gpointer user_data);
+
+/**
+ * @brief Outcome of an ingest.
+ */
+typedef struct {
+	/// Number of documents parsed.
+	guint documents;
+	/// Number of files that couldn't be read or parsed.
+	guint errors;
+	/// Bytes of the documents parsed.
+	guint64 bytes;
+	/// Duration of the ingest, in microseconds.
+	gint64 duration;
+} wtr_ingest_stats;
+
+/**
+ * @brief Parse in parallel all the Tiempo's XML documents of a directory tree.
+ *
+ * Hidden files and directories (starting with a dot) and symbolic links are skipped.
+ *
+ * @param[in] dir The directory.
+ * @param[in] threads Number of parsing threads, 0 to use a thread per processor.
+ * @param[in] func Function called with the forecasts of each document.
+ * @param[in] user_data Data to pass to @p func.
+ * @param[out] stats If not NULL, the outcome of the ingest will be stored here.
+ * @return TRUE if the whole tree was read (even if some documents are malformed), FALSE otherwise.
+ */
+gboolean wtr_ingest_dir(const gchar *dir, guint threads, wtr_ingest_func func, gpointer user_data, wtr_ingest_stats *stats);
+
+#endif  // __LIBWEATHER_INGEST_H__
@@ -0,0 +1,276 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_keys.c
+ * @brief Pool of API keys (e.g. Tiempo's Affiliate IDs) with daily budgets (implementation).
+ *
+ * The state file is a key file with a group per key: the day the usage
+ * refers to (YYYYMMDD), the number of requests made that day, the end of
+ * the cool-down (seconds since the Unix epoch) and the number of times in
+ * a row the key was throttled.
+ *
+ * Many processes can use the same pool at once: each one adds the requests it
+ * made to the ones in the state file, under a lock (@c flock on the state
+ * file followed by @c .lock), instead of overwriting them.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+// flock() is neither C99 nor POSIX
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "config.h"
+#include "libevents.h"
+#include "libweather_keys.h"
+
+/**
+ * @brief A key of the pool.
+ */
+typedef struct {
+	/// The key.
+	gchar *key;
+	/// Requests per day allowed to the key, 0 if unlimited.
+	gint64 budget;
+	/// Requests made today with the key (those that got an answer).
+	gint64 used;
+	/// Requests made today with the key by the other processes, as read from the state file.
+	gint64 used_by_others;
+	/// Requests that took the key but were not reported yet.
+	gint64 pending;
+	/// End of the cool-down, in seconds since the Unix epoch.
+	gint64 cooldown_until;
+	/// Number of times in a row the key was throttled.
+	gint strikes;
+} wtr_keys_entry;
+
+/// The keys (wtr_keys_entry), NULL if the pool is disabled.
+static GArray *wtr_keys = NULL;
+/// Where the usage of the keys is saved.
+static gchar *wtr_keys_state_file = NULL;
+/// Serializes the accesses from many threads.
+static GMutex wtr_keys_lock;
+
+/**
+ * @brief Returns today's date as YYYYMMDD.
+ *
+ * @warning The returned string must be freed with @c g_free.
+ */
+gchar *wtr_keys_today(void) {
+	GDateTime *now = g_date_time_new_now_local();
+	gchar *today = g_date_time_format(now, "%Y%m%d");
+	g_date_time_unref(now);
+	return today;
+}
+
+/**
+ * @brief Loads today's usage of the keys from the state file (a missing state file means no usage).
+ *
+ * The requests made by this process are kept apart from the ones read from the
+ * state file. Cool-downs are merged, the latest one wins along with its strikes.
+ *
+ * @param[out] state If not NULL, the content of the state file is loaded here.
+ */
+void wtr_keys_load_state(GKeyFile *state) {
+	GKeyFile *loaded = state != NULL ? state : g_key_file_new();
+	gchar *today = wtr_keys_today();
+	if (g_key_file_load_from_file(loaded, wtr_keys_state_file, G_KEY_FILE_NONE, NULL)) {
+		for (guint i = 0; i < wtr_keys->len; ++i) {
+			wtr_keys_entry *entry = &g_array_index(wtr_keys, wtr_keys_entry, i);
+			gchar *day = g_key_file_get_string(loaded, entry->key, "day", NULL);
+			entry->used_by_others = g_strcmp0(day, today) == 0 ? g_key_file_get_int64(loaded, entry->key, "used", NULL) : 0;
+			gint64 cooldown_until = g_key_file_get_int64(loaded, entry->key, "cooldown", NULL);
+			if (cooldown_until > entry->cooldown_until) {
+				entry->cooldown_until = cooldown_until;
+				entry->strikes = g_key_file_get_integer(loaded, entry->key, "strikes", NULL);
+			}
+			g_free(day);
+		}
+	}
+	g_free(today);
+	if (state == NULL) {
+		g_key_file_free(loaded);
+	}
+}
+
+/**
+ * @brief Takes the lock of the state file, which serializes the processes that save it.
+ *
+ * @return The file descriptor of the lock file, to pass to wtr_keys_unlock(), or -1 if it can't be locked.
+ */
+int wtr_keys_lock_state(void) {
+	gchar *lock_file = g_strconcat(wtr_keys_state_file, ".lock", NULL);
+	int fd = open(lock_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd >= 0 && flock(fd, LOCK_EX) != 0) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		events_log(EVENTS_WARNING, "wtr_keys_lock_state can't lock %s", lock_file);
+	}
+	g_free(lock_file);
+	return fd;
+}
+
+/**
+ * @brief Releases the lock taken by wtr_keys_lock_state().
+ */
+void wtr_keys_unlock_state(int fd) {
+	if (fd >= 0) {
+		flock(fd, LOCK_UN);
+		close(fd);
+	}
+}
+
+gboolean wtr_keys_open(const gchar *keys_file, const gchar *state_file) {
+	GKeyFile *keys = g_key_file_new();
+	GError *error = NULL;
+	if (!g_key_file_load_from_file(keys, keys_file, G_KEY_FILE_NONE, &error)) {
+		events_log(EVENTS_ERROR, "wtr_keys_open can't read %s: %s", keys_file, error->message);
+		g_error_free(error);
+		g_key_file_free(keys);
+		return FALSE;
+	}
+	gsize count;
+	gchar **groups = g_key_file_get_groups(keys, &count);
+	if (count == 0) {
+		events_log(EVENTS_ERROR, "wtr_keys_open no keys in %s", keys_file);
+		g_strfreev(groups);
+		g_key_file_free(keys);
+		return FALSE;
+	}
+	wtr_keys_close();
+	g_mutex_lock(&wtr_keys_lock);
+	wtr_keys = g_array_sized_new(FALSE, TRUE, sizeof(wtr_keys_entry), count);
+	for (guint i = 0; i < count; ++i) {
+		wtr_keys_entry entry = {g_strdup(groups[i]), MAX(g_key_file_get_int64(keys, groups[i], "budget", NULL), 0), 0, 0, 0, 0, 0};
+		g_array_append_val(wtr_keys, entry);
+	}
+	g_strfreev(groups);
+	g_key_file_free(keys);
+	wtr_keys_state_file = g_strdup(state_file);
+	wtr_keys_load_state(NULL);
+	g_mutex_unlock(&wtr_keys_lock);
+	return TRUE;
+}
+
+void wtr_keys_close(void) {
+	g_mutex_lock(&wtr_keys_lock);
+	if (wtr_keys != NULL) {
+		// The other processes may have saved their requests meanwhile: they are read again and added up
+		int lock_fd = wtr_keys_lock_state();
+		GKeyFile *state = g_key_file_new();
+		wtr_keys_load_state(state);
+		gchar *today = wtr_keys_today();
+		for (guint i = 0; i < wtr_keys->len; ++i) {
+			wtr_keys_entry *entry = &g_array_index(wtr_keys, wtr_keys_entry, i);
+			g_key_file_set_string(state, entry->key, "day", today);
+			g_key_file_set_int64(state, entry->key, "used", entry->used_by_others + entry->used);
+			g_key_file_set_int64(state, entry->key, "cooldown", entry->cooldown_until);
+			g_key_file_set_integer(state, entry->key, "strikes", entry->strikes);
+			g_free(entry->key);
+		}
+		gsize length;
+		gchar *data = g_key_file_to_data(state, &length, NULL);
+		GError *error = NULL;
+		if (!g_file_set_contents(wtr_keys_state_file, data, length, &error)) {
+			events_log(EVENTS_ERROR, "wtr_keys_close can't save %s: %s", wtr_keys_state_file, error->message);
+			g_error_free(error);
+		}
+		wtr_keys_unlock_state(lock_fd);
+		g_free(data);
+		g_free(today);
+		g_key_file_free(state);
+		g_array_free(wtr_keys, TRUE);
+		g_free(wtr_keys_state_file);
+		wtr_keys = NULL;
+		wtr_keys_state_file = NULL;
+	}
+	g_mutex_unlock(&wtr_keys_lock);
+}
+
+/**
+ * @brief Returns the requests left today to a key (unlimited keys have the most, minus what they used).
+ *
+ * The requests still pending count as made, so that the requests of a batch are spread over the keys.
+ */
+gint64 wtr_keys_remaining(wtr_keys_entry *entry) {
+	gint64 used = entry->used_by_others + entry->used + entry->pending;
+	return entry->budget > 0 ? entry->budget - used : G_MAXINT64 - used;
+}
+
+/**
+ * @brief Tells whether a key can be used right now.
+ */
+gboolean wtr_keys_usable(wtr_keys_entry *entry, gint64 now) {
+	return wtr_keys_remaining(entry) > 0 && entry->cooldown_until <= now;
+}
+
+const gchar *wtr_keys_acquire(const gchar *fallback) {
+	g_mutex_lock(&wtr_keys_lock);
+	if (wtr_keys == NULL) {
+		g_mutex_unlock(&wtr_keys_lock);
+		return fallback;
+	}
+	gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+	wtr_keys_entry *best = NULL;
+	for (guint i = 0; i < wtr_keys->len; ++i) {
+		wtr_keys_entry *entry = &g_array_index(wtr_keys, wtr_keys_entry, i);
+		if (best == NULL) {
+			best = entry;
+		} else if (wtr_keys_usable(entry, now) != wtr_keys_usable(best, now)) {
+			best = wtr_keys_usable(entry, now) ? entry : best;
+		} else if (!wtr_keys_usable(entry, now) && entry->cooldown_until != best->cooldown_until) {
+			// No key is usable: the first one to cool down is the least bad
+			best = entry->cooldown_until < best->cooldown_until ? entry : best;
+		} else if (wtr_keys_remaining(entry) > wtr_keys_remaining(best)) {
+			best = entry;
+		}
+	}
+	++best->pending;
+	g_mutex_unlock(&wtr_keys_lock);
+	return best->key;
+}
+
+gboolean wtr_keys_report(const gchar *key, gulong http_code) {
+	gboolean throttled = http_code == 429 || http_code == 403;
+	g_mutex_lock(&wtr_keys_lock);
+	for (guint i = 0; wtr_keys != NULL && i < wtr_keys->len; ++i) {
+		wtr_keys_entry *entry = &g_array_index(wtr_keys, wtr_keys_entry, i);
+		if (strcmp(entry->key, key) != 0) {
+			continue;
+		}
+		entry->pending = MAX(entry->pending - 1, 0);
+		// Requests that were never sent, or never got an answer, don't count against the budget
+		entry->used += http_code != 0 ? 1 : 0;
+		if (throttled) {
+			// The cool-down doubles every time the key is throttled again
+			gint64 cooldown = (gint64)WTR_KEYS_COOLDOWN << MIN(entry->strikes, 16);
+			entry->cooldown_until = g_get_real_time() / G_USEC_PER_SEC + MIN(cooldown, WTR_KEYS_MAX_COOLDOWN);
+			++entry->strikes;
+		} else if (http_code == 200) {
+			entry->strikes = 0;
+		}
+		break;
+	}
+	g_mutex_unlock(&wtr_keys_lock);
+	return throttled;
+}
+
+guint wtr_keys_available(void) {
+	g_mutex_lock(&wtr_keys_lock);
+	guint available = 0;
+	gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+	for (guint i = 0; wtr_keys != NULL && i < wtr_keys->len; ++i) {
+		available += wtr_keys_usable(&g_array_index(wtr_keys, wtr_keys_entry, i), now) ? 1 : 0;
+	}
+	g_mutex_unlock(&wtr_keys_lock);
+	return available;
+}
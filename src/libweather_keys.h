@@ -0,0 +1,84 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_KEYS_H__
+#define __LIBWEATHER_KEYS_H__
+
+#include <glib.h>
+
+/**
+ * @file libweather_keys.h
+ * @brief Pool of API keys (e.g. Tiempo's Affiliate IDs) with daily budgets.
+ *
+ * Providers throttle the requests of each key, so the requests are spread
+ * over all the keys of the pool: each request uses the key with the largest
+ * remaining daily budget. A key that gets throttled cools down for a while,
+ * longer and longer if it keeps being throttled.
+ *
+ * Keys are read from a key file, one group per key:
+ *
+ *     [0123456789abcd]
+ *     budget=5000
+ *
+ * @c budget is the number of requests per day allowed to the key (0 or
+ * missing means no limit). The number of requests made with each key today
+ * and the cool-downs are kept in a state file between runs, which many
+ * processes can share.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/**
+ * @brief Enable the pool of keys.
+ *
+ * @param[in] keys_file Key file with the keys.
+ * @param[in] state_file File with the usage of the keys; it's created if it doesn't exist yet.
+ * @return TRUE if the keys were read, FALSE otherwise (errors are reported on the standard error).
+ * @warning The pool must be closed with wtr_keys_close().
+ */
+gboolean wtr_keys_open(const gchar *keys_file, const gchar *state_file);
+
+/**
+ * @brief Disable the pool of keys, saving their usage.
+ *
+ * It's safe to call this function even if wtr_keys_open() was not called.
+ */
+void wtr_keys_close(void);
+
+/**
+ * @brief Take a key for a request.
+ *
+ * The key with the largest remaining budget that is not cooling down is
+ * chosen. When every key is exhausted or cooling down the least bad one
+ * is returned anyway.
+ *
+ * The request counts against the budget of the key only once it's reported
+ * with wtr_keys_report(), so every key taken must be reported, even if the
+ * request is never sent.
+ *
+ * @param[in] fallback Key returned when the pool is not enabled.
+ * @return The key (it stays valid until wtr_keys_close() is called).
+ */
+const gchar *wtr_keys_acquire(const gchar *fallback);
+
+/**
+ * @brief Report the outcome of a request made with a key.
+ *
+ * Requests that got an answer count against the budget of the key. HTTP
+ * status codes 429 (Too Many Requests) and 403 (Forbidden) make the key cool
+ * down; a successful request resets its cool-down.
+ *
+ * @param[in] key The key (keys that are not in the pool are ignored).
+ * @param[in] http_code HTTP status code of the response, 0 if the request was not sent or got no answer.
+ * @return TRUE if the key was throttled.
+ */
+gboolean wtr_keys_report(const gchar *key, gulong http_code);
+
+/**
+ * @brief Count the keys that can be used right now.
+ *
+ * @return Number of keys with some budget left that are not cooling down (0 if the pool is not enabled).
+ */
+guint wtr_keys_available(void);
+
+#endif  // __LIBWEATHER_KEYS_H__
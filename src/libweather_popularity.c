@@ -0,0 +1,228 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_popularity.c
+ * @brief Decayed access counters of the locations, to keep the popular ones warm (implementation).
+ *
+ * The hits are counted in memory and only added to the scores file when
+ * the counters are closed, so requests don't pay for any I/O. Many processes
+ * can share the scores file: each one reloads it and adds its hits under a
+ * lock (@c flock on the scores file followed by @c .lock), so that none of
+ * them overwrites the hits of the others.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+// flock() is neither C99 nor POSIX
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "config.h"
+#include "libevents.h"
+#include "libweather_popularity.h"
+
+/// Scores below this value are forgotten.
+#define WTR_POPULARITY_MIN_SCORE 0.01
+
+/// Where the scores are saved, NULL if the counters are disabled.
+static gchar *wtr_popularity_file = NULL;
+/// Hits since the counters were opened: "driver/code" => number of hits (as a pointer).
+static GHashTable *wtr_popularity_hits = NULL;
+/// Serializes the accesses from many threads.
+static GMutex wtr_popularity_lock;
+
+/**
+ * @brief A location and its score.
+ */
+typedef struct {
+	/// Location code.
+	gchar *code;
+	/// Decayed score.
+	gdouble score;
+} wtr_popularity_entry;
+
+/**
+ * @brief Returns a score decayed from the time it was updated to now.
+ */
+gdouble wtr_popularity_decay(gdouble score, gint64 updated, gint64 now) {
+	return updated >= now ? score : score * exp2(-(gdouble)(now - updated) / WTR_POPULARITY_HALF_LIFE);
+}
+
+/**
+ * @brief Returns the decayed score of a location saved in the scores file (0 if it's missing).
+ */
+gdouble wtr_popularity_score(GKeyFile *scores, const gchar *driver, const gchar *code, gint64 now) {
+	gsize length = 0;
+	gdouble *values = g_key_file_get_double_list(scores, driver, code, &length, NULL);
+	gdouble score = length == 2 ? wtr_popularity_decay(values[0], (gint64)values[1], now) : 0;
+	g_free(values);
+	return score;
+}
+
+/**
+ * @brief Loads the scores file (a missing file means no scores).
+ *
+ * @warning The returned key file must be freed with @c g_key_file_free.
+ */
+GKeyFile *wtr_popularity_load(void) {
+	GKeyFile *scores = g_key_file_new();
+	g_key_file_load_from_file(scores, wtr_popularity_file, G_KEY_FILE_NONE, NULL);
+	return scores;
+}
+
+/**
+ * @brief Takes the lock of the scores file, which serializes the processes that save it.
+ *
+ * @return The file descriptor of the lock file, to pass to wtr_popularity_unlock_scores(), or -1 if it can't be locked.
+ */
+int wtr_popularity_lock_scores(void) {
+	gchar *lock_file = g_strconcat(wtr_popularity_file, ".lock", NULL);
+	int fd = open(lock_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd >= 0 && flock(fd, LOCK_EX) != 0) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		events_log(EVENTS_WARNING, "wtr_popularity_lock_scores can't lock %s", lock_file);
+	}
+	g_free(lock_file);
+	return fd;
+}
+
+/**
+ * @brief Releases the lock taken by wtr_popularity_lock_scores().
+ */
+void wtr_popularity_unlock_scores(int fd) {
+	if (fd >= 0) {
+		flock(fd, LOCK_UN);
+		close(fd);
+	}
+}
+
+void wtr_popularity_open(const gchar *file) {
+	wtr_popularity_close();
+	g_mutex_lock(&wtr_popularity_lock);
+	wtr_popularity_file = g_strdup(file);
+	wtr_popularity_hits = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_mutex_unlock(&wtr_popularity_lock);
+}
+
+void wtr_popularity_close(void) {
+	g_mutex_lock(&wtr_popularity_lock);
+	if (wtr_popularity_file != NULL) {
+		// The scores are reloaded under the lock, with the hits saved meanwhile by the other processes
+		int lock_fd = g_hash_table_size(wtr_popularity_hits) > 0 ? wtr_popularity_lock_scores() : -1;
+		GKeyFile *scores = wtr_popularity_load();
+		gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+		GHashTableIter iter;
+		gpointer key, value;
+		g_hash_table_iter_init(&iter, wtr_popularity_hits);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			gchar **driver_code = g_strsplit((gchar *)key, "/", 2);
+			gdouble updated[] = {wtr_popularity_score(scores, driver_code[0], driver_code[1], now) + GPOINTER_TO_UINT(value),
+			                     (gdouble)now};
+			g_key_file_set_double_list(scores, driver_code[0], driver_code[1], updated, G_N_ELEMENTS(updated));
+			g_strfreev(driver_code);
+		}
+		// Forget the locations nobody asks for anymore
+		gchar **drivers = g_key_file_get_groups(scores, NULL);
+		for (guint d = 0; drivers[d] != NULL; ++d) {
+			gchar **codes = g_key_file_get_keys(scores, drivers[d], NULL, NULL);
+			for (guint c = 0; codes != NULL && codes[c] != NULL; ++c) {
+				if (wtr_popularity_score(scores, drivers[d], codes[c], now) < WTR_POPULARITY_MIN_SCORE) {
+					g_key_file_remove_key(scores, drivers[d], codes[c], NULL);
+				}
+			}
+			g_strfreev(codes);
+		}
+		g_strfreev(drivers);
+		if (g_hash_table_size(wtr_popularity_hits) > 0) {
+			gsize length;
+			gchar *data = g_key_file_to_data(scores, &length, NULL);
+			GError *error = NULL;
+			if (!g_file_set_contents(wtr_popularity_file, data, length, &error)) {
+				events_log(EVENTS_ERROR, "wtr_popularity_close can't save %s: %s", wtr_popularity_file, error->message);
+				g_error_free(error);
+			}
+			g_free(data);
+		}
+		wtr_popularity_unlock_scores(lock_fd);
+		g_key_file_free(scores);
+		g_hash_table_destroy(wtr_popularity_hits);
+		g_free(wtr_popularity_file);
+		wtr_popularity_hits = NULL;
+		wtr_popularity_file = NULL;
+	}
+	g_mutex_unlock(&wtr_popularity_lock);
+}
+
+void wtr_popularity_hit(const gchar *driver, const gchar *code) {
+	g_mutex_lock(&wtr_popularity_lock);
+	if (wtr_popularity_hits != NULL) {
+		gchar *key = g_strconcat(driver, "/", code, NULL);
+		guint hits = GPOINTER_TO_UINT(g_hash_table_lookup(wtr_popularity_hits, key));
+		g_hash_table_insert(wtr_popularity_hits, key, GUINT_TO_POINTER(hits + 1));
+	}
+	g_mutex_unlock(&wtr_popularity_lock);
+}
+
+/**
+ * @brief Sorts the locations by decreasing score (qsort comparison function).
+ */
+int wtr_popularity_compare(const void *a, const void *b) {
+	gdouble score_a = ((const wtr_popularity_entry *)a)->score;
+	gdouble score_b = ((const wtr_popularity_entry *)b)->score;
+	return score_a < score_b ? 1 : score_a > score_b ? -1 : 0;
+}
+
+/**
+ * @brief The saved scores and the hits not saved yet are added together.
+ */
+gchar **wtr_popularity_top(const gchar *driver, guint count) {
+	g_mutex_lock(&wtr_popularity_lock);
+	GPtrArray *top = g_ptr_array_new();
+	if (wtr_popularity_file != NULL) {
+		GKeyFile *scores = wtr_popularity_load();
+		gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+		gchar *prefix = g_strconcat(driver, "/", NULL);
+		GHashTableIter iter;
+		gpointer key, value;
+		g_hash_table_iter_init(&iter, wtr_popularity_hits);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			if (g_str_has_prefix((gchar *)key, prefix) && !g_key_file_has_key(scores, driver, (gchar *)key + strlen(prefix), NULL)) {
+				gdouble none[] = {0, (gdouble)now};
+				g_key_file_set_double_list(scores, driver, (gchar *)key + strlen(prefix), none, G_N_ELEMENTS(none));
+			}
+		}
+		gsize length = 0;
+		gchar **codes = g_key_file_get_keys(scores, driver, &length, NULL);
+		wtr_popularity_entry *entries = g_new(wtr_popularity_entry, MAX(length, 1));
+		for (gsize i = 0; i < length; ++i) {
+			gchar *hit_key = g_strconcat(prefix, codes[i], NULL);
+			entries[i].code = codes[i];
+			entries[i].score = wtr_popularity_score(scores, driver, codes[i], now) +
+			                   GPOINTER_TO_UINT(g_hash_table_lookup(wtr_popularity_hits, hit_key));
+			g_free(hit_key);
+		}
+		qsort(entries, length, sizeof(wtr_popularity_entry), wtr_popularity_compare);
+		for (gsize i = 0; i < length && i < count; ++i) {
+			g_ptr_array_add(top, g_strdup(entries[i].code));
+		}
+		g_free(entries);
+		g_strfreev(codes);
+		g_free(prefix);
+		g_key_file_free(scores);
+	}
+	g_mutex_unlock(&wtr_popularity_lock);
+	g_ptr_array_add(top, NULL);
+	return (gchar **)g_ptr_array_free(top, FALSE);
+}
@@ -0,0 +1,60 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_POPULARITY_H__
+#define __LIBWEATHER_POPULARITY_H__
+
+#include <glib.h>
+
+/**
+ * @file libweather_popularity.h
+ * @brief Decayed access counters of the locations, to keep the popular ones warm.
+ *
+ * Every time the forecasts of a location are requested its score grows by
+ * one; scores halve every @c WTR_POPULARITY_HALF_LIFE seconds, so locations
+ * nobody asks for anymore slowly fade away. The scores are kept in a key
+ * file next to the cache, one group per driver:
+ *
+ *     [tiempo]
+ *     8030=12.5;1520000000;
+ *
+ * where the values are the score and when it was last updated.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/**
+ * @brief Enable the access counters.
+ *
+ * @param[in] file The file with the scores; it's created if it doesn't exist yet.
+ * @warning The counters must be closed with wtr_popularity_close().
+ */
+void wtr_popularity_open(const gchar *file);
+
+/**
+ * @brief Disable the access counters, saving the scores.
+ *
+ * The hits are added to the scores saved in the meantime by other processes.
+ * It's safe to call this function even if wtr_popularity_open() was not called.
+ */
+void wtr_popularity_close(void);
+
+/**
+ * @brief Count an access to the forecasts of a location (nothing happens if the counters are not enabled).
+ *
+ * @param[in] driver Name of the driver.
+ * @param[in] code Location code.
+ */
+void wtr_popularity_hit(const gchar *driver, const gchar *code);
+
+/**
+ * @brief Get the most popular locations.
+ *
+ * @param[in] driver Name of the driver.
+ * @param[in] count Maximum number of locations.
+ * @return NULL-terminated array of location codes, the most popular first.
+ * @warning The returned array must be freed with @c g_strfreev.
+ */
+gchar **wtr_popularity_top(const gchar *driver, guint count);
+
+#endif  // __LIBWEATHER_POPULARITY_H__
@@ -0,0 +1,538 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_query.c
+ * @brief Queries over the hourly forecasts of many locations (implementation).
+ *
+ * Queries are parsed by a recursive descent parser, which emits the program
+ * in postfix order: comparisons push a boolean on the stack, @c and,
+ * @c or and @c not combine the booleans on top of it. Each hourly forecast
+ * is loaded once into an array of fields, so that the program accesses them
+ * by index.
+ *
+ * Grammar:
+ *
+ *     or         := and ("or" and)*
+ *     and        := not ("and" not)*
+ *     not        := "not" not | primary
+ *     primary    := "(" or ")" | field comparison number | field "in" "(" number ("," number)* ")"
+ *     comparison := "=" | "!=" | "<" | "<=" | ">" | ">="
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "libweather.h"
+#include "libweather_query.h"
+
+/// Maximum depth of the stack of a query program (i.e. of nested expressions).
+#define WTR_QUERY_MAX_DEPTH 64
+/// Number of forecasts evaluated by each task of wtr_query_filter().
+#define WTR_QUERY_CHUNK_SIZE 256
+
+/**
+ * @brief Fields of an hourly forecast, as loaded for the evaluation.
+ */
+typedef enum {
+	WTR_QUERY_WEATHER,
+	WTR_QUERY_TEMP,
+	WTR_QUERY_WIND_SPEED,
+	WTR_QUERY_RAIN,
+	WTR_QUERY_HUMIDITY,
+	WTR_QUERY_PRESSURE,
+	WTR_QUERY_HOUR,
+	WTR_QUERY_DAY,
+	WTR_QUERY_FIELDS
+} wtr_query_field;
+
+/**
+ * @brief Instructions of a query program.
+ */
+typedef enum {
+	WTR_QUERY_EQ,
+	WTR_QUERY_NE,
+	WTR_QUERY_LT,
+	WTR_QUERY_LE,
+	WTR_QUERY_GT,
+	WTR_QUERY_GE,
+	WTR_QUERY_IN,
+	WTR_QUERY_AND,
+	WTR_QUERY_OR,
+	WTR_QUERY_NOT
+} wtr_query_opcode;
+
+/**
+ * @brief An instruction of a query program.
+ */
+typedef struct {
+	/// The instruction (wtr_query_opcode).
+	guint8 opcode;
+	/// Field compared by comparisons (wtr_query_field).
+	guint8 field;
+	/// Number of constants of @c in.
+	guint16 set_length;
+	/// First constant of @c in, in the constants of the query.
+	guint32 set_start;
+	/// Constant compared by comparisons.
+	gdouble value;
+} wtr_query_instruction;
+
+/**
+ * @brief A compiled query.
+ */
+struct _wtr_query {
+	/// The program (wtr_query_instruction).
+	GArray *program;
+	/// Constants of the @c in instructions (gdouble).
+	GArray *constants;
+	/// Maximum depth of the stack during the evaluation.
+	guint max_depth;
+};
+
+/**
+ * @brief Names of the fields, in the same order as wtr_query_field (aliases follow).
+ */
+static const struct {
+	/// Name of the field.
+	const gchar *name;
+	/// The field.
+	wtr_query_field field;
+} wtr_query_fields[] = {{"weather", WTR_QUERY_WEATHER},   {"temp", WTR_QUERY_TEMP},         {"wind_speed", WTR_QUERY_WIND_SPEED},
+                        {"rain", WTR_QUERY_RAIN},         {"humidity", WTR_QUERY_HUMIDITY}, {"pressure", WTR_QUERY_PRESSURE},
+                        {"hour", WTR_QUERY_HOUR},         {"day", WTR_QUERY_DAY},           {"wind", WTR_QUERY_WIND_SPEED}};
+
+/**
+ * @brief Tokens of the query language.
+ */
+typedef enum {
+	WTR_QUERY_TOKEN_END,
+	WTR_QUERY_TOKEN_IDENTIFIER,
+	WTR_QUERY_TOKEN_NUMBER,
+	WTR_QUERY_TOKEN_OPERATOR,
+	WTR_QUERY_TOKEN_INVALID
+} wtr_query_token;
+
+/**
+ * @brief State of the query compiler.
+ */
+typedef struct {
+	/// The query being compiled.
+	const gchar *text;
+	/// Position of the next token.
+	const gchar *pos;
+	/// Position of the current token.
+	const gchar *token_start;
+	/// Type of the current token.
+	wtr_query_token token;
+	/// Text of the current token.
+	gchar *token_text;
+	/// Value of the current token, if it's a number.
+	gdouble token_value;
+	/// The query being built.
+	wtr_query *query;
+	/// Depth of the stack after the instructions emitted so far.
+	guint depth;
+	/// Where to report errors.
+	GError **error;
+	/// FALSE after the first error.
+	gboolean ok;
+} wtr_query_compiler;
+
+/**
+ * @brief Reads the next token.
+ */
+void wtr_query_next(wtr_query_compiler *compiler) {
+	const gchar *p = compiler->pos;
+	while (g_ascii_isspace(*p)) {
+		++p;
+	}
+	compiler->token_start = p;
+	g_free(compiler->token_text);
+	compiler->token_text = NULL;
+	if (*p == '\0') {
+		compiler->token = WTR_QUERY_TOKEN_END;
+	} else if (g_ascii_isalpha(*p) || *p == '_') {
+		const gchar *start = p;
+		while (g_ascii_isalnum(*p) || *p == '_') {
+			++p;
+		}
+		compiler->token = WTR_QUERY_TOKEN_IDENTIFIER;
+		compiler->token_text = g_ascii_strdown(start, p - start);
+	} else if (g_ascii_isdigit(*p) || ((*p == '-' || *p == '.') && (g_ascii_isdigit(p[1]) || p[1] == '.'))) {
+		gchar *end;
+		compiler->token_value = g_ascii_strtod(p, &end);
+		compiler->token = end != p ? WTR_QUERY_TOKEN_NUMBER : WTR_QUERY_TOKEN_INVALID;
+		p = end != p ? end : p + 1;
+	} else {
+		static const gchar *operators[] = {"<=", ">=", "!=", "==", "&&", "||", "=", "<", ">", "!", "(", ")", ",", NULL};
+		compiler->token = WTR_QUERY_TOKEN_INVALID;
+		for (guint i = 0; operators[i] != NULL; ++i) {
+			if (g_str_has_prefix(p, operators[i])) {
+				compiler->token = WTR_QUERY_TOKEN_OPERATOR;
+				compiler->token_text = g_strdup(operators[i]);
+				p += strlen(operators[i]);
+				break;
+			}
+		}
+		if (compiler->token == WTR_QUERY_TOKEN_INVALID) {
+			++p;
+		}
+	}
+	compiler->pos = p;
+}
+
+/**
+ * @brief Reports a syntax error at the current token (only the first error is reported).
+ */
+void wtr_query_fail(wtr_query_compiler *compiler, const gchar *expected) {
+	if (compiler->ok) {
+		g_set_error(compiler->error, WTR_QUERY_ERROR, 0, "expected %s at position %u of the query", expected,
+		            (guint)(compiler->token_start - compiler->text) + 1);
+		compiler->ok = FALSE;
+	}
+}
+
+/**
+ * @brief Tells whether the current token is the given keyword or operator.
+ */
+gboolean wtr_query_is(wtr_query_compiler *compiler, const gchar *text) {
+	return (compiler->token == WTR_QUERY_TOKEN_IDENTIFIER || compiler->token == WTR_QUERY_TOKEN_OPERATOR) &&
+	       g_strcmp0(compiler->token_text, text) == 0;
+}
+
+/**
+ * @brief Consumes the current token if it's the given keyword or operator.
+ *
+ * @return TRUE if the token was consumed.
+ */
+gboolean wtr_query_accept(wtr_query_compiler *compiler, const gchar *text) {
+	if (compiler->ok && wtr_query_is(compiler, text)) {
+		wtr_query_next(compiler);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * @brief Consumes a number.
+ *
+ * @param[out] value The number.
+ * @return TRUE if the current token was a number.
+ */
+gboolean wtr_query_number(wtr_query_compiler *compiler, gdouble *value) {
+	if (!compiler->ok || compiler->token != WTR_QUERY_TOKEN_NUMBER) {
+		wtr_query_fail(compiler, "a number");
+		return FALSE;
+	}
+	*value = compiler->token_value;
+	wtr_query_next(compiler);
+	return TRUE;
+}
+
+/**
+ * @brief Appends an instruction to the program, keeping track of the stack depth.
+ */
+void wtr_query_emit(wtr_query_compiler *compiler, wtr_query_instruction *instruction) {
+	if (instruction->opcode == WTR_QUERY_AND || instruction->opcode == WTR_QUERY_OR) {
+		--compiler->depth;
+	} else if (instruction->opcode != WTR_QUERY_NOT) {
+		++compiler->depth;
+	}
+	if (compiler->depth > WTR_QUERY_MAX_DEPTH) {
+		wtr_query_fail(compiler, "a simpler query");
+	}
+	compiler->query->max_depth = MAX(compiler->query->max_depth, compiler->depth);
+	g_array_append_vals(compiler->query->program, instruction, 1);
+}
+
+void wtr_query_or(wtr_query_compiler *compiler);
+
+/**
+ * @brief Compiles a comparison, an @c in or a parenthesized expression.
+ */
+void wtr_query_primary(wtr_query_compiler *compiler) {
+	if (wtr_query_accept(compiler, "(")) {
+		wtr_query_or(compiler);
+		if (!wtr_query_accept(compiler, ")")) {
+			wtr_query_fail(compiler, "')'");
+		}
+		return;
+	}
+	wtr_query_instruction instruction = {0, 0, 0, 0, 0};
+	gboolean found = FALSE;
+	for (guint i = 0; i < G_N_ELEMENTS(wtr_query_fields) && compiler->token == WTR_QUERY_TOKEN_IDENTIFIER; ++i) {
+		if (g_strcmp0(compiler->token_text, wtr_query_fields[i].name) == 0) {
+			instruction.field = wtr_query_fields[i].field;
+			found = TRUE;
+			break;
+		}
+	}
+	if (!found) {
+		wtr_query_fail(compiler, "a field (weather, temp, wind_speed, rain, humidity, pressure, hour or day)");
+		return;
+	}
+	wtr_query_next(compiler);
+	static const struct {
+		const gchar *text;
+		wtr_query_opcode opcode;
+	} comparisons[] = {{"=", WTR_QUERY_EQ}, {"==", WTR_QUERY_EQ}, {"!=", WTR_QUERY_NE}, {"<", WTR_QUERY_LT},
+	                   {"<=", WTR_QUERY_LE}, {">", WTR_QUERY_GT},  {">=", WTR_QUERY_GE}};
+	for (guint i = 0; i < G_N_ELEMENTS(comparisons); ++i) {
+		if (wtr_query_accept(compiler, comparisons[i].text)) {
+			instruction.opcode = comparisons[i].opcode;
+			if (wtr_query_number(compiler, &instruction.value)) {
+				wtr_query_emit(compiler, &instruction);
+			}
+			return;
+		}
+	}
+	if (!wtr_query_accept(compiler, "in")) {
+		wtr_query_fail(compiler, "a comparison or 'in'");
+		return;
+	}
+	if (!wtr_query_accept(compiler, "(")) {
+		wtr_query_fail(compiler, "'('");
+		return;
+	}
+	instruction.opcode = WTR_QUERY_IN;
+	instruction.set_start = compiler->query->constants->len;
+	do {
+		gdouble value;
+		if (!wtr_query_number(compiler, &value)) {
+			return;
+		}
+		g_array_append_val(compiler->query->constants, value);
+	} while (wtr_query_accept(compiler, ","));
+	instruction.set_length = compiler->query->constants->len - instruction.set_start;
+	if (!wtr_query_accept(compiler, ")")) {
+		wtr_query_fail(compiler, "',' or ')'");
+		return;
+	}
+	wtr_query_emit(compiler, &instruction);
+}
+
+/**
+ * @brief Compiles a negation.
+ */
+void wtr_query_not(wtr_query_compiler *compiler) {
+	if (wtr_query_accept(compiler, "not") || wtr_query_accept(compiler, "!")) {
+		wtr_query_not(compiler);
+		wtr_query_instruction instruction = {WTR_QUERY_NOT, 0, 0, 0, 0};
+		wtr_query_emit(compiler, &instruction);
+	} else {
+		wtr_query_primary(compiler);
+	}
+}
+
+/**
+ * @brief Compiles a conjunction.
+ */
+void wtr_query_and(wtr_query_compiler *compiler) {
+	wtr_query_not(compiler);
+	while (wtr_query_accept(compiler, "and") || wtr_query_accept(compiler, "&&")) {
+		wtr_query_not(compiler);
+		wtr_query_instruction instruction = {WTR_QUERY_AND, 0, 0, 0, 0};
+		wtr_query_emit(compiler, &instruction);
+	}
+}
+
+/**
+ * @brief Compiles a disjunction.
+ */
+void wtr_query_or(wtr_query_compiler *compiler) {
+	wtr_query_and(compiler);
+	while (wtr_query_accept(compiler, "or") || wtr_query_accept(compiler, "||")) {
+		wtr_query_and(compiler);
+		wtr_query_instruction instruction = {WTR_QUERY_OR, 0, 0, 0, 0};
+		wtr_query_emit(compiler, &instruction);
+	}
+}
+
+wtr_query *wtr_query_compile(const gchar *text, GError **error) {
+	wtr_query *query = (wtr_query *)g_malloc(sizeof(wtr_query));
+	query->program = g_array_new(FALSE, FALSE, sizeof(wtr_query_instruction));
+	query->constants = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	query->max_depth = 0;
+	wtr_query_compiler compiler = {text, text, text, WTR_QUERY_TOKEN_END, NULL, 0, query, 0, error, TRUE};
+	wtr_query_next(&compiler);
+	wtr_query_or(&compiler);
+	if (compiler.ok && compiler.token != WTR_QUERY_TOKEN_END) {
+		wtr_query_fail(&compiler, "'and', 'or' or the end of the query");
+	}
+	g_free(compiler.token_text);
+	if (!compiler.ok) {
+		wtr_query_free(query);
+		return NULL;
+	}
+	return query;
+}
+
+/**
+ * @brief Runs the program of a query on the fields of an hourly forecast.
+ */
+gboolean wtr_query_eval(const wtr_query *query, const gdouble *fields) {
+	gboolean stack[WTR_QUERY_MAX_DEPTH];
+	guint top = 0;
+	const wtr_query_instruction *program = (const wtr_query_instruction *)query->program->data;
+	const gdouble *constants = (const gdouble *)query->constants->data;
+	for (guint pc = 0; pc < query->program->len; ++pc) {
+		const wtr_query_instruction *instruction = &program[pc];
+		gdouble field = fields[instruction->field];
+		switch (instruction->opcode) {
+		case WTR_QUERY_EQ:
+			stack[top++] = field == instruction->value;
+			break;
+		case WTR_QUERY_NE:
+			stack[top++] = field != instruction->value;
+			break;
+		case WTR_QUERY_LT:
+			stack[top++] = field < instruction->value;
+			break;
+		case WTR_QUERY_LE:
+			stack[top++] = field <= instruction->value;
+			break;
+		case WTR_QUERY_GT:
+			stack[top++] = field > instruction->value;
+			break;
+		case WTR_QUERY_GE:
+			stack[top++] = field >= instruction->value;
+			break;
+		case WTR_QUERY_IN: {
+			gboolean in = FALSE;
+			for (guint i = 0; i < instruction->set_length && !in; ++i) {
+				in = field == constants[instruction->set_start + i];
+			}
+			stack[top++] = in;
+			break;
+		}
+		case WTR_QUERY_AND:
+			--top;
+			stack[top - 1] = stack[top - 1] && stack[top];
+			break;
+		case WTR_QUERY_OR:
+			--top;
+			stack[top - 1] = stack[top - 1] || stack[top];
+			break;
+		case WTR_QUERY_NOT:
+			stack[top - 1] = !stack[top - 1];
+			break;
+		}
+	}
+	return top > 0 && stack[top - 1];
+}
+
+/**
+ * @brief Evaluates every hourly forecast.
+ */
+gint64 wtr_query_match(wtr_query *query, wtr_forecast *forecast) {
+	return wtr_query_match_range(query, forecast, G_MININT64, G_MAXINT64);
+}
+
+/**
+ * @brief Loads the fields of each hourly forecast in the range and runs the program on them.
+ */
+gint64 wtr_query_match_range(wtr_query *query, wtr_forecast *forecast, gint64 from, gint64 to) {
+	gdouble fields[WTR_QUERY_FIELDS];
+	guint day_index = 0;
+	for (GList *day_ptr = forecast->days; day_ptr != NULL; day_ptr = day_ptr->next, ++day_index) {
+		wtr_forecast_day *day = (wtr_forecast_day *)day_ptr->data;
+		fields[WTR_QUERY_DAY] = day_index;
+		for (GList *hour_ptr = day->hours; hour_ptr != NULL; hour_ptr = hour_ptr->next) {
+			wtr_forecast_hour *hour = (wtr_forecast_hour *)hour_ptr->data;
+			gint64 tstamp = g_date_time_to_unix(hour->tstamp);
+			if (tstamp < from || tstamp >= to) {
+				continue;
+			}
+			fields[WTR_QUERY_WEATHER] = hour->weather;
+			fields[WTR_QUERY_TEMP] = hour->temp;
+			fields[WTR_QUERY_WIND_SPEED] = hour->wind_speed;
+			fields[WTR_QUERY_RAIN] = hour->rain;
+			fields[WTR_QUERY_HUMIDITY] = hour->humidity;
+			fields[WTR_QUERY_PRESSURE] = hour->pressure;
+			fields[WTR_QUERY_HOUR] = g_date_time_get_hour(hour->tstamp);
+			if (wtr_query_eval(query, fields)) {
+				return tstamp;
+			}
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Collects the fields compared by the instructions of the program.
+ */
+guint wtr_query_uses(wtr_query *query) {
+	static const guint uses[] = {WTR_QUERY_USES_WEATHER,  WTR_QUERY_USES_TEMP,     WTR_QUERY_USES_WIND_SPEED,
+	                             WTR_QUERY_USES_RAIN,     WTR_QUERY_USES_HUMIDITY, WTR_QUERY_USES_PRESSURE,
+	                             WTR_QUERY_USES_TIME,     WTR_QUERY_USES_TIME};
+	guint fields = 0;
+	for (guint pc = 0; pc < query->program->len; ++pc) {
+		wtr_query_instruction *instruction = &g_array_index(query->program, wtr_query_instruction, pc);
+		if (instruction->opcode <= WTR_QUERY_IN) {
+			fields |= uses[instruction->field];
+		}
+	}
+	return fields;
+}
+
+/**
+ * @brief A chunk of forecasts evaluated by a thread of wtr_query_filter().
+ */
+typedef struct {
+	/// The compiled query.
+	wtr_query *query;
+	/// First forecast of the chunk.
+	wtr_forecast **forecasts;
+	/// Number of forecasts of the chunk.
+	guint count;
+	/// Results for the chunk.
+	gint64 *matches;
+} wtr_query_chunk;
+
+/**
+ * @brief Evaluates a chunk of forecasts (GFunc).
+ */
+void wtr_query_filter_chunk(gpointer data, gpointer user_data) {
+	wtr_query_chunk *chunk = (wtr_query_chunk *)data;
+	for (guint i = 0; i < chunk->count; ++i) {
+		chunk->matches[i] = chunk->forecasts[i] != NULL ? wtr_query_match(chunk->query, chunk->forecasts[i]) : -1;
+	}
+}
+
+/**
+ * @brief Splits the forecasts in chunks evaluated by a pool of threads; the query is only read, so it can be shared.
+ */
+guint wtr_query_filter(wtr_query *query, wtr_forecast **forecasts, guint count, gint64 *matches) {
+	guint chunks_count = (count + WTR_QUERY_CHUNK_SIZE - 1) / WTR_QUERY_CHUNK_SIZE;
+	wtr_query_chunk *chunks = (wtr_query_chunk *)g_malloc(sizeof(wtr_query_chunk) * MAX(chunks_count, 1));
+	GThreadPool *pool = chunks_count > 1 ? g_thread_pool_new(wtr_query_filter_chunk, NULL, g_get_num_processors(), FALSE, NULL) : NULL;
+	for (guint c = 0; c < chunks_count; ++c) {
+		guint first = c * WTR_QUERY_CHUNK_SIZE;
+		chunks[c].query = query;
+		chunks[c].forecasts = forecasts + first;
+		chunks[c].count = MIN(WTR_QUERY_CHUNK_SIZE, count - first);
+		chunks[c].matches = matches + first;
+		if (pool == NULL || !g_thread_pool_push(pool, &chunks[c], NULL)) {
+			wtr_query_filter_chunk(&chunks[c], NULL);
+		}
+	}
+	if (pool != NULL) {
+		g_thread_pool_free(pool, FALSE, TRUE);
+	}
+	g_free(chunks);
+	guint matching = 0;
+	for (guint i = 0; i < count; ++i) {
+		matching += matches[i] >= 0 ? 1 : 0;
+	}
+	return matching;
+}
+
+void wtr_query_free(wtr_query *query) {
+	g_array_free(query->program, TRUE);
+	g_array_free(query->constants, TRUE);
+	g_free(query);
+}
@@ -0,0 +1,109 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_QUERY_H__
+#define __LIBWEATHER_QUERY_H__
+
+#include <glib.h>
+
+#include "libweather.h"
+
+/**
+ * @file libweather_query.h
+ * @brief Queries over the hourly forecasts of many locations.
+ *
+ * A query is a predicate over the fields of an hourly forecast, for example:
+ *
+ *     rain > 5 and wind_speed > 40
+ *     day = 1 and hour >= 12 and hour < 18 and weather in (11, 12, 13, 14, 15, 16)
+ *
+ * The fields are @c weather, @c temp, @c wind_speed (or @c wind), @c rain,
+ * @c humidity, @c pressure, @c hour (0-23) and @c day (0 is today, 1 is
+ * tomorrow and so on). Comparisons (=, !=, <, <=, >, >=) and @c in can be
+ * combined with @c and, @c or, @c not and parentheses. A forecast matches if
+ * any of its hourly forecasts matches.
+ *
+ * Queries are compiled once into a compact program for a stack machine,
+ * then they can be evaluated against any number of forecasts.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/// Error domain of the query compiler.
+#define WTR_QUERY_ERROR g_quark_from_static_string("wtr-query-error")
+
+/// The query reads the @c weather field (see wtr_query_uses()).
+#define WTR_QUERY_USES_WEATHER (1 << 0)
+/// The query reads the @c temp field.
+#define WTR_QUERY_USES_TEMP (1 << 1)
+/// The query reads the @c wind_speed field.
+#define WTR_QUERY_USES_WIND_SPEED (1 << 2)
+/// The query reads the @c rain field.
+#define WTR_QUERY_USES_RAIN (1 << 3)
+/// The query reads the @c humidity field.
+#define WTR_QUERY_USES_HUMIDITY (1 << 4)
+/// The query reads the @c pressure field.
+#define WTR_QUERY_USES_PRESSURE (1 << 5)
+/// The query reads the @c hour or the @c day field.
+#define WTR_QUERY_USES_TIME (1 << 6)
+
+/**
+ * @brief A compiled query.
+ */
+typedef struct _wtr_query wtr_query;
+
+/**
+ * @brief Compiles a query.
+ *
+ * @param[in] text The query.
+ * @param[out] error Description of the syntax error, if any (it can be NULL).
+ * @return The compiled query, or NULL if the query is not valid.
+ * @warning The query must be freed with wtr_query_free().
+ */
+wtr_query *wtr_query_compile(const gchar *text, GError **error);
+
+/**
+ * @brief Evaluates a query against a forecast.
+ *
+ * @param[in] query The compiled query.
+ * @param[in] forecast The forecast.
+ * @return The time of the first matching hourly forecast, in seconds since the Unix epoch, or -1 if none matches.
+ */
+gint64 wtr_query_match(wtr_query *query, wtr_forecast *forecast);
+
+/**
+ * @brief Evaluates a query against the hourly forecasts of a time range.
+ *
+ * @param[in] query The compiled query.
+ * @param[in] forecast The forecast.
+ * @param[in] from Only hourly forecasts starting at or after this time are evaluated (seconds since the Unix epoch).
+ * @param[in] to Only hourly forecasts starting before this time are evaluated (seconds since the Unix epoch).
+ * @return The time of the first matching hourly forecast, in seconds since the Unix epoch, or -1 if none matches.
+ */
+gint64 wtr_query_match_range(wtr_query *query, wtr_forecast *forecast, gint64 from, gint64 to);
+
+/**
+ * @brief Returns the fields read by a query.
+ *
+ * @param[in] query The compiled query.
+ * @return A bitmask of @c WTR_QUERY_USES_* flags.
+ */
+guint wtr_query_uses(wtr_query *query);
+
+/**
+ * @brief Evaluates a query against many forecasts in parallel.
+ *
+ * @param[in] query The compiled query.
+ * @param[in] forecasts The forecasts (NULL items never match).
+ * @param[in] count Number of forecasts.
+ * @param[out] matches For each forecast, the result of wtr_query_match().
+ * @return Number of matching forecasts.
+ */
+guint wtr_query_filter(wtr_query *query, wtr_forecast **forecasts, guint count, gint64 *matches);
+
+/**
+ * @brief Frees a query compiled by wtr_query_compile().
+ */
+void wtr_query_free(wtr_query *query);
+
+#endif  // __LIBWEATHER_QUERY_H__
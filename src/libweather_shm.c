@@ -0,0 +1,413 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_shm.c
+ * @brief Shared memory cache of parsed forecasts for libweather "drivers" (implementation).
+ *
+ * This cache keeps the parsed forecasts in a POSIX shared memory segment,
+ * so that many processes on the same host can read warm forecasts without
+ * reading nor parsing the cached documents. The filesystem cache (see
+ * libweather_cache.h) stays the backing store.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+// shm_open() and mmap() are POSIX, not C99
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "libmem.h"
+#include "libutils.h"
+#include "libweather_shm.h"
+
+/// Magic number at the beginning of the shared memory segment ("WTRS").
+#define WTR_SHM_MAGIC 0x53525457
+/// Version of the binary layout of the shared memory segment.
+#define WTR_SHM_VERSION 2
+/// Maximum number of slots probed to find a location.
+#define WTR_SHM_PROBES 8
+/// Maximum number of attempts to read a slot that is being updated.
+#define WTR_SHM_READ_ATTEMPTS 4
+/// Size of the (NULL-terminated) driver and location code fields.
+#define WTR_SHM_KEY_LENGTH 16
+/// Size of the (NULL-terminated) wind direction field.
+#define WTR_SHM_WIND_DIR_LENGTH 4
+
+/**
+ * @brief Hourly forecast in the shared memory layout (see wtr_forecast_hour).
+ */
+typedef struct {
+	/// Forecast beginning date and time, in seconds since the Unix epoch.
+	gint64 tstamp;
+	/// Rain level, in mm.
+	gdouble rain;
+	/// Weather code.
+	gint32 weather;
+	/// Temperature, in Celsius degrees.
+	gint32 temp;
+	/// Wind speed, in km/h.
+	gint32 wind_speed;
+	/// Humidity percentage.
+	gint32 humidity;
+	/// Pressure, in mb.
+	gint32 pressure;
+	/// Wind direction (empty if unknown).
+	gchar wind_dir[WTR_SHM_WIND_DIR_LENGTH];
+} wtr_shm_hour;
+
+/**
+ * @brief Daily forecast in the shared memory layout (see wtr_forecast_day).
+ */
+typedef struct {
+	/// Forecast date, in seconds since the Unix epoch.
+	gint64 date;
+	/// Rain level, in mm.
+	gdouble rain;
+	/// Weather code.
+	gint32 weather;
+	/// Minimum temperature, in Celsius degrees.
+	gint32 temp_min;
+	/// Maximum temperature, in Celsius degrees.
+	gint32 temp_max;
+	/// Wind speed, in km/h.
+	gint32 wind_speed;
+	/// Humidity percentage.
+	gint32 humidity;
+	/// Pressure, in mb.
+	gint32 pressure;
+	/// Number of valid entries in @c hours.
+	guint32 hours_count;
+	/// Hourly forecasts.
+	wtr_shm_hour hours[WTR_SHM_MAX_HOURS];
+} wtr_shm_day;
+
+/**
+ * @brief The forecasts of a location in the shared memory layout.
+ *
+ * The content of the slot is valid only if @c seq is even and doesn't change
+ * while it's being read.
+ */
+typedef struct {
+	/// Sequence lock: odd while the slot is being written, incremented by 2 at each update.
+	guint32 seq;
+	/// Cache bucket of the forecasts, as YYYYMMDD.
+	guint32 bucket;
+	/// Hash of the document the forecasts were parsed from.
+	guint64 hash;
+	/// Name of the libweather "driver".
+	gchar driver[WTR_SHM_KEY_LENGTH];
+	/// Location code.
+	gchar code[WTR_SHM_KEY_LENGTH];
+	/// Number of valid entries in @c days.
+	guint32 days_count;
+	/// Non-zero if the hourly forecasts were dropped to save memory (see wtr_forecast).
+	guint32 hours_dropped;
+	/// Daily forecasts.
+	wtr_shm_day days[WTR_SHM_MAX_DAYS];
+} wtr_shm_slot;
+
+/**
+ * @brief Layout of the shared memory segment.
+ */
+typedef struct {
+	/// Set to @c WTR_SHM_MAGIC once the segment is initialized.
+	guint32 magic;
+	/// Version of the layout (@c WTR_SHM_VERSION).
+	guint32 version;
+	/// Number of slots.
+	guint32 slots_count;
+	/// Size of a slot, to detect layout mismatches.
+	guint32 slot_size;
+	/// The slots.
+	wtr_shm_slot slots[WTR_SHM_SLOTS];
+} wtr_shm_segment;
+
+/// The attached shared memory segment, NULL if it's not attached.
+static wtr_shm_segment *wtr_shm = NULL;
+
+/**
+ * @brief Returns the name of the shared memory segment of the current user.
+ *
+ * @return The segment name (e.g. @c /libweather-1000).
+ * @warning The returned string must be freed with @c g_free.
+ */
+gchar *wtr_shm_name() {
+	return g_strdup_printf("/libweather-%lu", (unsigned long)getuid());
+}
+
+/**
+ * @brief Maps the shared memory segment, creating and sizing it if needed.
+ *
+ * Processes can race to create the segment: sizing it is idempotent and the
+ * pages of a new segment are zeroed, which means empty slots, so the header is
+ * the only thing to initialize.
+ */
+gboolean wtr_shm_attach(void) {
+	if (wtr_shm != NULL) {
+		return TRUE;
+	}
+	gchar *name = wtr_shm_name();
+	int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+	g_free(name);
+	if (fd < 0) {
+		return FALSE;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (st.st_size < (off_t)sizeof(wtr_shm_segment) && ftruncate(fd, sizeof(wtr_shm_segment)) != 0)) {
+		close(fd);
+		return FALSE;
+	}
+	void *address = mmap(NULL, sizeof(wtr_shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (address == MAP_FAILED) {
+		return FALSE;
+	}
+	wtr_shm_segment *segment = (wtr_shm_segment *)address;
+	guint32 magic = 0;
+	if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) == 0) {
+		segment->version = WTR_SHM_VERSION;
+		segment->slots_count = WTR_SHM_SLOTS;
+		segment->slot_size = sizeof(wtr_shm_slot);
+		__atomic_compare_exchange_n(&segment->magic, &magic, WTR_SHM_MAGIC, FALSE, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE);
+	}
+	if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != WTR_SHM_MAGIC || segment->version != WTR_SHM_VERSION ||
+	    segment->slots_count != WTR_SHM_SLOTS || segment->slot_size != sizeof(wtr_shm_slot)) {
+		// Created by an incompatible version of libweather
+		munmap(address, sizeof(wtr_shm_segment));
+		return FALSE;
+	}
+	wtr_shm = segment;
+	return TRUE;
+}
+
+void wtr_shm_detach(void) {
+	if (wtr_shm != NULL) {
+		munmap(wtr_shm, sizeof(wtr_shm_segment));
+		wtr_shm = NULL;
+	}
+}
+
+/**
+ * @brief Returns today's cache bucket as YYYYMMDD.
+ */
+guint32 wtr_shm_bucket() {
+	GDateTime *today = g_date_time_new_now_local();
+	guint32 bucket = g_date_time_get_year(today) * 10000 + g_date_time_get_month(today) * 100 + g_date_time_get_day_of_month(today);
+	g_date_time_unref(today);
+	return bucket;
+}
+
+/**
+ * @brief Returns the first slot to probe for a location.
+ */
+guint wtr_shm_first_slot(const gchar *driver, const gchar *location_code) {
+	xxh64_state state;
+	xxh64_init(&state, 0);
+	xxh64_update(&state, driver, strlen(driver) + 1);
+	xxh64_update(&state, location_code, strlen(location_code));
+	return xxh64_digest(&state) % WTR_SHM_SLOTS;
+}
+
+/**
+ * @brief Checks if a slot belongs to a location (the result is valid only if the slot sequence doesn't change meanwhile).
+ */
+gboolean wtr_shm_slot_matches(const wtr_shm_slot *slot, const gchar *driver, const gchar *location_code) {
+	return strncmp(slot->driver, driver, WTR_SHM_KEY_LENGTH) == 0 && strncmp(slot->code, location_code, WTR_SHM_KEY_LENGTH) == 0;
+}
+
+/**
+ * @brief Converts a slot read from the shared memory to a wtr_forecast.
+ *
+ * @param[in] slot A consistent private copy of the slot.
+ * @param[in] days Number of days to convert, 0 to convert all of them.
+ * @return The forecasts.
+ */
+wtr_forecast *wtr_shm_unpack(const wtr_shm_slot *slot, guint days) {
+	wtr_forecast *forecast = wtr_forecast_init();
+	forecast->hours_dropped = slot->hours_dropped != 0;
+	guint days_count = days == 0 ? slot->days_count : MIN(days, slot->days_count);
+	for (guint d = 0; d < days_count; ++d) {
+		const wtr_shm_day *packed_day = &slot->days[d];
+		wtr_forecast_day *day = (wtr_forecast_day *)g_malloc(sizeof(wtr_forecast_day));
+		day->date = g_date_time_new_from_unix_local(packed_day->date);
+		day->weather = packed_day->weather;
+		day->temp_min = packed_day->temp_min;
+		day->temp_max = packed_day->temp_max;
+		day->wind_speed = packed_day->wind_speed;
+		day->rain = packed_day->rain;
+		day->humidity = packed_day->humidity;
+		day->pressure = packed_day->pressure;
+		day->hours = NULL;
+		for (guint h = 0; h < packed_day->hours_count; ++h) {
+			const wtr_shm_hour *packed_hour = &packed_day->hours[h];
+			wtr_forecast_hour *hour = (wtr_forecast_hour *)g_malloc(sizeof(wtr_forecast_hour));
+			hour->tstamp = g_date_time_new_from_unix_local(packed_hour->tstamp);
+			hour->weather = packed_hour->weather;
+			hour->temp = packed_hour->temp;
+			hour->wind_speed = packed_hour->wind_speed;
+			hour->wind_dir = packed_hour->wind_dir[0] != '\0' ? g_strdup(packed_hour->wind_dir) : NULL;
+			hour->rain = packed_hour->rain;
+			hour->humidity = packed_hour->humidity;
+			hour->pressure = packed_hour->pressure;
+			day->hours = g_list_prepend(day->hours, hour);
+		}
+		day->hours = g_list_reverse(day->hours);
+		forecast->days = g_list_prepend(forecast->days, day);
+	}
+	forecast->days = g_list_reverse(forecast->days);
+	if (days_count == slot->days_count) {
+		forecast->hash = slot->hash;
+	}
+	return forecast;
+}
+
+/**
+ * @brief Converts a wtr_forecast to the shared memory layout.
+ *
+ * @param[in] forecast The forecasts to convert.
+ * @param[out] slot The slot to fill (except its sequence and key).
+ * @return FALSE if the forecasts don't fit in a slot.
+ */
+gboolean wtr_shm_pack(wtr_forecast *forecast, wtr_shm_slot *slot) {
+	slot->days_count = 0;
+	for (GList *day_ptr = forecast->days; day_ptr != NULL; day_ptr = day_ptr->next) {
+		wtr_forecast_day *day = (wtr_forecast_day *)day_ptr->data;
+		if (slot->days_count == WTR_SHM_MAX_DAYS) {
+			return FALSE;
+		}
+		wtr_shm_day *packed_day = &slot->days[slot->days_count++];
+		packed_day->date = g_date_time_to_unix(day->date);
+		packed_day->weather = day->weather;
+		packed_day->temp_min = day->temp_min;
+		packed_day->temp_max = day->temp_max;
+		packed_day->wind_speed = day->wind_speed;
+		packed_day->rain = day->rain;
+		packed_day->humidity = day->humidity;
+		packed_day->pressure = day->pressure;
+		packed_day->hours_count = 0;
+		for (GList *hour_ptr = day->hours; hour_ptr != NULL; hour_ptr = hour_ptr->next) {
+			wtr_forecast_hour *hour = (wtr_forecast_hour *)hour_ptr->data;
+			if (packed_day->hours_count == WTR_SHM_MAX_HOURS ||
+			    (hour->wind_dir != NULL && strlen(hour->wind_dir) >= WTR_SHM_WIND_DIR_LENGTH)) {
+				return FALSE;
+			}
+			wtr_shm_hour *packed_hour = &packed_day->hours[packed_day->hours_count++];
+			packed_hour->tstamp = g_date_time_to_unix(hour->tstamp);
+			packed_hour->weather = hour->weather;
+			packed_hour->temp = hour->temp;
+			packed_hour->wind_speed = hour->wind_speed;
+			g_snprintf(packed_hour->wind_dir, WTR_SHM_WIND_DIR_LENGTH, "%s", hour->wind_dir != NULL ? hour->wind_dir : "");
+			packed_hour->rain = hour->rain;
+			packed_hour->humidity = hour->humidity;
+			packed_hour->pressure = hour->pressure;
+		}
+	}
+	slot->hash = forecast->hash;
+	slot->hours_dropped = forecast->hours_dropped;
+	return TRUE;
+}
+
+/**
+ * @brief Reads the slots where the location can be, without locks nor system calls.
+ *
+ * Each slot is read optimistically: the sequence is read before and after
+ * copying it and the copy is retried if a writer was active meanwhile.
+ */
+wtr_forecast *wtr_shm_get(const gchar *driver, const gchar *location_code, guint64 hash, guint days) {
+	if (wtr_shm == NULL) {
+		return NULL;
+	}
+	// Without memory pressure the hourly forecasts are worth parsing the document again
+	gboolean partial = mem_pressure();
+	guint32 bucket = wtr_shm_bucket();
+	guint first = wtr_shm_first_slot(driver, location_code);
+	for (guint probe = 0; probe < WTR_SHM_PROBES; ++probe) {
+		wtr_shm_slot *slot = &wtr_shm->slots[(first + probe) % WTR_SHM_SLOTS];
+		for (guint attempt = 0; attempt < WTR_SHM_READ_ATTEMPTS; ++attempt) {
+			guint32 seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			if (seq & 1) {
+				continue;
+			}
+			gboolean matches = wtr_shm_slot_matches(slot, driver, location_code) && slot->bucket == bucket && slot->hash == hash &&
+			                   (partial || !slot->hours_dropped);
+			wtr_shm_slot *copy = NULL;
+			if (matches) {
+				copy = (wtr_shm_slot *)g_malloc(sizeof(wtr_shm_slot));
+				memcpy(copy, slot, sizeof(wtr_shm_slot));
+			}
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+				g_free(copy);
+				continue;
+			}
+			if (copy == NULL) {
+				break;
+			}
+			wtr_forecast *forecast = wtr_shm_unpack(copy, days);
+			g_free(copy);
+			return forecast;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Writes the forecasts in the slot of the location, or in a free or stale one.
+ *
+ * The slot is acquired by atomically making its sequence odd: if another
+ * writer holds it, the update is just skipped.
+ */
+void wtr_shm_set(const gchar *driver, const gchar *location_code, wtr_forecast *forecast) {
+	if (wtr_shm == NULL || forecast->hash == 0 || strlen(driver) >= WTR_SHM_KEY_LENGTH ||
+	    strlen(location_code) >= WTR_SHM_KEY_LENGTH) {
+		return;
+	}
+	wtr_shm_slot *packed = (wtr_shm_slot *)g_malloc0(sizeof(wtr_shm_slot));
+	if (!wtr_shm_pack(forecast, packed)) {
+		g_free(packed);
+		return;
+	}
+	guint32 bucket = wtr_shm_bucket();
+	guint first = wtr_shm_first_slot(driver, location_code);
+	// Prefer the slot of the location, then the oldest of the probed ones (empty slots have bucket 0)
+	wtr_shm_slot *target = NULL;
+	for (guint probe = 0; probe < WTR_SHM_PROBES; ++probe) {
+		wtr_shm_slot *slot = &wtr_shm->slots[(first + probe) % WTR_SHM_SLOTS];
+		if (wtr_shm_slot_matches(slot, driver, location_code)) {
+			target = slot;
+			break;
+		}
+		if (target == NULL || slot->bucket < target->bucket) {
+			target = slot;
+		}
+	}
+	guint32 seq = __atomic_load_n(&target->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) == 0 && __atomic_compare_exchange_n(&target->seq, &seq, seq + 1, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		if (packed->hours_dropped && !target->hours_dropped && target->hash == packed->hash && target->bucket == bucket &&
+		    wtr_shm_slot_matches(target, driver, location_code)) {
+			// Don't replace the complete forecasts of the same document, the slot is left as it was
+			__atomic_store_n(&target->seq, seq, __ATOMIC_RELEASE);
+			g_free(packed);
+			return;
+		}
+		// The odd sequence must be visible before any change to the slot content
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		target->bucket = bucket;
+		target->hash = packed->hash;
+		g_snprintf(target->driver, WTR_SHM_KEY_LENGTH, "%s", driver);
+		g_snprintf(target->code, WTR_SHM_KEY_LENGTH, "%s", location_code);
+		target->days_count = packed->days_count;
+		target->hours_dropped = packed->hours_dropped;
+		memcpy(target->days, packed->days, sizeof(wtr_shm_day) * packed->days_count);
+		__atomic_store_n(&target->seq, seq + 2, __ATOMIC_RELEASE);
+	}
+	g_free(packed);
+}
@@ -0,0 +1,88 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_SHM_H__
+#define __LIBWEATHER_SHM_H__
+
+#include <glib.h>
+
+#include "libweather.h"
+
+/**
+ * @file libweather_shm.h
+ * @brief Shared memory cache of parsed forecasts for libweather "drivers".
+ *
+ * This cache keeps the parsed forecasts in a POSIX shared memory segment,
+ * so that many processes on the same host can read warm forecasts without
+ * reading nor parsing the cached documents. The filesystem cache (see
+ * libweather_cache.h) stays the backing store.
+ *
+ * The segment contains a fixed number of slots, each one holding the
+ * forecasts of a location in a position-independent binary layout, along
+ * with the hash of the document they were parsed from. Slots are protected
+ * by a sequence lock: readers never block nor make system calls to read a
+ * slot, writers that find a slot busy just skip the update. A slot is valid
+ * only while its hash matches the one of the document in the filesystem
+ * cache, which the caller reads from the hash file (see wtr_cache_get_hash()),
+ * so the forecasts of a document that was replaced are never returned.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/// Number of slots (locations) in the shared memory segment.
+#define WTR_SHM_SLOTS 4096
+/// Maximum number of days of forecasts in a slot.
+#define WTR_SHM_MAX_DAYS 7
+/// Maximum number of hourly forecasts per day in a slot.
+#define WTR_SHM_MAX_HOURS 24
+
+/**
+ * @brief Attach the shared memory cache.
+ *
+ * The shared memory segment is created if it doesn't exist yet. After this
+ * call wtr_shm_get() and wtr_shm_set() use the segment.
+ *
+ * @return TRUE if the segment was attached, FALSE otherwise (the shared memory cache stays disabled).
+ * @warning The segment must be detached with wtr_shm_detach().
+ */
+gboolean wtr_shm_attach(void);
+
+/**
+ * @brief Detach the shared memory cache.
+ *
+ * It's safe to call this function even if wtr_shm_attach() was not called.
+ */
+void wtr_shm_detach(void);
+
+/**
+ * @brief Get today's forecasts of a location from the shared memory cache.
+ *
+ * Forecasts whose hourly forecasts were dropped to save memory are only
+ * returned while the memory is under pressure (see libmem.h); otherwise the
+ * document is worth parsing again.
+ *
+ * @param[in] driver Name of the libweather "driver".
+ * @param[in] location_code Location code.
+ * @param[in] hash Hash of the document in the filesystem cache; forecasts parsed from another document are ignored.
+ * @param[in] days Number of days to get, 0 to get all of them.
+ * @return The forecasts, or NULL if they are not in the shared memory cache (or if it's not attached).
+ * @warning The caller has the responsibility to free the returned forecasts by calling wtr_forecast_free()
+ */
+wtr_forecast *wtr_shm_get(const gchar *driver, const gchar *location_code, guint64 hash, guint days);
+
+/**
+ * @brief Store today's forecasts of a location in the shared memory cache.
+ *
+ * Only the forecasts of a whole document (with a non-zero @c hash) that fit
+ * in a slot are stored; if another process is updating the same slot the
+ * update is skipped. Forecasts whose hourly forecasts were dropped are
+ * stored as such, but they never replace the complete forecasts of the
+ * same document.
+ *
+ * @param[in] driver Name of the libweather "driver".
+ * @param[in] location_code Location code.
+ * @param[in] forecast Forecasts to store.
+ */
+void wtr_shm_set(const gchar *driver, const gchar *location_code, wtr_forecast *forecast);
+
+#endif  // __LIBWEATHER_SHM_H__
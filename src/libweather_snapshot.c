@@ -0,0 +1,499 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_snapshot.c
+ * @brief Snapshots of the libweather cache (implementation).
+ *
+ * A snapshot is a gzip-compressed stream made of a header, the cached
+ * documents and a trailer; integers are little endian:
+ *
+ * - header: magic (8 bytes), cache bucket as YYYYMMDD (8 bytes), creation
+ *   time in seconds since the Unix epoch (u64), host name (string), number of
+ *   entries (u32);
+ * - entry: driver (string), location code (string), hash of the document
+ *   (u64), the document (u32 length followed by the bytes);
+ * - trailer: xxh64 of all the uncompressed bytes that precede it (u64).
+ *
+ * Strings are stored as their u16 length followed by the bytes, without the
+ * terminating NULL.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+// close() is POSIX, not C99
+#define _POSIX_C_SOURCE 200112L
+
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <zlib.h>
+
+#include "libevents.h"
+#include "libutils.h"
+#include "libweather_cache.h"
+#include "libweather_snapshot.h"
+
+/// Magic number at the beginning of a snapshot (it includes the format version).
+#define WTR_SNAPSHOT_MAGIC "WTRSNP01"
+/// Length of the magic number.
+#define WTR_SNAPSHOT_MAGIC_LENGTH 8
+/// Length of the cache bucket (YYYYMMDD).
+#define WTR_SNAPSHOT_BUCKET_LENGTH 8
+/// Size of the chunks read from a compressed snapshot.
+#define WTR_SNAPSHOT_CHUNK_SIZE 65536
+
+/**
+ * @brief A cached document, as exported into or imported from a snapshot.
+ */
+typedef struct {
+	/// Name of the libweather "driver".
+	gchar *driver;
+	/// Location code.
+	gchar *code;
+	/// Hash of the document.
+	guint64 hash;
+	/// The document (it points inside the snapshot while importing).
+	gchar *data;
+	/// Length of the document.
+	guint32 length;
+} wtr_snapshot_entry;
+
+/**
+ * @brief A snapshot being written.
+ */
+typedef struct {
+	/// Compressed stream.
+	gzFile gz;
+	/// Checksum of the uncompressed bytes written so far.
+	xxh64_state checksum;
+	/// FALSE after an I/O error.
+	gboolean ok;
+} wtr_snapshot_writer;
+
+/**
+ * @brief A snapshot being read, completely decompressed in memory.
+ */
+typedef struct {
+	/// The uncompressed snapshot.
+	const guchar *data;
+	/// Length of the uncompressed snapshot.
+	gsize length;
+	/// Read position.
+	gsize pos;
+	/// FALSE after reading past the end of the snapshot.
+	gboolean ok;
+} wtr_snapshot_reader;
+
+/**
+ * @brief Returns today's cache bucket as YYYYMMDD.
+ *
+ * @warning The returned string must be freed with @c g_free.
+ */
+gchar *wtr_snapshot_bucket() {
+	GDateTime *today = g_date_time_new_now_local();
+	gchar *bucket = g_date_time_format(today, "%Y%m%d");
+	g_date_time_unref(today);
+	return bucket;
+}
+
+/**
+ * @brief Writes raw bytes into a snapshot, updating its checksum.
+ */
+void wtr_snapshot_write(wtr_snapshot_writer *writer, const void *data, gsize length) {
+	if (!writer->ok || length == 0) {
+		return;
+	}
+	xxh64_update(&writer->checksum, data, length);
+	writer->ok = gzwrite(writer->gz, data, length) == (int)length;
+}
+
+/**
+ * @brief Writes a little endian u16 into a snapshot.
+ */
+void wtr_snapshot_write_u16(wtr_snapshot_writer *writer, guint16 value) {
+	guint16 le = GUINT16_TO_LE(value);
+	wtr_snapshot_write(writer, &le, sizeof(le));
+}
+
+/**
+ * @brief Writes a little endian u32 into a snapshot.
+ */
+void wtr_snapshot_write_u32(wtr_snapshot_writer *writer, guint32 value) {
+	guint32 le = GUINT32_TO_LE(value);
+	wtr_snapshot_write(writer, &le, sizeof(le));
+}
+
+/**
+ * @brief Writes a little endian u64 into a snapshot.
+ */
+void wtr_snapshot_write_u64(wtr_snapshot_writer *writer, guint64 value) {
+	guint64 le = GUINT64_TO_LE(value);
+	wtr_snapshot_write(writer, &le, sizeof(le));
+}
+
+/**
+ * @brief Writes a string (u16 length and bytes) into a snapshot.
+ */
+void wtr_snapshot_write_string(wtr_snapshot_writer *writer, const gchar *value) {
+	gsize length = MIN(strlen(value), G_MAXUINT16);
+	wtr_snapshot_write_u16(writer, length);
+	wtr_snapshot_write(writer, value, length);
+}
+
+/**
+ * @brief Reads raw bytes from a snapshot.
+ *
+ * @return A pointer to the bytes inside the snapshot, or NULL if the snapshot is too short.
+ */
+const guchar *wtr_snapshot_read(wtr_snapshot_reader *reader, gsize length) {
+	if (!reader->ok || reader->length - reader->pos < length) {
+		reader->ok = FALSE;
+		return NULL;
+	}
+	const guchar *data = reader->data + reader->pos;
+	reader->pos += length;
+	return data;
+}
+
+/**
+ * @brief Reads a little endian u16 from a snapshot (0 if the snapshot is too short).
+ */
+guint16 wtr_snapshot_read_u16(wtr_snapshot_reader *reader) {
+	guint16 le = 0;
+	const guchar *data = wtr_snapshot_read(reader, sizeof(le));
+	if (data != NULL) {
+		memcpy(&le, data, sizeof(le));
+	}
+	return GUINT16_FROM_LE(le);
+}
+
+/**
+ * @brief Reads a little endian u32 from a snapshot (0 if the snapshot is too short).
+ */
+guint32 wtr_snapshot_read_u32(wtr_snapshot_reader *reader) {
+	guint32 le = 0;
+	const guchar *data = wtr_snapshot_read(reader, sizeof(le));
+	if (data != NULL) {
+		memcpy(&le, data, sizeof(le));
+	}
+	return GUINT32_FROM_LE(le);
+}
+
+/**
+ * @brief Reads a little endian u64 from a snapshot (0 if the snapshot is too short).
+ */
+guint64 wtr_snapshot_read_u64(wtr_snapshot_reader *reader) {
+	guint64 le = 0;
+	const guchar *data = wtr_snapshot_read(reader, sizeof(le));
+	if (data != NULL) {
+		memcpy(&le, data, sizeof(le));
+	}
+	return GUINT64_FROM_LE(le);
+}
+
+/**
+ * @brief Reads a string (u16 length and bytes) from a snapshot.
+ *
+ * @return The string, or NULL if the snapshot is too short.
+ * @warning The returned string must be freed with @c g_free.
+ */
+gchar *wtr_snapshot_read_string(wtr_snapshot_reader *reader) {
+	guint16 length = wtr_snapshot_read_u16(reader);
+	const guchar *data = wtr_snapshot_read(reader, length);
+	return data != NULL ? g_strndup((const gchar *)data, length) : NULL;
+}
+
+/**
+ * @brief Frees a wtr_snapshot_entry.
+ *
+ * @param[in] entry The entry to free.
+ * @param[in] owns_data TRUE if the document was allocated for the entry, FALSE if it points inside a snapshot.
+ */
+void wtr_snapshot_entry_free(wtr_snapshot_entry *entry, gboolean owns_data) {
+	if (owns_data) {
+		g_free(entry->data);
+	}
+	g_free(entry->driver);
+	g_free(entry->code);
+	g_free(entry);
+}
+
+/**
+ * @brief Frees a list of wtr_snapshot_entry.
+ *
+ * @param[in] entries The list to free.
+ * @param[in] owns_data TRUE if the documents were allocated for the entries, FALSE if they point inside a snapshot.
+ */
+void wtr_snapshot_entries_free(GList *entries, gboolean owns_data) {
+	for (GList *ptr = entries; ptr != NULL; ptr = ptr->next) {
+		wtr_snapshot_entry_free((wtr_snapshot_entry *)ptr->data, owns_data);
+	}
+	g_list_free(entries);
+}
+
+/**
+ * @brief Collects a cached document to be exported (wtr_cache_func).
+ *
+ * Only the key is collected: the documents are read later, all together.
+ *
+ * @param[in] user_data Pointer to the GList of the collected wtr_snapshot_entry.
+ */
+void wtr_snapshot_collect(gchar *driver, gchar *location_code, gpointer user_data) {
+	GList **entries = (GList **)user_data;
+	wtr_snapshot_entry *entry = (wtr_snapshot_entry *)g_malloc0(sizeof(wtr_snapshot_entry));
+	entry->driver = g_strdup(driver);
+	entry->code = g_strdup(location_code);
+	*entries = g_list_prepend(*entries, entry);
+}
+
+/**
+ * @brief Compares two wtr_snapshot_entry by driver (GCompareFunc).
+ */
+gint wtr_snapshot_entry_compare(gconstpointer a, gconstpointer b) {
+	return g_strcmp0(((const wtr_snapshot_entry *)a)->driver, ((const wtr_snapshot_entry *)b)->driver);
+}
+
+/**
+ * @brief Reads the documents of the collected entries, with a batch read for each driver.
+ *
+ * Entries whose document disappeared in the meanwhile are dropped.
+ *
+ * @param[in] entries The collected wtr_snapshot_entry.
+ * @return The entries with their documents, sorted by driver.
+ */
+GList *wtr_snapshot_read_entries(GList *entries) {
+	entries = g_list_sort(entries, wtr_snapshot_entry_compare);
+	GList *read = NULL;
+	GList *first = entries;
+	while (first != NULL) {
+		const gchar *driver = ((wtr_snapshot_entry *)first->data)->driver;
+		guint count = 0;
+		GList *last = first;
+		for (; last != NULL && g_strcmp0(((wtr_snapshot_entry *)last->data)->driver, driver) == 0; last = last->next) {
+			++count;
+		}
+		gchar **codes = (gchar **)g_malloc(sizeof(gchar *) * count);
+		gchar **data = (gchar **)g_malloc(sizeof(gchar *) * count);
+		gsize *lengths = (gsize *)g_malloc(sizeof(gsize) * count);
+		guint i = 0;
+		for (GList *ptr = first; ptr != last; ptr = ptr->next) {
+			codes[i++] = ((wtr_snapshot_entry *)ptr->data)->code;
+		}
+		wtr_cache_get_many((gchar *)driver, codes, count, data, lengths);
+		i = 0;
+		for (GList *ptr = first; ptr != last; ptr = ptr->next, ++i) {
+			wtr_snapshot_entry *entry = (wtr_snapshot_entry *)ptr->data;
+			if (data[i] == NULL) {
+				wtr_snapshot_entry_free(entry, TRUE);
+				continue;
+			}
+			entry->data = data[i];
+			entry->length = lengths[i];
+			entry->hash = xxh64(entry->data, entry->length, 0);
+			read = g_list_prepend(read, entry);
+		}
+		g_free(lengths);
+		g_free(data);
+		g_free(codes);
+		first = last;
+	}
+	g_list_free(entries);
+	return g_list_reverse(read);
+}
+
+gboolean wtr_snapshot_export(const gchar *path, guint *entries) {
+	GList *collected = NULL;
+	wtr_cache_foreach(wtr_snapshot_collect, &collected);
+	collected = wtr_snapshot_read_entries(collected);
+	gchar *temp_path = g_strconcat(path, ".XXXXXX", NULL);
+	int fd = g_mkstemp(temp_path);
+	if (fd < 0) {
+		events_log(EVENTS_ERROR, "wtr_snapshot_export can't create %s", temp_path);
+		g_free(temp_path);
+		wtr_snapshot_entries_free(collected, TRUE);
+		return FALSE;
+	}
+	wtr_snapshot_writer writer;
+	writer.gz = gzdopen(fd, "wb9");
+	writer.ok = TRUE;
+	xxh64_init(&writer.checksum, 0);
+	guint count = g_list_length(collected);
+	if (writer.gz == NULL) {
+		close(fd);
+		writer.ok = FALSE;
+	} else {
+		gchar *bucket = wtr_snapshot_bucket();
+		wtr_snapshot_write(&writer, WTR_SNAPSHOT_MAGIC, WTR_SNAPSHOT_MAGIC_LENGTH);
+		wtr_snapshot_write(&writer, bucket, WTR_SNAPSHOT_BUCKET_LENGTH);
+		wtr_snapshot_write_u64(&writer, g_get_real_time() / G_USEC_PER_SEC);
+		wtr_snapshot_write_string(&writer, g_get_host_name());
+		wtr_snapshot_write_u32(&writer, count);
+		g_free(bucket);
+		for (GList *ptr = collected; ptr != NULL; ptr = ptr->next) {
+			wtr_snapshot_entry *entry = (wtr_snapshot_entry *)ptr->data;
+			wtr_snapshot_write_string(&writer, entry->driver);
+			wtr_snapshot_write_string(&writer, entry->code);
+			wtr_snapshot_write_u64(&writer, entry->hash);
+			wtr_snapshot_write_u32(&writer, entry->length);
+			wtr_snapshot_write(&writer, entry->data, entry->length);
+		}
+		// The trailer is not part of the checksum
+		guint64 checksum = GUINT64_TO_LE(xxh64_digest(&writer.checksum));
+		writer.ok = writer.ok && gzwrite(writer.gz, &checksum, sizeof(checksum)) == sizeof(checksum);
+		writer.ok = gzclose(writer.gz) == Z_OK && writer.ok;
+	}
+	wtr_snapshot_entries_free(collected, TRUE);
+	if (writer.ok && g_rename(temp_path, path) != 0) {
+		writer.ok = FALSE;
+	}
+	if (!writer.ok) {
+		events_log(EVENTS_ERROR, "wtr_snapshot_export can't write %s", path);
+		g_unlink(temp_path);
+	} else if (entries != NULL) {
+		*entries = count;
+	}
+	g_free(temp_path);
+	return writer.ok;
+}
+
+/**
+ * @brief Checks that a driver name or a location code can be safely used as part of a cache file name.
+ */
+gboolean wtr_snapshot_name_ok(const gchar *name, gboolean is_driver) {
+	if (name == NULL || name[0] == '\0') {
+		return FALSE;
+	}
+	for (const gchar *c = name; *c != '\0'; ++c) {
+		if (*c == '/' || *c == '.' || (is_driver && *c == '-')) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * @brief Reads and decompresses a whole snapshot file.
+ *
+ * @return The uncompressed snapshot, or NULL on I/O or decompression errors.
+ * @warning The returned array must be freed with @c g_byte_array_free.
+ */
+GByteArray *wtr_snapshot_load(const gchar *path) {
+	gzFile gz = gzopen(path, "rb");
+	if (gz == NULL) {
+		return NULL;
+	}
+	GByteArray *snapshot = g_byte_array_new();
+	guchar *chunk = (guchar *)g_malloc(WTR_SNAPSHOT_CHUNK_SIZE);
+	int read;
+	while ((read = gzread(gz, chunk, WTR_SNAPSHOT_CHUNK_SIZE)) > 0) {
+		g_byte_array_append(snapshot, chunk, read);
+	}
+	g_free(chunk);
+	if (gzclose(gz) != Z_OK || read < 0) {
+		g_byte_array_free(snapshot, TRUE);
+		return NULL;
+	}
+	return snapshot;
+}
+
+/**
+ * @brief Parses and verifies the entries of an uncompressed snapshot.
+ *
+ * @param[in] path Path of the snapshot, for the error messages.
+ * @param[in] snapshot The uncompressed snapshot.
+ * @param[out] valid TRUE if the snapshot is valid (an empty one is valid too), FALSE otherwise.
+ * @return The entries (wtr_snapshot_entry pointing inside the snapshot) in snapshot order.
+ */
+GList *wtr_snapshot_parse(const gchar *path, GByteArray *snapshot, gboolean *valid) {
+	*valid = FALSE;
+	if (snapshot->len < WTR_SNAPSHOT_MAGIC_LENGTH + sizeof(guint64) ||
+	    memcmp(snapshot->data, WTR_SNAPSHOT_MAGIC, WTR_SNAPSHOT_MAGIC_LENGTH) != 0) {
+		events_log(EVENTS_ERROR, "wtr_snapshot_import %s is not a cache snapshot", path);
+		return NULL;
+	}
+	// Nothing is trusted before the checksum is verified
+	gsize body_length = snapshot->len - sizeof(guint64);
+	guint64 checksum;
+	memcpy(&checksum, snapshot->data + body_length, sizeof(checksum));
+	if (GUINT64_FROM_LE(checksum) != xxh64(snapshot->data, body_length, 0)) {
+		events_log(EVENTS_ERROR, "wtr_snapshot_import %s is corrupted (checksum mismatch)", path);
+		return NULL;
+	}
+	wtr_snapshot_reader reader = {snapshot->data, body_length, WTR_SNAPSHOT_MAGIC_LENGTH, TRUE};
+	const guchar *bucket = wtr_snapshot_read(&reader, WTR_SNAPSHOT_BUCKET_LENGTH);
+	gchar *today = wtr_snapshot_bucket();
+	gboolean fresh = bucket != NULL && memcmp(bucket, today, WTR_SNAPSHOT_BUCKET_LENGTH) == 0;
+	g_free(today);
+	if (!fresh) {
+		events_log(EVENTS_ERROR, "wtr_snapshot_import %s was not taken today", path);
+		return NULL;
+	}
+	wtr_snapshot_read_u64(&reader);
+	g_free(wtr_snapshot_read_string(&reader));
+	guint32 count = wtr_snapshot_read_u32(&reader);
+	GList *entries = NULL;
+	gboolean ok = reader.ok;
+	for (guint32 i = 0; i < count && ok; ++i) {
+		wtr_snapshot_entry *entry = (wtr_snapshot_entry *)g_malloc(sizeof(wtr_snapshot_entry));
+		entry->driver = wtr_snapshot_read_string(&reader);
+		entry->code = wtr_snapshot_read_string(&reader);
+		entry->hash = wtr_snapshot_read_u64(&reader);
+		entry->length = wtr_snapshot_read_u32(&reader);
+		entry->data = (gchar *)wtr_snapshot_read(&reader, entry->length);
+		ok = reader.ok && wtr_snapshot_name_ok(entry->driver, TRUE) && wtr_snapshot_name_ok(entry->code, FALSE) &&
+		     xxh64(entry->data, entry->length, 0) == entry->hash;
+		entries = g_list_prepend(entries, entry);
+	}
+	if (!ok || reader.pos != reader.length) {
+		events_log(EVENTS_ERROR, "wtr_snapshot_import %s contains invalid entries", path);
+		wtr_snapshot_entries_free(entries, FALSE);
+		return NULL;
+	}
+	*valid = TRUE;
+	return g_list_reverse(entries);
+}
+
+gboolean wtr_snapshot_import(const gchar *path, guint *entries, guint *unchanged) {
+	GByteArray *snapshot = wtr_snapshot_load(path);
+	if (snapshot == NULL) {
+		events_log(EVENTS_ERROR, "wtr_snapshot_import can't read %s", path);
+		return FALSE;
+	}
+	gboolean valid;
+	GList *parsed = wtr_snapshot_parse(path, snapshot, &valid);
+	guint count = 0;
+	guint same = 0;
+	guint failed = 0;
+	if (valid) {
+		// All the documents are synced together and published only after the whole snapshot was verified
+		wtr_cache_batch_begin();
+		for (GList *ptr = parsed; ptr != NULL; ptr = ptr->next) {
+			wtr_snapshot_entry *entry = (wtr_snapshot_entry *)ptr->data;
+			wtr_cache_outcome outcome = wtr_cache_set_hashed(entry->driver, entry->code, entry->data, entry->length, entry->hash);
+			if (outcome == WTR_CACHE_FAILED) {
+				++failed;
+				continue;
+			}
+			if (outcome == WTR_CACHE_UNCHANGED) {
+				++same;
+			}
+			++count;
+		}
+		wtr_cache_batch_commit();
+		wtr_snapshot_entries_free(parsed, FALSE);
+	}
+	g_byte_array_free(snapshot, TRUE);
+	if (valid && entries != NULL) {
+		*entries = count;
+	}
+	if (valid && unchanged != NULL) {
+		*unchanged = same;
+	}
+	if (failed > 0) {
+		events_log(EVENTS_ERROR, "wtr_snapshot_import can't cache %u documents of %s", failed, path);
+	}
+	return valid && failed == 0;
+}
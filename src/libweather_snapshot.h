@@ -0,0 +1,47 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_SNAPSHOT_H__
+#define __LIBWEATHER_SNAPSHOT_H__
+
+#include <glib.h>
+
+/**
+ * @file libweather_snapshot.h
+ * @brief Snapshots of the libweather cache.
+ *
+ * A snapshot packs all of today's cached documents into a single compressed
+ * archive, along with some metadata and a checksum, so that a host can seed
+ * the cache of other hosts instead of having each of them download the same
+ * forecasts.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/**
+ * @brief Exports today's cached documents into a snapshot file.
+ *
+ * The snapshot is written into a temporary file which atomically replaces
+ * @p path once complete.
+ *
+ * @param[in] path Path of the snapshot file.
+ * @param[out] entries Number of exported documents (it can be NULL).
+ * @return TRUE if the snapshot was written, FALSE otherwise.
+ */
+gboolean wtr_snapshot_export(const gchar *path, guint *entries);
+
+/**
+ * @brief Imports the documents of a snapshot file into today's cache.
+ *
+ * The whole snapshot is read and verified before anything is written into
+ * the cache; snapshots taken on another day are refused. The documents are
+ * then published with a single batch (see wtr_cache_batch_begin()).
+ *
+ * @param[in] path Path of the snapshot file.
+ * @param[out] entries Number of imported documents (it can be NULL).
+ * @param[out] unchanged Number of documents that were already cached (it can be NULL).
+ * @return TRUE if the snapshot was imported, FALSE otherwise (also if some of its documents couldn't be cached).
+ */
+gboolean wtr_snapshot_import(const gchar *path, guint *entries, guint *unchanged);
+
+#endif  // __LIBWEATHER_SNAPSHOT_H__
@@ -0,0 +1,371 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_stats.c
+ * @brief Aggregate statistics over the forecasts of many locations (implementation).
+ *
+ * Values are gathered in a single pass over the forecasts, then they are
+ * grouped with a counting sort on the group index, so that each group is a
+ * contiguous slice of the column. The kernels keep several independent
+ * accumulators ("lanes") so that their loops have no dependency between
+ * consecutive iterations and can be vectorized.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "libweather.h"
+#include "libweather_stats.h"
+
+/// Number of independent accumulators of the kernels (4 doubles fill an AVX register).
+#define WTR_STATS_LANES 4
+
+/**
+ * @brief Values of a forecast field, gathered from many forecasts and grouped by key.
+ */
+struct _wtr_stats_column {
+	/// Number of groups.
+	guint groups_count;
+	/// Key of each group, sorted.
+	gchar **keys;
+	/// Start of each group in @c values; @c offsets[groups_count] is the number of values.
+	guint *offsets;
+	/// The values, grouped.
+	gdouble *values;
+};
+
+/// Names of the fields, in the same order as wtr_stats_field.
+static const gchar *wtr_stats_field_names[] = {"temp", "temp_min", "temp_max", "wind_speed", "rain", "humidity", "pressure"};
+
+gboolean wtr_stats_field_parse(const gchar *name, wtr_stats_field *field) {
+	for (guint i = 0; i < G_N_ELEMENTS(wtr_stats_field_names); ++i) {
+		if (g_strcmp0(name, wtr_stats_field_names[i]) == 0) {
+			*field = (wtr_stats_field)i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * @brief Returns a field of an hourly forecast.
+ */
+gdouble wtr_stats_hour_value(wtr_forecast_hour *hour, wtr_stats_field field) {
+	switch (field) {
+	case WTR_STATS_TEMP:
+		return hour->temp;
+	case WTR_STATS_WIND_SPEED:
+		return hour->wind_speed;
+	case WTR_STATS_RAIN:
+		return hour->rain;
+	case WTR_STATS_HUMIDITY:
+		return hour->humidity;
+	case WTR_STATS_PRESSURE:
+		return hour->pressure;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief Returns a field of a daily forecast.
+ */
+gdouble wtr_stats_day_value(wtr_forecast_day *day, wtr_stats_field field) {
+	switch (field) {
+	case WTR_STATS_TEMP_MIN:
+		return day->temp_min;
+	case WTR_STATS_TEMP_MAX:
+		return day->temp_max;
+	case WTR_STATS_WIND_SPEED:
+		return day->wind_speed;
+	case WTR_STATS_RAIN:
+		return day->rain;
+	case WTR_STATS_HUMIDITY:
+		return day->humidity;
+	case WTR_STATS_PRESSURE:
+		return day->pressure;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief Compares two strings through pointers to them (for @c qsort).
+ */
+int wtr_stats_key_compare(const void *a, const void *b) {
+	return g_strcmp0(*(const gchar *const *)a, *(const gchar *const *)b);
+}
+
+/**
+ * @brief Assigns each forecast the index of its group, with groups sorted by key.
+ *
+ * @param[in] keys Group key of each forecast, or NULL for a single group.
+ * @param[in] count Number of forecasts.
+ * @param[out] groups Group index of each forecast.
+ * @param[out] column The column whose @c keys and @c groups_count are set.
+ */
+void wtr_stats_group(const gchar **keys, guint count, guint *groups, wtr_stats_column *column) {
+	if (keys == NULL) {
+		column->groups_count = 1;
+		column->keys = (gchar **)g_malloc(sizeof(gchar *));
+		column->keys[0] = g_strdup("");
+		memset(groups, 0, sizeof(guint) * count);
+		return;
+	}
+	GHashTable *distinct = g_hash_table_new(g_str_hash, g_str_equal);
+	for (guint i = 0; i < count; ++i) {
+		g_hash_table_add(distinct, (gpointer)(keys[i] != NULL ? keys[i] : ""));
+	}
+	column->groups_count = g_hash_table_size(distinct);
+	column->keys = (gchar **)g_malloc(sizeof(gchar *) * column->groups_count);
+	GHashTableIter iter;
+	gpointer key;
+	guint group = 0;
+	g_hash_table_iter_init(&iter, distinct);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		column->keys[group++] = g_strdup((gchar *)key);
+	}
+	qsort(column->keys, column->groups_count, sizeof(gchar *), wtr_stats_key_compare);
+	for (group = 0; group < column->groups_count; ++group) {
+		g_hash_table_insert(distinct, column->keys[group], GUINT_TO_POINTER(group));
+	}
+	for (guint i = 0; i < count; ++i) {
+		groups[i] = GPOINTER_TO_UINT(g_hash_table_lookup(distinct, keys[i] != NULL ? keys[i] : ""));
+	}
+	g_hash_table_destroy(distinct);
+}
+
+wtr_stats_column *wtr_stats_gather(wtr_forecast **forecasts, const gchar **keys, guint count, wtr_stats_field field, gboolean hourly,
+                                   gint day) {
+	if ((hourly && (field == WTR_STATS_TEMP_MIN || field == WTR_STATS_TEMP_MAX)) || (!hourly && field == WTR_STATS_TEMP)) {
+		return NULL;
+	}
+	wtr_stats_column *column = (wtr_stats_column *)g_malloc(sizeof(wtr_stats_column));
+	guint *forecast_groups = (guint *)g_malloc(sizeof(guint) * MAX(count, 1));
+	wtr_stats_group(keys, count, forecast_groups, column);
+	// Gather the values in forecast order, along with their group
+	GArray *values = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	GArray *value_groups = g_array_new(FALSE, FALSE, sizeof(guint));
+	for (guint i = 0; i < count; ++i) {
+		if (forecasts[i] == NULL) {
+			continue;
+		}
+		GList *day_ptr = day < 0 ? forecasts[i]->days : g_list_nth(forecasts[i]->days, day);
+		for (; day_ptr != NULL; day_ptr = day < 0 ? day_ptr->next : NULL) {
+			wtr_forecast_day *forecast_day = (wtr_forecast_day *)day_ptr->data;
+			if (!hourly) {
+				gdouble value = wtr_stats_day_value(forecast_day, field);
+				g_array_append_val(values, value);
+				g_array_append_val(value_groups, forecast_groups[i]);
+				continue;
+			}
+			for (GList *hour_ptr = forecast_day->hours; hour_ptr != NULL; hour_ptr = hour_ptr->next) {
+				gdouble value = wtr_stats_hour_value((wtr_forecast_hour *)hour_ptr->data, field);
+				g_array_append_val(values, value);
+				g_array_append_val(value_groups, forecast_groups[i]);
+			}
+		}
+	}
+	g_free(forecast_groups);
+	// Counting sort by group: count, prefix sums, scatter
+	column->offsets = (guint *)g_malloc0(sizeof(guint) * (column->groups_count + 1));
+	guint *groups = (guint *)value_groups->data;
+	for (guint i = 0; i < values->len; ++i) {
+		++column->offsets[groups[i] + 1];
+	}
+	for (guint group = 0; group < column->groups_count; ++group) {
+		column->offsets[group + 1] += column->offsets[group];
+	}
+	guint *next = (guint *)g_malloc(sizeof(guint) * column->groups_count);
+	memcpy(next, column->offsets, sizeof(guint) * column->groups_count);
+	column->values = (gdouble *)g_malloc(sizeof(gdouble) * MAX(values->len, 1));
+	for (guint i = 0; i < values->len; ++i) {
+		column->values[next[groups[i]]++] = g_array_index(values, gdouble, i);
+	}
+	g_free(next);
+	g_array_free(value_groups, TRUE);
+	g_array_free(values, TRUE);
+	return column;
+}
+
+guint wtr_stats_groups(wtr_stats_column *column) {
+	return column->groups_count;
+}
+
+const gchar *wtr_stats_key(wtr_stats_column *column, guint group) {
+	return column->keys[group];
+}
+
+guint wtr_stats_count(wtr_stats_column *column, guint group) {
+	return column->offsets[group + 1] - column->offsets[group];
+}
+
+/**
+ * @brief Minimum of a slice of values.
+ *
+ * @param[in] values The values.
+ * @param[in] n Number of values (at least 1).
+ */
+gdouble wtr_stats_kernel_min(const gdouble *restrict values, gsize n) {
+	gdouble lanes[WTR_STATS_LANES];
+	for (guint l = 0; l < WTR_STATS_LANES; ++l) {
+		lanes[l] = values[0];
+	}
+	gsize i = 0;
+	for (; i + WTR_STATS_LANES <= n; i += WTR_STATS_LANES) {
+		for (guint l = 0; l < WTR_STATS_LANES; ++l) {
+			lanes[l] = values[i + l] < lanes[l] ? values[i + l] : lanes[l];
+		}
+	}
+	gdouble min = lanes[0];
+	for (guint l = 1; l < WTR_STATS_LANES; ++l) {
+		min = lanes[l] < min ? lanes[l] : min;
+	}
+	for (; i < n; ++i) {
+		min = values[i] < min ? values[i] : min;
+	}
+	return min;
+}
+
+/**
+ * @brief Maximum of a slice of values.
+ *
+ * @param[in] values The values.
+ * @param[in] n Number of values (at least 1).
+ */
+gdouble wtr_stats_kernel_max(const gdouble *restrict values, gsize n) {
+	gdouble lanes[WTR_STATS_LANES];
+	for (guint l = 0; l < WTR_STATS_LANES; ++l) {
+		lanes[l] = values[0];
+	}
+	gsize i = 0;
+	for (; i + WTR_STATS_LANES <= n; i += WTR_STATS_LANES) {
+		for (guint l = 0; l < WTR_STATS_LANES; ++l) {
+			lanes[l] = values[i + l] > lanes[l] ? values[i + l] : lanes[l];
+		}
+	}
+	gdouble max = lanes[0];
+	for (guint l = 1; l < WTR_STATS_LANES; ++l) {
+		max = lanes[l] > max ? lanes[l] : max;
+	}
+	for (; i < n; ++i) {
+		max = values[i] > max ? values[i] : max;
+	}
+	return max;
+}
+
+/**
+ * @brief Sum of a slice of values.
+ *
+ * @param[in] values The values.
+ * @param[in] n Number of values.
+ */
+gdouble wtr_stats_kernel_sum(const gdouble *restrict values, gsize n) {
+	gdouble lanes[WTR_STATS_LANES] = {0};
+	gsize i = 0;
+	for (; i + WTR_STATS_LANES <= n; i += WTR_STATS_LANES) {
+		for (guint l = 0; l < WTR_STATS_LANES; ++l) {
+			lanes[l] += values[i + l];
+		}
+	}
+	gdouble sum = 0;
+	for (guint l = 0; l < WTR_STATS_LANES; ++l) {
+		sum += lanes[l];
+	}
+	for (; i < n; ++i) {
+		sum += values[i];
+	}
+	return sum;
+}
+
+gdouble wtr_stats_min(wtr_stats_column *column, guint group) {
+	guint n = wtr_stats_count(column, group);
+	return n > 0 ? wtr_stats_kernel_min(column->values + column->offsets[group], n) : 0;
+}
+
+gdouble wtr_stats_max(wtr_stats_column *column, guint group) {
+	guint n = wtr_stats_count(column, group);
+	return n > 0 ? wtr_stats_kernel_max(column->values + column->offsets[group], n) : 0;
+}
+
+gdouble wtr_stats_sum(wtr_stats_column *column, guint group) {
+	return wtr_stats_kernel_sum(column->values + column->offsets[group], wtr_stats_count(column, group));
+}
+
+/**
+ * @brief Returns the k-th smallest value of an array, partially reordering it (quickselect).
+ *
+ * @param[in,out] values The values.
+ * @param[in] n Number of values.
+ * @param[in] k Rank of the value to select (0 is the minimum).
+ */
+gdouble wtr_stats_select(gdouble *values, gsize n, gsize k) {
+	gsize left = 0;
+	gsize right = n - 1;
+	while (left < right) {
+		gdouble pivot = values[left + (right - left) / 2];
+		gsize i = left;
+		gsize j = right;
+		while (i <= j) {
+			while (values[i] < pivot) {
+				++i;
+			}
+			while (values[j] > pivot) {
+				--j;
+			}
+			if (i <= j) {
+				gdouble swap = values[i];
+				values[i] = values[j];
+				values[j] = swap;
+				++i;
+				if (j == 0) {
+					break;
+				}
+				--j;
+			}
+		}
+		if (k <= j) {
+			right = j;
+		} else if (k >= i) {
+			left = i;
+		} else {
+			break;
+		}
+	}
+	return values[k];
+}
+
+/**
+ * @brief Selects the nearest-rank percentile on a copy of the group, so that the column is left untouched.
+ */
+gdouble wtr_stats_percentile(wtr_stats_column *column, guint group, gdouble percentile) {
+	guint n = wtr_stats_count(column, group);
+	if (n == 0) {
+		return 0;
+	}
+	percentile = CLAMP(percentile, 0, 100);
+	// Nearest rank: the smallest value such that at least percentile% of the values are less or equal to it
+	gsize rank = (gsize)ceil(percentile / 100.0 * n);
+	rank = rank > 0 ? rank - 1 : 0;
+	gdouble *copy = (gdouble *)g_malloc(sizeof(gdouble) * n);
+	memcpy(copy, column->values + column->offsets[group], sizeof(gdouble) * n);
+	gdouble value = wtr_stats_select(copy, n, MIN(rank, n - 1));
+	g_free(copy);
+	return value;
+}
+
+void wtr_stats_column_free(wtr_stats_column *column) {
+	for (guint group = 0; group < column->groups_count; ++group) {
+		g_free(column->keys[group]);
+	}
+	g_free(column->keys);
+	g_free(column->offsets);
+	g_free(column->values);
+	g_free(column);
+}
@@ -0,0 +1,116 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_STATS_H__
+#define __LIBWEATHER_STATS_H__
+
+#include <glib.h>
+
+#include "libweather.h"
+
+/**
+ * @file libweather_stats.h
+ * @brief Aggregate statistics over the forecasts of many locations.
+ *
+ * A field of the daily or hourly forecasts of many locations is gathered
+ * into a column: a contiguous array of values sorted by group (e.g. by
+ * province), so that minimum, maximum, sum and percentiles of each group are
+ * computed by tight loops over a contiguous slice, which the compiler turns
+ * into SIMD code.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/**
+ * @brief Forecast fields that can be aggregated.
+ *
+ * Some fields only exist in daily forecasts (@c WTR_STATS_TEMP_MIN and
+ * @c WTR_STATS_TEMP_MAX) or in hourly ones (@c WTR_STATS_TEMP).
+ */
+typedef enum {
+	WTR_STATS_TEMP,
+	WTR_STATS_TEMP_MIN,
+	WTR_STATS_TEMP_MAX,
+	WTR_STATS_WIND_SPEED,
+	WTR_STATS_RAIN,
+	WTR_STATS_HUMIDITY,
+	WTR_STATS_PRESSURE
+} wtr_stats_field;
+
+/**
+ * @brief Values of a forecast field, gathered from many forecasts and grouped by key.
+ */
+typedef struct _wtr_stats_column wtr_stats_column;
+
+/**
+ * @brief Parses the name of a forecast field.
+ *
+ * @param[in] name Field name: temp, temp_min, temp_max, wind_speed, rain, humidity or pressure.
+ * @param[out] field The field.
+ * @return TRUE if the name is valid, FALSE otherwise.
+ */
+gboolean wtr_stats_field_parse(const gchar *name, wtr_stats_field *field);
+
+/**
+ * @brief Gathers a field of many forecasts into a column.
+ *
+ * @param[in] forecasts The forecasts (NULL items are skipped).
+ * @param[in] keys Group key of each forecast (e.g. the province of its wtr_location), or NULL to put all the values in a single group.
+ * @param[in] count Number of forecasts.
+ * @param[in] field The field to gather.
+ * @param[in] hourly TRUE to gather the field of the hourly forecasts, FALSE to gather the one of the daily forecasts.
+ * @param[in] day Index of the day to gather (0 is today), or -1 to gather all the days.
+ * @return The column, or NULL if @p field doesn't exist in the daily or hourly forecasts.
+ * @warning The column must be freed with wtr_stats_column_free().
+ */
+wtr_stats_column *wtr_stats_gather(wtr_forecast **forecasts, const gchar **keys, guint count, wtr_stats_field field, gboolean hourly,
+                                   gint day);
+
+/**
+ * @brief Returns the number of groups of a column.
+ *
+ * Groups are sorted by key.
+ */
+guint wtr_stats_groups(wtr_stats_column *column);
+
+/**
+ * @brief Returns the key of a group (the empty string if the column was gathered without keys).
+ */
+const gchar *wtr_stats_key(wtr_stats_column *column, guint group);
+
+/**
+ * @brief Returns the number of values of a group.
+ */
+guint wtr_stats_count(wtr_stats_column *column, guint group);
+
+/**
+ * @brief Returns the minimum value of a group (0 if the group is empty).
+ */
+gdouble wtr_stats_min(wtr_stats_column *column, guint group);
+
+/**
+ * @brief Returns the maximum value of a group (0 if the group is empty).
+ */
+gdouble wtr_stats_max(wtr_stats_column *column, guint group);
+
+/**
+ * @brief Returns the sum of the values of a group.
+ */
+gdouble wtr_stats_sum(wtr_stats_column *column, guint group);
+
+/**
+ * @brief Returns a percentile of the values of a group (nearest rank).
+ *
+ * @param[in] column The column.
+ * @param[in] group The group.
+ * @param[in] percentile The percentile, between 0 and 100 (e.g. 50 for the median).
+ * @return The percentile (0 if the group is empty).
+ */
+gdouble wtr_stats_percentile(wtr_stats_column *column, guint group, gdouble percentile);
+
+/**
+ * @brief Frees a column created by wtr_stats_gather().
+ */
+void wtr_stats_column_free(wtr_stats_column *column);
+
+#endif  // __LIBWEATHER_STATS_H__
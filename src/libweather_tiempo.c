@@ -15,15 +15,25 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <libxml/SAX2.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
 #include "config.h"
+#include "libevents.h"
+#include "libmem.h"
+#include "libmetrics.h"
 #include "libnet.h"
 #include "libutils.h"
 #include "libweather.h"
+#include "libweather_alerts.h"
+#include "libweather_archive.h"
 #include "libweather_cache.h"
+#include "libweather_keys.h"
+#include "libweather_popularity.h"
+#include "libweather_shm.h"
 #include "libweather_tiempo.h"
+#include "probes.h"
 
 /// Template URL for @c *printf to get forecasts for an Italian location; the location ID and the Affiliate ID must be provided via.
 #define TIEMPO_URL_TEMPLATE "http://api.ilmeteo.net/index.php?api_lang=it&localidad=%s&affiliate_id=%s&v=2&h=1"
@@ -35,17 +45,41 @@
  *
  * Tiempo API require a formatted url (see @c TIEMPO_URL_TEMPLATE). This function
  * returns the URL for the specified location assuming that it's an Italian location
- * and by using a fixed Affiliate ID (for API accounting and throttling).
+ * and by using an Affiliate ID (for API accounting and throttling): the one of the pool
+ * of keys with the most requests left today (see libweather_keys.h), if enabled,
+ * otherwise the fixed one.
  *
  * @param[in] code Tiempo location code.
  * @return URL to get the XML weather forecasts for the specified location.
  */
 gchar *wtr_tiempo_forecast_url(gchar *code) {
 	gchar *url = (gchar *)g_malloc(sizeof(gchar) * TIEMPO_URL_MAX_LENGTH);
-	g_snprintf(url, TIEMPO_URL_MAX_LENGTH, TIEMPO_URL_TEMPLATE, code, TIEMPO_AFFILATE_ID);
+	g_snprintf(url, TIEMPO_URL_MAX_LENGTH, TIEMPO_URL_TEMPLATE, code, wtr_keys_acquire(TIEMPO_AFFILATE_ID));
 	return url;
 }
 
+/**
+ * @brief Reports the outcome of a request to the pool of keys, so that throttled Affiliate IDs cool down.
+ *
+ * Every URL returned by wtr_tiempo_forecast_url() took a key from the pool, so
+ * it must be reported even if the request was never sent.
+ *
+ * @param[in] url URL of the request, as returned by wtr_tiempo_forecast_url().
+ * @param[in] data Result of the request.
+ * @return TRUE if the Affiliate ID of the request was throttled.
+ */
+gboolean wtr_tiempo_key_report(const gchar *url, net_http_rawdata *data) {
+	const gchar *key = strstr(url, "affiliate_id=");
+	if (key == NULL) {
+		return FALSE;
+	}
+	key += strlen("affiliate_id=");
+	gchar *affiliate_id = g_strndup(key, strcspn(key, "&"));
+	gboolean throttled = wtr_keys_report(affiliate_id, data->http_code);
+	g_free(affiliate_id);
+	return throttled;
+}
+
 /**
  * @brief Parses an hourly forecast from Tiempo's XML and returns a wtr_forecast_hour.
  *
@@ -68,14 +102,18 @@ wtr_forecast_hour *wtr_forecast_parse_hour(xmlNode *xmlHour, wtr_forecast_day *d
 	hour->tstamp = g_date_time_new_local(g_date_time_get_year(day->date), g_date_time_get_month(day->date),
 	                                     g_date_time_get_day_of_month(day->date), hh, mm, 0);
 	g_date_time_unref(only_time);
-	g_free(value);
+	xmlFree(value);
 	for (xmlNode *child = xmlHour->children; child; child = child->next) {
 		if (g_strcmp0((const char *)child->name, "symbol") == 0) {
 			hour->weather = xmlGetPropInt(child, "value");
 		} else if (g_strcmp0((const char *)child->name, "temp") == 0) {
 			hour->temp = xmlGetPropInt(child, "value");
 		} else if (g_strcmp0((const char *)child->name, "wind") == 0) {
-			hour->wind_dir = (char *)xmlGetProp(child, (const xmlChar *)"dir");
+			// Strings of libxml2 must be freed with xmlFree(), the forecasts are freed with g_free()
+			xmlChar *dir = xmlGetProp(child, (const xmlChar *)"dir");
+			g_free(hour->wind_dir);
+			hour->wind_dir = dir != NULL ? g_strdup((const gchar *)dir) : NULL;
+			xmlFree(dir);
 			hour->wind_speed = xmlGetPropInt(child, "value");
 		} else if (g_strcmp0((const char *)child->name, "rain") == 0) {
 			hour->rain = xmlGetPropDouble(child, "value");
@@ -104,7 +142,7 @@ wtr_forecast_day *wtr_forecast_parse_day(xmlNode *xmlDay) {
 	char *value = (char *)xmlGetProp(xmlDay, (const xmlChar *)"value");
 	day->date = parseDateTime(value, "%Y%m%d");
 	// printf("Day: %s\n", value);
-	g_free(value);
+	xmlFree(value);
 	for (xmlNode *child = xmlDay->children; child; child = child->next) {
 		if (g_strcmp0((const char *)child->name, "symbol") == 0) {
 			day->weather = xmlGetPropInt(child, "value");
@@ -129,45 +167,452 @@ wtr_forecast_day *wtr_forecast_parse_day(xmlNode *xmlDay) {
 }
 
 /**
- * @brief Parses a 5-day forecast from Tiempo's XML and returns a wtr_forecast.
+ * @brief Incremental parser of Tiempo's XML forecasts.
  *
- * Tiempo API provides weather forecasts in XML format. This function converts the
- * specified 5-days forecast to a libweather's wtr_forecast struct.
+ * The XML is parsed chunk by chunk, as soon as it's available, by a libxml2
+ * push parser that builds the document tree. The parser stops as soon as a
+ * @c day element past the requested ones begins, so that the rest of the
+ * document doesn't need to be received nor parsed.
+ */
+struct wtr_tiempo_parser {
+	/// libxml2 push parser context (its @c _private member points to the wtr_tiempo_parser).
+	xmlParserCtxtPtr ctxt;
+	/// Number of days to parse, 0 to parse all of them.
+	guint days;
+	/// Number of @c day elements completely parsed so far.
+	guint days_parsed;
+	/// TRUE if the parser stopped because the document has more days than the requested ones.
+	gboolean enough;
+	/// TRUE if some @c hour elements were dropped because the memory is under pressure.
+	gboolean hours_dropped;
+	/// Bytes fed to the parser so far.
+	gsize fed;
+	/// Time spent parsing so far, in µs (the time spent waiting for the chunks is not counted).
+	gint64 busy_us;
+};
+
+/**
+ * @brief SAX2 start element handler that stops the parser when a day past the requested ones begins.
  *
- * @param[in] report The @c report tag (libxml2), which is the root of Tiempo's XML forecasts.
- * @return The 5-days forecasts as a wtr_forecast.
- * @warning The caller of this function must free the wtr_forecast with wtr_forecast_free().
+ * Stopping there, rather than at the end of the last requested day, tells a
+ * document that has exactly the requested days (i.e. a complete one) from a
+ * longer one. Otherwise the default libxml2 handler builds the tree as usual.
  */
-wtr_forecast *wtr_forecast_parse(char *content, size_t length) {
+void wtr_tiempo_parser_start_element(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI,
+                                     int nb_namespaces, const xmlChar **namespaces, int nb_attributes, int nb_defaulted,
+                                     const xmlChar **attributes) {
+	xmlParserCtxtPtr ctxt = (xmlParserCtxtPtr)ctx;
+	wtr_tiempo_parser *parser = (wtr_tiempo_parser *)ctxt->_private;
+	// ctxt->node is the parent of the element that begins
+	if (parser->days > 0 && parser->days_parsed >= parser->days && g_strcmp0((const char *)localname, "day") == 0 &&
+	    ctxt->node != NULL && g_strcmp0((const char *)ctxt->node->name, "location") == 0) {
+		parser->enough = TRUE;
+		xmlStopParser(ctxt);
+		return;
+	}
+	xmlSAX2StartElementNs(ctx, localname, prefix, URI, nb_namespaces, namespaces, nb_attributes, nb_defaulted, attributes);
+}
+
+/**
+ * @brief SAX2 end element handler that counts the completely parsed days.
+ *
+ * The default libxml2 handler is called first, so that the tree is built as
+ * usual. When the memory is under pressure the @c hour elements are removed
+ * from the tree as soon as they are complete.
+ */
+void wtr_tiempo_parser_end_element(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI) {
+	xmlParserCtxtPtr ctxt = (xmlParserCtxtPtr)ctx;
+	wtr_tiempo_parser *parser = (wtr_tiempo_parser *)ctxt->_private;
+	xmlSAX2EndElementNs(ctx, localname, prefix, URI);
+	if (g_strcmp0((const char *)localname, "hour") == 0 && ctxt->node != NULL && ctxt->node->last != NULL && mem_pressure()) {
+		xmlNodePtr hour = ctxt->node->last;
+		xmlUnlinkNode(hour);
+		xmlFreeNode(hour);
+		parser->hours_dropped = TRUE;
+		return;
+	}
+	// Now ctxt->node is the parent of the element that was just closed
+	if (g_strcmp0((const char *)localname, "day") == 0 && ctxt->node != NULL &&
+	    g_strcmp0((const char *)ctxt->node->name, "location") == 0) {
+		++parser->days_parsed;
+	}
+}
+
+wtr_tiempo_parser *wtr_tiempo_parser_new(guint days) {
+	wtr_tiempo_parser *parser = (wtr_tiempo_parser *)g_malloc(sizeof(wtr_tiempo_parser));
+	xmlSAXHandler sax;
+	xmlSAXVersion(&sax, 2);
+	sax.startElementNs = wtr_tiempo_parser_start_element;
+	sax.endElementNs = wtr_tiempo_parser_end_element;
 	// The document being in memory, it have no base per RFC 2396,
 	// and the "noname.xml" argument will serve as its base.
-	xmlDocPtr doc = xmlReadMemory(content, length, "noname.xml", NULL, 0);
-	if (doc == NULL) {
-		fprintf(stderr, "Failed to parse document\n");
+	parser->ctxt = xmlCreatePushParserCtxt(&sax, NULL, NULL, 0, "noname.xml");
+	parser->ctxt->_private = parser;
+	parser->days = days;
+	parser->days_parsed = 0;
+	parser->enough = FALSE;
+	parser->hours_dropped = FALSE;
+	parser->fed = 0;
+	parser->busy_us = 0;
+	return parser;
+}
+
+/**
+ * @brief Feeds a chunk of Tiempo's XML forecasts to the parser.
+ *
+ * @param[in,out] parser The parser.
+ * @param[in] chunk Chunk of XML (it doesn't need to be NULL-terminated).
+ * @param[in] len Length of the chunk.
+ * @return TRUE if the parser needs more data, FALSE if it already parsed all the requested days or if the XML is malformed.
+ */
+gboolean wtr_tiempo_parser_feed(wtr_tiempo_parser *parser, const char *chunk, size_t len) {
+	if (parser->enough) {
+		return FALSE;
+	}
+	gint64 start = g_get_monotonic_time();
+	int error = xmlParseChunk(parser->ctxt, chunk, len, 0);
+	parser->busy_us += g_get_monotonic_time() - start;
+	parser->fed += len;
+	return !parser->enough && error == 0;
+}
+
+void wtr_tiempo_parser_free(wtr_tiempo_parser *parser) {
+	xmlFreeDoc(parser->ctxt->myDoc);
+	xmlFreeParserCtxt(parser->ctxt);
+	g_free(parser);
+}
+
+/**
+ * @brief Returns the number of hourly forecasts of all the days (0 if @p forecast is NULL).
+ */
+guint wtr_tiempo_hours_count(wtr_forecast *forecast) {
+	guint count = 0;
+	for (GList *day = forecast != NULL ? forecast->days : NULL; day != NULL; day = day->next) {
+		count += g_list_length(((wtr_forecast_day *)day->data)->hours);
+	}
+	return count;
+}
+
+/**
+ * @brief Builds the wtr_forecast from the tree of the parsed Tiempo's XML (see wtr_tiempo_parser_convert()).
+ */
+wtr_forecast *wtr_tiempo_parser_build(wtr_tiempo_parser *parser) {
+	if (!parser->enough) {
+		xmlParseChunk(parser->ctxt, NULL, 0, 1);
+	}
+	xmlDocPtr doc = parser->ctxt->myDoc;
+	gboolean ok = doc != NULL && (parser->enough || parser->ctxt->wellFormed);
+	guint days = parser->days;
+	gboolean hours_dropped = parser->hours_dropped;
+	parser->ctxt->myDoc = NULL;
+	if (!ok) {
+		events_log(EVENTS_ERROR, "Failed to parse document");
+		xmlFreeDoc(doc);
+		metrics_add(METRICS_PARSE_ERRORS, 1);
 		return NULL;
 	}
 	xmlNode *report = xmlDocGetRootElement(doc);
 	if (g_strcmp0((const char *)report->name, "report") != 0) {
-		fprintf(stderr, "Tiempo XML parsing error: root element report not found.\n");
+		events_log(EVENTS_ERROR, "Tiempo XML parsing error: root element report not found.");
+		xmlFreeDoc(doc);
+		metrics_add(METRICS_PARSE_ERRORS, 1);
 		return NULL;
 	}
 	xmlNode *location = report->children;
-	if (g_strcmp0((const char *)location->name, "location") != 0) {
-		fprintf(stderr, "Tiempo XML parsing error: location element inside report not found.\n");
+	if (location == NULL || g_strcmp0((const char *)location->name, "location") != 0) {
+		events_log(EVENTS_ERROR, "Tiempo XML parsing error: location element inside report not found.");
+		xmlFreeDoc(doc);
+		metrics_add(METRICS_PARSE_ERRORS, 1);
 		return NULL;
 	}
 	wtr_forecast *forecast = wtr_forecast_init();
-	for (xmlNode *child = location->children; child; child = child->next) {
+	guint count = 0;
+	for (xmlNode *child = location->children; child && (days == 0 || count < days); child = child->next) {
 		// Inside location there are other elements, such as "interesting"
 		if (g_strcmp0((const char *)child->name, "day") != 0) {
 			continue;
 		}
 		forecast->days = g_list_append(forecast->days, wtr_forecast_parse_day(child));
+		++count;
 	}
 	xmlFreeDoc(doc);
+	forecast->hours_dropped = hours_dropped;
+	metrics_add(METRICS_PARSE_DOCUMENTS, 1);
+	return forecast;
+}
+
+/**
+ * @brief Converts the parsed Tiempo's XML to a wtr_forecast, leaving the parser ready to be reset.
+ *
+ * If the parser didn't stop by itself the XML is assumed to be complete. The
+ * duration of the whole parse, whether the document was fed at once or
+ * streamed, is recorded in the metrics and passed to the forecast__parse
+ * probe.
+ *
+ * @param[in] parser The parser; the document it built is freed by this function.
+ * @return The parsed forecasts, or NULL if the XML was malformed.
+ * @warning The caller of this function must free the wtr_forecast with wtr_forecast_free().
+ */
+wtr_forecast *wtr_tiempo_parser_convert(wtr_tiempo_parser *parser) {
+	gint64 start = g_get_monotonic_time();
+	wtr_forecast *forecast = wtr_tiempo_parser_build(parser);
+	parser->busy_us += g_get_monotonic_time() - start;
+	metrics_record(METRICS_PARSE_DURATION, parser->busy_us);
+	if (WTR_PROBE_ENABLED(libweather, forecast__parse)) {
+		WTR_PROBE4(libweather, forecast__parse, parser->fed, forecast != NULL ? g_list_length(forecast->days) : 0,
+		           wtr_tiempo_hours_count(forecast), parser->busy_us);
+	}
+	return forecast;
+}
+
+/**
+ * @brief Converts the parsed Tiempo's XML to a wtr_forecast and frees the parser.
+ *
+ * @param[in] parser The parser; it's freed by this function.
+ * @return The parsed forecasts, or NULL if the XML was malformed.
+ * @warning The caller of this function must free the wtr_forecast with wtr_forecast_free().
+ */
+wtr_forecast *wtr_tiempo_parser_finish(wtr_tiempo_parser *parser) {
+	wtr_forecast *forecast = wtr_tiempo_parser_convert(parser);
+	xmlFreeParserCtxt(parser->ctxt);
+	g_free(parser);
+	return forecast;
+}
+
+/**
+ * @brief Resets a parser, so that it can parse another document.
+ *
+ * The libxml2 context, with its dictionary of names, is kept.
+ */
+void wtr_tiempo_parser_reset(wtr_tiempo_parser *parser) {
+	xmlCtxtResetPush(parser->ctxt, NULL, 0, "noname.xml", NULL);
+	parser->ctxt->_private = parser;
+	parser->days_parsed = 0;
+	parser->enough = FALSE;
+	parser->hours_dropped = FALSE;
+	parser->fed = 0;
+	parser->busy_us = 0;
+}
+
+/**
+ * @brief Parses a whole document, recording how long it took.
+ */
+wtr_forecast *wtr_tiempo_parser_parse(wtr_tiempo_parser *parser, const char *content, size_t length) {
+	wtr_tiempo_parser_reset(parser);
+	wtr_tiempo_parser_feed(parser, content, length);
+	return wtr_tiempo_parser_convert(parser);
+}
+
+/**
+ * @brief Parses a 5-day forecast from Tiempo's XML and returns a wtr_forecast.
+ *
+ * Tiempo API provides weather forecasts in XML format. This function converts the
+ * specified 5-days forecast to a libweather's wtr_forecast struct. Only the first
+ * @p days days are parsed: the rest of the XML is not even read.
+ *
+ * @param[in] content Tiempo's XML forecasts.
+ * @param[in] length Length of the XML.
+ * @param[in] days Number of days to parse, 0 to parse all of them.
+ * @return The forecasts as a wtr_forecast, or NULL if the XML was malformed.
+ * @warning The caller of this function must free the wtr_forecast with wtr_forecast_free().
+ */
+wtr_forecast *wtr_forecast_parse(char *content, size_t length, guint days) {
+	wtr_tiempo_parser *parser = wtr_tiempo_parser_new(days);
+	wtr_forecast *forecast = wtr_tiempo_parser_parse(parser, content, length);
+	wtr_tiempo_parser_free(parser);
+	return forecast;
+}
+
+/**
+ * @brief A Tiempo's XML download in progress.
+ */
+typedef struct {
+	/// Parser of the downloaded XML.
+	wtr_tiempo_parser *parser;
+	/// Cache entry the XML is written into, NULL if it can't be cached.
+	wtr_cache_writer *cache;
+	/// Hash of the XML downloaded so far.
+	xxh64_state hash;
+	/// TRUE if the whole XML was received, even if the parser stopped before its end.
+	gboolean complete;
+} wtr_tiempo_download;
+
+/**
+ * @brief Tells whether a chunk of XML ends with the end of a Tiempo's document (the closing tag of @c report).
+ */
+gboolean wtr_tiempo_xml_ends(const gchar *chunk, size_t len) {
+	static const gchar end_tag[] = "</report>";
+	while (len > 0 && g_ascii_isspace(chunk[len - 1])) {
+		--len;
+	}
+	return len >= strlen(end_tag) && memcmp(chunk + len - strlen(end_tag), end_tag, strlen(end_tag)) == 0;
+}
+
+/**
+ * @brief Streams the downloaded XML into the parser and the cache at the same time (net_http_write_func).
+ *
+ * The transfer is aborted as soon as the parser doesn't need more data,
+ * unless the chunk that stopped the parser already ends the document: then
+ * the transfer is completed, so that the document can be cached. If the
+ * cache can't be written the download goes on without caching.
+ */
+gboolean wtr_tiempo_download_write(const gchar *chunk, size_t len, gpointer user_data) {
+	wtr_tiempo_download *download = (wtr_tiempo_download *)user_data;
+	if (download->cache != NULL && !wtr_cache_writer_write(download->cache, chunk, len)) {
+		wtr_cache_writer_abort(download->cache);
+		download->cache = NULL;
+	}
+	xxh64_update(&download->hash, chunk, len);
+	if (download->complete || wtr_tiempo_parser_feed(download->parser, chunk, len)) {
+		return TRUE;
+	}
+	download->complete = download->parser->enough && wtr_tiempo_xml_ends(chunk, len);
+	return download->complete;
+}
+
+/// Most recent complete forecasts of each location, as code -> wtr_forecast (protected by wtr_tiempo_memo_lock).
+static GHashTable *wtr_tiempo_memo = NULL;
+/// Serializes the access to wtr_tiempo_memo.
+static GMutex wtr_tiempo_memo_lock;
+/// Memory taken by wtr_tiempo_memo, as accounted in the memory budget.
+static gsize wtr_tiempo_memo_bytes = 0;
+
+/**
+ * @brief Returns an estimate of the memory taken by forecasts.
+ */
+gsize wtr_tiempo_forecast_size(wtr_forecast *forecast) {
+	gsize size = sizeof(wtr_forecast);
+	for (GList *day = forecast->days; day != NULL; day = day->next) {
+		size += sizeof(GList) + sizeof(wtr_forecast_day);
+		for (GList *hour = ((wtr_forecast_day *)day->data)->hours; hour != NULL; hour = hour->next) {
+			gchar *wind_dir = ((wtr_forecast_hour *)hour->data)->wind_dir;
+			size += sizeof(GList) + sizeof(wtr_forecast_hour) + (wind_dir != NULL ? strlen(wind_dir) + 1 : 0);
+		}
+	}
+	return size;
+}
+
+/**
+ * @brief Tells whether some forecasts of a location are memoized, whatever document they were parsed from.
+ */
+gboolean wtr_tiempo_memo_has(gchar *code) {
+	g_mutex_lock(&wtr_tiempo_memo_lock);
+	gboolean found = wtr_tiempo_memo != NULL && g_hash_table_contains(wtr_tiempo_memo, code);
+	g_mutex_unlock(&wtr_tiempo_memo_lock);
+	return found;
+}
+
+/**
+ * @brief Drops the memoized forecasts of a location, if any (wtr_tiempo_memo_lock must be held).
+ */
+void wtr_tiempo_memo_remove(gchar *code) {
+	wtr_forecast *old = g_hash_table_lookup(wtr_tiempo_memo, code);
+	if (old != NULL) {
+		gsize old_size = wtr_tiempo_forecast_size(old);
+		mem_release(old_size);
+		wtr_tiempo_memo_bytes -= old_size;
+		g_hash_table_remove(wtr_tiempo_memo, code);
+	}
+}
+
+/**
+ * @brief Counts forecasts found already parsed, in the memo or in the shared memory cache, as a cache hit.
+ */
+void wtr_tiempo_parsed_hit(gchar *code) {
+	metrics_add(METRICS_CACHE_HITS, 1);
+	if (WTR_PROBE_ENABLED(libweather, cache__hit)) {
+		gchar *entry = g_strconcat(WTR_DRIVER_TIEMPO, "-", code, NULL);
+		WTR_PROBE2(libweather, cache__hit, entry, 0);
+		g_free(entry);
+	}
+}
+
+/**
+ * @brief Returns a copy of the memoized forecasts of a location, if they were parsed from a document with the given hash.
+ *
+ * @param[in] code Tiempo location code.
+ * @param[in] hash Hash of the cached document.
+ * @param[in] days Number of days to copy, 0 to copy all of them.
+ * @return A copy of the memoized forecasts, or NULL if they are missing or come from another document.
+ */
+wtr_forecast *wtr_tiempo_memo_get(gchar *code, guint64 hash, guint days) {
+	wtr_forecast *forecast = NULL;
+	g_mutex_lock(&wtr_tiempo_memo_lock);
+	wtr_forecast *memo = wtr_tiempo_memo != NULL ? g_hash_table_lookup(wtr_tiempo_memo, code) : NULL;
+	if (memo != NULL && memo->hash == hash) {
+		forecast = wtr_forecast_copy(memo, days);
+	}
+	g_mutex_unlock(&wtr_tiempo_memo_lock);
 	return forecast;
 }
 
+/**
+ * @brief Memoizes a copy of the complete forecasts of a location.
+ *
+ * The forecasts are published in the shared memory cache too (if attached),
+ * for the other processes on the same host.
+ *
+ * Forecasts whose hourly forecasts were dropped to save memory are not
+ * memoized, since memory is short, but they go into the shared memory cache
+ * flagged as such (see wtr_shm_set()). Forecasts without a hash (0) can't be
+ * looked up, so they are not memoized. At most WTR_MEMO_MAX_LOCATIONS
+ * locations are memoized, an arbitrary one is dropped to make room for a new
+ * one; when the memory is under pressure the memoized forecasts of all the
+ * locations are dropped.
+ *
+ * @param[in] code Tiempo location code.
+ * @param[in] forecast Forecasts parsed from a complete document, with its hash.
+ */
+void wtr_tiempo_memo_set(gchar *code, wtr_forecast *forecast) {
+	gsize size = wtr_tiempo_forecast_size(forecast);
+	g_mutex_lock(&wtr_tiempo_memo_lock);
+	if (wtr_tiempo_memo == NULL) {
+		wtr_tiempo_memo = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)wtr_forecast_free);
+	}
+	wtr_tiempo_memo_remove(code);
+	if (g_hash_table_size(wtr_tiempo_memo) >= WTR_MEMO_MAX_LOCATIONS) {
+		GHashTableIter iter;
+		gpointer victim;
+		g_hash_table_iter_init(&iter, wtr_tiempo_memo);
+		if (g_hash_table_iter_next(&iter, &victim, NULL)) {
+			wtr_tiempo_memo_remove((gchar *)victim);
+		}
+	}
+	if (forecast->hash == 0 || forecast->hours_dropped) {
+		// Nothing to memoize
+	} else if (mem_pressure() || !mem_charge(size)) {
+		mem_release(wtr_tiempo_memo_bytes);
+		wtr_tiempo_memo_bytes = 0;
+		g_hash_table_remove_all(wtr_tiempo_memo);
+	} else {
+		g_hash_table_replace(wtr_tiempo_memo, g_strdup(code), wtr_forecast_copy(forecast, 0));
+		wtr_tiempo_memo_bytes += size;
+	}
+	g_mutex_unlock(&wtr_tiempo_memo_lock);
+	wtr_shm_set(WTR_DRIVER_TIEMPO, code, forecast);
+}
+
+/**
+ * @brief Checks the outcome of an HTTP call to Tiempo's API.
+ *
+ * Errors are reported on the standard error, prefixed by the name of the caller.
+ *
+ * @param[in] caller Name of the calling function, for the error messages.
+ * @param[in] data Result of the HTTP call.
+ * @return TRUE if the call succeeded and its body can be parsed, FALSE otherwise.
+ */
+gboolean wtr_tiempo_response_ok(const gchar *caller, net_http_rawdata *data) {
+	// A wrong status code comes first: it's likely the reason why a streamed body was rejected
+	if (data->http_code != 0 && data->http_code != 200) {
+		events_log(EVENTS_ERROR, "%s HTTP status code %lu", caller, data->http_code);
+		return FALSE;
+	} else if (data->curl_code) {
+		events_log(EVENTS_ERROR, "%s curl error %u: %s", caller, data->curl_code, curl_easy_strerror(data->curl_code));
+		return FALSE;
+	}
+	return TRUE;
+}
+
 /**
  * @brief Gets Tiempo's 5-days forecasts via their HTTP API.
  *
@@ -175,32 +620,331 @@ wtr_forecast *wtr_forecast_parse(char *content, size_t length) {
  * makes an HTTP GET call, gets the XML forecasts and returns them as a libweather's
  * wtr_forecast structure.
  *
+ * The XML is parsed and written into the cache while it's being downloaded, without
+ * keeping it in memory; the cache entry is published only after a successful parse.
+ * If only some days are requested the download is aborted as soon as they have been
+ * parsed, unless the whole XML was received anyway. A truncated XML is never cached,
+ * and only the forecasts of all the days are archived.
+ * Complete forecasts are memoized along with the hash of their XML, so that the same
+ * cached XML is never parsed twice by the same process, and shared with the other
+ * processes via the shared memory cache, which is looked up first; both are valid
+ * only while the hash of the cached XML matches.
+ *
  * @warning The caller of this function must free the wtr_forecast with wtr_forecast_free().
  */
-wtr_forecast *wtr_tiempo_forecast_get(gchar *code) {
+wtr_forecast *wtr_tiempo_forecast_get(gchar *code, guint days) {
+	wtr_popularity_hit(WTR_DRIVER_TIEMPO, code);
 	wtr_forecast *forecast = NULL;
+	guint64 hash;
+	// If the cached XML was already parsed, by any process on this host or by this one, don't parse it again
+	gboolean hashed = wtr_cache_get_hash(WTR_DRIVER_TIEMPO, code, &hash);
+	if (hashed && ((forecast = wtr_shm_get(WTR_DRIVER_TIEMPO, code, hash, days)) != NULL ||
+	               (forecast = wtr_tiempo_memo_get(code, hash, days)) != NULL)) {
+		wtr_tiempo_parsed_hit(code);
+		if (days == 0) {
+			wtr_alerts_update(code, forecast);
+		}
+		return forecast;
+	}
 	gchar *cached_xml = wtr_cache_get(WTR_DRIVER_TIEMPO, code);
 	if (cached_xml != NULL) {
-		// Use the cached XML
-		forecast = wtr_forecast_parse(cached_xml, strlen(cached_xml));
+		// Use the cached XML; the hash file, written after it, tells which document it is
+		forecast = wtr_forecast_parse(cached_xml, strlen(cached_xml), days);
+		if (forecast != NULL && days == 0) {
+			forecast->hash = hashed ? hash : 0;
+			wtr_tiempo_memo_set(code, forecast);
+			wtr_alerts_update(code, forecast);
+		}
 		g_free(cached_xml);
 	} else {
 		// Cache miss, must download the forecasts XML via the HTTP API
 		gchar *url = wtr_tiempo_forecast_url(code);
-		net_http_rawdata data = net_http_get(url);
+		wtr_tiempo_download download = {wtr_tiempo_parser_new(days), wtr_cache_writer_new(WTR_DRIVER_TIEMPO, code)};
+		download.complete = FALSE;
+		xxh64_init(&download.hash, 0);
+		net_http_rawdata data = net_http_get_stream(url, wtr_tiempo_download_write, &download);
+		wtr_tiempo_key_report(url, &data);
 		g_free(url);
-		if (data.curl_code) {
-			g_printerr("wtr_tiempo_forecast_get curl error %u: %s\n", data.curl_code, curl_easy_strerror(data.curl_code));
-		} else if (data.http_code != 200) {
-			g_printerr("wtr_tiempo_forecast_get HTTP status code %lu\n", data.http_code);
-		} else {
-			forecast = wtr_forecast_parse(data.buffer, data.len);
-			// Don't cache incorrect XML data
-			if (forecast != NULL) {
-				wtr_cache_set(WTR_DRIVER_TIEMPO, code, data.buffer);
+		// If the parser got all the days it needed the transfer was aborted on purpose
+		gboolean truncated = download.parser->enough && !download.complete;
+		if (truncated && data.curl_code == CURLE_WRITE_ERROR) {
+			data.curl_code = CURLE_OK;
+		}
+		if (wtr_tiempo_response_ok("wtr_tiempo_forecast_get", &data)) {
+			forecast = wtr_tiempo_parser_finish(download.parser);
+			// Don't cache nor archive incorrect or incomplete XML data
+			if (forecast != NULL && !truncated) {
+				guint64 hash = xxh64_digest(&download.hash);
+				if (download.cache != NULL) {
+					wtr_cache_writer_commit(download.cache, hash);
+					download.cache = NULL;
+				}
+				// Only the forecasts of all the days stand for the whole document, even if it was all received
+				if (days == 0) {
+					wtr_archive_append(code, forecast);
+					forecast->hash = hash;
+					wtr_tiempo_memo_set(code, forecast);
+					wtr_alerts_update(code, forecast);
+				}
 			}
+		} else {
+			wtr_tiempo_parser_free(download.parser);
+		}
+		if (download.cache != NULL) {
+			wtr_cache_writer_abort(download.cache);
 		}
 		net_http_rawdata_free(&data);
 	}
 	return forecast;
 }
+
+/**
+ * @brief Requests again, once, the forecasts whose Affiliate ID was throttled, with the other keys of the pool.
+ *
+ * @param[in,out] requests The completed requests; the throttled ones are replaced.
+ * @param[in] codes Tiempo location codes of the requests.
+ * @param[in] count Number of requests.
+ */
+void wtr_tiempo_retry_throttled(net_http_request *requests, gchar **codes, guint count) {
+	guint *throttled = (guint *)g_malloc(sizeof(guint) * MAX(count, 1));
+	guint throttled_count = 0;
+	for (guint i = 0; i < count; ++i) {
+		if (wtr_tiempo_key_report(requests[i].url, &requests[i].data)) {
+			throttled[throttled_count++] = i;
+		}
+	}
+	if (throttled_count > 0 && wtr_keys_available() > 0) {
+		net_http_request *retries = (net_http_request *)g_malloc(sizeof(net_http_request) * throttled_count);
+		for (guint t = 0; t < throttled_count; ++t) {
+			guint i = throttled[t];
+			net_http_rawdata_free(&requests[i].data);
+			g_free((gchar *)requests[i].url);
+			retries[t].url = wtr_tiempo_forecast_url(codes[i]);
+			retries[t].write_func = NULL;
+			retries[t].user_data = NULL;
+		}
+		net_http_get_many(retries, throttled_count);
+		for (guint t = 0; t < throttled_count; ++t) {
+			wtr_tiempo_key_report(retries[t].url, &retries[t].data);
+			requests[throttled[t]] = retries[t];
+		}
+		g_free(retries);
+	}
+	g_free(throttled);
+}
+
+/**
+ * @brief Downloads Tiempo's forecasts for a batch of locations with a single bulk HTTP call.
+ *
+ * @param[in] codes Tiempo location codes.
+ * @param[in] count Number of location codes.
+ * @param[in,out] unchanged The number of refreshed locations whose forecasts didn't change is added here.
+ * @return Number of locations whose forecasts have been refreshed.
+ */
+guint wtr_tiempo_prefetch_batch(gchar **codes, guint count, guint *unchanged) {
+	net_http_request *requests = g_malloc(sizeof(net_http_request) * count);
+	for (guint i = 0; i < count; ++i) {
+		requests[i].url = wtr_tiempo_forecast_url(codes[i]);
+		requests[i].write_func = NULL;
+		requests[i].user_data = NULL;
+	}
+	net_http_get_many(requests, count);
+	wtr_tiempo_retry_throttled(requests, codes, count);
+	guint refreshed = 0;
+	guint same = 0;
+	// A single sync for all the locations instead of one each
+	wtr_cache_batch_begin();
+	for (guint i = 0; i < count; ++i) {
+		net_http_rawdata *data = &requests[i].data;
+		if (wtr_tiempo_response_ok("wtr_tiempo_forecast_prefetch", data)) {
+			guint64 hash = xxh64(data->buffer, data->len, 0);
+			guint64 cached_hash;
+			if (wtr_cache_get_hash(WTR_DRIVER_TIEMPO, codes[i], &cached_hash) && cached_hash == hash) {
+				wtr_cache_touch(WTR_DRIVER_TIEMPO, codes[i]);
+				// The windows of the rules move even if the forecasts don't change
+				if (wtr_alerts_watching(codes[i])) {
+					wtr_forecast *forecast = wtr_shm_get(WTR_DRIVER_TIEMPO, codes[i], hash, 0);
+					if (forecast == NULL && (forecast = wtr_tiempo_memo_get(codes[i], hash, 0)) == NULL &&
+					    (forecast = wtr_forecast_parse(data->buffer, data->len, 0)) != NULL) {
+						forecast->hash = hash;
+						wtr_tiempo_memo_set(codes[i], forecast);
+					}
+					if (forecast != NULL) {
+						wtr_alerts_update(codes[i], forecast);
+						wtr_forecast_free(forecast);
+					}
+				}
+				++same;
+				++refreshed;
+			} else {
+				wtr_forecast *forecast = wtr_forecast_parse(data->buffer, data->len, 0);
+				if (forecast != NULL) {
+					forecast->hash = hash;
+					wtr_archive_append(codes[i], forecast);
+					// A location whose document couldn't be cached was not refreshed (the error is logged)
+					if (wtr_cache_set_hashed(WTR_DRIVER_TIEMPO, codes[i], data->buffer, data->len, hash) != WTR_CACHE_FAILED) {
+						++refreshed;
+					}
+					wtr_tiempo_memo_set(codes[i], forecast);
+					wtr_alerts_update(codes[i], forecast);
+					wtr_forecast_free(forecast);
+				}
+			}
+		}
+		net_http_rawdata_free(data);
+		g_free((gchar *)requests[i].url);
+	}
+	wtr_cache_batch_commit();
+	g_free(requests);
+	*unchanged += same;
+	return refreshed;
+}
+
+/**
+ * @brief Downloads Tiempo's forecasts for many locations with bulk HTTP calls.
+ *
+ * The XML of every location is parsed before being cached, so that incorrect
+ * data never replaces good cached forecasts. XML identical to the cached one
+ * (same hash) is neither parsed nor written again.
+ *
+ * All the locations are requested at once, unless there is a memory budget:
+ * then the responses buffered at once must fit in half of the memory left.
+ */
+guint wtr_tiempo_forecast_prefetch(gchar **codes, guint count, guint *unchanged) {
+	guint refreshed = 0;
+	guint same = 0;
+	for (guint start = 0; start < count;) {
+		guint batch = count - start;
+		if (mem_budget() > 0) {
+			batch = (guint)CLAMP(mem_headroom() / 2 / WTR_MEMORY_DOCUMENT_SIZE, 1, batch);
+		}
+		refreshed += wtr_tiempo_prefetch_batch(codes + start, batch, &same);
+		start += batch;
+	}
+	if (unchanged != NULL) {
+		*unchanged = same;
+	}
+	return refreshed;
+}
+
+guint wtr_tiempo_forecast_refresh_popular(guint count, guint max_age, guint *stale, guint *unchanged) {
+	gchar **top = wtr_popularity_top(WTR_DRIVER_TIEMPO, count);
+	GPtrArray *codes = g_ptr_array_new();
+	for (guint i = 0; top[i] != NULL; ++i) {
+		gint64 age;
+		// Missing or about to go stale: warm forecasts are left alone
+		if (!wtr_cache_get_age(WTR_DRIVER_TIEMPO, top[i], &age) || age >= max_age) {
+			g_ptr_array_add(codes, top[i]);
+		}
+	}
+	if (stale != NULL) {
+		*stale = codes->len;
+	}
+	guint same = 0;
+	guint refreshed = codes->len > 0 ? wtr_tiempo_forecast_prefetch((gchar **)codes->pdata, codes->len, &same) : 0;
+	if (unchanged != NULL) {
+		*unchanged = same;
+	}
+	g_ptr_array_free(codes, TRUE);
+	g_strfreev(top);
+	return refreshed;
+}
+
+/**
+ * @brief A cached Tiempo's XML to be parsed by wtr_tiempo_forecast_get_cached().
+ */
+typedef struct {
+	/// Tiempo location code.
+	gchar *code;
+	/// The cached XML.
+	gchar *xml;
+	/// Length of the XML.
+	gsize length;
+	/// Hash of the XML, 0 if it was not computed yet.
+	guint64 hash;
+	/// Where to store the parsed forecasts.
+	wtr_forecast **forecast;
+} wtr_tiempo_cached;
+
+/**
+ * @brief Parses a cached XML on a thread of the pool and memoizes the forecasts (GFunc).
+ */
+void wtr_tiempo_cached_parse(gpointer item, gpointer user_data) {
+	wtr_tiempo_cached *cached = (wtr_tiempo_cached *)item;
+	wtr_forecast *forecast = wtr_forecast_parse(cached->xml, cached->length, 0);
+	if (forecast != NULL) {
+		// The document is hashed only if its forecasts can be memoized
+		forecast->hash = cached->hash != 0 || mem_pressure() ? cached->hash : xxh64(cached->xml, cached->length, 0);
+		wtr_tiempo_memo_set(cached->code, forecast);
+	}
+	*cached->forecast = forecast;
+	g_free(cached->xml);
+	g_free(cached);
+}
+
+/**
+ * @brief Looks up the shared memory cache, then reads the remaining documents in a batch and parses them on a pool of threads.
+ */
+guint wtr_tiempo_forecast_get_cached(gchar **codes, guint count, wtr_forecast **forecasts) {
+	gchar **missing = (gchar **)g_malloc(sizeof(gchar *) * MAX(count, 1));
+	guint *missing_index = (guint *)g_malloc(sizeof(guint) * MAX(count, 1));
+	guint missing_count = 0;
+	for (guint i = 0; i < count; ++i) {
+		guint64 hash;
+		forecasts[i] = wtr_cache_get_hash(WTR_DRIVER_TIEMPO, codes[i], &hash) ? wtr_shm_get(WTR_DRIVER_TIEMPO, codes[i], hash, 0) : NULL;
+		if (forecasts[i] != NULL) {
+			wtr_tiempo_parsed_hit(codes[i]);
+		} else {
+			missing[missing_count] = codes[i];
+			missing_index[missing_count++] = i;
+		}
+	}
+	gchar **xml = (gchar **)g_malloc(sizeof(gchar *) * MAX(missing_count, 1));
+	gsize *lengths = (gsize *)g_malloc(sizeof(gsize) * MAX(missing_count, 1));
+	wtr_cache_get_many(WTR_DRIVER_TIEMPO, missing, missing_count, xml, lengths);
+	GThreadPool *pool = g_thread_pool_new(wtr_tiempo_cached_parse, NULL, g_get_num_processors(), FALSE, NULL);
+	for (guint m = 0; m < missing_count; ++m) {
+		if (xml[m] == NULL) {
+			continue;
+		}
+		wtr_tiempo_cached *cached = (wtr_tiempo_cached *)g_malloc(sizeof(wtr_tiempo_cached));
+		cached->code = missing[m];
+		cached->xml = xml[m];
+		cached->length = lengths[m];
+		cached->hash = 0;
+		cached->forecast = &forecasts[missing_index[m]];
+		// If the cached XML was already parsed, don't parse it again (the hash is needed only to tell)
+		if (wtr_tiempo_memo_has(cached->code)) {
+			cached->hash = xxh64(xml[m], lengths[m], 0);
+			*cached->forecast = wtr_tiempo_memo_get(cached->code, cached->hash, 0);
+		}
+		if (*cached->forecast != NULL) {
+			wtr_tiempo_parsed_hit(cached->code);
+			g_free(cached->xml);
+			g_free(cached);
+		} else if (pool == NULL || !g_thread_pool_push(pool, cached, NULL)) {
+			wtr_tiempo_cached_parse(cached, NULL);
+		}
+	}
+	if (pool != NULL) {
+		g_thread_pool_free(pool, FALSE, TRUE);
+	}
+	g_free(lengths);
+	g_free(xml);
+	g_free(missing_index);
+	g_free(missing);
+	guint found = 0;
+	for (guint i = 0; i < count; ++i) {
+		if (forecasts[i] != NULL) {
+			// Wherever they come from, the forecasts of all the days
+			wtr_alerts_update(codes[i], forecasts[i]);
+			++found;
+		}
+	}
+	return found;
+}
+
+const wtr_driver *wtr_tiempo_driver(void) {
+	static const wtr_driver driver = {WTR_DRIVER_TIEMPO, wtr_tiempo_forecast_url, wtr_forecast_parse, wtr_tiempo_key_report};
+	return &driver;
+}
@@ -6,6 +6,8 @@
 #include <glib.h>
 #include <glib/gprintf.h>
 
+#include "libweather_driver.h"
+
 /**
  * @file libweather_tiempo.h
  * @brief Tiempo (ilmeteo.net) "driver" for libweather.
@@ -30,10 +32,106 @@
  * daily summaries and hourly details (the first 2 days have hour-by-hour details
  * while the next 3 days details refer to a 3 hour interval).
  *
+ * When only the first few days are needed, the download and the parsing stop
+ * as soon as they are available.
+ *
  * @param[in] code Tiempo location code.
- * @return Weather forecasts as wtr_forecast, with daily and hourly forecasts for the next 5 days.
+ * @param[in] days Number of days to get (starting from the current one), 0 to get all of them.
+ * @return Weather forecasts as wtr_forecast, with daily and hourly forecasts for the next 5 days (or @p days days); when
+ * all the days are requested its @c hash identifies the Tiempo document, so that unchanged forecasts can be detected.
  * @warning The caller has the responsibility to free the returned forecasts by calling wtr_forecast_free()
  */
-wtr_forecast *wtr_tiempo_forecast_get(gchar *code);
+wtr_forecast *wtr_tiempo_forecast_get(gchar *code, guint days);
+
+/**
+ * @brief Refresh the cached Tiempo forecasts of many locations at once.
+ *
+ * This function downloads the Tiempo (ilmeteo.net) forecasts of all the
+ * specified locations concurrently (see net_http_get_many()) and stores
+ * them in the cache, replacing the ones already there, so that the following
+ * calls to wtr_tiempo_forecast_get() don't need any network call. Forecasts
+ * identical to the cached ones are detected by their hash and skipped.
+ *
+ * When a pool of Affiliate IDs is enabled (see libweather_keys.h) the
+ * requests are spread over its keys, and those throttled are tried again
+ * once with the other keys.
+ *
+ * @param[in] codes Tiempo location codes.
+ * @param[in] count Number of location codes.
+ * @param[out] unchanged If not NULL, the number of refreshed locations whose forecasts didn't change will be stored here.
+ * @return Number of locations whose forecasts have been refreshed.
+ */
+guint wtr_tiempo_forecast_prefetch(gchar **codes, guint count, guint *unchanged);
+
+/**
+ * @brief Refresh the cached Tiempo forecasts of the most popular locations (see libweather_popularity.h).
+ *
+ * Only the forecasts that are missing or older than @p max_age are downloaded,
+ * so that the popular locations are always warm while the others are only
+ * fetched when somebody asks for them. Meant to be called periodically,
+ * more often than @p max_age.
+ *
+ * @param[in] count How many of the most popular locations to keep warm.
+ * @param[in] max_age Age, in seconds, after which cached forecasts are refreshed (e.g. WTR_POPULAR_REFRESH_AGE).
+ * @param[out] stale If not NULL, the number of popular locations whose forecasts were missing or too old will be stored here.
+ * @param[out] unchanged If not NULL, the number of refreshed locations whose forecasts didn't change will be stored here.
+ * @return Number of locations whose forecasts have been refreshed.
+ */
+guint wtr_tiempo_forecast_refresh_popular(guint count, guint max_age, guint *stale, guint *unchanged);
+
+/**
+ * @brief Get the cached Tiempo forecasts of many locations, without any network call.
+ *
+ * The cached documents are read together (see wtr_cache_get_many()) and
+ * parsed in parallel; forecasts already parsed by this process or available
+ * in the shared memory cache are not parsed again.
+ *
+ * @param[in] codes Tiempo location codes.
+ * @param[in] count Number of location codes.
+ * @param[out] forecasts For each location code, its forecasts or NULL if they are not cached.
+ * @return Number of locations whose forecasts were found.
+ * @warning The caller has the responsibility to free each returned forecast by calling wtr_forecast_free()
+ */
+guint wtr_tiempo_forecast_get_cached(gchar **codes, guint count, wtr_forecast **forecasts);
+
+/// Parser of Tiempo's XML forecasts, which keeps its state (e.g. the dictionary of names) between documents.
+typedef struct wtr_tiempo_parser wtr_tiempo_parser;
+
+/**
+ * @brief Creates a new parser of Tiempo's XML forecasts.
+ *
+ * A parser can parse many documents, one at a time, with
+ * wtr_tiempo_parser_parse(); threads parsing in parallel need a parser each.
+ *
+ * @param[in] days Number of days to parse, 0 to parse all of them.
+ * @return A new parser.
+ * @warning The parser must be freed with wtr_tiempo_parser_free().
+ */
+wtr_tiempo_parser *wtr_tiempo_parser_new(guint days);
+
+/**
+ * @brief Parses a whole Tiempo's XML document, reusing a parser.
+ *
+ * @param[in,out] parser The parser.
+ * @param[in] content Tiempo's XML forecasts (it doesn't need to be NULL-terminated).
+ * @param[in] length Length of the XML.
+ * @return The forecasts as a wtr_forecast, or NULL if the XML was malformed.
+ * @warning The caller has the responsibility to free the returned forecasts by calling wtr_forecast_free()
+ */
+wtr_forecast *wtr_tiempo_parser_parse(wtr_tiempo_parser *parser, const char *content, size_t length);
+
+/**
+ * @brief Frees a parser.
+ *
+ * @param[in] parser The parser to free.
+ */
+void wtr_tiempo_parser_free(wtr_tiempo_parser *parser);
+
+/**
+ * @brief Returns the Tiempo driver, for the dispatcher (see libweather_driver.h).
+ *
+ * Unlike wtr_tiempo_forecast_get(), the dispatcher only uses the filesystem cache.
+ */
+const wtr_driver *wtr_tiempo_driver(void);
 
 #endif  // #define __LIB_WEATHER_TIEMPO_H__
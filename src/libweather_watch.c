@@ -0,0 +1,226 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file libweather_watch.c
+ * @brief Notifications of the updates of the libweather cache (implementation).
+ *
+ * Cached documents are always published by renaming a complete temporary
+ * file into place, so an update is an @c IN_MOVED_TO event in the directory
+ * of today's cache (written in place by other tools, an @c IN_CLOSE_WRITE
+ * event). Temporary and hash files have a dot in their names and are
+ * ignored. The cache root is watched too, for the directory of the next day.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+// poll() is POSIX, not C99
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <glib.h>
+
+#include "libevents.h"
+#include "libweather_cache.h"
+#include "libweather_watch.h"
+
+/// Length of the name of a partition of the cache (YYYYMMDD).
+#define WTR_WATCH_PARTITION_LENGTH 8
+
+/**
+ * @brief A subscription to the updates of the cache.
+ */
+struct _wtr_watch {
+	/// The inotify instance.
+	int fd;
+	/// Watch descriptor of the cache root.
+	int root_wd;
+	/// Watch descriptor of the watched partition, -1 if none.
+	int day_wd;
+	/// Path of the cache root.
+	gchar *root;
+	/// Name of the watched partition (e.g. 20180308).
+	gchar *day;
+	/// Name of the "driver" whose updates are delivered, NULL for all of them.
+	gchar *driver;
+	/// Function called for each updated document.
+	wtr_watch_func func;
+	/// Data to pass to @c func.
+	gpointer user_data;
+};
+
+/**
+ * @brief Tells whether a name is the one of a partition of the cache (YYYYMMDD).
+ */
+gboolean wtr_watch_is_partition(const gchar *name) {
+	guint length = 0;
+	while (name[length] >= '0' && name[length] <= '9') {
+		++length;
+	}
+	return length == WTR_WATCH_PARTITION_LENGTH && name[length] == '\0';
+}
+
+/**
+ * @brief Collects a cached document named e.g. @c tiempo-8031 as updated, unless it's filtered out.
+ *
+ * @param[in] watch The subscription.
+ * @param[in] name Name of the file.
+ * @param[in,out] updated Updated documents, as "driver-code" names.
+ */
+void wtr_watch_collect(wtr_watch *watch, const gchar *name, GHashTable *updated) {
+	const gchar *separator = strchr(name, '-');
+	if (separator == NULL || separator == name || separator[1] == '\0' || strchr(name, '.') != NULL) {
+		return;
+	}
+	if (watch->driver == NULL ||
+	    (strlen(watch->driver) == (gsize)(separator - name) && strncmp(watch->driver, name, separator - name) == 0)) {
+		g_hash_table_add(updated, g_strdup(name));
+	}
+}
+
+#ifdef __linux__
+
+/**
+ * @brief Moves the watch onto a partition of the cache.
+ *
+ * The documents already in the partition are collected as updated, since
+ * they may have been published before the watch was added.
+ *
+ * @param[in] watch The subscription.
+ * @param[in] day Name of the partition.
+ * @param[in,out] updated Updated documents, or NULL not to collect the documents already there.
+ * @return TRUE on success, FALSE if the partition can't be watched.
+ */
+gboolean wtr_watch_follow(wtr_watch *watch, const gchar *day, GHashTable *updated) {
+	gchar *dir = g_build_filename(watch->root, day, NULL);
+	int wd = inotify_add_watch(watch->fd, dir, IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR);
+	if (wd >= 0) {
+		if (watch->day_wd >= 0 && watch->day_wd != wd) {
+			inotify_rm_watch(watch->fd, watch->day_wd);
+		}
+		watch->day_wd = wd;
+		g_free(watch->day);
+		watch->day = g_strdup(day);
+		GDir *handle = updated != NULL ? g_dir_open(dir, 0, NULL) : NULL;
+		const gchar *name;
+		while (handle != NULL && (name = g_dir_read_name(handle)) != NULL) {
+			wtr_watch_collect(watch, name, updated);
+		}
+		if (handle != NULL) {
+			g_dir_close(handle);
+		}
+	}
+	g_free(dir);
+	return wd >= 0;
+}
+
+wtr_watch *wtr_watch_new(const gchar *driver, wtr_watch_func func, gpointer user_data) {
+	wtr_watch *watch = (wtr_watch *)g_malloc0(sizeof(wtr_watch));
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	watch->root_wd = -1;
+	watch->day_wd = -1;
+	watch->root = wtr_cache_dir();
+	watch->driver = g_strdup(driver);
+	watch->func = func;
+	watch->user_data = user_data;
+	GDateTime *now = g_date_time_new_now_local();
+	gchar *today = g_date_time_format(now, "%Y%m%d");
+	gchar *today_dir = g_build_filename(watch->root, today, NULL);
+	g_date_time_unref(now);
+	// Today's partition may not exist yet
+	g_mkdir_with_parents(today_dir, 0755);
+	if (watch->fd >= 0) {
+		watch->root_wd = inotify_add_watch(watch->fd, watch->root, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+	}
+	gboolean ok = watch->root_wd >= 0 && wtr_watch_follow(watch, today, NULL);
+	if (!ok) {
+		events_log(EVENTS_ERROR, "wtr_watch_new can't watch %s: %s", today_dir, g_strerror(errno));
+		wtr_watch_free(watch);
+		watch = NULL;
+	}
+	g_free(today);
+	g_free(today_dir);
+	return watch;
+}
+
+gint wtr_watch_dispatch(wtr_watch *watch, gint timeout) {
+	struct pollfd pfd = {watch->fd, POLLIN, 0};
+	int ready = poll(&pfd, 1, timeout);
+	if (ready < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+	GHashTable *updated = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	gboolean overflow = FALSE;
+	union {
+		struct inotify_event event;
+		char bytes[4096];
+	} buffer;
+	ssize_t length;
+	while (ready > 0 && (length = read(watch->fd, &buffer, sizeof(buffer))) > 0) {
+		for (char *ptr = buffer.bytes; ptr < buffer.bytes + length;) {
+			struct inotify_event *event = (struct inotify_event *)ptr;
+			if (event->mask & IN_Q_OVERFLOW) {
+				overflow = TRUE;
+			} else if (event->wd == watch->root_wd && (event->mask & IN_ISDIR) && event->len > 0 &&
+			           wtr_watch_is_partition(event->name) && strcmp(event->name, watch->day) > 0) {
+				// The next day began: its documents replace those of the day before
+				wtr_watch_follow(watch, event->name, updated);
+			} else if (event->wd == watch->day_wd && !(event->mask & IN_ISDIR) && event->len > 0) {
+				wtr_watch_collect(watch, event->name, updated);
+			}
+			ptr += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	gint delivered = overflow ? 1 : g_hash_table_size(updated);
+	if (overflow) {
+		events_log(EVENTS_WARNING, "wtr_watch_dispatch lost some updates of the cache");
+		watch->func(NULL, NULL, watch->user_data);
+	} else {
+		GHashTableIter iter;
+		gpointer name;
+		g_hash_table_iter_init(&iter, updated);
+		while (g_hash_table_iter_next(&iter, &name, NULL)) {
+			gchar *separator = strchr((gchar *)name, '-');
+			*separator = '\0';
+			watch->func((gchar *)name, separator + 1, watch->user_data);
+		}
+	}
+	g_hash_table_destroy(updated);
+	return delivered;
+}
+
+#else
+
+wtr_watch *wtr_watch_new(const gchar *driver, wtr_watch_func func, gpointer user_data) {
+	events_log(EVENTS_ERROR, "wtr_watch_new notifications are only available on Linux");
+	return NULL;
+}
+
+gint wtr_watch_dispatch(wtr_watch *watch, gint timeout) {
+	return -1;
+}
+
+#endif
+
+int wtr_watch_fd(wtr_watch *watch) {
+	return watch->fd;
+}
+
+void wtr_watch_free(wtr_watch *watch) {
+	if (watch != NULL) {
+		if (watch->fd >= 0) {
+			close(watch->fd);
+		}
+		g_free(watch->driver);
+		g_free(watch->day);
+		g_free(watch->root);
+		g_free(watch);
+	}
+}
@@ -0,0 +1,86 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+#ifndef __LIBWEATHER_WATCH_H__
+#define __LIBWEATHER_WATCH_H__
+
+#include <glib.h>
+
+/**
+ * @file libweather_watch.h
+ * @brief Notifications of the updates of the libweather cache.
+ *
+ * Processes that keep forecasts in memory (or render them) can subscribe to
+ * the updates of the filesystem cache made by any process, e.g. by a
+ * periodic prefetch, and invalidate exactly the locations whose documents
+ * changed instead of polling the cache.
+ *
+ * A subscription has a file descriptor that becomes readable when there are
+ * updates, so that it can be added to an event loop (@c poll, @c epoll,
+ * @c g_unix_fd_add, ...); wtr_watch_dispatch() then delivers them. Documents
+ * fetched again and found unchanged are not updates.
+ *
+ * The notifications are based on inotify, so they are only available on
+ * Linux.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+/**
+ * @brief A subscription to the updates of the cache.
+ */
+typedef struct _wtr_watch wtr_watch;
+
+/**
+ * @brief Function called for each updated document by wtr_watch_dispatch().
+ *
+ * When some notifications were lost (the kernel queue overflowed) it's
+ * called with NULL @p driver and @p location_code: any document may have
+ * changed.
+ *
+ * @param[in] driver Name of the "driver" of the updated document.
+ * @param[in] location_code Location code of the updated document.
+ * @param[in] user_data Data passed to wtr_watch_new().
+ */
+typedef void (*wtr_watch_func)(const gchar *driver, const gchar *location_code, gpointer user_data);
+
+/**
+ * @brief Subscribe to the updates of today's cache.
+ *
+ * The subscription follows the cache into the next day at midnight.
+ *
+ * @param[in] driver Name of the "driver" whose updates are delivered, NULL for all of them.
+ * @param[in] func Function called for each updated document.
+ * @param[in] user_data Data to pass to @p func.
+ * @return The subscription, or NULL if the cache can't be watched.
+ * @warning The subscription must be freed with wtr_watch_free().
+ */
+wtr_watch *wtr_watch_new(const gchar *driver, wtr_watch_func func, gpointer user_data);
+
+/**
+ * @brief Returns the file descriptor that becomes readable when there are updates to dispatch.
+ *
+ * @param[in] watch The subscription.
+ * @return The file descriptor; it must not be read nor closed by the caller.
+ */
+int wtr_watch_fd(wtr_watch *watch);
+
+/**
+ * @brief Deliver the pending updates.
+ *
+ * Many updates of the same document are delivered once.
+ *
+ * @param[in] watch The subscription.
+ * @param[in] timeout Milliseconds to wait for updates if there are none: 0 to return immediately, -1 to wait forever.
+ * @return Number of updates delivered, -1 on errors.
+ */
+gint wtr_watch_dispatch(wtr_watch *watch, gint timeout);
+
+/**
+ * @brief Unsubscribe from the updates of the cache.
+ *
+ * @param[in] watch The subscription to free (it can be NULL).
+ */
+void wtr_watch_free(wtr_watch *watch);
+
+#endif  // __LIBWEATHER_WATCH_H__
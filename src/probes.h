@@ -0,0 +1,122 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+
+/**
+ * @file probes.h
+ * @brief Static tracepoints (USDT) on the hot paths, for profiling in production.
+ *
+ * When the program is compiled with @c WTR_HAVE_SDT (the Makefile does it
+ * when <sys/sdt.h> is available) every WTR_PROBE*() is a SystemTap/DTrace
+ * style probe: a single @c nop in the code plus a note in the ELF file, which
+ * tools like bpftrace, perf and SystemTap turn into a breakpoint only while
+ * they are attached. For example:
+ *
+ *     # bpftrace -e 'usdt:./wtrc:libnet:http__done { @ms = hist(arg4 / 1000); }'
+ *
+ * Each probe has a semaphore, which the tracers increment while they are
+ * attached to it: the arguments that take some work to compute (e.g. a
+ * walk of the forecasts) are computed only if WTR_PROBE_ENABLED(). The
+ * semaphores of each provider are defined, with WTR_PROBE_SEMAPHORE_DEFINE(),
+ * in the file with its name (libnet.c and libweather.c).
+ *
+ * Otherwise the probes compile to nothing, their arguments are never
+ * evaluated, WTR_PROBE_TIME() included, and WTR_PROBE_ENABLED() is FALSE.
+ *
+ * Probes (provider, name and arguments):
+ *  - libnet http__start: URL.
+ *  - libnet http__done: URL, bytes, HTTP status code, cURL code, duration in µs.
+ *  - libweather cache__hit: cache entry path (or driver-code for parsed forecasts), bytes (0 for parsed forecasts).
+ *  - libweather cache__miss: cache entry path.
+ *  - libweather cache__set: cache entry path, bytes, 1 if unchanged.
+ *  - libweather forecast__parse: bytes, days, hours, duration in µs (of parsing, also when streamed).
+ *  - libweather location__search: query, search type, results, duration in µs.
+ *
+ * @author Paolo Bernardi
+ * @date 6 Mar 2018
+ */
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+#ifdef WTR_HAVE_SDT
+
+#include <glib.h>
+// The probes refer to their semaphores
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+/// Name of the semaphore of a probe, as <sys/sdt.h> wants it.
+#define WTR_PROBE_SEMAPHORE(provider, name) provider##_##name##_semaphore
+/// Defines the semaphore of a probe in the section where the tracers look for it.
+#define WTR_PROBE_SEMAPHORE_DEFINE(provider, name) \
+	unsigned short WTR_PROBE_SEMAPHORE(provider, name) __attribute__((section(".probes"), used)) = 0
+/// TRUE while a tracer is attached to the probe.
+#define WTR_PROBE_ENABLED(provider, name) __builtin_expect(WTR_PROBE_SEMAPHORE(provider, name) != 0, 0)
+
+extern unsigned short WTR_PROBE_SEMAPHORE(libnet, http__start);
+extern unsigned short WTR_PROBE_SEMAPHORE(libnet, http__done);
+extern unsigned short WTR_PROBE_SEMAPHORE(libweather, cache__hit);
+extern unsigned short WTR_PROBE_SEMAPHORE(libweather, cache__miss);
+extern unsigned short WTR_PROBE_SEMAPHORE(libweather, cache__set);
+extern unsigned short WTR_PROBE_SEMAPHORE(libweather, forecast__parse);
+extern unsigned short WTR_PROBE_SEMAPHORE(libweather, location__search);
+
+#define WTR_PROBE1(provider, name, a) DTRACE_PROBE1(provider, name, a)
+#define WTR_PROBE2(provider, name, a, b) DTRACE_PROBE2(provider, name, a, b)
+#define WTR_PROBE3(provider, name, a, b, c) DTRACE_PROBE3(provider, name, a, b, c)
+#define WTR_PROBE4(provider, name, a, b, c, d) DTRACE_PROBE4(provider, name, a, b, c, d)
+#define WTR_PROBE5(provider, name, a, b, c, d, e) DTRACE_PROBE5(provider, name, a, b, c, d, e)
+
+/// Monotonic time in µs, to compute the durations passed to the probes.
+#define WTR_PROBE_TIME() g_get_monotonic_time()
+
+#else
+
+// The arguments are referenced, so that they don't look unused, but never evaluated
+#define WTR_PROBE1(provider, name, a) \
+	do {                              \
+		if (0) {                      \
+			(void)(a);                \
+		}                             \
+	} while (0)
+#define WTR_PROBE2(provider, name, a, b) \
+	do {                                 \
+		if (0) {                         \
+			(void)(a);                   \
+			(void)(b);                   \
+		}                                \
+	} while (0)
+#define WTR_PROBE3(provider, name, a, b, c) \
+	do {                                    \
+		if (0) {                            \
+			(void)(a);                      \
+			(void)(b);                      \
+			(void)(c);                      \
+		}                                   \
+	} while (0)
+#define WTR_PROBE4(provider, name, a, b, c, d) \
+	do {                                       \
+		if (0) {                               \
+			(void)(a);                         \
+			(void)(b);                         \
+			(void)(c);                         \
+			(void)(d);                         \
+		}                                      \
+	} while (0)
+#define WTR_PROBE5(provider, name, a, b, c, d, e) \
+	do {                                          \
+		if (0) {                                  \
+			(void)(a);                            \
+			(void)(b);                            \
+			(void)(c);                            \
+			(void)(d);                            \
+			(void)(e);                            \
+		}                                         \
+	} while (0)
+
+#define WTR_PROBE_TIME() 0
+
+#define WTR_PROBE_ENABLED(provider, name) FALSE
+
+#endif  // WTR_HAVE_SDT
+
+#endif  // __PROBES_H__
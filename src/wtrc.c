@@ -12,21 +12,39 @@
  */
 
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <curl/curl.h>
 #include <glib.h>
 #include <glib/gprintf.h>
 #include <libxml/parser.h>
 
+#include "config.h"
+#include "libevents.h"
+#include "libmem.h"
+#include "libmetrics.h"
 #include "libnet.h"
 #include "libutils.h"
 #include "libweather.h"
+#include "libweather_alerts.h"
+#include "libweather_archive.h"
+#include "libweather_cache.h"
+#include "libweather_driver.h"
+#include "libweather_ingest.h"
+#include "libweather_keys.h"
+#include "libweather_popularity.h"
+#include "libweather_query.h"
+#include "libweather_shm.h"
+#include "libweather_snapshot.h"
+#include "libweather_stats.h"
 #include "libweather_tiempo.h"
+#include "libweather_watch.h"
 
 /// Argument of the --search (-s) command line option, used to search for a location.
 static gchar *opt_search = NULL;
@@ -35,12 +53,126 @@ static gchar *opt_search = NULL;
 static gchar *opt_location = NULL;
 /// When false, only daily forecasts will be shown. When true, hourly forecasts will be shown as well.
 static gboolean opt_hour = FALSE;
+/// When true, the cached forecasts of all the available locations will be refreshed.
+static gboolean opt_prefetch = FALSE;
+/// Argument of the --days command line option: number of days of forecasts to show (0 means all of them).
+static gint opt_days = 0;
+/// Argument of the --capture command line option, used to record every HTTP request into a traffic corpus file.
+static gchar *opt_capture = NULL;
+/// Argument of the --replay command line option, used to serve every HTTP request from a traffic corpus file.
+static gchar *opt_replay = NULL;
+/// When true, --replay reproduces the recorded timing instead of serving the responses as fast as possible.
+static gboolean opt_replay_timing = FALSE;
+
+/// When true, parsed forecasts are shared with the other wtrc processes via shared memory.
+static gboolean opt_shm = FALSE;
+/// Argument of the --cache-export command line option: file to export today's cached forecasts into.
+static gchar *opt_cache_export = NULL;
+/// Argument of the --cache-import command line option: file to import cached forecasts from.
+static gchar *opt_cache_import = NULL;
+/// Argument of the --aggregate command line option: forecast field to aggregate by province.
+static gchar *opt_aggregate = NULL;
+/// Argument of the --archive command line option: directory of the archive of the fetched forecasts.
+static gchar *opt_archive = NULL;
+/// Argument of the --history command line option: archived field to summarize.
+static gchar *opt_history = NULL;
+/// Argument of the --where command line option: query to run against the cached forecasts.
+static gchar *opt_where = NULL;
+/// Argument of the --alerts command line option: file with the alert rules to check against the refreshed forecasts.
+static gchar *opt_alerts = NULL;
+/// Argument of the --providers command line option: comma-separated drivers to get the forecasts of --location from.
+static gchar *opt_providers = NULL;
+/// Argument of the --deadline command line option: milliseconds available to the providers (0 means no deadline).
+static gint opt_deadline = 0;
+/// Enabled by the --merge command line option: merge the answers of the providers instead of taking the first one.
+static gboolean opt_merge = FALSE;
+/// Argument of the --keys command line option: file with the pool of Tiempo's Affiliate IDs.
+static gchar *opt_keys = NULL;
+/// Argument of the --refresh-popular command line option: number of the most popular locations to keep warm.
+static gint opt_refresh_popular = 0;
+/// When true, a summary of the metrics (cache efficiency, HTTP requests, parsing) is shown at the end.
+static gboolean opt_stats = FALSE;
+/// Argument of the --metrics command line option: file to write the metrics into, in the Prometheus text format.
+static gchar *opt_metrics = NULL;
+/// When true, the events logged by the library (see libevents.h) are shown at the end.
+static gboolean opt_debug_dump = FALSE;
+/// Argument of the --memory-budget command line option: memory the library may take, in MiB (0 means no limit).
+static gint opt_memory_budget = 0;
+/// Argument of the --ingest command line option: directory of saved Tiempo's XML documents to reprocess.
+static gchar *opt_ingest = NULL;
+/// Argument of the --ingest-format command line option: where the ingested forecasts go, "json" (default) or "archive".
+static gchar *opt_ingest_format = NULL;
+/// When true, the updates of the forecasts cache made by any process are shown until wtrc is interrupted.
+static gboolean opt_watch = FALSE;
+
+/// Set by the SIGINT and SIGTERM handlers to stop --watch.
+static volatile sig_atomic_t watch_stopped = 0;
 
 /// Command line switches configuration for g_option.
 static GOptionEntry opt_entries[] = {{"search", 's', 0, G_OPTION_ARG_STRING, &opt_search, "Search a location whose name contains L", "L"},
                                      {"location", 'l', 0, G_OPTION_ARG_STRING, &opt_location,
                                       "Get weather forecasts for the location L (location code or name, if unique)", "L"},
                                      {"hour", 'h', 0, G_OPTION_ARG_NONE, &opt_hour, "Show hourly forecast", NULL},
+                                     {"days", 'd', 0, G_OPTION_ARG_INT, &opt_days, "Show only the forecasts of the next N days", "N"},
+                                     {"prefetch", 0, 0, G_OPTION_ARG_NONE, &opt_prefetch,
+                                      "Refresh the cached forecasts of all the available locations", NULL},
+                                     {"refresh-popular", 0, 0, G_OPTION_ARG_INT, &opt_refresh_popular,
+                                      "Refresh the cached forecasts of the N most requested locations, if they are about to go stale",
+                                      "N"},
+                                     {"capture", 0, 0, G_OPTION_ARG_FILENAME, &opt_capture, "Record every HTTP request into the corpus F", "F"},
+                                     {"replay", 0, 0, G_OPTION_ARG_FILENAME, &opt_replay, "Serve every HTTP request from the corpus F", "F"},
+                                     {"replay-timing", 0, 0, G_OPTION_ARG_NONE, &opt_replay_timing,
+                                      "Reproduce the recorded timing when replaying a corpus", NULL},
+                                     {"shm", 0, 0, G_OPTION_ARG_NONE, &opt_shm,
+                                      "Share the parsed forecasts with other wtrc processes via shared memory", NULL},
+                                     {"cache-export", 0, 0, G_OPTION_ARG_FILENAME, &opt_cache_export,
+                                      "Export today's cached forecasts into the snapshot F", "F"},
+                                     {"aggregate", 0, 0, G_OPTION_ARG_STRING, &opt_aggregate,
+                                      "Aggregate the field F of the cached forecasts by province (temp, temp_min, temp_max, wind_speed, rain, "
+                                      "humidity or pressure; with --hour, hourly forecasts are aggregated)",
+                                      "F"},
+                                     {"where", 0, 0, G_OPTION_ARG_STRING, &opt_where,
+                                      "Show the locations whose cached hourly forecasts match the query Q (e.g. 'rain > 5 and wind > 40')",
+                                      "Q"},
+                                     {"archive", 0, 0, G_OPTION_ARG_FILENAME, &opt_archive,
+                                      "Archive every fetched forecast into the directory D", "D"},
+                                     {"history", 0, 0, G_OPTION_ARG_STRING, &opt_history,
+                                      "Summarize the field F of the archived forecasts by fetch date (requires --archive; "
+                                      "with --hour, hourly forecasts are summarized; with --location, only that location)",
+                                      "F"},
+                                     {"alerts", 0, 0, G_OPTION_ARG_FILENAME, &opt_alerts,
+                                      "Check every refreshed forecast against the alert rules in the file F and show the alerts "
+                                      "that fire or clear",
+                                      "F"},
+                                     {"providers", 0, 0, G_OPTION_ARG_STRING, &opt_providers,
+                                      "Get the forecasts of --location from the providers P concurrently (comma-separated, e.g. "
+                                      "'tiempo,fixture')",
+                                      "P"},
+                                     {"deadline", 0, 0, G_OPTION_ARG_INT, &opt_deadline,
+                                      "Give up on the providers that don't answer within MS milliseconds", "MS"},
+                                     {"merge", 0, 0, G_OPTION_ARG_NONE, &opt_merge,
+                                      "Merge the answers of the providers instead of taking the first one", NULL},
+                                     {"keys", 0, 0, G_OPTION_ARG_FILENAME, &opt_keys,
+                                      "Spread the requests to Tiempo over the Affiliate IDs in the file F", "F"},
+                                     {"stats", 0, 0, G_OPTION_ARG_NONE, &opt_stats,
+                                      "Show the metrics of cache efficiency, HTTP requests and parsing at the end", NULL},
+                                     {"metrics", 0, 0, G_OPTION_ARG_FILENAME, &opt_metrics,
+                                      "Write the metrics into the file F, in the Prometheus text format", "F"},
+                                     {"debug-dump", 0, 0, G_OPTION_ARG_NONE, &opt_debug_dump,
+                                      "Show the diagnostic events logged by the library at the end (they are also shown on SIGUSR1)",
+                                      NULL},
+                                     {"ingest", 0, 0, G_OPTION_ARG_FILENAME, &opt_ingest,
+                                      "Parse in parallel all the saved Tiempo's XML documents in the directory D", "D"},
+                                     {"ingest-format", 0, 0, G_OPTION_ARG_STRING, &opt_ingest_format,
+                                      "Write the ingested forecasts as JSON lines on the standard output (json) or into the "
+                                      "archive (archive)",
+                                      "F"},
+                                     {"watch", 0, 0, G_OPTION_ARG_NONE, &opt_watch,
+                                      "Show the updates of the cached forecasts, made by any process, until interrupted", NULL},
+                                     {"memory-budget", 0, 0, G_OPTION_ARG_INT, &opt_memory_budget,
+                                      "Keep the memory taken by the documents and caches under N MiB", "N"},
+                                     {"cache-import", 0, 0, G_OPTION_ARG_FILENAME, &opt_cache_import,
+                                      "Import the cached forecasts of the snapshot F before any other action", "F"},
                                      {NULL}};
 
 /**
@@ -64,6 +196,34 @@ void search_location(char *query) {
 	g_list_free(results);
 }
 
+/**
+ * @brief Get the forecasts of a location from the providers of the --providers option.
+ *
+ * @param[in] code Location code.
+ * @return The forecasts, or NULL if a provider is unknown or none of them answered in time.
+ */
+wtr_forecast *dispatch_forecasts(gchar *code) {
+	gchar **names = g_strsplit(opt_providers, ",", -1);
+	guint count = g_strv_length(names);
+	const wtr_driver **drivers = (const wtr_driver **)g_malloc(sizeof(wtr_driver *) * MAX(count, 1));
+	gboolean ok = count > 0;
+	for (guint i = 0; i < count; ++i) {
+		drivers[i] = wtr_driver_find(g_strstrip(names[i]));
+		if (drivers[i] == NULL) {
+			g_printerr("Unknown provider '%s'.\n", names[i]);
+			ok = FALSE;
+		}
+	}
+	wtr_forecast *forecast = NULL;
+	if (ok) {
+		forecast = wtr_driver_forecast_get(drivers, count, code, opt_days, opt_deadline,
+		                                   opt_merge ? WTR_DISPATCH_MERGE : WTR_DISPATCH_FIRST);
+	}
+	g_free(drivers);
+	g_strfreev(names);
+	return forecast;
+}
+
 /**
  * @brief Show the forecasts for the location on the screen.
  *
@@ -95,17 +255,496 @@ void get_forecasts(char *query) {
 	}
 	g_list_free(results);
 	g_print("Weather forecasts for %s (%s)\n\n", location->name, location->province);
-	wtr_forecast *forecast = wtr_tiempo_forecast_get(location->code);
+	wtr_forecast *forecast =
+	    opt_providers != NULL ? dispatch_forecasts(location->code) : wtr_tiempo_forecast_get(location->code, opt_days);
+	if (forecast == NULL) {
+		g_printerr("Forecasts for %s not available.\n", location->name);
+		return;
+	}
 	wtr_forecast_print(forecast, opt_hour);
 	wtr_forecast_free(forecast);
 }
 
+/**
+ * @brief Refresh the cached forecasts of all the available locations.
+ *
+ * This function downloads the forecasts of all the locations in a single
+ * bulk call and shows on the screen how many of them were refreshed and
+ * how long it took.
+ */
+void prefetch_forecasts() {
+	guint count = sizeof(WTR_LOCATIONS) / sizeof(wtr_location);
+	gchar **codes = g_malloc(sizeof(gchar *) * count);
+	for (guint i = 0; i < count; ++i) {
+		codes[i] = WTR_LOCATIONS[i].code;
+	}
+	gint64 start = g_get_monotonic_time();
+	guint unchanged = 0;
+	guint refreshed = wtr_tiempo_forecast_prefetch(codes, count, &unchanged);
+	gint64 elapsed = g_get_monotonic_time() - start;
+	g_print("%u of %u location%s refreshed (%u unchanged) in %" G_GINT64_FORMAT " ms.\n", refreshed, count, count != 1 ? "s" : "",
+	        unchanged, elapsed / 1000);
+	g_free(codes);
+}
+
+/**
+ * @brief Refresh the cached forecasts of the most requested locations, if they are about to go stale.
+ *
+ * Meant to be run periodically (e.g. by cron), so that the popular locations
+ * are always served from the cache.
+ *
+ * @param[in] count Number of the most popular locations to keep warm.
+ */
+void refresh_popular_forecasts(guint count) {
+	gint64 start = g_get_monotonic_time();
+	guint stale = 0;
+	guint unchanged = 0;
+	guint refreshed = wtr_tiempo_forecast_refresh_popular(count, WTR_POPULAR_REFRESH_AGE, &stale, &unchanged);
+	gint64 elapsed = g_get_monotonic_time() - start;
+	g_print("%u of %u stale popular location%s refreshed (%u unchanged) in %" G_GINT64_FORMAT " ms.\n", refreshed, stale,
+	        stale != 1 ? "s" : "", unchanged, elapsed / 1000);
+}
+
+/**
+ * @brief Shows aggregate statistics of a field of the cached forecasts of all the locations, by province and day.
+ *
+ * @param[in] field_name Name of the field (see wtr_stats_field_parse()).
+ * @return TRUE on success, FALSE if the field is not valid.
+ */
+gboolean aggregate_forecasts(gchar *field_name) {
+	wtr_stats_field field;
+	if (!wtr_stats_field_parse(field_name, &field)) {
+		g_printerr("Unknown field '%s'.\n", field_name);
+		return FALSE;
+	}
+	guint count = sizeof(WTR_LOCATIONS) / sizeof(wtr_location);
+	gchar **codes = g_malloc(sizeof(gchar *) * count);
+	const gchar **provinces = g_malloc(sizeof(gchar *) * count);
+	wtr_forecast **forecasts = g_malloc(sizeof(wtr_forecast *) * count);
+	for (guint i = 0; i < count; ++i) {
+		codes[i] = WTR_LOCATIONS[i].code;
+		provinces[i] = WTR_LOCATIONS[i].province;
+	}
+	guint found = wtr_tiempo_forecast_get_cached(codes, count, forecasts);
+	guint days = 0;
+	for (guint i = 0; i < count; ++i) {
+		days = forecasts[i] != NULL ? MAX(days, g_list_length(forecasts[i]->days)) : days;
+	}
+	if (opt_days > 0) {
+		days = MIN(days, (guint)opt_days);
+	}
+	gboolean ok = TRUE;
+	gint64 elapsed = 0;
+	for (guint day = 0; day < days && ok; ++day) {
+		gint64 start = g_get_monotonic_time();
+		wtr_stats_column *column = wtr_stats_gather(forecasts, provinces, count, field, opt_hour, day);
+		if (column == NULL) {
+			g_printerr("Field '%s' is not available in %s forecasts.\n", field_name, opt_hour ? "hourly" : "daily");
+			ok = FALSE;
+			break;
+		}
+		g_print("Day %u\n\nProv   Count       Min       Max        Sum    Median       P90\n", day);
+		g_print("----   -----       ---       ---        ---    ------       ---\n");
+		for (guint group = 0; group < wtr_stats_groups(column); ++group) {
+			g_print("%-4s %7u %9.1f %9.1f %10.1f %9.1f %9.1f\n", wtr_stats_key(column, group), wtr_stats_count(column, group),
+			        wtr_stats_min(column, group), wtr_stats_max(column, group), wtr_stats_sum(column, group),
+			        wtr_stats_percentile(column, group, 50), wtr_stats_percentile(column, group, 90));
+		}
+		g_print("\n");
+		wtr_stats_column_free(column);
+		elapsed += g_get_monotonic_time() - start;
+	}
+	if (ok) {
+		g_print("%u of %u locations aggregated in %" G_GINT64_FORMAT " ms.\n", found, count, elapsed / 1000);
+	}
+	for (guint i = 0; i < count; ++i) {
+		if (forecasts[i] != NULL) {
+			wtr_forecast_free(forecasts[i]);
+		}
+	}
+	g_free(forecasts);
+	g_free(provinces);
+	g_free(codes);
+	return ok;
+}
+
+/**
+ * @brief Shows the locations whose cached forecasts match a query.
+ *
+ * @param[in] text The query (see libweather_query.h).
+ * @return TRUE on success, FALSE if the query is not valid.
+ */
+gboolean query_forecasts(gchar *text) {
+	GError *error = NULL;
+	wtr_query *query = wtr_query_compile(text, &error);
+	if (query == NULL) {
+		g_printerr("Invalid query: %s.\n", error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+	guint count = sizeof(WTR_LOCATIONS) / sizeof(wtr_location);
+	gchar **codes = g_malloc(sizeof(gchar *) * count);
+	wtr_forecast **forecasts = g_malloc(sizeof(wtr_forecast *) * count);
+	gint64 *matches = g_malloc(sizeof(gint64) * count);
+	for (guint i = 0; i < count; ++i) {
+		codes[i] = WTR_LOCATIONS[i].code;
+	}
+	guint found = wtr_tiempo_forecast_get_cached(codes, count, forecasts);
+	gint64 start = g_get_monotonic_time();
+	guint matching = wtr_query_filter(query, forecasts, count, matches);
+	gint64 elapsed = g_get_monotonic_time() - start;
+	for (guint i = 0; i < count; ++i) {
+		if (matches[i] < 0) {
+			continue;
+		}
+		GDateTime *when = g_date_time_new_from_unix_local(matches[i]);
+		gchar *when_str = g_date_time_format(when, "%a %e %H:%M");
+		g_print("%-10s %s %s (%s)\n", WTR_LOCATIONS[i].code, when_str, WTR_LOCATIONS[i].name, WTR_LOCATIONS[i].province);
+		g_free(when_str);
+		g_date_time_unref(when);
+	}
+	g_print("%u of %u locations match (%u cached) in %" G_GINT64_FORMAT " ms.\n", matching, count, found, elapsed / 1000);
+	for (guint i = 0; i < count; ++i) {
+		if (forecasts[i] != NULL) {
+			wtr_forecast_free(forecasts[i]);
+		}
+	}
+	g_free(matches);
+	g_free(forecasts);
+	g_free(codes);
+	wtr_query_free(query);
+	return TRUE;
+}
+
+/**
+ * @brief Summary of the archived values fetched in a day.
+ */
+typedef struct {
+	/// Fetch date, as YYYYMMDD.
+	gchar date[9];
+	/// Number of values.
+	guint64 count;
+	/// Minimum value.
+	gint64 min;
+	/// Maximum value.
+	gint64 max;
+	/// Sum of the values.
+	gint64 sum;
+} history_day;
+
+/**
+ * @brief Adds a block of archived values to the summary of its fetch date (wtr_archive_func).
+ *
+ * @param[in] user_data GArray of history_day, in chronological order.
+ */
+gboolean history_add(const gchar *location_code, gint64 fetched, const gint64 *values, guint count, gpointer user_data) {
+	GArray *days = (GArray *)user_data;
+	GDateTime *fetched_time = g_date_time_new_from_unix_local(fetched);
+	gchar *date = g_date_time_format(fetched_time, "%Y%m%d");
+	g_date_time_unref(fetched_time);
+	history_day *day = days->len > 0 ? &g_array_index(days, history_day, days->len - 1) : NULL;
+	if (day == NULL || strcmp(day->date, date) != 0) {
+		history_day new_day = {"", 0, G_MAXINT64, G_MININT64, 0};
+		g_strlcpy(new_day.date, date, sizeof(new_day.date));
+		g_array_append_val(days, new_day);
+		day = &g_array_index(days, history_day, days->len - 1);
+	}
+	g_free(date);
+	for (guint i = 0; i < count; ++i) {
+		day->min = MIN(day->min, values[i]);
+		day->max = MAX(day->max, values[i]);
+		day->sum += values[i];
+	}
+	day->count += count;
+	return TRUE;
+}
+
+/**
+ * @brief Shows a summary of an archived field for each fetch date.
+ *
+ * @param[in] field Name of the field (see wtr_archive_table).
+ * @return TRUE on success, FALSE if the field or the archive don't exist.
+ */
+gboolean show_history(gchar *field) {
+	gchar *code = NULL;
+	if (opt_location != NULL) {
+		GList *results = wtr_location_search(opt_location, is_number(opt_location) ? WTR_SEARCH_LOCATION_EXACT_CODE
+		                                                                           : WTR_SEARCH_LOCATION_EXACT_NAME);
+		if (results == NULL) {
+			g_printerr("Location '%s' not found.\n", opt_location);
+			return FALSE;
+		}
+		code = ((wtr_location *)results->data)->code;
+		g_list_free(results);
+	}
+	GArray *days = g_array_new(FALSE, FALSE, sizeof(history_day));
+	gboolean ok = wtr_archive_scan(opt_archive, opt_hour ? WTR_ARCHIVE_HOURS : WTR_ARCHIVE_DAYS, field, NULL, NULL, code,
+	                               history_add, days);
+	if (!ok) {
+		g_printerr("Field '%s' is not archived in %s forecasts, or the archive can't be read.\n", field,
+		           opt_hour ? "hourly" : "daily");
+	} else {
+		// Rain is archived in tenths of mm
+		gdouble scale = g_strcmp0(field, "rain") == 0 ? 10.0 : 1.0;
+		g_print("Fetched     Count       Min       Max      Mean\n");
+		g_print("-------     -----       ---       ---      ----\n");
+		for (guint i = 0; i < days->len; ++i) {
+			history_day *day = &g_array_index(days, history_day, i);
+			g_print("%s %9" G_GUINT64_FORMAT " %9.1f %9.1f %9.1f\n", day->date, day->count, day->min / scale, day->max / scale,
+			        day->sum / scale / day->count);
+		}
+	}
+	g_array_free(days, TRUE);
+	return ok;
+}
+
+/**
+ * @brief Exports today's cached forecasts into a snapshot file.
+ *
+ * @param[in] path Path of the snapshot file.
+ * @return TRUE on success, FALSE otherwise.
+ */
+gboolean export_cache(gchar *path) {
+	guint entries = 0;
+	if (!wtr_snapshot_export(path, &entries)) {
+		return FALSE;
+	}
+	g_print("%u cached forecasts exported into %s.\n", entries, path);
+	return TRUE;
+}
+
+/**
+ * @brief Imports the cached forecasts of a snapshot file.
+ *
+ * @param[in] path Path of the snapshot file.
+ * @return TRUE on success, FALSE otherwise.
+ */
+gboolean import_cache(gchar *path) {
+	guint entries = 0;
+	guint unchanged = 0;
+	if (!wtr_snapshot_import(path, &entries, &unchanged)) {
+		return FALSE;
+	}
+	g_print("%u cached forecasts imported from %s (%u unchanged).\n", entries, path, unchanged);
+	return TRUE;
+}
+
+/**
+ * @brief Opens the persistent resolve cache, inside the forecasts cache directory.
+ */
+void open_resolve_cache() {
+	gchar *cache_dir = wtr_cache_dir();
+	gchar *resolve_file = g_build_filename(cache_dir, "resolve", NULL);
+	net_resolve_cache_open(resolve_file, WTR_RESOLVE_TTL);
+	g_free(resolve_file);
+	g_free(cache_dir);
+}
+
+/**
+ * @brief Opens the access counters of the locations, inside the forecasts cache directory.
+ */
+void open_popularity() {
+	gchar *cache_dir = wtr_cache_dir();
+	gchar *popularity_file = g_build_filename(cache_dir, "popularity", NULL);
+	wtr_popularity_open(popularity_file);
+	g_free(popularity_file);
+	g_free(cache_dir);
+}
+
+/**
+ * @brief Shows an alert that fired or cleared (wtr_alerts_func).
+ */
+void show_alert(const gchar *rule, const gchar *location_code, gboolean firing, gint64 when, gpointer user_data) {
+	GDateTime *time = g_date_time_new_from_unix_local(when);
+	gchar *time_str = g_date_time_format(time, "%Y-%m-%d %H:%M");
+	g_print("%-5s %s %s %s\n", firing ? "FIRE" : "CLEAR", rule, location_code, time_str);
+	g_free(time_str);
+	g_date_time_unref(time);
+}
+
+/**
+ * @brief Enables the alert rules, keeping their state inside the forecasts cache directory.
+ *
+ * @param[in] rules_file File with the alert rules.
+ * @return TRUE on success, FALSE otherwise.
+ */
+gboolean open_alerts(const gchar *rules_file) {
+	gchar *cache_dir = wtr_cache_dir();
+	gchar *state_file = g_build_filename(cache_dir, "alerts.state", NULL);
+	gboolean ok = wtr_alerts_open(rules_file, state_file, show_alert, NULL);
+	g_free(state_file);
+	g_free(cache_dir);
+	return ok;
+}
+
+/**
+ * @brief Enables the pool of Affiliate IDs, keeping their usage inside the forecasts cache directory.
+ *
+ * @param[in] keys_file File with the Affiliate IDs.
+ * @return TRUE on success, FALSE otherwise.
+ */
+gboolean open_keys(const gchar *keys_file) {
+	gchar *cache_dir = wtr_cache_dir();
+	gchar *state_file = g_build_filename(cache_dir, "keys.state", NULL);
+	gboolean ok = wtr_keys_open(keys_file, state_file);
+	g_free(state_file);
+	g_free(cache_dir);
+	return ok;
+}
+
+/**
+ * @brief Appends a string to a JSON document, quoted and escaped.
+ */
+void json_append_string(GString *json, const gchar *value) {
+	g_string_append_c(json, '"');
+	for (const gchar *c = value != NULL ? value : ""; *c != '\0'; ++c) {
+		if (*c == '"' || *c == '\\') {
+			g_string_append_c(json, '\\');
+			g_string_append_c(json, *c);
+		} else if ((guchar)*c < 0x20) {
+			g_string_append_printf(json, "\\u%04x", (guint)*c);
+		} else {
+			g_string_append_c(json, *c);
+		}
+	}
+	g_string_append_c(json, '"');
+}
+
+/**
+ * @brief Writes an ingested forecast on the standard output as a line of JSON (wtr_ingest_func).
+ */
+void ingest_json(const gchar *location_code, gint64 fetched, wtr_forecast *forecast, gpointer user_data) {
+	GString *json = (GString *)user_data;
+	g_string_truncate(json, 0);
+	g_string_append(json, "{\"code\":");
+	json_append_string(json, location_code);
+	g_string_append_printf(json, ",\"fetched\":%" G_GINT64_FORMAT ",\"hash\":\"%016" G_GINT64_MODIFIER "x\",\"days\":[", fetched,
+	                       forecast->hash);
+	for (GList *d = forecast->days; d != NULL; d = d->next) {
+		wtr_forecast_day *day = (wtr_forecast_day *)d->data;
+		gchar *date = g_date_time_format(day->date, "%Y-%m-%d");
+		g_string_append_printf(json,
+		                       "%s{\"date\":\"%s\",\"weather\":%d,\"temp_min\":%d,\"temp_max\":%d,\"wind_speed\":%d,"
+		                       "\"rain\":%.1f,\"humidity\":%d,\"pressure\":%d,\"hours\":[",
+		                       d != forecast->days ? "," : "", date, day->weather, day->temp_min, day->temp_max, day->wind_speed,
+		                       day->rain, day->humidity, day->pressure);
+		g_free(date);
+		for (GList *h = day->hours; h != NULL; h = h->next) {
+			wtr_forecast_hour *hour = (wtr_forecast_hour *)h->data;
+			gchar *tstamp = g_date_time_format(hour->tstamp, "%Y-%m-%dT%H:%M:%S%:z");
+			g_string_append_printf(json, "%s{\"tstamp\":\"%s\",\"weather\":%d,\"temp\":%d,\"wind_speed\":%d,\"wind_dir\":",
+			                       h != day->hours ? "," : "", tstamp, hour->weather, hour->temp, hour->wind_speed);
+			json_append_string(json, hour->wind_dir);
+			g_string_append_printf(json, ",\"rain\":%.1f,\"humidity\":%d,\"pressure\":%d}", hour->rain, hour->humidity,
+			                       hour->pressure);
+			g_free(tstamp);
+		}
+		g_string_append(json, "]}");
+	}
+	g_string_append(json, "]}\n");
+	fwrite(json->str, 1, json->len, stdout);
+}
+
+/**
+ * @brief Appends an ingested forecast to the archive, in the partition of its fetch date (wtr_ingest_func).
+ */
+void ingest_archive(const gchar *location_code, gint64 fetched, wtr_forecast *forecast, gpointer user_data) {
+	if (!wtr_archive_append_at(location_code, forecast, fetched)) {
+		++*(guint *)user_data;
+	}
+}
+
+/**
+ * @brief Reprocesses the saved Tiempo's XML documents of a directory tree, showing the throughput.
+ *
+ * The forecasts are written as JSON lines on the standard output (then the
+ * throughput is shown on the standard error) or into the archive, according
+ * to --ingest-format.
+ *
+ * @param[in] dir The directory.
+ * @return TRUE on success, FALSE if the directory can't be read or some forecasts couldn't be archived.
+ */
+gboolean ingest_documents(gchar *dir) {
+	gboolean json = g_strcmp0(opt_ingest_format, "archive") != 0;
+	GString *buffer = g_string_new(NULL);
+	guint failures = 0;
+	wtr_ingest_stats stats;
+	gboolean ok = wtr_ingest_dir(dir, 0, json ? ingest_json : ingest_archive, json ? (gpointer)buffer : (gpointer)&failures, &stats);
+	g_string_free(buffer, TRUE);
+	if (ok) {
+		gdouble seconds = MAX(stats.duration, 1) / (gdouble)G_USEC_PER_SEC;
+		gdouble megabytes = stats.bytes / (1024.0 * 1024.0);
+		(json ? g_printerr : g_print)("%u documents ingested (%u malformed), %.1f MB in %" G_GINT64_FORMAT
+		                              " ms: %.0f documents/s, %.1f MB/s.\n",
+		                              stats.documents, stats.errors, megabytes, stats.duration / 1000, stats.documents / seconds,
+		                              megabytes / seconds);
+	}
+	return ok && failures == 0;
+}
+
+/**
+ * @brief Shows an update of the cache (wtr_watch_func).
+ */
+void show_update(const gchar *driver, const gchar *location_code, gpointer user_data) {
+	GDateTime *now = g_date_time_new_now_local();
+	gchar *now_str = g_date_time_format(now, "%H:%M:%S");
+	if (driver == NULL) {
+		g_print("%s some updates were lost, any forecast may have changed\n", now_str);
+	} else {
+		g_print("%s %s/%s updated\n", now_str, driver, location_code);
+	}
+	// Updates are meant to be read as they happen, e.g. through a pipe
+	fflush(stdout);
+	g_free(now_str);
+	g_date_time_unref(now);
+}
+
+/**
+ * @brief Stops --watch (signal handler).
+ */
+void stop_watch(int signum) {
+	watch_stopped = 1;
+}
+
+/**
+ * @brief Shows the updates of the forecasts cache until wtrc is interrupted (SIGINT or SIGTERM).
+ *
+ * @return TRUE if wtrc was interrupted, FALSE if the cache can't be watched.
+ */
+gboolean watch_cache(void) {
+	wtr_watch *watch = wtr_watch_new(NULL, show_update, NULL);
+	if (watch == NULL) {
+		return FALSE;
+	}
+	signal(SIGINT, stop_watch);
+	signal(SIGTERM, stop_watch);
+	gint delivered = 0;
+	while (!watch_stopped && delivered >= 0) {
+		// The wait is bounded, since a signal may arrive right before it begins
+		delivered = wtr_watch_dispatch(watch, 1000);
+	}
+	wtr_watch_free(watch);
+	return delivered >= 0;
+}
+
+/**
+ * @brief Shows the memory taken by the library: the accounted peak, the budget and the peak resident set size.
+ */
+void show_memory(void) {
+	g_print("Memory: %" G_GSIZE_FORMAT " KiB peak accounted", mem_peak() / 1024);
+	if (mem_budget() > 0) {
+		g_print(" of %" G_GSIZE_FORMAT " KiB budget", mem_budget() / 1024);
+	}
+	g_print(", %" G_GSIZE_FORMAT " KiB peak RSS\n", mem_peak_rss() / 1024);
+}
+
 /**
  * @brief Simple Tiempo weather forecast client.
  *
  * This command line client for Tiempo weather forecasts API allows to search
- * for a supported location (--search option) and to get weather forecasts
- * (--location option).
+ * for a supported location (--search option), to get weather forecasts
+ * (--location option), to refresh the cached forecasts (--prefetch option) and
+ * to export or import them (--cache-export and --cache-import options).
  *
  * @param[in] argc Command line arguments number (including the executable name).
  * @param[in] argv Command line arguments values (including the executable name).
@@ -121,7 +760,11 @@ int main(int argc, char *argv[]) {
 		exit_status = EXIT_FAILURE;
 		goto clean_and_exit;
 	}
-	if (opt_search == NULL && opt_location == NULL) {
+	if ((opt_search == NULL && opt_location == NULL && !opt_prefetch && opt_refresh_popular == 0 && opt_cache_export == NULL &&
+	     opt_cache_import == NULL && opt_aggregate == NULL && opt_history == NULL && opt_where == NULL && opt_ingest == NULL && !opt_watch) ||
+	    opt_days < 0 || opt_deadline < 0 || opt_memory_budget < 0 || opt_refresh_popular < 0 || (opt_history != NULL && opt_archive == NULL) ||
+	    (opt_ingest_format != NULL && g_strcmp0(opt_ingest_format, "json") != 0 && g_strcmp0(opt_ingest_format, "archive") != 0) ||
+	    (g_strcmp0(opt_ingest_format, "archive") == 0 && opt_archive == NULL)) {
 		g_printerr("Incorrect usage, try --help.\n");
 		exit_status = EXIT_FAILURE;
 		goto clean_and_exit;
@@ -129,16 +772,77 @@ int main(int argc, char *argv[]) {
 
 	// Initialize the library and check potential ABI mismatches between
 	// the version it was compiled for and the actual shared library used.
+	// The allocators must be set up before the libraries allocate anything.
+	if (opt_memory_budget > 0) {
+		mem_budget_set((gsize)opt_memory_budget * 1024 * 1024);
+		mem_xml_setup();
+	}
 	LIBXML_TEST_VERSION
 	xmlInitParser();
-	CURLcode code = curl_global_init(CURL_GLOBAL_DEFAULT);
+	CURLcode code = opt_memory_budget > 0 ? mem_curl_global_init(CURL_GLOBAL_DEFAULT) : curl_global_init(CURL_GLOBAL_DEFAULT);
 	if (code == 0) {
 		// test_libweather();
-		if (opt_search != NULL) {
+		if (opt_debug_dump) {
+			events_dump_on_signal(SIGUSR1, STDERR_FILENO);
+		}
+		open_resolve_cache();
+		open_popularity();
+		if (opt_shm && !wtr_shm_attach()) {
+			g_printerr("WARN: shared memory cache unavailable\n");
+		}
+		if (opt_capture != NULL && !net_capture_open(opt_capture)) {
+			exit_status = EXIT_FAILURE;
+		} else if (opt_archive != NULL && !wtr_archive_open(opt_archive)) {
+			exit_status = EXIT_FAILURE;
+		} else if (opt_keys != NULL && !open_keys(opt_keys)) {
+			exit_status = EXIT_FAILURE;
+		} else if (opt_alerts != NULL && !open_alerts(opt_alerts)) {
+			exit_status = EXIT_FAILURE;
+		} else if (opt_cache_import != NULL && !import_cache(opt_cache_import)) {
+			// Like the options above, a successful import goes on with the action, which sees the imported forecasts
+			exit_status = EXIT_FAILURE;
+		} else if (opt_history != NULL) {
+			exit_status = show_history(opt_history) ? EXIT_SUCCESS : EXIT_FAILURE;
+		} else if (opt_replay != NULL && !net_replay_open(opt_replay, opt_replay_timing)) {
+			exit_status = EXIT_FAILURE;
+		} else if (opt_search != NULL) {
 			search_location(opt_search);
 		} else if (opt_location != NULL) {
 			get_forecasts(opt_location);
+		} else if (opt_prefetch) {
+			prefetch_forecasts();
+		} else if (opt_refresh_popular > 0) {
+			refresh_popular_forecasts(opt_refresh_popular);
+		} else if (opt_aggregate != NULL && !aggregate_forecasts(opt_aggregate)) {
+			exit_status = EXIT_FAILURE;
+		} else if (opt_where != NULL && !query_forecasts(opt_where)) {
+			exit_status = EXIT_FAILURE;
+		} else if (opt_ingest != NULL && !ingest_documents(opt_ingest)) {
+			exit_status = EXIT_FAILURE;
+		} else if (opt_watch && !watch_cache()) {
+			exit_status = EXIT_FAILURE;
+		}
+		// The export comes last, so that it includes the forecasts just prefetched
+		if (exit_status == EXIT_SUCCESS && opt_cache_export != NULL && !export_cache(opt_cache_export)) {
+			exit_status = EXIT_FAILURE;
+		}
+		if (opt_debug_dump) {
+			events_dump(STDERR_FILENO);
+		}
+		if (opt_stats) {
+			metrics_print();
+			show_memory();
+		}
+		if (opt_metrics != NULL && !metrics_write_prometheus(opt_metrics)) {
+			exit_status = EXIT_FAILURE;
 		}
+		net_traffic_close();
+		wtr_alerts_close();
+		wtr_keys_close();
+		wtr_archive_close();
+		wtr_shm_detach();
+		wtr_popularity_close();
+		net_resolve_cache_close();
 		curl_global_cleanup();
 	} else {
 		g_printerr("ERR: libcurl initialization failed\n");